@@ -7,7 +7,7 @@
 # - Compiles the project if necessary
 # - Generates histograms (mode 'histo')
 # - Calculates downstream leakage from facilities (mode 'leaks')
-# - Exports CSV and creates PNG graphs using gnuplot
+# - Exports CSV and PNG graphs (drawn by the program itself)
 #
 # Usage: ./scripts/myScript.sh [<data_file>] <mode> <argument>
 #   - <data_file>: Optional, defaults to data/c-wildwater_v3.dat
@@ -174,12 +174,22 @@ case "$COMMAND" in
         show_separator
         log_progress "Histogram Mode (${BOLD}$PARAM${RESET})"
 
-        # Generate CSV file
+        # Generate CSV file and charts
         OUT_CSV="$DATA_DIR/vol_${PARAM}.csv"
-        echo -e "${YELLOW}Generating data...${RESET}"
+        IMG_PREFIX="$GRAPH_DIR/vol_${PARAM}"
+        echo -e "${YELLOW}Generating data and charts...${RESET}"
+
+        # Sort key: the histogram value ('all' defaults to capacity)
+        SORT_OPT=()
+        if [ "$PARAM" != "all" ]; then
+            SORT_OPT=(--sort "$PARAM")
+        fi
 
         # Execute with simulated progress indicator
-        "$EXEC_MAIN" "$DATAFILE" "$PARAM" > "$DATA_DIR/.temp_output" &
+        # The program writes the full sorted table to OUT_CSV and draws the
+        # Top 10 / Bottom 50 charts itself (IMG_PREFIX_big.png, _small.png)
+        "$EXEC_MAIN" "$DATAFILE" "$PARAM" "${SORT_OPT[@]}" --csv "$OUT_CSV" \
+            --top 10 --bottom 50 --chart "$IMG_PREFIX" --chart-format png > /dev/null &
         PID=$!
 
         # Display progress indicator during processing
@@ -200,10 +210,6 @@ case "$COMMAND" in
             exit 1
         fi
 
-        # Sort data
-        printf "\r[#] Sorting data...                 "
-        LC_ALL=C sort -t';' -k2,2g "$DATA_DIR/.temp_output" > "$OUT_CSV"
-        rm -f "$DATA_DIR/.temp_output"
         printf "\r%s\n" "$(printf ' %.0s' {1..50})"  # Clear line
 
         if [ ! -s "$OUT_CSV" ]; then
@@ -213,169 +219,13 @@ case "$COMMAND" in
 
         log_success "Data generated and sorted successfully"
 
-        # Handle "all" mode (combined histogram) or standard modes
-        if [ "$PARAM" = "all" ]; then
-            # Combined Histogram (Capacity / Source / Real)
-            # Temporary files
-            TMP_MAX="$CACHE_DIR/.tmp_max"
-            TMP_SRC="$CACHE_DIR/.tmp_src"
-            TMP_REAL="$CACHE_DIR/.tmp_real"
-            TMP_MERGED="$CACHE_DIR/.tmp_merged"
-            TMP_SORTED="$CACHE_DIR/.tmp_sorted"
-
-            echo -e "${YELLOW}Generating combined data...${RESET}"
-
-            # Generate the 3 files separately
-            "$EXEC_MAIN" "$DATAFILE" "max"  > "$TMP_MAX"
-            "$EXEC_MAIN" "$DATAFILE" "src"  > "$TMP_SRC"
-            "$EXEC_MAIN" "$DATAFILE" "real" > "$TMP_REAL"
-
-            # Merge into: ID;Max;Source;Real
-            # Join files on ID. Missing values default to 0.
-            awk -F';' '
-                FNR==1 { file_idx++ }
-                file_idx==1 { max[$1] = $2; next }
-                file_idx==2 { src[$1] = $2; next }
-                file_idx==3 { real[$1] = $2; next }
-                END {
-                    OFS=";"
-                    for (id in max) {
-                        m = max[id] + 0
-                        s = (id in src) ? src[id] + 0 : 0
-                        r = (id in real) ? real[id] + 0 : 0
-                        if (m > 0) print id, m, s, r
-                    }
-                }
-            ' "$TMP_MAX" "$TMP_SRC" "$TMP_REAL" > "$TMP_MERGED"
-
-            # Sort on capacity (column 2)
-            sort -t';' -k2,2g "$TMP_MERGED" > "$TMP_SORTED"
-
-            # Cleanup intermediate files
-            rm -f "$TMP_MAX" "$TMP_SRC" "$TMP_REAL" "$TMP_MERGED"
-
-            if [ ! -s "$TMP_SORTED" ]; then
-                log_error "Error generating combined data."
-                exit 1
-            fi
-
-            # Generate Top 10 (biggest) graph
-            IMG_BIG="$GRAPH_DIR/vol_all_big.png"
-            GP_DATA_BIG="$DATA_DIR/data_all_big.dat"
-            
-            tail -n 10 "$TMP_SORTED" > "$GP_DATA_BIG"
-
-            echo -e "${YELLOW}Generating Top 10 graph (Stacked)...${RESET}"
-
-            gnuplot -persist <<EOF
-set terminal png size 1200,800
-set output '$IMG_BIG'
-set title "Top 10 Stations - Bonus Mode (Smallest to Largest)"
-set style data histograms
-set style histogram rowstacked
-set style fill solid 1.0 border -1
-set datafile separator ';'
-set ylabel 'Volume (M.m3)'
-set xtics rotate by -45 font ',10'
-set key outside top center horizontal
-set grid y
-set boxwidth 0.7 relative
-
-# Stacking: Blue (Bottom) -> Red (Middle) -> Green (Top)
-plot '$GP_DATA_BIG' using 4:xtic(1) title 'Real Output' lc rgb '#3366CC', \
-     '' using (\$3-\$4 < 0 ? 0 : \$3-\$4) title 'Losses' lc rgb '#DC3912', \
-     '' using (\$2-\$3 < 0 ? 0 : \$2-\$3) title 'Unused Capacity' lc rgb '#109618'
-EOF
-            if [ -f "$IMG_BIG" ]; then
-                log_success "Top 10 Graph generated: ${BOLD}$IMG_BIG${RESET}"
-            fi
-
-            # Generate Bottom 50 (smallest) graph
-            IMG_SMALL="$GRAPH_DIR/vol_all_small.png"
-            GP_DATA_SMALL="$DATA_DIR/data_all_small.dat"
-            
-            head -n 50 "$TMP_SORTED" > "$GP_DATA_SMALL"
-
-            echo -e "${YELLOW}Generating Bottom 50 graph (Stacked)...${RESET}"
-
-            gnuplot -persist <<EOF
-set terminal png size 1600,900
-set output '$IMG_SMALL'
-set title "Bottom 50 Stations - Bonus Mode (Smallest to Largest)"
-set style data histograms
-set style histogram rowstacked
-set style fill solid 1.0 border -1
-set datafile separator ';'
-set ylabel 'Volume (M.m3)'
-set xtics rotate by -90 font ',8'
-set key outside top center horizontal
-set grid y
-set boxwidth 0.8 relative
-
-plot '$GP_DATA_SMALL' using 4:xtic(1) title 'Real Output' lc rgb '#3366CC', \
-     '' using (\$3-\$4 < 0 ? 0 : \$3-\$4) title 'Losses' lc rgb '#DC3912', \
-     '' using (\$2-\$3 < 0 ? 0 : \$2-\$3) title 'Unused Capacity' lc rgb '#109618'
-EOF
-            if [ -f "$IMG_SMALL" ]; then
-                log_success "Bottom 50 Graph generated: ${BOLD}$IMG_SMALL${RESET}"
-            fi
-
-            # Final cleanup
-            rm -f "$TMP_SORTED" "$GP_DATA_BIG" "$GP_DATA_SMALL"
-
-        else
-            # Standard modes (max, src, real)
-            echo -e "${YELLOW}Creating histograms...${RESET}"
-            
-            # Sort in ascending order (Small -> Big)
-            SORTED_STD="$DATA_DIR/.sorted_std_asc"
-            sort -t';' -k2,2g "$OUT_CSV" > "$SORTED_STD"
-
-            # Generate Top 10 (Largest) graph
-            GP_BIG="$DATA_DIR/data_big.dat"
-            tail -n 10 "$SORTED_STD" > "$GP_BIG"
-            IMG_BIG="$GRAPH_DIR/vol_${PARAM}_big.png"
-
-            gnuplot -persist <<EOF
-set terminal png size 1200,800
-set output '$IMG_BIG'
-set title "Top 10 Stations ($PARAM) - Smallest to Largest"
-set yrange [0:*]
-set style data histograms
-set style fill solid 1.0 border -1
-set datafile separator ';'
-set ylabel 'Volume (M.m3)'
-set xtics rotate by -45
-set grid y
-plot '$GP_BIG' using 2:xtic(1) title 'Volume' lc rgb 'blue'
-EOF
+        IMG_BIG="${IMG_PREFIX}_big.png"
+        IMG_SMALL="${IMG_PREFIX}_small.png"
+        if [ -f "$IMG_BIG" ]; then
             log_success "Top 10 image generated: ${BOLD}$IMG_BIG${RESET}"
-
-            # Generate Bottom 50 (Smallest) graph
-            GP_SMALL="$DATA_DIR/data_small.dat"
-            head -n 50 "$SORTED_STD" > "$GP_SMALL"
-            IMG_SMALL="$GRAPH_DIR/vol_${PARAM}_small.png"
-
-            gnuplot -persist <<EOF
-set terminal png size 1600,900
-set output '$IMG_SMALL'
-set title "Bottom 50 Stations ($PARAM) - Smallest to Largest"
-set key outside top center horizontal
-set style data histograms
-set boxwidth 0.8 relative
-set style fill solid 1.0 border -1
-set datafile separator ';'
-set ylabel 'Volume (M.m3)'
-set format y "%.4f"
-set yrange [*:*]
-set xtics rotate by -90 font ',8'
-set grid y
-plot '$GP_SMALL' using 2:xtic(1) title 'Volume' lc rgb 'red'
-EOF
+        fi
+        if [ -f "$IMG_SMALL" ]; then
             log_success "Bottom 50 image generated: ${BOLD}$IMG_SMALL${RESET}"
-
-            # Clean up temporary files
-            rm -f "$GP_BIG" "$GP_SMALL" "$SORTED_STD"
         fi
         ;;
 
@@ -383,8 +233,8 @@ EOF
         show_separator
         log_progress "Leaks Mode (${BOLD}$PARAM${RESET})"
         LEAK_FILE="$DATA_DIR/leaks.dat"
-        CACHE_FILE="$CACHE_DIR/.leaks_cache.dat"
-        touch "$CACHE_FILE"
+        # Result cache managed by the program (keyed on the data file content)
+        CACHE_FILE="$CACHE_DIR/leaks.cache"
 
         # Process a single facility
         process_factory() {
@@ -399,23 +249,13 @@ EOF
             local TEMP_ERR_FILE="$CACHE_DIR/err_${FACTORY_HASH}.tmp"
             local TEMP_OUT_FILE="$CACHE_DIR/out_${FACTORY_HASH}.tmp"
 
-            # Check cache for previous results
-            CACHED_VAL=$(grep -F "$(echo "$FACTORY" | sed 's/;/\\;/g');" "$CACHE_FILE" | tail -n1 | cut -d';' -f2)
-            if [ -n "$CACHED_VAL" ]; then
-                echo -e "${GREEN}[CACHE]${RESET} Result found in cache"
-                if ! grep -q "$(echo "$FACTORY" | sed 's/;/\\;/g');" "$LEAK_FILE" 2>/dev/null; then
-                    echo "$FACTORY;$CACHED_VAL" >> "$LEAK_FILE"
-                fi
-                echo -e "${BOLD}Leak volume for $FACTORY:${RESET} ${BLUE}${CACHED_VAL} M.m3${RESET}"
-                return
-            fi
-
             # Calculate leakage with progress indicator
             echo -e "${YELLOW}Calculation in progress...${RESET}"
             T_START=$(date +%s%3N)
 
             # Run calculation with reduced priority
-            nice -n 10 stdbuf -oL -eL "$EXEC_MAIN" "$DATAFILE" "$FACTORY" > "$TEMP_OUT_FILE" 2> "$TEMP_ERR_FILE" &
+            nice -n 10 stdbuf -oL -eL "$EXEC_MAIN" "$DATAFILE" "$FACTORY" --cache "$CACHE_FILE" \
+                > "$TEMP_OUT_FILE" 2> "$TEMP_ERR_FILE" &
             PID=$!
 
             # Display animated progress indicator
@@ -468,11 +308,12 @@ EOF
             if [ "$VAL" = "-1" ] || [ -z "$VAL" ]; then
                 log_error "Facility '$FACTORY' not found or calculation failed (${DURATION}ms)"
                 echo "$FACTORY;-1" >> "$LEAK_FILE"
-                echo "$FACTORY;-1" >> "$CACHE_FILE"
             else
+                if grep -q "Result served from cache" "$TEMP_ERR_FILE" 2>/dev/null; then
+                    echo -e "${GREEN}[CACHE]${RESET} Result found in cache"
+                fi
                 log_success "Calculation completed in ${DURATION}ms"
                 echo "$FACTORY;$VAL" >> "$LEAK_FILE"
-                echo "$FACTORY;$VAL" >> "$CACHE_FILE"
                 echo -e "${BOLD}Leak volume for $FACTORY:${RESET} ${BLUE}${VAL} M.m3${RESET}"
                 
                 # Display critical section information if available
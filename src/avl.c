@@ -9,24 +9,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avl.h"
+#include "pool.h"
+#include "memstats.h"
 
 // -----------------------------------------------------------------------------
 // Internal utility functions
 // -----------------------------------------------------------------------------
 
-/**
- * Creates a duplicate of a string
- *
- * @param s  String to duplicate
- * @return   New allocated string or NULL if allocation fails
- */
-static char* my_strdup(const char* s) {
-    if (!s) return NULL;
-    size_t len = strlen(s) + 1;
-    char* new = malloc(len);
-    if (new) memcpy(new, s, len);
-    return new;
-}
+// Stations, connections and identifiers are pooled: one network per process
+static Pool station_pool = POOL_INIT;
+static Pool link_pool = POOL_INIT;
+static Pool name_pool = POOL_INIT;
+
+POOL_DEFINE_TYPE(station, Station)
+POOL_DEFINE_TYPE(link, AdjNode)
 
 /**
  * Returns the maximum of two integers
@@ -56,12 +52,10 @@ static int get_balance(Station* n) {
  * @return      Newly allocated station
  */
 static Station* create_node(char* name) {
-    Station* node = (Station*)malloc(sizeof(Station));
-    if (!node) {
-        fprintf(stderr, "Error: unable to allocate a new station\n");
-        exit(EXIT_FAILURE);
-    }
-    node->name = my_strdup(name);
+    Station* node = station_new(&station_pool);
+    node->name = pool_strdup(&name_pool, name);
+    mem_track(MEM_STATIONS, sizeof(Station));
+    mem_track(MEM_NAMES, (long)strlen(name) + 1);
     node->capacity = 0;
     node->consumption = 0;
     node->real_qty = 0;
@@ -105,6 +99,73 @@ static Station* left_rotate(Station* x) {
     return y;
 }
 
+/**
+ * Builds a balanced subtree from names sorted in identifier order
+ *
+ * @param names  Sorted identifiers
+ * @param lo     First index of the subtree
+ * @param hi     Index past the last one
+ * @param nodes  Receives the created stations at the index of their name
+ * @return       Root of the subtree
+ */
+static Station* build_range(char** names, long lo, long hi, Station** nodes) {
+    if (lo >= hi) return NULL;
+    long mid = lo + (hi - lo) / 2;
+    Station* node = create_node(names[mid]);
+    node->left = build_range(names, lo, mid, nodes);
+    node->right = build_range(names, mid + 1, hi, nodes);
+    node->height = max_int(get_height(node->left), get_height(node->right)) + 1;
+    nodes[mid] = node;
+    return node;
+}
+
+/**
+ * Stores the stations of a subtree in identifier order
+ */
+static void collect_nodes(Station* node, Station** nodes, long* count) {
+    if (!node) return;
+    collect_nodes(node->left, nodes, count);
+    nodes[(*count)++] = node;
+    collect_nodes(node->right, nodes, count);
+}
+
+/**
+ * Copies a station into the new pool, leaving a forwarding pointer behind:
+ * the old station keeps its left field pointing to the copy and a height of 0
+ */
+static Station* move_station(Station* s, Pool* pool, Station** order, long* moved) {
+    Station* copy = station_new(pool);
+    *copy = *s;
+    copy->height = (s->height < 0) ? -s->height : s->height;
+    s->height = 0;
+    s->left = copy;
+    order[(*moved)++] = s;
+    return copy;
+}
+
+/**
+ * Moves a station and everything it reaches, depth first in the order of the
+ * adjacency lists (the order of solve_leaks)
+ *
+ * @param stack  Room for one section iterator per station
+ */
+static void move_reachable(Station* s, Pool* pool, Station** order, long* moved, AdjNode** stack) {
+    move_station(s, pool, order, moved);
+    long depth = 0;
+    stack[depth++] = s->children;
+    while (depth > 0) {
+        AdjNode* e = stack[depth - 1];
+        if (!e) {
+            depth--;
+            continue;
+        }
+        stack[depth - 1] = e->next;
+        if (e->target->height == 0) continue;  // Already moved
+        move_station(e->target, pool, order, moved);
+        stack[depth++] = e->target->children;
+    }
+}
+
 // -----------------------------------------------------------------------------
 // Public functions
 // -----------------------------------------------------------------------------
@@ -131,31 +192,30 @@ Station* find_station(Station* node, char* name) {
  * @param child    Destination station
  * @param leak     Leak percentage on this section
  * @param factory  Factory associated with this connection
+ * @return         The new connection, or the existing one for this factory
  */
-void add_connection(Station* parent, Station* child, double leak, Station* factory) {
-    if (!parent || !child) return;
+AdjNode* add_connection(Station* parent, Station* child, double leak, Station* factory) {
+    if (!parent || !child) return NULL;
 
     // Check if connection already exists for this factory
     AdjNode* check = parent->children;
     while (check) {
         if (check->target == child && check->factory == factory) {
-            return; // Connection already exists
+            return check; // Connection already exists
         }
         check = check->next;
     }
 
     // Create and initialize a new connection
-    AdjNode* new_adj = (AdjNode*)malloc(sizeof(AdjNode));
-    if (!new_adj) {
-        fprintf(stderr, "Error: unable to allocate a new connection\n");
-        exit(EXIT_FAILURE);
-    }
+    AdjNode* new_adj = new_connection();
     new_adj->target = child;
     new_adj->leak_perc = leak;
     new_adj->factory = factory;
+    new_adj->volume = 0;
     new_adj->next = parent->children;
     parent->children = new_adj;
     parent->nb_children++;
+    return new_adj;
 }
 
 /**
@@ -218,69 +278,128 @@ Station* insert_station(Station* node, char* name, long cap, long cons, long rea
 }
 
 /**
- * Frees memory used by the tree and its connections
+ * Releases the process-wide pools of stations, connections and identifiers
+ * Every tree built so far is freed at once
+ */
+void release_station_pools(void) {
+    pool_release(&station_pool);
+    pool_release(&link_pool);
+    pool_release(&name_pool);
+    mem_clear(MEM_STATIONS);
+    mem_clear(MEM_CONNECTIONS);
+    mem_clear(MEM_NAMES);
+}
+
+/**
+ * Allocates an uninitialized connection
  *
- * @param node  Root of the tree to free
+ * @return  New connection (the program exits if memory is exhausted)
  */
-void free_tree(Station* node) {
-    if (!node) return;
+AdjNode* new_connection(void) {
+    mem_track(MEM_CONNECTIONS, sizeof(AdjNode));
+    return link_new(&link_pool);
+}
 
-    // Recursive freeing of subtrees
-    free_tree(node->left);
-    free_tree(node->right);
+/**
+ * Memory held by the stations, connections and identifiers of the tree
+ *
+ * @return  Bytes allocated by the pools
+ */
+size_t tree_memory(void) {
+    return station_pool.allocated + link_pool.allocated + name_pool.allocated;
+}
 
-    // Free the connection list
-    AdjNode* curr = node->children;
-    while (curr) {
-        AdjNode* tmp = curr;
-        curr = curr->next;
-        free(tmp);
-    }
+/**
+ * Counts the stations stored in the tree
+ *
+ * @param node  Root of the tree
+ * @return      Number of stations
+ */
+long count_stations(Station* node) {
+    if (!node) return 0;
+    return 1 + count_stations(node->left) + count_stations(node->right);
+}
 
-    free(node->name);
-    free(node);
+/**
+ * Builds a balanced tree directly from identifiers sorted in strcmp order
+ *
+ * @param names  Sorted, distinct identifiers
+ * @param count  Number of identifiers
+ * @param nodes  Receives the created stations, in the same order as names
+ * @return       Root of the tree
+ */
+Station* build_sorted_tree(char** names, long count, Station** nodes) {
+    return build_range(names, 0, count, nodes);
 }
 
 /**
- * Writes station data to a CSV file according to the specified mode
+ * Moves every station and connection to new memory in traversal order:
+ * depth first from each station without parent (sources and facilities,
+ * in identifier order), then the stations only reachable through a cycle.
+ * A station is followed by the stations it feeds and its connections are
+ * contiguous, so a leak calculation walks memory mostly forward.
+ * Station addresses change: indexes holding them must be built afterwards
  *
- * @param node    Root of the tree
- * @param output  Output file
- * @param mode    Data type ("max", "src", "real", or "all")
+ * @param root  Root of the tree
+ * @return      New root (the tree is left unchanged if memory is short)
  */
-void write_csv(Station* node, FILE* output, char* mode) {
-    if (!node) return;
+Station* relayout_tree(Station* root) {
+    long n = count_stations(root);
+    Station** nodes = malloc((n > 0 ? n : 1) * sizeof(Station*));
+    Station** order = malloc((n > 0 ? n : 1) * sizeof(Station*));
+    AdjNode** stack = malloc((n + 1) * sizeof(AdjNode*));
+    if (!nodes || !order || !stack) {
+        free(nodes);
+        free(order);
+        free(stack);
+        return root;
+    }
+    long count = 0;
+    collect_nodes(root, nodes, &count);
 
-    // Inorder traversal (left-root-right)
-    write_csv(node->left, output, mode);
+    // Stations fed by a section are marked with a negative height
+    for (long i = 0; i < n; i++) {
+        for (AdjNode* e = nodes[i]->children; e; e = e->next) {
+            if (e->target->height > 0) e->target->height = -e->target->height;
+        }
+    }
 
-    if (strcmp(mode, "all") == 0) {
-        // Mode "all": display all three values on the same line
-        double max_val = node->capacity/1000.0;
-        double src_val = node->consumption/1000.0;
-        double real_val = node->real_qty/1000.0;
+    Pool stations = POOL_INIT;
+    Pool links = POOL_INIT;
+    long moved = 0;
+    for (long i = 0; i < n; i++) {
+        if (nodes[i]->height > 0) move_reachable(nodes[i], &stations, order, &moved, stack);
+    }
+    for (long i = 0; i < n; i++) {
+        if (nodes[i]->height != 0) move_reachable(nodes[i], &stations, order, &moved, stack);
+    }
 
-        // Write only if at least one value is positive
-        if (max_val > 0 || src_val > 0 || real_val > 0) {
-            fprintf(output, "%s;%.6f;%.6f;%.6f\n",
-                   node->name, max_val, src_val, real_val);
-        }
-    } else {
-        // Standard modes (max, src, real)
-        double val = 0;
-        if (strcmp(mode, "max") == 0) {
-            val = node->capacity/1000.0;        // Maximum capacity
-        } else if (strcmp(mode, "src") == 0) {
-            val = node->consumption/1000.0;     // Captured volume
-        } else if (strcmp(mode, "real") == 0) {
-            val = node->real_qty/1000.0;        // Actual volume
-        }
+    // Pointers of the copies still lead to the old stations: follow the forwarding
+    for (long k = 0; k < moved; k++) {
+        Station* copy = order[k]->left;
+        if (copy->left) copy->left = copy->left->left;
+        if (copy->right) copy->right = copy->right->left;
 
-        // Write only positive values
-        if (val > 0) {
-            fprintf(output, "%s;%.6f\n", node->name, val);
+        AdjNode** tail = &copy->children;
+        for (AdjNode* e = copy->children; e; e = e->next) {
+            AdjNode* c = link_new(&links);
+            c->target = e->target->left;
+            c->leak_perc = e->leak_perc;
+            c->factory = e->factory ? e->factory->left : NULL;
+            c->volume = e->volume;
+            *tail = c;
+            tail = &c->next;
         }
+        *tail = NULL;
     }
+    Station* new_root = root ? root->left : NULL;
 
-    write_csv(node->right, output, mode);
-}
\ No newline at end of file
+    pool_release(&station_pool);
+    pool_release(&link_pool);
+    station_pool = stations;
+    link_pool = links;
+    free(nodes);
+    free(order);
+    free(stack);
+    return new_root;
+}
@@ -7,7 +7,7 @@
 #ifndef AVL_H
 #define AVL_H
 
-#include <stdio.h>
+#include <stddef.h>
 #include "structs.h"
 
 /**
@@ -38,23 +38,59 @@ Station* find_station(Station* node, char* name);
  * @param child   Destination station
  * @param leak    Leak percentage on this section
  * @param factory Factory associated with this connection
+ * @return        The new connection, or the existing one for this factory
  */
-void add_connection(Station* parent, Station* child, double leak, Station* factory);
+AdjNode* add_connection(Station* parent, Station* child, double leak, Station* factory);
 
 /**
- * Frees the memory used by the tree and its connections
+ * Releases the process-wide pools of stations, connections and identifiers
+ * Every tree built so far is freed at once: no tree can be released alone
+ */
+void release_station_pools(void);
+
+/**
+ * Allocates an uninitialized connection from the connection pool
+ *
+ * @return  New connection (the program exits if memory is exhausted)
+ */
+AdjNode* new_connection(void);
+
+/**
+ * Memory held by the stations, connections and identifiers of the tree
+ *
+ * @return  Bytes allocated by the pools
+ */
+size_t tree_memory(void);
+
+/**
+ * Counts the stations stored in the tree
+ *
+ * @param node  Root of the tree
+ * @return      Number of stations
+ */
+long count_stations(Station* node);
+
+/**
+ * Builds a balanced tree directly from identifiers sorted in strcmp order
  *
- * @param node  Root of the tree to free
+ * @param names  Sorted, distinct identifiers
+ * @param count  Number of identifiers
+ * @param nodes  Receives the created stations, in the same order as names
+ * @return       Root of the tree
  */
-void free_tree(Station* node);
+Station* build_sorted_tree(char** names, long count, Station** nodes);
 
 /**
- * Generates a CSV file from the tree data
+ * Moves every station and connection to new memory in traversal order:
+ * depth first from each station without parent (sources and facilities,
+ * in identifier order), then the stations only reachable through a cycle.
+ * A station is followed by the stations it feeds and its connections are
+ * contiguous, so a leak calculation walks memory mostly forward.
+ * Station addresses change: indexes holding them must be built afterwards
  *
- * @param node    Root of the tree
- * @param output  Output file
- * @param mode    Data type ("max", "src" or "real")
+ * @param root  Root of the tree
+ * @return      New root (the tree is left unchanged if memory is short)
  */
-void write_csv(Station* node, FILE* output, char* mode);
+Station* relayout_tree(Station* root);
 
 #endif /* AVL_H */
\ No newline at end of file
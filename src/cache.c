@@ -0,0 +1,493 @@
+/*
+ * cache.c
+ *
+ * Persistent cache of leak results: a file-backed open-addressing hash
+ * table mapped with mmap and protected by an fcntl lock, so concurrent
+ * runs can share it. The header also remembers the fingerprint and content
+ * hash of the last CACHE_FILES input files.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+/**
+ * File format identification
+ */
+#define CACHE_MAGIC   0x4843414b4c575757ULL  // "WWWLKACH"
+#define CACHE_FORMAT  2
+#define CACHE_MIN_CAP 256
+
+/**
+ * Input files remembered in the header, and bytes of each one hashed in its fingerprint
+ */
+#define CACHE_FILES 8
+#define CACHE_HEAD_BYTES 4096
+
+/**
+ * 64-bit hash primes
+ */
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+/**
+ * Cheap identification of an input file: read without scanning the file
+ */
+typedef struct {
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t inode;
+    uint64_t device;
+    uint64_t head_hash;    // Hash of the first CACHE_HEAD_BYTES bytes
+} CacheFingerprint;
+
+/**
+ * Input file seen by a previous run
+ */
+typedef struct {
+    uint64_t used;
+    uint64_t file_hash;    // Content hash of the whole file
+    CacheFingerprint fp;
+} CacheFile;
+
+/**
+ * Header at the start of the cache file
+ */
+typedef struct {
+    uint64_t magic;
+    uint32_t format;
+    uint32_t next_file;             // Entry of files replaced next
+    uint64_t capacity;              // Number of slots (power of two)
+    uint64_t count;                 // Used slots
+    CacheFile files[CACHE_FILES];   // Recently seen input files
+} CacheHeader;
+
+/**
+ * Slot of the table
+ */
+typedef struct {
+    uint64_t key;        // Hash of (file, facility, engine), 0 = empty slot
+    uint64_t file_hash;
+    uint32_t engine;
+    uint32_t found;
+    double loss;
+    double max_loss;
+    char facility[CACHE_NAME_LEN];
+    char max_from[CACHE_NAME_LEN];
+    char max_to[CACHE_NAME_LEN];
+} CacheEntry;
+
+/**
+ * Mapped cache file
+ */
+typedef struct {
+    int fd;
+    size_t size;
+    CacheHeader* header;
+    CacheEntry* slots;
+} CacheMap;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME1;
+}
+
+/**
+ * 64-bit hash of a memory block (four independent lanes over 32-byte stripes)
+ */
+static uint64_t hash_bytes(const unsigned char* p, size_t len, uint64_t seed) {
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+        const unsigned char* limit = end - 32;
+        do {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = (h ^ hash_round(0, v1)) * PRIME1 + PRIME4;
+        h = (h ^ hash_round(0, v2)) * PRIME1 + PRIME4;
+        h = (h ^ hash_round(0, v3)) * PRIME1 + PRIME4;
+        h = (h ^ hash_round(0, v4)) * PRIME1 + PRIME4;
+    } else {
+        h = seed + PRIME5;
+    }
+    h += (uint64_t)len;
+
+    while (p + 8 <= end) {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+    while (p < end) {
+        h ^= (*p) * PRIME5;
+        h = rotl64(h, 11) * PRIME1;
+        p++;
+    }
+
+    // Final avalanche
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * Hashes the whole content of an open file
+ */
+static int hash_fd(int fd, size_t size, uint64_t* hash) {
+    if (size == 0) {
+        *hash = hash_bytes(NULL, 0, 0);
+        return 0;
+    }
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return -1;
+    *hash = hash_bytes((const unsigned char*)data, size, 0);
+    munmap(data, size);
+    return 0;
+}
+
+/**
+ * Fingerprint of an open regular file
+ */
+static int fingerprint(int fd, CacheFingerprint* fp) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    memset(fp, 0, sizeof(*fp));
+    fp->size = (uint64_t)st.st_size;
+    fp->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    fp->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    fp->inode = (uint64_t)st.st_ino;
+    fp->device = (uint64_t)st.st_dev;
+
+    unsigned char head[CACHE_HEAD_BYTES];
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    if (n < 0) return -1;
+    fp->head_hash = hash_bytes(head, (size_t)n, 0);
+    return 0;
+}
+
+/**
+ * Key of an entry (never 0, which marks empty slots)
+ */
+static uint64_t entry_key(uint64_t file_hash, uint32_t engine, const char* facility) {
+    uint64_t k = hash_bytes((const unsigned char*)facility, strlen(facility), file_hash ^ engine);
+    return k ? k : 1;
+}
+
+/**
+ * Takes or releases the exclusive lock of the cache file
+ */
+static int lock_file(int fd, short type) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    return fcntl(fd, F_SETLKW, &fl);
+}
+
+/**
+ * Maps a cache file of a given size
+ */
+static int map_cache(CacheMap* m, size_t size) {
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+    if (addr == MAP_FAILED) return -1;
+    m->size = size;
+    m->header = (CacheHeader*)addr;
+    m->slots = (CacheEntry*)((char*)addr + sizeof(CacheHeader));
+    return 0;
+}
+
+/**
+ * Resizes the file to a capacity and writes an empty table
+ */
+static int init_cache(CacheMap* m, uint64_t capacity) {
+    size_t size = sizeof(CacheHeader) + capacity * sizeof(CacheEntry);
+    if (m->header) munmap(m->header, m->size);
+    m->header = NULL;
+
+    // Shrink first so that the new area reads back as zeros (empty slots)
+    if (ftruncate(m->fd, 0) != 0 || ftruncate(m->fd, (off_t)size) != 0) return -1;
+    if (map_cache(m, size) != 0) return -1;
+
+    m->header->magic = CACHE_MAGIC;
+    m->header->format = CACHE_FORMAT;
+    m->header->capacity = capacity;
+    m->header->count = 0;
+    return 0;
+}
+
+/**
+ * Opens, locks and maps the cache file
+ *
+ * @return 0 on success, -1 on failure (nothing left open)
+ */
+static int open_cache(CacheMap* m, const char* path, int create) {
+    m->header = NULL;
+    m->fd = open(path, create ? (O_RDWR | O_CREAT) : O_RDWR, 0644);
+    if (m->fd < 0) return -1;
+    if (lock_file(m->fd, F_WRLCK) != 0) {
+        close(m->fd);
+        return -1;
+    }
+
+    struct stat st;
+    int ok = (fstat(m->fd, &st) == 0);
+    size_t size = ok ? (size_t)st.st_size : 0;
+
+    if (ok && size >= sizeof(CacheHeader) && map_cache(m, size) == 0) {
+        CacheHeader* h = m->header;
+        size_t expected = sizeof(CacheHeader) + h->capacity * sizeof(CacheEntry);
+        if (h->magic == CACHE_MAGIC && h->format == CACHE_FORMAT && expected == size &&
+            h->capacity > 0 && (h->capacity & (h->capacity - 1)) == 0) {
+            return 0;
+        }
+    }
+
+    // Missing or unreadable table: start a new one
+    if (ok && create && init_cache(m, CACHE_MIN_CAP) == 0) return 0;
+
+    if (m->header) munmap(m->header, m->size);
+    lock_file(m->fd, F_UNLCK);
+    close(m->fd);
+    return -1;
+}
+
+/**
+ * Unmaps and unlocks the cache file
+ */
+static void close_cache(CacheMap* m) {
+    if (m->header) {
+        msync(m->header, m->size, MS_ASYNC);
+        munmap(m->header, m->size);
+    }
+    lock_file(m->fd, F_UNLCK);
+    close(m->fd);
+}
+
+/**
+ * Finds the slot of a key, or the empty slot where it would go
+ */
+static CacheEntry* probe(CacheMap* m, uint64_t key, uint64_t file_hash, uint32_t engine,
+                         const char* facility) {
+    uint64_t mask = m->header->capacity - 1;
+    for (uint64_t i = key & mask;; i = (i + 1) & mask) {
+        CacheEntry* e = &m->slots[i];
+        if (e->key == 0) return e;
+        if (e->key == key && e->file_hash == file_hash && e->engine == engine &&
+            strncmp(e->facility, facility, CACHE_NAME_LEN) == 0) {
+            return e;
+        }
+    }
+}
+
+/**
+ * Rebuilds the table with room to grow, keeping only the entries of
+ * the current input file
+ */
+static int rebuild_cache(CacheMap* m, uint64_t file_hash) {
+    uint64_t old_cap = m->header->capacity;
+    uint64_t live = 0;
+    for (uint64_t i = 0; i < old_cap; i++) {
+        if (m->slots[i].key != 0 && m->slots[i].file_hash == file_hash) live++;
+    }
+
+    CacheEntry* kept = malloc((live > 0 ? live : 1) * sizeof(CacheEntry));
+    if (!kept) return -1;
+    uint64_t k = 0;
+    for (uint64_t i = 0; i < old_cap; i++) {
+        if (m->slots[i].key != 0 && m->slots[i].file_hash == file_hash) kept[k++] = m->slots[i];
+    }
+
+    // Keep the load factor under 1/4 after the rebuild
+    uint64_t capacity = CACHE_MIN_CAP;
+    while (capacity < (live + 1) * 4) capacity *= 2;
+
+    // The remembered input files survive the rebuild
+    CacheFile files[CACHE_FILES];
+    uint32_t next_file = m->header->next_file;
+    memcpy(files, m->header->files, sizeof(files));
+
+    if (init_cache(m, capacity) != 0) {
+        free(kept);
+        return -1;
+    }
+    memcpy(m->header->files, files, sizeof(files));
+    m->header->next_file = next_file;
+    for (uint64_t i = 0; i < live; i++) {
+        CacheEntry* e = probe(m, kept[i].key, kept[i].file_hash, kept[i].engine, kept[i].facility);
+        *e = kept[i];
+        m->header->count++;
+    }
+    free(kept);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Returns the content hash of an input file
+ * A file whose size, modification time, inode and first block match one of
+ * the files remembered by the cache gets its recorded hash without being
+ * read; otherwise the whole file is hashed and remembered
+ *
+ * @param cache_path  Cache file (created if needed)
+ * @param path        Input file
+ * @param hash        Receives the 64-bit content hash
+ * @return            0 on success, -1 if the file cannot be read
+ */
+int cache_file_hash(const char* cache_path, const char* path, uint64_t* hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    CacheFingerprint fp;
+    if (fingerprint(fd, &fp) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    CacheMap m;
+    int cached = (open_cache(&m, cache_path, 1) == 0);
+    if (cached) {
+        for (int i = 0; i < CACHE_FILES; i++) {
+            CacheFile* f = &m.header->files[i];
+            if (f->used && memcmp(&f->fp, &fp, sizeof(fp)) == 0) {
+                *hash = f->file_hash;
+                close_cache(&m);
+                close(fd);
+                return 0;
+            }
+        }
+        // The lock is not held while the file is read
+        close_cache(&m);
+    }
+
+    int status = hash_fd(fd, (size_t)fp.size, hash);
+    close(fd);
+    if (status != 0 || !cached || open_cache(&m, cache_path, 1) != 0) return status;
+
+    CacheFile* f = &m.header->files[m.header->next_file % CACHE_FILES];
+    f->used = 1;
+    f->file_hash = *hash;
+    f->fp = fp;
+    m.header->next_file = (m.header->next_file + 1) % CACHE_FILES;
+    close_cache(&m);
+    return 0;
+}
+
+/**
+ * Looks up a leak result
+ *
+ * @param cache_path  Cache file
+ * @param file_hash   Content hash of the input file
+ * @param engine      Engine identifier and version
+ * @param facility    Facility identifier
+ * @param out         Receives the cached result
+ * @return            1 on hit, 0 on miss or error
+ */
+int cache_lookup(const char* cache_path, uint64_t file_hash, uint32_t engine,
+                 const char* facility, CachedLeak* out) {
+    if (strlen(facility) >= CACHE_NAME_LEN) return 0;
+
+    CacheMap m;
+    if (open_cache(&m, cache_path, 0) != 0) return 0;
+
+    uint64_t key = entry_key(file_hash, engine, facility);
+    CacheEntry* e = probe(&m, key, file_hash, engine, facility);
+    int hit = (e->key != 0);
+    if (hit) {
+        out->found = (int)e->found;
+        out->loss = e->loss;
+        out->max_loss = e->max_loss;
+        memcpy(out->max_from, e->max_from, CACHE_NAME_LEN);
+        memcpy(out->max_to, e->max_to, CACHE_NAME_LEN);
+        out->max_from[CACHE_NAME_LEN - 1] = '\0';
+        out->max_to[CACHE_NAME_LEN - 1] = '\0';
+    }
+
+    close_cache(&m);
+    return hit;
+}
+
+/**
+ * Stores a leak result
+ *
+ * @param cache_path  Cache file (created if needed)
+ * @param file_hash   Content hash of the input file
+ * @param engine      Engine identifier and version
+ * @param facility    Facility identifier
+ * @param value       Result to store
+ * @return            0 on success, -1 on failure or identifiers too long
+ */
+int cache_store(const char* cache_path, uint64_t file_hash, uint32_t engine,
+                const char* facility, const CachedLeak* value) {
+    if (strlen(facility) >= CACHE_NAME_LEN || strlen(value->max_from) >= CACHE_NAME_LEN ||
+        strlen(value->max_to) >= CACHE_NAME_LEN) {
+        return -1;
+    }
+
+    CacheMap m;
+    if (open_cache(&m, cache_path, 1) != 0) return -1;
+
+    // Grow (and drop stale entries) beyond a 70% load factor
+    if ((m.header->count + 1) * 10 > m.header->capacity * 7 && rebuild_cache(&m, file_hash) != 0) {
+        close_cache(&m);
+        return -1;
+    }
+
+    uint64_t key = entry_key(file_hash, engine, facility);
+    CacheEntry* e = probe(&m, key, file_hash, engine, facility);
+    if (e->key == 0) m.header->count++;
+
+    memset(e, 0, sizeof(CacheEntry));
+    e->key = key;
+    e->file_hash = file_hash;
+    e->engine = engine;
+    e->found = (uint32_t)(value->found != 0);
+    e->loss = value->loss;
+    e->max_loss = value->max_loss;
+    strcpy(e->facility, facility);
+    strcpy(e->max_from, value->max_from);
+    strcpy(e->max_to, value->max_to);
+
+    close_cache(&m);
+    return 0;
+}
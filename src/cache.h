@@ -0,0 +1,74 @@
+/*
+ * cache.h
+ *
+ * Persistent cache of leak results.
+ * An mmap'd open-addressing hash table keyed by (input file content hash,
+ * facility ID, engine version): a hit costs one probe sequence, and a
+ * modified input file changes the hash so old results are never served.
+ * The content hash of a file already seen is found from a fingerprint
+ * (size, modification time, inode, hash of the first block), so only a new
+ * or changed file is read in full.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+/**
+ * Maximum length of the identifiers stored in an entry (terminator included)
+ */
+#define CACHE_NAME_LEN 128
+
+/**
+ * Cached leak result
+ */
+typedef struct {
+    int found;                        // 0 if the facility does not exist
+    double loss;                      // Total leak volume (internal units)
+    double max_loss;                  // Loss on the critical section
+    char max_from[CACHE_NAME_LEN];    // Upstream station of the critical section
+    char max_to[CACHE_NAME_LEN];      // Downstream station of the critical section
+} CachedLeak;
+
+/**
+ * Returns the content hash of an input file
+ * A file whose size, modification time, inode and first block match one of
+ * the files remembered by the cache gets its recorded hash without being
+ * read; otherwise the whole file is hashed and remembered
+ *
+ * @param cache_path  Cache file (created if needed)
+ * @param path        Input file
+ * @param hash        Receives the 64-bit content hash
+ * @return            0 on success, -1 if the file cannot be read
+ */
+int cache_file_hash(const char* cache_path, const char* path, uint64_t* hash);
+
+/**
+ * Looks up a leak result
+ *
+ * @param cache_path  Cache file
+ * @param file_hash   Content hash of the input file
+ * @param engine      Engine identifier and version
+ * @param facility    Facility identifier
+ * @param out         Receives the cached result
+ * @return            1 on hit, 0 on miss or error
+ */
+int cache_lookup(const char* cache_path, uint64_t file_hash, uint32_t engine,
+                 const char* facility, CachedLeak* out);
+
+/**
+ * Stores a leak result (replacing an older one with the same key)
+ * Entries of other input files are dropped when the table is resized
+ *
+ * @param cache_path  Cache file (created if needed)
+ * @param file_hash   Content hash of the input file
+ * @param engine      Engine identifier and version
+ * @param facility    Facility identifier
+ * @param value       Result to store
+ * @return            0 on success, -1 on failure or identifiers too long
+ */
+int cache_store(const char* cache_path, uint64_t file_hash, uint32_t engine,
+                const char* facility, const CachedLeak* value);
+
+#endif /* CACHE_H */
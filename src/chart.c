@@ -0,0 +1,661 @@
+/*
+ * chart.c
+ *
+ * Native SVG and PNG rendering of the histogram charts (see chart.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "chart.h"
+#include "output.h"
+#include "rank.h"
+
+// Glyphs of the PNG font: 5 columns of 7 bits (bit 0 at the top), ' ' to '~'
+static const unsigned char FONT[95][5] = {
+    {0x00,0x00,0x00,0x00,0x00}, {0x00,0x00,0x5F,0x00,0x00}, {0x00,0x07,0x00,0x07,0x00},
+    {0x14,0x7F,0x14,0x7F,0x14}, {0x24,0x2A,0x7F,0x2A,0x12}, {0x23,0x13,0x08,0x64,0x62},
+    {0x36,0x49,0x55,0x22,0x50}, {0x00,0x05,0x03,0x00,0x00}, {0x00,0x1C,0x22,0x41,0x00},
+    {0x00,0x41,0x22,0x1C,0x00}, {0x08,0x2A,0x1C,0x2A,0x08}, {0x08,0x08,0x3E,0x08,0x08},
+    {0x00,0x50,0x30,0x00,0x00}, {0x08,0x08,0x08,0x08,0x08}, {0x00,0x60,0x60,0x00,0x00},
+    {0x20,0x10,0x08,0x04,0x02}, {0x3E,0x51,0x49,0x45,0x3E}, {0x00,0x42,0x7F,0x40,0x00},
+    {0x42,0x61,0x51,0x49,0x46}, {0x21,0x41,0x45,0x4B,0x31}, {0x18,0x14,0x12,0x7F,0x10},
+    {0x27,0x45,0x45,0x45,0x39}, {0x3C,0x4A,0x49,0x49,0x30}, {0x01,0x71,0x09,0x05,0x03},
+    {0x36,0x49,0x49,0x49,0x36}, {0x06,0x49,0x49,0x29,0x1E}, {0x00,0x36,0x36,0x00,0x00},
+    {0x00,0x56,0x36,0x00,0x00}, {0x08,0x14,0x22,0x41,0x00}, {0x14,0x14,0x14,0x14,0x14},
+    {0x00,0x41,0x22,0x14,0x08}, {0x02,0x01,0x51,0x09,0x06}, {0x32,0x49,0x79,0x41,0x3E},
+    {0x7E,0x11,0x11,0x11,0x7E}, {0x7F,0x49,0x49,0x49,0x36}, {0x3E,0x41,0x41,0x41,0x22},
+    {0x7F,0x41,0x41,0x22,0x1C}, {0x7F,0x49,0x49,0x49,0x41}, {0x7F,0x09,0x09,0x01,0x01},
+    {0x3E,0x41,0x41,0x51,0x32}, {0x7F,0x08,0x08,0x08,0x7F}, {0x00,0x41,0x7F,0x41,0x00},
+    {0x20,0x40,0x41,0x3F,0x01}, {0x7F,0x08,0x14,0x22,0x41}, {0x7F,0x40,0x40,0x40,0x40},
+    {0x7F,0x02,0x04,0x02,0x7F}, {0x7F,0x04,0x08,0x10,0x7F}, {0x3E,0x41,0x41,0x41,0x3E},
+    {0x7F,0x09,0x09,0x09,0x06}, {0x3E,0x41,0x51,0x21,0x5E}, {0x7F,0x09,0x19,0x29,0x46},
+    {0x46,0x49,0x49,0x49,0x31}, {0x01,0x01,0x7F,0x01,0x01}, {0x3F,0x40,0x40,0x40,0x3F},
+    {0x1F,0x20,0x40,0x20,0x1F}, {0x7F,0x20,0x18,0x20,0x7F}, {0x63,0x14,0x08,0x14,0x63},
+    {0x03,0x04,0x78,0x04,0x03}, {0x61,0x51,0x49,0x45,0x43}, {0x00,0x7F,0x41,0x41,0x00},
+    {0x02,0x04,0x08,0x10,0x20}, {0x00,0x41,0x41,0x7F,0x00}, {0x04,0x02,0x01,0x02,0x04},
+    {0x40,0x40,0x40,0x40,0x40}, {0x00,0x01,0x02,0x04,0x00}, {0x20,0x54,0x54,0x54,0x78},
+    {0x7F,0x48,0x44,0x44,0x38}, {0x38,0x44,0x44,0x44,0x20}, {0x38,0x44,0x44,0x48,0x7F},
+    {0x38,0x54,0x54,0x54,0x18}, {0x08,0x7E,0x09,0x01,0x02}, {0x08,0x14,0x54,0x54,0x3C},
+    {0x7F,0x08,0x04,0x04,0x78}, {0x00,0x44,0x7D,0x40,0x00}, {0x20,0x40,0x44,0x3D,0x00},
+    {0x00,0x7F,0x10,0x28,0x44}, {0x00,0x41,0x7F,0x40,0x00}, {0x7C,0x04,0x18,0x04,0x78},
+    {0x7C,0x08,0x04,0x04,0x78}, {0x38,0x44,0x44,0x44,0x38}, {0x7C,0x14,0x14,0x14,0x08},
+    {0x08,0x14,0x14,0x18,0x7C}, {0x7C,0x08,0x04,0x04,0x08}, {0x48,0x54,0x54,0x54,0x20},
+    {0x04,0x3F,0x44,0x40,0x20}, {0x3C,0x40,0x40,0x20,0x7C}, {0x1C,0x20,0x40,0x20,0x1C},
+    {0x3C,0x40,0x30,0x40,0x3C}, {0x44,0x28,0x10,0x28,0x44}, {0x0C,0x50,0x50,0x50,0x3C},
+    {0x44,0x64,0x54,0x4C,0x44}, {0x00,0x08,0x36,0x41,0x00}, {0x00,0x00,0x7F,0x00,0x00},
+    {0x00,0x41,0x36,0x08,0x00}, {0x08,0x04,0x08,0x10,0x08}
+};
+
+// Degrees to radians
+#define CHART_PI 3.14159265358979323846
+
+// Advance of a glyph, gap included (PNG font units)
+#define GLYPH_ADVANCE 6
+#define GLYPH_HEIGHT 7
+
+// Colors (0xRRGGBB)
+#define COLOR_WHITE 0xFFFFFF
+#define COLOR_BLACK 0x000000
+#define COLOR_GRID 0xC8C8C8
+#define COLOR_REAL 0x3366CC
+#define COLOR_LOSS 0xDC3912
+#define COLOR_UNUSED 0x109618
+#define COLOR_TOP 0x0000FF
+#define COLOR_BOTTOM 0xFF0000
+
+// Text anchors
+#define ANCHOR_START 0
+#define ANCHOR_MIDDLE 1
+#define ANCHOR_END 2
+
+/**
+ * Drawing surface: an RGB pixel buffer (PNG) or an SVG document
+ */
+typedef struct {
+    int format;              // CHART_* format
+    int width;               // Pixels
+    int height;              // Pixels
+    unsigned char* pixels;   // RGB rows (PNG)
+    OutBuffer* svg;          // Document being written (SVG)
+} Canvas;
+
+/**
+ * Growable byte buffer with an LSB-first bit writer (deflate)
+ */
+typedef struct {
+    unsigned char* data;
+    size_t len;
+    size_t cap;
+    unsigned long bits;   // Pending bits
+    int nbits;            // Number of pending bits
+    int error;            // Non-zero after an allocation failure
+} ByteBuffer;
+
+/**
+ * Deflate length and distance code tables (RFC 1951)
+ */
+static const int LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const int LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const int DIST_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const int DIST_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Appends bytes to a buffer
+ */
+static void buf_append(ByteBuffer* b, const void* data, size_t n) {
+    if (b->error) return;
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 65536;
+        while (cap < b->len + n) cap *= 2;
+        unsigned char* p = realloc(b->data, cap);
+        if (!p) {
+            b->error = 1;
+            return;
+        }
+        b->data = p;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+/**
+ * Appends a 32-bit big-endian integer
+ */
+static void buf_u32(ByteBuffer* b, unsigned long v) {
+    unsigned char be[4] = {
+        (unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v
+    };
+    buf_append(b, be, 4);
+}
+
+/**
+ * Writes n bits, least significant first
+ */
+static void put_bits(ByteBuffer* b, unsigned long value, int n) {
+    b->bits |= value << b->nbits;
+    b->nbits += n;
+    while (b->nbits >= 8) {
+        unsigned char byte = (unsigned char)(b->bits & 0xFF);
+        buf_append(b, &byte, 1);
+        b->bits >>= 8;
+        b->nbits -= 8;
+    }
+}
+
+/**
+ * Writes a Huffman code, most significant bit first
+ */
+static void put_code(ByteBuffer* b, unsigned code, int len) {
+    unsigned reversed = 0;
+    for (int i = 0; i < len; i++) reversed |= ((code >> i) & 1u) << (len - 1 - i);
+    put_bits(b, reversed, len);
+}
+
+/**
+ * Writes a literal/length symbol with the fixed Huffman codes
+ */
+static void put_symbol(ByteBuffer* b, int v) {
+    if (v < 144) put_code(b, 0x30 + v, 8);
+    else if (v < 256) put_code(b, 0x190 + (v - 144), 9);
+    else if (v < 280) put_code(b, v - 256, 7);
+    else put_code(b, 0xC0 + (v - 280), 8);
+}
+
+/**
+ * Writes a match of len bytes at distance dist
+ */
+static void put_match(ByteBuffer* b, int len, int dist) {
+    int i = 28;
+    while (LENGTH_BASE[i] > len) i--;
+    put_symbol(b, 257 + i);
+    put_bits(b, (unsigned long)(len - LENGTH_BASE[i]), LENGTH_EXTRA[i]);
+
+    int d = 29;
+    while (DIST_BASE[d] > dist) d--;
+    put_code(b, (unsigned)d, 5);
+    put_bits(b, (unsigned long)(dist - DIST_BASE[d]), DIST_EXTRA[d]);
+}
+
+/**
+ * Compresses data as a zlib stream: one fixed Huffman block whose matches
+ * repeat the previous pixel or the pixel above, which is all flat charts need
+ */
+static void zlib_compress(ByteBuffer* b, const unsigned char* data, size_t n, size_t stride) {
+    static const unsigned char header[2] = { 0x78, 0x01 };
+    buf_append(b, header, 2);
+    put_bits(b, 1, 1);  // Final block
+    put_bits(b, 1, 2);  // Fixed Huffman codes
+
+    size_t dists[2] = { 3, stride };
+    size_t i = 0;
+    while (i < n) {
+        size_t best = 0;
+        size_t best_dist = 0;
+        for (int k = 0; k < 2; k++) {
+            size_t d = dists[k];
+            if (d > i || d > 32768) continue;
+            size_t len = 0;
+            while (len < 258 && i + len < n && data[i + len] == data[i + len - d]) len++;
+            if (len > best) {
+                best = len;
+                best_dist = d;
+            }
+        }
+        if (best >= 3) {
+            put_match(b, (int)best, (int)best_dist);
+            i += best;
+        } else {
+            put_symbol(b, data[i]);
+            i++;
+        }
+    }
+    put_symbol(b, 256);
+    if (b->nbits > 0) put_bits(b, 0, 8 - b->nbits);
+
+    // Adler-32 of the uncompressed data
+    unsigned long a = 1, s = 0;
+    for (size_t k = 0; k < n; k++) {
+        a = (a + data[k]) % 65521;
+        s = (s + a) % 65521;
+    }
+    buf_u32(b, (s << 16) | a);
+}
+
+/**
+ * CRC-32 of a byte range (PNG chunks)
+ */
+static unsigned long crc32_of(const unsigned char* data, size_t n) {
+    static unsigned long table[256];
+    static int ready = 0;
+    if (!ready) {
+        for (unsigned long c = 0; c < 256; c++) {
+            unsigned long v = c;
+            for (int k = 0; k < 8; k++) v = (v & 1) ? 0xEDB88320UL ^ (v >> 1) : v >> 1;
+            table[c] = v;
+        }
+        ready = 1;
+    }
+    unsigned long crc = 0xFFFFFFFFUL;
+    for (size_t i = 0; i < n; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFUL;
+}
+
+/**
+ * Appends a PNG chunk
+ */
+static void png_chunk(ByteBuffer* b, const char* type, const unsigned char* data, size_t n) {
+    buf_u32(b, (unsigned long)n);
+    size_t start = b->len;
+    buf_append(b, type, 4);
+    if (n > 0) buf_append(b, data, n);
+    if (!b->error) buf_u32(b, crc32_of(b->data + start, n + 4));
+}
+
+/**
+ * Writes the pixels of a canvas as a PNG file
+ */
+static int write_png(const Canvas* c, const char* path) {
+    size_t stride = (size_t)c->width * 3 + 1;
+    size_t size = stride * (size_t)c->height;
+    unsigned char* raw = malloc(size);
+    if (!raw) return -1;
+    for (int y = 0; y < c->height; y++) {
+        raw[y * stride] = 0;  // No filter
+        memcpy(raw + y * stride + 1, c->pixels + (size_t)y * c->width * 3, (size_t)c->width * 3);
+    }
+
+    ByteBuffer z = { NULL, 0, 0, 0, 0, 0 };
+    zlib_compress(&z, raw, size, stride);
+    free(raw);
+
+    ByteBuffer png = { NULL, 0, 0, 0, 0, 0 };
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    unsigned char ihdr[13] = {
+        (unsigned char)(c->width >> 24), (unsigned char)(c->width >> 16),
+        (unsigned char)(c->width >> 8), (unsigned char)c->width,
+        (unsigned char)(c->height >> 24), (unsigned char)(c->height >> 16),
+        (unsigned char)(c->height >> 8), (unsigned char)c->height,
+        8, 2, 0, 0, 0   // 8-bit RGB, no interlace
+    };
+    buf_append(&png, signature, 8);
+    png_chunk(&png, "IHDR", ihdr, sizeof(ihdr));
+    if (!z.error) png_chunk(&png, "IDAT", z.data, z.len);
+    png_chunk(&png, "IEND", NULL, 0);
+
+    int status = (z.error || png.error) ? -1 : 0;
+    FILE* file = (status == 0) ? fopen(path, "wb") : NULL;
+    if (!file || fwrite(png.data, 1, png.len, file) != png.len) status = -1;
+    if (file && fclose(file) != 0) status = -1;
+    free(z.data);
+    free(png.data);
+    return status;
+}
+
+/**
+ * Sets one pixel (clipped)
+ */
+static void put_pixel(Canvas* c, int x, int y, unsigned color) {
+    if (x < 0 || y < 0 || x >= c->width || y >= c->height) return;
+    unsigned char* p = c->pixels + ((size_t)y * c->width + x) * 3;
+    p[0] = (unsigned char)(color >> 16);
+    p[1] = (unsigned char)(color >> 8);
+    p[2] = (unsigned char)color;
+}
+
+/**
+ * Writes a color as an SVG attribute value
+ */
+static void svg_color(OutBuffer* out, unsigned color) {
+    char tmp[16];
+    snprintf(tmp, sizeof(tmp), "#%06X", color & 0xFFFFFF);
+    out_puts(out, tmp);
+}
+
+/**
+ * Writes text with the XML special characters escaped
+ */
+static void svg_escaped(OutBuffer* out, const char* s) {
+    for (; *s; s++) {
+        switch (*s) {
+            case '&': out_puts(out, "&amp;"); break;
+            case '<': out_puts(out, "&lt;"); break;
+            case '>': out_puts(out, "&gt;"); break;
+            case '"': out_puts(out, "&quot;"); break;
+            default: out_write(out, s, 1); break;
+        }
+    }
+}
+
+/**
+ * Fills a rectangle, with a black border if border is set
+ */
+static void draw_rect(Canvas* c, int x, int y, int w, int h, unsigned color, int border) {
+    if (w <= 0 || h <= 0) return;
+    if (c->format == CHART_SVG) {
+        char tmp[128];
+        snprintf(tmp, sizeof(tmp), "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" fill=\"",
+                 x, y, w, h);
+        out_puts(c->svg, tmp);
+        svg_color(c->svg, color);
+        out_puts(c->svg, border ? "\" stroke=\"#000000\" stroke-width=\"1\"/>\n" : "\"/>\n");
+        return;
+    }
+    for (int j = y; j < y + h; j++) {
+        for (int i = x; i < x + w; i++) {
+            int edge = border && (i == x || i == x + w - 1 || j == y || j == y + h - 1);
+            put_pixel(c, i, j, edge ? COLOR_BLACK : color);
+        }
+    }
+}
+
+/**
+ * Draws a horizontal or vertical line, dashed if requested
+ */
+static void draw_line(Canvas* c, int x0, int y0, int x1, int y1, unsigned color, int dashed) {
+    if (c->format == CHART_SVG) {
+        char tmp[160];
+        snprintf(tmp, sizeof(tmp), "<line x1=\"%d\" y1=\"%d\" x2=\"%d\" y2=\"%d\" stroke=\"",
+                 x0, y0, x1, y1);
+        out_puts(c->svg, tmp);
+        svg_color(c->svg, color);
+        out_puts(c->svg, dashed ? "\" stroke-dasharray=\"4,4\"/>\n" : "\"/>\n");
+        return;
+    }
+    int steps = abs(x1 - x0) > abs(y1 - y0) ? abs(x1 - x0) : abs(y1 - y0);
+    for (int k = 0; k <= steps; k++) {
+        if (dashed && (k / 4) % 2) continue;
+        int x = steps ? x0 + (x1 - x0) * k / steps : x0;
+        int y = steps ? y0 + (y1 - y0) * k / steps : y0;
+        put_pixel(c, x, y, color);
+    }
+}
+
+/**
+ * Width of a text in pixels at a scale
+ */
+static int text_width(const char* s, int scale) {
+    int n = (int)strlen(s);
+    return n > 0 ? (n * GLYPH_ADVANCE - 1) * scale : 0;
+}
+
+/**
+ * Draws a text line centered vertically on (x, y), rotated clockwise by
+ * angle degrees around that point
+ */
+static void draw_text(Canvas* c, int x, int y, const char* s, int scale, int anchor, int angle) {
+    if (c->format == CHART_SVG) {
+        char tmp[192];
+        static const char* const ANCHORS[3] = { "start", "middle", "end" };
+        snprintf(tmp, sizeof(tmp),
+                 "<text x=\"%d\" y=\"%d\" font-family=\"sans-serif\" font-size=\"%d\" "
+                 "text-anchor=\"%s\" dominant-baseline=\"middle\"", x, y, 10 * scale, ANCHORS[anchor]);
+        out_puts(c->svg, tmp);
+        if (angle != 0) {
+            snprintf(tmp, sizeof(tmp), " transform=\"rotate(%d %d %d)\"", angle, x, y);
+            out_puts(c->svg, tmp);
+        }
+        out_puts(c->svg, ">");
+        svg_escaped(c->svg, s);
+        out_puts(c->svg, "</text>\n");
+        return;
+    }
+
+    double rad = angle * CHART_PI / 180.0;
+    double cs = cos(rad), sn = sin(rad);
+    int w = text_width(s, scale);
+    double u0 = (anchor == ANCHOR_START) ? 0.0 : (anchor == ANCHOR_MIDDLE) ? -w / 2.0 : -w;
+    double v0 = -GLYPH_HEIGHT * scale / 2.0;
+
+    // Slanted text is sampled twice as finely to leave no holes
+    int samples = (angle % 90 != 0) ? 2 * scale : scale;
+    for (int k = 0; s[k]; k++) {
+        int ch = (unsigned char)s[k];
+        if (ch < 32 || ch > 126) ch = '?';
+        const unsigned char* glyph = FONT[ch - 32];
+        for (int col = 0; col < 5; col++) {
+            for (int row = 0; row < GLYPH_HEIGHT; row++) {
+                if (!((glyph[col] >> row) & 1)) continue;
+                for (int i = 0; i < samples; i++) {
+                    for (int j = 0; j < samples; j++) {
+                        double u = u0 + (k * GLYPH_ADVANCE + col) * scale + (i + 0.5) * scale / samples;
+                        double v = v0 + row * scale + (j + 0.5) * scale / samples;
+                        put_pixel(c, (int)floor(x + u * cs - v * sn), (int)floor(y + u * sn + v * cs),
+                                  COLOR_BLACK);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Step between two y-axis ticks: 1, 2 or 5 times a power of ten
+ */
+static double tick_step(double max) {
+    double raw = max / 8.0;
+    double mag = pow(10.0, floor(log10(raw)));
+    double norm = raw / mag;
+    if (norm <= 1.0) return mag;
+    if (norm <= 2.0) return 2.0 * mag;
+    if (norm <= 5.0) return 5.0 * mag;
+    return 10.0 * mag;
+}
+
+/**
+ * Segments of the bar of a station (M.m3), bottom first
+ *
+ * @return  Number of segments
+ */
+static int bar_segments(const Station* s, const char* mode, int metric, double seg[3]) {
+    if (strcmp(mode, "all") == 0) {
+        double cap = s->capacity / 1000.0;
+        double src = s->consumption / 1000.0;
+        double real = s->real_qty / 1000.0;
+        seg[0] = real;
+        seg[1] = (src - real > 0.0) ? src - real : 0.0;
+        seg[2] = (cap - src > 0.0) ? cap - src : 0.0;
+        return 3;
+    }
+    seg[0] = station_metric(s, metric) / 1000.0;
+    return 1;
+}
+
+/**
+ * Draws the legend centered at the top of the chart
+ */
+static void draw_legend(Canvas* c, const char* const* labels, const unsigned* colors, int n) {
+    int total = 0;
+    for (int i = 0; i < n; i++) total += 26 + text_width(labels[i], 1) + 20;
+    int x = (c->width - total) / 2;
+    for (int i = 0; i < n; i++) {
+        draw_rect(c, x, 44, 20, 10, colors[i], 1);
+        draw_text(c, x + 26, 49, labels[i], 1, ANCHOR_START, 0);
+        x += 26 + text_width(labels[i], 1) + 20;
+    }
+}
+
+/**
+ * Draws a whole chart on a canvas
+ */
+static void draw_chart(Canvas* c, const char* mode, const char* title, Station* const* rows, long n,
+                       int is_top) {
+    int stacked = (strcmp(mode, "all") == 0);
+    int metric = stacked ? METRIC_MAX : parse_metric(mode);
+
+    draw_rect(c, 0, 0, c->width, c->height, COLOR_WHITE, 0);
+    draw_text(c, c->width / 2, 20, title, 2, ANCHOR_MIDDLE, 0);
+
+    static const char* const STACK_LABELS[3] = { "Real Output", "Losses", "Unused Capacity" };
+    static const unsigned STACK_COLORS[3] = { COLOR_REAL, COLOR_LOSS, COLOR_UNUSED };
+    static const char* const SINGLE_LABEL[1] = { "Volume" };
+    unsigned single_color = is_top ? COLOR_TOP : COLOR_BOTTOM;
+    if (stacked) draw_legend(c, STACK_LABELS, STACK_COLORS, 3);
+    else draw_legend(c, SINGLE_LABEL, &single_color, 1);
+
+    // Largest bar and room for the labels below the axis
+    double max = 0.0;
+    int longest = 0;
+    for (long i = 0; i < n; i++) {
+        double seg[3];
+        int k = bar_segments(rows[i], mode, metric, seg);
+        double total = 0.0;
+        for (int j = 0; j < k; j++) total += seg[j];
+        if (total > max) max = total;
+        int w = text_width(rows[i]->name, 1);
+        if (w > longest) longest = w;
+    }
+    if (max <= 0.0) max = 1.0;
+    int angle = is_top ? 45 : 90;
+    int label_room = (angle == 90) ? longest : (int)(longest * 0.7072) + 8;
+    if (label_room > c->height / 2) label_room = c->height / 2;
+
+    int left = 100, right = c->width - 30, top = 70, bottom = c->height - label_room - 20;
+    double step = tick_step(max);
+    double y_max = ceil(max / step) * step;
+    int decimals = (step >= 1.0) ? 0 : (int)ceil(-log10(step) - 1e-9);
+    if (decimals > 6) decimals = 6;
+
+    // Grid and y-axis labels
+    char tmp[64];
+    for (int t = 0; t * step <= y_max + step / 2.0; t++) {
+        int y = bottom - (int)((bottom - top) * (t * step) / y_max);
+        if (t > 0) draw_line(c, left, y, right, y, COLOR_GRID, 1);
+        snprintf(tmp, sizeof(tmp), "%.*f", decimals, t * step);
+        draw_text(c, left - 6, y, tmp, 1, ANCHOR_END, 0);
+    }
+    draw_text(c, 22, (top + bottom) / 2, "Volume (M.m3)", 1, ANCHOR_MIDDLE, -90);
+
+    // Bars, from the smallest station to the largest
+    double slot = (n > 0) ? (double)(right - left) / n : 0.0;
+    for (long i = 0; i < n; i++) {
+        double seg[3];
+        int k = bar_segments(rows[i], mode, metric, seg);
+        int x = left + (int)(slot * i + slot * 0.15);
+        int w = (int)(slot * 0.7);
+        if (w < 1) w = 1;
+        double base = 0.0;
+        for (int j = 0; j < k; j++) {
+            int y0 = bottom - (int)((bottom - top) * base / y_max);
+            int y1 = bottom - (int)((bottom - top) * (base + seg[j]) / y_max);
+            draw_rect(c, x, y1, w, y0 - y1, stacked ? STACK_COLORS[j] : single_color, 1);
+            base += seg[j];
+        }
+        draw_text(c, left + (int)(slot * (i + 0.5)), bottom + 10, rows[i]->name, 1,
+                  ANCHOR_START, angle);
+    }
+
+    draw_line(c, left, top, left, bottom, COLOR_BLACK, 0);
+    draw_line(c, left, bottom, right, bottom, COLOR_BLACK, 0);
+}
+
+/**
+ * Draws the chart of one block of rows (top block: blue bars, slanted labels)
+ * to a file
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int render(const char* path, int format, const char* mode, const char* title,
+                  Station* const* rows, long n, int is_top) {
+    int width = is_top ? 1200 : 1600;
+    int height = is_top ? 800 : 900;
+    Canvas c = { format, width, height, NULL, NULL };
+
+    if (format == CHART_PNG) {
+        c.pixels = malloc((size_t)width * height * 3);
+        if (!c.pixels) return -1;
+        draw_chart(&c, mode, title, rows, n, is_top);
+        int status = write_png(&c, path);
+        free(c.pixels);
+        return status;
+    }
+
+    FILE* file = fopen(path, "w");
+    OutBuffer out;
+    if (!file || out_open_stream(&out, file) != 0) {
+        if (file) fclose(file);
+        return -1;
+    }
+    char tmp[192];
+    snprintf(tmp, sizeof(tmp),
+             "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" "
+             "viewBox=\"0 0 %d %d\">\n", width, height, width, height);
+    out_puts(&out, tmp);
+    c.svg = &out;
+    draw_chart(&c, mode, title, rows, n, is_top);
+    out_puts(&out, "</svg>\n");
+    int status = out_close(&out);
+    if (fclose(file) != 0) status = -1;
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Converts a format name ("svg" or "png") to its CHART_* code
+ *
+ * @param name  Format name
+ * @return      CHART_* code, -1 if unknown
+ */
+int chart_parse_format(const char* name) {
+    if (strcmp(name, "svg") == 0) return CHART_SVG;
+    if (strcmp(name, "png") == 0) return CHART_PNG;
+    return -1;
+}
+
+/**
+ * Draws the charts of a histogram selection
+ *
+ * @param prefix     Path prefix of the images
+ * @param format     CHART_* format
+ * @param mode       Data type ("max", "src", "real" or "all")
+ * @param bottom     Smallest rows
+ * @param nb_bottom  Number of smallest rows
+ * @param top        Largest rows
+ * @param nb_top     Number of largest rows
+ * @return           0 on success, -1 if a chart cannot be written
+ */
+int chart_write_selection(const char* prefix, int format, const char* mode,
+                          Station* const* bottom, long nb_bottom,
+                          Station* const* top, long nb_top) {
+    const char* ext = (format == CHART_PNG) ? "png" : "svg";
+    int stacked = (strcmp(mode, "all") == 0);
+    size_t len = strlen(prefix) + 16;
+    char* path = malloc(len);
+    char title[128];
+    int status = path ? 0 : -1;
+
+    if (status == 0 && nb_top > 0) {
+        snprintf(path, len, "%s_big.%s", prefix, ext);
+        if (stacked) snprintf(title, sizeof(title), "Top %ld Stations - Bonus Mode (Smallest to Largest)", nb_top);
+        else snprintf(title, sizeof(title), "Top %ld Stations (%s) - Smallest to Largest", nb_top, mode);
+        if (render(path, format, mode, title, top, nb_top, 1) != 0) status = -1;
+    }
+    if (status == 0 && nb_bottom > 0) {
+        snprintf(path, len, "%s_small.%s", prefix, ext);
+        if (stacked) snprintf(title, sizeof(title), "Bottom %ld Stations - Bonus Mode (Smallest to Largest)", nb_bottom);
+        else snprintf(title, sizeof(title), "Bottom %ld Stations (%s) - Smallest to Largest", nb_bottom, mode);
+        if (render(path, format, mode, title, bottom, nb_bottom, 0) != 0) status = -1;
+    }
+    if (status != 0 && path) fprintf(stderr, "Error: unable to write the chart %s\n", path);
+    free(path);
+    return status;
+}
@@ -0,0 +1,51 @@
+/*
+ * chart.h
+ *
+ * Native rendering of the histogram charts, straight from the ranked rows:
+ * SVG documents, or PNG images through a small built-in rasterizer (5x7
+ * bitmap font, deflate with fixed Huffman codes), so a histogram job needs
+ * neither gnuplot nor temporary files.
+ *
+ * Single-value modes draw one bar per station. The "all" mode stacks the
+ * actual volume, the losses (captured - actual) and the unused capacity
+ * (capacity - captured), as the former gnuplot charts did.
+ */
+
+#ifndef CHART_H
+#define CHART_H
+
+#include "structs.h"
+
+/**
+ * Output formats
+ */
+#define CHART_SVG 0
+#define CHART_PNG 1
+
+/**
+ * Converts a format name ("svg" or "png") to its CHART_* code
+ *
+ * @param name  Format name
+ * @return      CHART_* code, -1 if unknown
+ */
+int chart_parse_format(const char* name);
+
+/**
+ * Draws the charts of a histogram selection (both blocks in ascending order):
+ * <prefix>_small.<ext> for the bottom block, <prefix>_big.<ext> for the top
+ * block; an empty block draws no chart
+ *
+ * @param prefix     Path prefix of the images
+ * @param format     CHART_* format
+ * @param mode       Data type ("max", "src", "real" or "all")
+ * @param bottom     Smallest rows
+ * @param nb_bottom  Number of smallest rows
+ * @param top        Largest rows
+ * @param nb_top     Number of largest rows
+ * @return           0 on success, -1 if a chart cannot be written
+ */
+int chart_write_selection(const char* prefix, int format, const char* mode,
+                          Station* const* bottom, long nb_bottom,
+                          Station* const* top, long nb_top);
+
+#endif /* CHART_H */
@@ -0,0 +1,444 @@
+/*
+ * check.c
+ *
+ * Differential check of the calculation engines (see check.h).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "check.h"
+#include "network.h"
+#include "avl.h"
+#include "leaks.h"
+#include "whatif.h"
+#include "shard.h"
+#include "fixedpoint.h"
+
+// Threads of the sharded loader under check
+#define CHECK_HISTO_THREADS 4
+
+// Relative tolerance of the what-if fractions (they ignore the 0.001 cut-off)
+#define CHECK_WHATIF_TOLERANCE 1e-6
+
+// Relative tolerance of the fixed-point engines (each step rounds to the nearest)
+#define CHECK_FIXED_TOLERANCE 1e-6
+
+/**
+ * Network under check
+ */
+typedef struct {
+    Network net;    // Graph and every aggregate
+    WhatIf whatif;  // What-if engine on the graph
+} CheckNetwork;
+
+/**
+ * Leak engine compared with the serial one
+ */
+typedef struct {
+    const char* name;   // Name in the report
+    double tolerance;   // Relative tolerance on the total and the critical section
+    // Fills res (max_loss < 0 when the engine has no critical section)
+    int (*run)(CheckNetwork* cn, Station* facility, LeakResult* res);
+} LeakEngine;
+
+/**
+ * Differences observed for one engine
+ */
+typedef struct {
+    long runs;          // Comparisons made
+    double max_abs;     // Largest absolute difference (m3)
+    double max_rel;     // Largest relative difference
+    long failures;      // Comparisons out of tolerance
+} CheckStats;
+
+/**
+ * Histogram row copied out of the tree
+ */
+typedef struct {
+    char* name;
+    long capacity;
+    long consumption;
+    long real_qty;
+} HistoRow;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Serial engine: the reference
+ */
+static int run_serial(CheckNetwork* cn, Station* facility, LeakResult* res) {
+    return leak_query(cn->net.root, facility->name, 0, res);
+}
+
+/**
+ * Multithreaded engine
+ */
+static int run_threaded(CheckNetwork* cn, Station* facility, LeakResult* res) {
+    return leak_query(cn->net.root, facility->name, 1, res);
+}
+
+/**
+ * Fixed-point engine
+ */
+static int run_fixed(CheckNetwork* cn, Station* facility, LeakResult* res) {
+    return leak_query_fixed(cn->net.root, facility->name, 0, res);
+}
+
+/**
+ * Fixed-point engine with threaded branches
+ */
+static int run_fixed_threaded(CheckNetwork* cn, Station* facility, LeakResult* res) {
+    return leak_query_fixed(cn->net.root, facility->name, 1, res);
+}
+
+/**
+ * What-if engine (total only)
+ */
+static int run_whatif(CheckNetwork* cn, Station* facility, LeakResult* res) {
+    FacilityModel* m = whatif_model(&cn->whatif, facility);
+    if (!m) return -1;
+    res->loss = whatif_loss(m);
+    res->max_loss = -1.0;
+    return 0;
+}
+
+/**
+ * Registered leak engines, the reference first
+ */
+static const LeakEngine engines[] = {
+    { "serial", 0.0, run_serial },
+    { "threaded", CHECK_DEFAULT_TOLERANCE, run_threaded },
+    { "whatif", CHECK_WHATIF_TOLERANCE, run_whatif },
+    { "fixed", CHECK_FIXED_TOLERANCE, run_fixed },
+    { "fixed-threaded", CHECK_FIXED_TOLERANCE, run_fixed_threaded },
+};
+
+#define ENGINE_COUNT ((int)(sizeof(engines) / sizeof(engines[0])))
+
+/**
+ * Records one comparison
+ *
+ * @return  1 if the values are within the tolerance, 0 otherwise
+ */
+static int record(CheckStats* st, double ref, double value, double tolerance) {
+    double abs_diff = fabs(value - ref) / 1000.0;
+    double rel_diff = fabs(value - ref) / (fabs(ref) > 1.0 ? fabs(ref) : 1.0);
+    if (abs_diff > st->max_abs) st->max_abs = abs_diff;
+    if (rel_diff > st->max_rel) st->max_rel = rel_diff;
+    return rel_diff <= tolerance;
+}
+
+/**
+ * Collects the facilities of a tree (stations with a capacity)
+ */
+static void collect_facilities(Station* node, Station*** list, long* count, long* capacity) {
+    if (!node) return;
+    collect_facilities(node->left, list, count, capacity);
+    if (node->capacity > 0) {
+        if (*count == *capacity) {
+            long cap = *capacity ? *capacity * 2 : 64;
+            Station** grown = realloc(*list, cap * sizeof(Station*));
+            if (!grown) return;
+            *list = grown;
+            *capacity = cap;
+        }
+        (*list)[(*count)++] = node;
+    }
+    collect_facilities(node->right, list, count, capacity);
+}
+
+/**
+ * Runs every leak engine on every facility of a network
+ *
+ * @return  0 on success, -1 if the network cannot be read
+ */
+static int check_leaks(const char* path, const CheckOptions* opts, CheckStats* stats) {
+    CheckNetwork cn;
+    LoadSpec spec = { LOAD_GRAPH | LOAD_HISTO | LOAD_RELAYOUT | LOAD_REVERSE, HISTO_ALL, NULL, NULL, NULL };
+    network_init(&cn.net);
+    if (network_load(&cn.net, path, &spec) != 0) {
+        network_free(&cn.net);
+        return -1;
+    }
+    whatif_init(&cn.whatif, cn.net.root, cn.net.reverse);
+
+    Station** facilities = NULL;
+    long count = 0;
+    long capacity = 0;
+    collect_facilities(cn.net.root, &facilities, &count, &capacity);
+
+    for (long f = 0; f < count; f++) {
+        LeakResult ref;
+        leak_result_init(&ref);
+        if (engines[0].run(&cn, facilities[f], &ref) != 0) continue;
+        stats[0].runs++;
+
+        for (int e = 1; e < ENGINE_COUNT; e++) {
+            double tolerance = (opts->tolerance >= 0) ? opts->tolerance : engines[e].tolerance;
+            LeakResult res;
+            leak_result_init(&res);
+            int ok = (engines[e].run(&cn, facilities[f], &res) == 0);
+            stats[e].runs++;
+
+            if (ok) ok = record(&stats[e], ref.loss, res.loss, tolerance);
+            if (ok && res.max_loss >= 0.0) {
+                ok = record(&stats[e], ref.max_loss, res.max_loss, tolerance);
+                // Equal losses must designate the same section
+                if (ok && res.max_loss == ref.max_loss && ref.max_from &&
+                    (!res.max_from || strcmp(res.max_from, ref.max_from) != 0 ||
+                     strcmp(res.max_to, ref.max_to) != 0)) {
+                    ok = 0;
+                }
+            }
+            if (!ok) {
+                stats[e].failures++;
+                fprintf(stderr, "Mismatch: %s on %s: %.6f instead of %.6f\n",
+                        engines[e].name, facilities[f]->name, res.loss / 1000.0, ref.loss / 1000.0);
+            }
+        }
+    }
+
+    free(facilities);
+    whatif_free(&cn.whatif);
+    network_free(&cn.net);
+    return 0;
+}
+
+/**
+ * Copies the rows of a tree in identifier order
+ */
+static void snapshot_rows(Station* node, HistoRow* rows, long* n) {
+    if (!node) return;
+    snapshot_rows(node->left, rows, n);
+    HistoRow* r = &rows[(*n)++];
+    r->name = malloc(strlen(node->name) + 1);
+    if (r->name) strcpy(r->name, node->name);
+    r->capacity = node->capacity;
+    r->consumption = node->consumption;
+    r->real_qty = node->real_qty;
+    snapshot_rows(node->right, rows, n);
+}
+
+/**
+ * Largest difference between two rows, -1 if they are not the same station
+ */
+static long row_difference(const HistoRow* a, const Station* b) {
+    if (!a->name || strcmp(a->name, b->name) != 0) return -1;
+    long d = labs(a->capacity - b->capacity);
+    if (labs(a->consumption - b->consumption) > d) d = labs(a->consumption - b->consumption);
+    if (labs(a->real_qty - b->real_qty) > d) d = labs(a->real_qty - b->real_qty);
+    return d;
+}
+
+/**
+ * Compares a tree with a snapshot, in identifier order
+ *
+ * @return  Largest value difference, -1 if the stations differ
+ */
+static long compare_rows(Station* node, const HistoRow* rows, long count, long* pos) {
+    if (!node) return 0;
+    long worst = compare_rows(node->left, rows, count, pos);
+    if (worst < 0) return -1;
+    if (*pos >= count) return -1;
+    long d = row_difference(&rows[(*pos)++], node);
+    if (d < 0) return -1;
+    if (d > worst) worst = d;
+    long right = compare_rows(node->right, rows, count, pos);
+    if (right < 0) return -1;
+    return (right > worst) ? right : worst;
+}
+
+/**
+ * Compares the sharded histogram loader with the sequential one, every mode
+ *
+ * @return  0 on success, -1 if the network cannot be read
+ */
+static int check_histograms(const char* path, CheckStats* st) {
+    for (int mode = HISTO_MAX; mode <= HISTO_ALL; mode++) {
+        Network net;
+        LoadSpec spec = { LOAD_HISTO, mode, NULL, NULL, NULL };
+        network_init(&net);
+        if (network_load(&net, path, &spec) != 0) {
+            network_free(&net);
+            return -1;
+        }
+
+        // The pools hold one tree at a time: keep a copy of the reference
+        long count = count_stations(net.root);
+        long n = 0;
+        HistoRow* rows = malloc((count > 0 ? count : 1) * sizeof(HistoRow));
+        if (!rows) {
+            network_free(&net);
+            return -1;
+        }
+        snapshot_rows(net.root, rows, &n);
+        network_free(&net);
+
+        network_init(&net);
+        long pos = 0;
+        long diff = -1;
+        if (network_load_sharded(&net, path, mode, CHECK_HISTO_THREADS) == 0) {
+            diff = compare_rows(net.root, rows, count, &pos);
+            if (pos != count) diff = -1;
+        }
+        network_free(&net);
+
+        st->runs++;
+        if (diff != 0) {
+            st->failures++;
+            fprintf(stderr, "Mismatch: sharded histogram (mode %d) on %s\n", mode, path);
+        }
+        if (diff > 0 && diff / 1000.0 > st->max_abs) st->max_abs = diff / 1000.0;
+        if (diff < 0) st->max_rel = INFINITY;
+
+        for (long i = 0; i < n; i++) free(rows[i].name);
+        free(rows);
+    }
+    return 0;
+}
+
+/**
+ * Next value of a xorshift64* generator
+ */
+static unsigned long long next_random(unsigned long long* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/**
+ * Random integer in [lo, hi]
+ */
+static int uniform(unsigned long long* state, int lo, int hi) {
+    return lo + (int)(next_random(state) % (unsigned long long)(hi - lo + 1));
+}
+
+/**
+ * Random leak percentage written with 3 decimals
+ */
+static double random_leak(unsigned long long* state) {
+    return uniform(state, 0, 5000) / 1000.0;
+}
+
+/**
+ * Writes a random network in the data file format
+ * Facilities feed storages, junctions, services and customers; a few sections
+ * are shared between facilities (no factory column)
+ */
+static void generate_network(FILE* f, unsigned long seed) {
+    unsigned long long state = 0x9E3779B97F4A7C15ULL ^ ((unsigned long long)seed * 0xBF58476D1CE4E5B9ULL);
+    if (state == 0) state = 1;
+
+    int facilities = uniform(&state, 4, 16);
+    for (int fi = 0; fi < facilities; fi++) {
+        char fac[64];
+        snprintf(fac, sizeof(fac), "Facility complex #G%lu_%03d", seed, fi);
+
+        int sources = uniform(&state, 20, 200);
+        for (int s = 0; s < sources; s++) {
+            fprintf(f, "-;Spring #S%03d_%03d;%s;%d;%.3f\n", fi, s, fac,
+                    uniform(&state, 1, 50000), random_leak(&state));
+        }
+        fprintf(f, "-;%s;-;%d;-\n", fac, uniform(&state, 100000, 9000000));
+
+        int storages = uniform(&state, 1, 6);
+        for (int t = 0; t < storages; t++) {
+            fprintf(f, "-;%s;Storage #T%03d_%d;-;%.3f\n", fac, fi, t, random_leak(&state));
+            int junctions = uniform(&state, 1, 4);
+            for (int j = 0; j < junctions; j++) {
+                fprintf(f, "%s;Storage #T%03d_%d;Junction #J%03d_%d_%d;-;%.3f\n",
+                        fac, fi, t, fi, t, j, random_leak(&state));
+                int services = uniform(&state, 1, 5);
+                for (int v = 0; v < services; v++) {
+                    const char* owner = (uniform(&state, 0, 19) == 0) ? "-" : fac;
+                    fprintf(f, "%s;Junction #J%03d_%d_%d;Service #V%03d_%d_%d_%d;-;%.3f\n",
+                            owner, fi, t, j, fi, t, j, v, random_leak(&state));
+                    int customers = uniform(&state, 1, 8);
+                    for (int c = 0; c < customers; c++) {
+                        fprintf(f, "%s;Service #V%03d_%d_%d_%d;Cust #C%03d_%d_%d_%d_%d;-;%.3f\n",
+                                fac, fi, t, j, v, fi, t, j, v, c, random_leak(&state));
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Checks one network file with every engine
+ *
+ * @return  0 on success, -1 if the network cannot be read
+ */
+static int check_network(const char* path, const CheckOptions* opts, CheckStats* stats) {
+    if (check_leaks(path, opts, stats) != 0) return -1;
+    return check_histograms(path, &stats[ENGINE_COUNT]);
+}
+
+/**
+ * Writes the report line of an engine
+ *
+ * @return  1 if the engine passed, 0 otherwise
+ */
+static int report(const char* name, const CheckStats* st, double tolerance) {
+    int ok = (st->failures == 0);
+    printf("%s;%ld;%.3e;%.3e;%.1e;%s\n", name, st->runs, st->max_abs, st->max_rel,
+           tolerance, ok ? "OK" : "FAIL");
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Runs every engine on the requested networks and reports the differences
+ *
+ * @param opts  Check options
+ * @return      0 if every engine is within its tolerance, 5 on a mismatch,
+ *              2 if a network cannot be read
+ */
+int run_check(const CheckOptions* opts) {
+    // One slot per leak engine, then the sharded histogram loader
+    CheckStats stats[ENGINE_COUNT + 1];
+    memset(stats, 0, sizeof(stats));
+
+    if (opts->path && check_network(opts->path, opts, stats) != 0) {
+        fprintf(stderr, "Error: unable to read %s\n", opts->path);
+        return 2;
+    }
+
+    for (int g = 0; g < opts->generate; g++) {
+        char path[] = "/tmp/c-wildwater-check-XXXXXX";
+        int fd = mkstemp(path);
+        FILE* f = (fd >= 0) ? fdopen(fd, "w") : NULL;
+        if (!f) {
+            if (fd >= 0) close(fd);
+            fprintf(stderr, "Error: unable to create a temporary network\n");
+            return 2;
+        }
+        generate_network(f, opts->seed + g);
+        int written = (fclose(f) == 0);
+        int status = written ? check_network(path, opts, stats) : -1;
+        unlink(path);
+        if (status != 0) {
+            fprintf(stderr, "Error: unable to check the network of seed %lu\n", opts->seed + g);
+            return 2;
+        }
+    }
+
+    int ok = 1;
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        double tolerance = (e > 0 && opts->tolerance >= 0) ? opts->tolerance : engines[e].tolerance;
+        ok &= report(engines[e].name, &stats[e], tolerance);
+    }
+    ok &= report("sharded-histogram", &stats[ENGINE_COUNT], 0.0);
+    return ok ? 0 : 5;
+}
@@ -0,0 +1,41 @@
+/*
+ * check.h
+ *
+ * Differential check of the calculation engines.
+ * Every leak engine is run on every facility of a network and compared with
+ * the serial engine, and the sharded histogram loader is compared with the
+ * sequential one. Networks come from a data file and/or are generated at
+ * random (reproducible from a seed).
+ *
+ * One line per engine is written to stdout:
+ *   engine;runs;max_abs_diff;max_rel_diff;tolerance;OK|FAIL
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+/**
+ * Default relative tolerance of the engines expected to match the serial one
+ */
+#define CHECK_DEFAULT_TOLERANCE 1e-9
+
+/**
+ * Options of a check run
+ */
+typedef struct {
+    const char* path;       // Data file to check (NULL for generated networks only)
+    int generate;           // Number of random networks to check
+    unsigned long seed;     // Seed of the first random network
+    double tolerance;       // Relative tolerance overriding the engines' own (< 0 = keep)
+} CheckOptions;
+
+/**
+ * Runs every engine on the requested networks and reports the differences
+ *
+ * @param opts  Check options
+ * @return      0 if every engine is within its tolerance, 5 on a mismatch,
+ *              2 if a network cannot be read
+ */
+int run_check(const CheckOptions* opts);
+
+#endif /* CHECK_H */
@@ -0,0 +1,587 @@
+/*
+ * columnar.c
+ *
+ * Columnar binary export of the parsed data rows (see columnar.h).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/types.h>
+#include "columnar.h"
+#include "avl.h"
+#include "pool.h"
+#include "reader.h"
+#include "memstats.h"
+
+// Size of the stdio buffers used to write and read a columnar file
+#define COLUMNAR_BUFFER_SIZE (8 * 1024 * 1024)
+
+/**
+ * File header
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t groups;          // Number of row groups
+    int64_t rows;             // Data rows
+    int64_t lines;            // Lines of the data file
+    int64_t names;            // Identifiers in the dictionary
+    int64_t name_bytes;       // Size of the identifier block
+    uint64_t names_offset;    // Offset of the identifier block
+    uint64_t index_offset;    // Offset of the group index
+} ColumnarHeader;
+
+/**
+ * Rows of one type, columns kept apart
+ */
+typedef struct {
+    uint32_t* ids[3];         // Identifier columns (temporary dictionary indices)
+    int64_t* volume;          // Volumes
+    double* leak;             // Leak percentages
+    long count;               // Rows
+    long capacity;            // Allocated rows
+} RowColumns;
+
+/**
+ * Dictionary under construction: identifiers numbered in order of appearance
+ */
+typedef struct {
+    Pool pool;                // Identifier copies
+    char** names;             // Identifier of each index
+    long count;               // Identifiers
+    long capacity;            // Allocated entries of names
+    long* slots;              // Hash table of indices (-1 = empty)
+    long mask;                // Hash table size - 1
+} Dictionary;
+
+/**
+ * Identifier and its temporary index, for sorting
+ */
+typedef struct {
+    const char* name;
+    long id;
+} DictEntry;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * 64-bit FNV-1a hash of an identifier
+ */
+static uint64_t hash_name(const char* s) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Rebuilds the hash table with twice the slots
+ */
+static int dict_grow(Dictionary* d) {
+    long size = d->slots ? (d->mask + 1) * 2 : 4096;
+    long* slots = malloc(size * sizeof(long));
+    if (!slots) return -1;
+    for (long i = 0; i < size; i++) slots[i] = -1;
+    for (long id = 0; id < d->count; id++) {
+        long i = (long)(hash_name(d->names[id]) & (uint64_t)(size - 1));
+        while (slots[i] >= 0) i = (i + 1) & (size - 1);
+        slots[i] = id;
+    }
+    free(d->slots);
+    d->slots = slots;
+    d->mask = size - 1;
+    return 0;
+}
+
+/**
+ * Returns the index of an identifier, adding it if needed
+ *
+ * @return  Index, COLUMNAR_NULL_ID for an empty column, -1 on allocation failure
+ */
+static long dict_id(Dictionary* d, const char* name) {
+    if (!name) return COLUMNAR_NULL_ID;
+    if ((d->count + 1) * 2 > (d->slots ? d->mask + 1 : 0) && dict_grow(d) != 0) return -1;
+
+    long i = (long)(hash_name(name) & (uint64_t)d->mask);
+    while (d->slots[i] >= 0) {
+        if (strcmp(d->names[d->slots[i]], name) == 0) return d->slots[i];
+        i = (i + 1) & d->mask;
+    }
+
+    if (d->count == d->capacity) {
+        long cap = d->capacity ? d->capacity * 2 : 4096;
+        char** grown = realloc(d->names, cap * sizeof(char*));
+        if (!grown) return -1;
+        d->names = grown;
+        d->capacity = cap;
+    }
+    d->names[d->count] = pool_strdup(&d->pool, name);
+    d->slots[i] = d->count;
+    return d->count++;
+}
+
+/**
+ * Releases a dictionary
+ */
+static void dict_free(Dictionary* d) {
+    pool_release(&d->pool);
+    free(d->names);
+    free(d->slots);
+}
+
+/**
+ * Appends a row to the columns of its type
+ *
+ * @return  0 on success, -1 on allocation failure
+ */
+static int append_row(RowColumns* rc, const long ids[3], int64_t volume, double leak) {
+    if (rc->count == rc->capacity) {
+        long cap = rc->capacity ? rc->capacity * 2 : COLUMNAR_GROUP_ROWS;
+        for (int c = 0; c < 3; c++) {
+            uint32_t* grown = realloc(rc->ids[c], cap * sizeof(uint32_t));
+            if (!grown) return -1;
+            rc->ids[c] = grown;
+        }
+        int64_t* volume_grown = realloc(rc->volume, cap * sizeof(int64_t));
+        if (!volume_grown) return -1;
+        rc->volume = volume_grown;
+        double* leak_grown = realloc(rc->leak, cap * sizeof(double));
+        if (!leak_grown) return -1;
+        rc->leak = leak_grown;
+        rc->capacity = cap;
+    }
+    for (int c = 0; c < 3; c++) rc->ids[c][rc->count] = (uint32_t)ids[c];
+    rc->volume[rc->count] = volume;
+    rc->leak[rc->count] = leak;
+    rc->count++;
+    return 0;
+}
+
+/**
+ * Orders dictionary entries by identifier
+ */
+static int compare_dict_entries(const void* a, const void* b) {
+    return strcmp(((const DictEntry*)a)->name, ((const DictEntry*)b)->name);
+}
+
+/**
+ * Writes one row group and fills its index entry
+ *
+ * @param f      Destination file
+ * @param rc     Rows of the group's type
+ * @param start  First row of the group
+ * @param rows   Rows in the group
+ * @param remap  Final dictionary index of each temporary index
+ * @param ids    Work area of COLUMNAR_GROUP_ROWS identifiers
+ * @param g      Receives the index entry
+ * @return       0 on success, -1 on write failure
+ */
+static int write_group(FILE* f, const RowColumns* rc, long start, long rows,
+                       const uint32_t* remap, uint32_t* ids, ColumnarGroup* g) {
+    for (int c = 0; c < 3; c++) {
+        g->offset[c] = (uint64_t)ftello(f);
+        g->id_min[c] = COLUMNAR_NULL_ID;
+        g->id_max[c] = COLUMNAR_NULL_ID;
+        for (long i = 0; i < rows; i++) {
+            uint32_t id = rc->ids[c][start + i];
+            if (id != COLUMNAR_NULL_ID) {
+                id = remap[id];
+                if (g->id_min[c] == COLUMNAR_NULL_ID || id < g->id_min[c]) g->id_min[c] = id;
+                if (g->id_max[c] == COLUMNAR_NULL_ID || id > g->id_max[c]) g->id_max[c] = id;
+            }
+            ids[i] = id;
+        }
+        if (fwrite(ids, sizeof(uint32_t), rows, f) != (size_t)rows) return -1;
+    }
+
+    g->offset[COL_VOLUME] = (uint64_t)ftello(f);
+    g->volume_min = COLUMNAR_NULL_VOLUME;
+    g->volume_max = COLUMNAR_NULL_VOLUME;
+    for (long i = 0; i < rows; i++) {
+        int64_t v = rc->volume[start + i];
+        if (v == COLUMNAR_NULL_VOLUME) continue;
+        if (g->volume_min == COLUMNAR_NULL_VOLUME || v < g->volume_min) g->volume_min = v;
+        if (g->volume_max == COLUMNAR_NULL_VOLUME || v > g->volume_max) g->volume_max = v;
+    }
+    if (fwrite(rc->volume + start, sizeof(int64_t), rows, f) != (size_t)rows) return -1;
+
+    g->offset[COL_LEAK] = (uint64_t)ftello(f);
+    g->leak_min = NAN;
+    g->leak_max = NAN;
+    for (long i = 0; i < rows; i++) {
+        double l = rc->leak[start + i];
+        if (isnan(l)) continue;
+        if (isnan(g->leak_min) || l < g->leak_min) g->leak_min = l;
+        if (isnan(g->leak_max) || l > g->leak_max) g->leak_max = l;
+    }
+    if (fwrite(rc->leak + start, sizeof(double), rows, f) != (size_t)rows) return -1;
+
+    g->rows = (uint32_t)rows;
+    return 0;
+}
+
+/**
+ * Writes the whole columnar file
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int write_file(FILE* f, RowColumns types[ROW_TYPES], const Dictionary* d, long lines) {
+    // Final indices: identifiers in strcmp order
+    DictEntry* entries = malloc((d->count > 0 ? d->count : 1) * sizeof(DictEntry));
+    uint32_t* remap = malloc((d->count > 0 ? d->count : 1) * sizeof(uint32_t));
+    uint32_t* ids = malloc(COLUMNAR_GROUP_ROWS * sizeof(uint32_t));
+    long groups = 0;
+    for (int t = 0; t < ROW_TYPES; t++) {
+        groups += (types[t].count + COLUMNAR_GROUP_ROWS - 1) / COLUMNAR_GROUP_ROWS;
+    }
+    ColumnarGroup* index = calloc(groups > 0 ? groups : 1, sizeof(ColumnarGroup));
+    int status = (entries && remap && ids && index) ? 0 : -1;
+
+    ColumnarHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, COLUMNAR_MAGIC, sizeof(h.magic));
+    h.version = COLUMNAR_VERSION;
+    h.groups = (uint32_t)groups;
+    h.lines = lines;
+    h.names = d->count;
+
+    if (status == 0) {
+        for (long i = 0; i < d->count; i++) {
+            entries[i].name = d->names[i];
+            entries[i].id = i;
+        }
+        qsort(entries, d->count, sizeof(DictEntry), compare_dict_entries);
+        for (long i = 0; i < d->count; i++) {
+            remap[entries[i].id] = (uint32_t)i;
+            h.name_bytes += (int64_t)strlen(entries[i].name) + 1;
+        }
+        // Header rewritten once the offsets are known
+        if (fwrite(&h, sizeof(h), 1, f) != 1) status = -1;
+    }
+
+    long g = 0;
+    for (int t = 0; t < ROW_TYPES && status == 0; t++) {
+        for (long start = 0; start < types[t].count && status == 0; start += COLUMNAR_GROUP_ROWS) {
+            long rows = types[t].count - start;
+            if (rows > COLUMNAR_GROUP_ROWS) rows = COLUMNAR_GROUP_ROWS;
+            index[g].type = (uint32_t)t;
+            status = write_group(f, &types[t], start, rows, remap, ids, &index[g]);
+            h.rows += rows;
+            g++;
+        }
+    }
+
+    if (status == 0) {
+        h.names_offset = (uint64_t)ftello(f);
+        for (long i = 0; i < d->count && status == 0; i++) {
+            if (fwrite(entries[i].name, strlen(entries[i].name) + 1, 1, f) != 1) status = -1;
+        }
+    }
+    if (status == 0) {
+        h.index_offset = (uint64_t)ftello(f);
+        if (groups > 0 && fwrite(index, sizeof(ColumnarGroup), groups, f) != (size_t)groups) status = -1;
+    }
+    if (status == 0 && (fseeko(f, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, f) != 1)) {
+        status = -1;
+    }
+    if (status == 0) {
+        fprintf(stderr, "Columnar file: %ld rows in %ld row groups, %ld identifiers\n",
+                (long)h.rows, groups, d->count);
+    }
+
+    free(entries);
+    free(remap);
+    free(ids);
+    free(index);
+    return status;
+}
+
+/**
+ * Reads the identifier block (strictly increasing identifiers)
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int read_names(FILE* file, const ColumnarHeader* h, char** block, char*** names) {
+    *block = malloc(h->name_bytes > 0 ? (size_t)h->name_bytes : 1);
+    *names = malloc((h->names > 0 ? (size_t)h->names : 1) * sizeof(char*));
+    if (!*block || !*names) return -1;
+    if (fseeko(file, (off_t)h->names_offset, SEEK_SET) != 0) return -1;
+    if (h->name_bytes > 0 && fread(*block, (size_t)h->name_bytes, 1, file) != 1) return -1;
+
+    int64_t pos = 0;
+    for (int64_t i = 0; i < h->names; i++) {
+        char* end = memchr(*block + pos, '\0', (size_t)(h->name_bytes - pos));
+        if (!end) return -1;
+        (*names)[i] = *block + pos;
+        pos = (end - *block) + 1;
+        if (i > 0 && strcmp((*names)[i - 1], (*names)[i]) >= 0) return -1;
+    }
+    return (pos == h->name_bytes) ? 0 : -1;
+}
+
+/**
+ * Reads one column chunk of a row group
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int read_column(FILE* file, const ColumnarGroup* g, int column, void* dst, size_t width) {
+    if (fseeko(file, (off_t)g->offset[column], SEEK_SET) != 0) return -1;
+    return (g->rows == 0 || fread(dst, width, g->rows, file) == g->rows) ? 0 : -1;
+}
+
+/**
+ * Adds the rows of a capacity or source group to the per-identifier sums
+ * Same amounts as histo_row_value on the text rows. The group statistics
+ * reject a damaged group before it is read, and spare the columns holding
+ * a single value: a constant volume, no leak (empty or 0 %: the actual
+ * volume is the volume)
+ *
+ * @return  0 on success, -1 if the group is damaged
+ */
+static int sum_group(FILE* file, const ColumnarGroup* g, int mode, int64_t names,
+                     uint32_t* ids, int64_t* volume, double* leak,
+                     long* cap, long* cons, long* real, char* used) {
+    int capacity = (g->type == ROW_CAPACITY);
+    int id_column = capacity ? COL_UPSTREAM : COL_DOWNSTREAM;
+    int need_leak = !capacity && (mode == HISTO_REAL || mode == HISTO_ALL);
+
+    // Every row of these types has a station and a volume
+    if (g->rows == 0) return 0;
+    if (g->id_max[id_column] == COLUMNAR_NULL_ID || g->id_max[id_column] >= names ||
+        g->id_min[id_column] > g->id_max[id_column] ||
+        g->volume_min == COLUMNAR_NULL_VOLUME) {
+        return -1;
+    }
+    int constant_volume = (g->volume_min == g->volume_max);
+    if (need_leak && (isnan(g->leak_max) || (g->leak_min == 0.0 && g->leak_max == 0.0))) need_leak = 0;
+
+    if (read_column(file, g, id_column, ids, sizeof(uint32_t)) != 0 ||
+        (!constant_volume && read_column(file, g, COL_VOLUME, volume, sizeof(int64_t)) != 0) ||
+        (need_leak && read_column(file, g, COL_LEAK, leak, sizeof(double)) != 0)) {
+        return -1;
+    }
+
+    int with_real = (mode == HISTO_REAL || mode == HISTO_ALL);
+    for (uint32_t i = 0; i < g->rows; i++) {
+        if (ids[i] >= names) return -1;
+        long vol = (long)(constant_volume ? g->volume_min : volume[i]);
+        used[ids[i]] = 1;
+        if (capacity) {
+            cap[ids[i]] += vol;
+            continue;
+        }
+        if (mode == HISTO_SRC || mode == HISTO_ALL) cons[ids[i]] += vol;
+        if (with_real) {
+            long r = vol;
+            if (need_leak && !isnan(leak[i])) r = (long)(vol * (1.0 - (leak[i] / 100.0)));
+            real[ids[i]] += r;
+        }
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Classifies a split row
+ *
+ * @param cols  The 5 columns of the row
+ * @return      ROW_* type
+ */
+int columnar_row_type(char* cols[5]) {
+    if (cols[1] && !cols[2] && cols[3]) return ROW_CAPACITY;
+    if (cols[2] && cols[3]) return ROW_SOURCE;
+    if (!cols[0] && cols[1] && cols[2]) return ROW_STORAGE;
+    if (cols[0] && cols[1] && cols[2]) return ROW_DISTRIBUTION;
+    return ROW_OTHER;
+}
+
+/**
+ * Tells whether an open file is a columnar file (the position is reset)
+ *
+ * @param file  File opened for reading
+ * @return      1 if the file starts with the columnar signature, 0 otherwise
+ */
+int columnar_detect(FILE* file) {
+    char magic[8];
+    size_t n = fread(magic, 1, sizeof(magic), file);
+    rewind(file);
+    return n == sizeof(magic) && memcmp(magic, COLUMNAR_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * Parses a data file and writes it as a columnar file
+ * The file is replaced atomically
+ *
+ * @param data_path  Data file ("-" for the standard input)
+ * @param path       Destination file
+ * @return           0 on success, 2 if the data cannot be read, 3 if the file cannot be written
+ */
+int columnar_export(const char* data_path, const char* path) {
+    LineReader* reader = reader_open(data_path);
+    if (!reader) return 2;
+
+    Dictionary dict = { POOL_INIT, NULL, 0, 0, NULL, 0 };
+    RowColumns types[ROW_TYPES];
+    memset(types, 0, sizeof(types));
+
+    char line[1024];
+    long lines = 0;
+    int status = 0;
+    while (status == 0 && reader_gets(reader, line, sizeof(line))) {
+        lines++;
+        char* cols[5];
+        if (split_columns(line, cols) != 0) continue;
+
+        long ids[3];
+        for (int c = 0; c < 3; c++) {
+            ids[c] = dict_id(&dict, cols[c]);
+            if (ids[c] < 0) status = 3;
+        }
+        int64_t volume = cols[3] ? (int64_t)atol(cols[3]) : COLUMNAR_NULL_VOLUME;
+        double leak = cols[4] ? atof(cols[4]) : NAN;
+        if (status == 0 && append_row(&types[columnar_row_type(cols)], ids, volume, leak) != 0) {
+            status = 3;
+        }
+    }
+    if (reader_close(reader) != 0 && status == 0) status = 2;
+
+    if (status == 0) {
+        // Written next to the destination, then renamed over it
+        size_t len = strlen(path);
+        char* tmp_path = malloc(len + 5);
+        FILE* f = NULL;
+        if (tmp_path) {
+            memcpy(tmp_path, path, len);
+            memcpy(tmp_path + len, ".tmp", 5);
+            f = fopen(tmp_path, "wb");
+        }
+        status = 3;
+        if (f) {
+            char* buffer = malloc(COLUMNAR_BUFFER_SIZE);
+            if (buffer) setvbuf(f, buffer, _IOFBF, COLUMNAR_BUFFER_SIZE);
+            if (write_file(f, types, &dict, lines) == 0) status = 0;
+            if (fclose(f) != 0) status = 3;
+            free(buffer);
+            if (status == 0 && rename(tmp_path, path) != 0) status = 3;
+            if (status != 0) remove(tmp_path);
+        }
+        free(tmp_path);
+    }
+
+    for (int t = 0; t < ROW_TYPES; t++) {
+        for (int c = 0; c < 3; c++) free(types[t].ids[c]);
+        free(types[t].volume);
+        free(types[t].leak);
+    }
+    dict_free(&dict);
+    return status;
+}
+
+/**
+ * Loads the histogram aggregates of a columnar file into an empty network
+ * Only the capacity and source row groups are read, and only their columns
+ *
+ * @param net         Empty network
+ * @param path        Columnar file
+ * @param histo_mode  HISTO_* aggregates
+ * @return            0 on success, -1 if the file is damaged or cannot be read
+ */
+int columnar_load_histogram(Network* net, const char* path, int histo_mode) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return -1;
+    char* buffer = mem_malloc(MEM_INPUT, COLUMNAR_BUFFER_SIZE);
+    if (buffer) setvbuf(file, buffer, _IOFBF, COLUMNAR_BUFFER_SIZE);
+
+    ColumnarHeader h;
+    char* block = NULL;
+    char** names = NULL;
+    ColumnarGroup* index = NULL;
+    long* sums = NULL;
+    char* used = NULL;
+    uint32_t* ids = malloc(COLUMNAR_GROUP_ROWS * sizeof(uint32_t));
+    int64_t* volume = malloc(COLUMNAR_GROUP_ROWS * sizeof(int64_t));
+    double* leak = malloc(COLUMNAR_GROUP_ROWS * sizeof(double));
+
+    int status = (ids && volume && leak) ? 0 : -1;
+    if (status == 0 && (fread(&h, sizeof(h), 1, file) != 1 ||
+                        memcmp(h.magic, COLUMNAR_MAGIC, sizeof(h.magic)) != 0 ||
+                        h.version != COLUMNAR_VERSION || h.names < 0 || h.name_bytes < 0)) {
+        status = -1;
+    }
+    if (status == 0 && read_names(file, &h, &block, &names) != 0) status = -1;
+
+    if (status == 0) {
+        index = malloc((h.groups > 0 ? h.groups : 1) * sizeof(ColumnarGroup));
+        sums = calloc(3 * (h.names > 0 ? (size_t)h.names : 1), sizeof(long));
+        used = calloc(h.names > 0 ? (size_t)h.names : 1, 1);
+        if (!index || !sums || !used ||
+            fseeko(file, (off_t)h.index_offset, SEEK_SET) != 0 ||
+            (h.groups > 0 && fread(index, sizeof(ColumnarGroup), h.groups, file) != h.groups)) {
+            status = -1;
+        }
+    }
+
+    // Only the groups holding histogram rows of the mode are read
+    uint32_t read_groups = 0;
+    for (uint32_t g = 0; status == 0 && g < h.groups; g++) {
+        int wanted = (index[g].type == ROW_CAPACITY)
+                         ? (histo_mode == HISTO_MAX || histo_mode == HISTO_ALL)
+                         : (index[g].type == ROW_SOURCE && histo_mode != HISTO_MAX);
+        if (!wanted) continue;
+        if (index[g].rows > COLUMNAR_GROUP_ROWS ||
+            sum_group(file, &index[g], histo_mode, h.names, ids, volume, leak,
+                      sums, sums + h.names, sums + 2 * h.names, used) != 0) {
+            status = -1;
+        }
+        read_groups++;
+    }
+
+    // Stations with at least one row, already in identifier order
+    if (status == 0) {
+        long count = 0;
+        for (int64_t i = 0; i < h.names; i++) {
+            if (used[i]) names[count++] = names[i];
+        }
+        Station** nodes = malloc((count > 0 ? count : 1) * sizeof(Station*));
+        if (!nodes) status = -1;
+        if (status == 0 && count > 0) {
+            net->root = build_sorted_tree(names, count, nodes);
+            long n = 0;
+            for (int64_t i = 0; i < h.names; i++) {
+                if (!used[i]) continue;
+                nodes[n]->capacity = sums[i];
+                nodes[n]->consumption = sums[h.names + i];
+                nodes[n]->real_qty = sums[2 * h.names + i];
+                n++;
+            }
+        }
+        free(nodes);
+        net->line_count = (long)h.lines;
+        fprintf(stderr, "Columnar file: %u of %u row groups read\n", read_groups, h.groups);
+    }
+
+    if (status != 0) fprintf(stderr, "Error: unsupported or damaged columnar file\n");
+    free(ids);
+    free(volume);
+    free(leak);
+    free(block);
+    free(names);
+    free(index);
+    free(sums);
+    free(used);
+    fclose(file);
+    mem_free(MEM_INPUT, buffer, COLUMNAR_BUFFER_SIZE);
+    return status;
+}
@@ -0,0 +1,120 @@
+/*
+ * columnar.h
+ *
+ * Columnar binary export of the parsed data rows.
+ * Rows are grouped by type into row groups of at most COLUMNAR_GROUP_ROWS
+ * rows. Each group stores its five columns one after the other:
+ *   facility, upstream, downstream   uint32 dictionary index (COLUMNAR_NULL_ID if empty)
+ *   volume                           int64 (COLUMNAR_NULL_VOLUME if empty)
+ *   leak %                           float64 (NaN if empty)
+ * The dictionary holds the identifiers in strcmp order, so identifier ranges
+ * are index ranges. The group index records the type, the column offsets and
+ * the min/max of every column, so a reader only loads the groups and columns
+ * it needs. Histogram modes read such a file without any text parsing.
+ *
+ * Layout (native byte order):
+ *   header    magic, version, counts, dictionary and index offsets
+ *   groups    column chunks of each row group
+ *   names     NUL-terminated identifiers in strcmp order
+ *   index     one ColumnarGroup per row group
+ */
+
+#ifndef COLUMNAR_H
+#define COLUMNAR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "network.h"
+
+/**
+ * File signature and format version
+ */
+#define COLUMNAR_MAGIC "CWWCOLUM"
+#define COLUMNAR_VERSION 1u
+
+/**
+ * Most rows of a row group
+ */
+#define COLUMNAR_GROUP_ROWS 65536
+
+/**
+ * Empty values
+ */
+#define COLUMNAR_NULL_ID UINT32_MAX
+#define COLUMNAR_NULL_VOLUME INT64_MIN
+
+/**
+ * Row types (a row group holds rows of one type)
+ */
+#define ROW_SOURCE 0        // Volume row: source -> facility
+#define ROW_CAPACITY 1      // Facility capacity
+#define ROW_STORAGE 2       // Facility -> storage
+#define ROW_DISTRIBUTION 3  // Downstream sections (facility column set)
+#define ROW_OTHER 4         // Anything else
+#define ROW_TYPES 5
+
+/**
+ * Columns
+ */
+#define COL_FACILITY 0
+#define COL_UPSTREAM 1
+#define COL_DOWNSTREAM 2
+#define COL_VOLUME 3
+#define COL_LEAK 4
+#define COLUMNS 5
+
+/**
+ * Index entry of a row group
+ */
+typedef struct {
+    uint32_t type;              // ROW_* type of every row
+    uint32_t rows;              // Number of rows
+    uint64_t offset[COLUMNS];   // File offset of each column chunk
+    uint32_t id_min[3];         // Smallest identifier index of the id columns
+    uint32_t id_max[3];         // Largest one (COLUMNAR_NULL_ID if all empty)
+    int64_t volume_min;         // Smallest volume (COLUMNAR_NULL_VOLUME if all empty)
+    int64_t volume_max;         // Largest volume
+    double leak_min;            // Smallest leak % (NaN if all empty)
+    double leak_max;            // Largest leak %
+} ColumnarGroup;
+
+/**
+ * Classifies a split row
+ *
+ * @param cols  The 5 columns of the row
+ * @return      ROW_* type
+ */
+int columnar_row_type(char* cols[5]);
+
+/**
+ * Tells whether an open file is a columnar file (the position is reset)
+ *
+ * @param file  File opened for reading
+ * @return      1 if the file starts with the columnar signature, 0 otherwise
+ */
+int columnar_detect(FILE* file);
+
+/**
+ * Parses a data file and writes it as a columnar file
+ * The file is replaced atomically
+ *
+ * @param data_path  Data file ("-" for the standard input)
+ * @param path       Destination file
+ * @return           0 on success, 2 if the data cannot be read, 3 if the file cannot be written
+ */
+int columnar_export(const char* data_path, const char* path);
+
+/**
+ * Loads the histogram aggregates of a columnar file into an empty network
+ * Only the capacity and source row groups are read, and only their columns;
+ * the group statistics reject damaged groups and spare the constant volume
+ * columns and the leak columns without any leak
+ *
+ * @param net         Empty network
+ * @param path        Columnar file
+ * @param histo_mode  HISTO_* aggregates
+ * @return            0 on success, -1 if the file is damaged or cannot be read
+ */
+int columnar_load_histogram(Network* net, const char* path, int histo_mode);
+
+#endif /* COLUMNAR_H */
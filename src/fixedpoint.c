@@ -0,0 +1,270 @@
+/*
+ * fixedpoint.c
+ *
+ * Fixed-point leak engine (see fixedpoint.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "fixedpoint.h"
+#include "avl.h"
+#include "multiThreaded.h"
+#include "memstats.h"
+#include "trace.h"
+
+/**
+ * Volume with FIXED_SHIFT fractional bits
+ */
+typedef uint64_t Fixed;
+
+// Cut-off of solve_leaks (0.001 unit): smaller volumes are not propagated
+#define FIXED_EPSILON ((Fixed)1048)
+
+/**
+ * Section with the largest loss seen so far
+ */
+typedef struct {
+    Fixed loss;
+    char* from;
+    char* to;
+} FixedMax;
+
+/**
+ * First-level branch computed by a worker thread
+ */
+typedef struct {
+    Station* target;      // Downstream station of the section
+    Fixed section_loss;   // Loss on the section itself
+    Fixed volume;         // Volume entering the subtree
+    Station* facility;    // Facility of the calculation
+    Fixed loss;           // Loss of the subtree
+    FixedMax max;         // Critical section of the subtree
+    SectionHeap* worst;   // Worst sections of the subtree (NULL if not tracked)
+} FixedBranch;
+
+// ceil(2^64 / k) for each fan-out k below FIXED_RECIPROCALS
+static uint64_t reciprocals[FIXED_RECIPROCALS];
+static int reciprocals_ready = 0;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Fills the reciprocal table (before any worker thread starts)
+ */
+static void init_reciprocals(void) {
+    if (reciprocals_ready) return;
+    for (uint64_t k = 1; k < FIXED_RECIPROCALS; k++) reciprocals[k] = UINT64_MAX / k + 1;
+    reciprocals_ready = 1;
+}
+
+/**
+ * Divides a volume by a fan-out, rounding to the nearest
+ * With v < 2^64 / FIXED_RECIPROCALS, the high half of v * ceil(2^64 / k) is
+ * exactly floor(v / k)
+ */
+static inline Fixed divide(Fixed v, int k) {
+    if (k == 1) return v;
+    v += (Fixed)(k / 2);
+    if (k < FIXED_RECIPROCALS) return (Fixed)(((unsigned __int128)v * reciprocals[k]) >> 64);
+    return v / (Fixed)k;
+}
+
+/**
+ * Leak rate of a section as a 32-bit binary fraction, from the percentage in
+ * thousandths of a percent (0 at or below 0.001 %, the cut-off of solve_leaks;
+ * at most the whole volume)
+ */
+static inline uint64_t leak_rate(double percent) {
+    long milli = lround(percent * 1000.0);
+    if (milli <= 1) return 0;
+    if (milli > 100000) milli = 100000;
+    return (((uint64_t)milli << 32) + 50000) / 100000;
+}
+
+/**
+ * Loss of a section, rounded to the nearest
+ */
+static inline Fixed section_loss(Fixed volume, const AdjNode* edge) {
+    uint64_t rate = leak_rate(edge->leak_perc);
+    if (rate == 0) return 0;
+    return (Fixed)(((unsigned __int128)volume * rate + ((uint64_t)1 << 31)) >> 32);
+}
+
+/**
+ * Volume in internal units
+ */
+static double to_units(Fixed v) {
+    return (double)v / (double)((Fixed)1 << FIXED_SHIFT);
+}
+
+/**
+ * Number of sections followed from a station for a facility
+ */
+static int valid_sections(const Station* node, const Station* u) {
+    int count = 0;
+    for (AdjNode* curr = node->children; curr; curr = curr->next) {
+        if (curr->factory == NULL || curr->factory == u) count++;
+    }
+    return count;
+}
+
+/**
+ * solve_leaks in fixed point
+ */
+static Fixed solve_fixed(Station* node, Fixed input, Station* u, FixedMax* max, SectionHeap* worst) {
+    if (!node || input <= FIXED_EPSILON) return 0;
+    if (node->nb_children == 0) return 0;
+
+    int valid_count = valid_sections(node, u);
+    if (valid_count == 0) return 0;
+
+    Fixed total = 0;
+    Fixed per_pipe = divide(input, valid_count);
+    for (AdjNode* curr = node->children; curr; curr = curr->next) {
+        if (curr->factory != NULL && curr->factory != u) continue;
+
+        Fixed loss = section_loss(per_pipe, curr);
+        if (loss > max->loss) {
+            max->loss = loss;
+            max->from = node->name;
+            max->to = curr->target->name;
+        }
+        if (worst && loss > 0) section_heap_push(worst, to_units(loss), node->name, curr->target->name);
+        total += loss;
+
+        Fixed arrived = per_pipe - loss;
+        if (arrived > FIXED_EPSILON) total += solve_fixed(curr->target, arrived, u, max, worst);
+    }
+    return total;
+}
+
+/**
+ * Thread task: subtree of a first-level branch
+ */
+static void fixed_branch_task(void* arg) {
+    FixedBranch* b = (FixedBranch*)arg;
+    if (trace_on) trace_event(TRACE_BEGIN, "branch", b->target->name, -1);
+    b->loss = solve_fixed(b->target, b->volume, b->facility, &b->max, b->worst);
+    if (trace_on) trace_event(TRACE_END, "branch", NULL, -1);
+}
+
+/**
+ * solve_fixed with the first-level subtrees computed on worker threads
+ * Branches are combined in section order: integer sums and the first
+ * largest loss do not depend on the thread that computed them
+ */
+static Fixed solve_fixed_mt(Station* node, Fixed input, Station* u, FixedMax* max, SectionHeap* worst) {
+    if (!node || input <= FIXED_EPSILON) return 0;
+    int count = valid_sections(node, u);
+    if (count <= 2) return solve_fixed(node, input, u, max, worst);
+
+    Threads* threads = setupThreads();
+    FixedBranch* branches = mem_calloc(MEM_LEAK_TASKS, count, sizeof(FixedBranch));
+    if (!threads || !branches) {
+        if (threads) cleanupThreads(threads);
+        mem_free(MEM_LEAK_TASKS, branches, count * sizeof(FixedBranch));
+        return solve_fixed(node, input, u, max, worst);
+    }
+
+    Fixed per_pipe = divide(input, count);
+    int i = 0;
+    for (AdjNode* curr = node->children; curr; curr = curr->next) {
+        if (curr->factory != NULL && curr->factory != u) continue;
+        FixedBranch* b = &branches[i++];
+        b->target = curr->target;
+        b->section_loss = section_loss(per_pipe, curr);
+        if (worst && b->section_loss > 0) {
+            section_heap_push(worst, to_units(b->section_loss), node->name, curr->target->name);
+        }
+
+        Fixed arrived = per_pipe - b->section_loss;
+        if (arrived <= FIXED_EPSILON) continue;
+        b->volume = arrived;
+        b->facility = u;
+        if (worst) {
+            // Each branch fills its own heap, merged once the threads are done
+            b->worst = mem_malloc(MEM_LEAK_TASKS, sizeof(SectionHeap));
+            if (!b->worst || section_heap_init(b->worst, worst->capacity) != 0) {
+                fprintf(stderr, "Memory allocation failed for section heap\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (addTaskInThreads(threads, fixed_branch_task, b) != 0) fixed_branch_task(b);
+    }
+
+    thread_start = clock();
+    int th_err = handleThreads(threads);
+    if (th_err != 0) fprintf(stderr, "Warning: %d thread operations failed\n", th_err);
+    thread_stop = clock();
+
+    Fixed total = 0;
+    for (i = 0; i < count; i++) {
+        FixedBranch* b = &branches[i];
+        if (b->section_loss > max->loss) {
+            max->loss = b->section_loss;
+            max->from = node->name;
+            max->to = b->target->name;
+        }
+        total += b->section_loss + b->loss;
+        if (b->max.loss > max->loss) *max = b->max;
+        if (b->worst) {
+            section_heap_merge(worst, b->worst);
+            section_heap_free(b->worst);
+            mem_free(MEM_LEAK_TASKS, b->worst, sizeof(SectionHeap));
+        }
+    }
+
+    mem_free(MEM_LEAK_TASKS, branches, count * sizeof(FixedBranch));
+    cleanupThreads(threads);
+    return total;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Calculates the leaks downstream of a facility in fixed point
+ *
+ * @param root         Root of the station tree
+ * @param facility_id  Facility identifier
+ * @param threaded     1 to split the first branches across threads (same result)
+ * @param res          Result initialized by leak_result_init, receives the total and
+ *                     the critical section, and the worst sections if res->worst is set
+ * @return             0 on success, -1 if the facility does not exist
+ */
+int leak_query_fixed(Station* root, const char* facility_id, int threaded, LeakResult* res) {
+    res->loss = 0.0;
+    res->max_loss = 0.0;
+    res->max_from = NULL;
+    res->max_to = NULL;
+    res->bound = 0.0;
+
+    Station* start = find_station(root, (char*)facility_id);
+    if (!start) return -1;
+
+    long volume = (start->real_qty > 0) ? start->real_qty : start->capacity;
+    if (volume <= 0) return 0;
+    if (volume >= FIXED_MAX_VOLUME) {
+        fprintf(stderr, "Warning: volume too large for the fixed-point engine, floating point used\n");
+        return leak_query(root, facility_id, threaded, res);
+    }
+
+    init_reciprocals();
+    if (trace_on) trace_event(TRACE_BEGIN, "leak", start->name, -1);
+    FixedMax max = { 0, NULL, NULL };
+    Fixed input = (Fixed)volume << FIXED_SHIFT;
+    Fixed total = threaded ? solve_fixed_mt(start, input, start, &max, res->worst)
+                           : solve_fixed(start, input, start, &max, res->worst);
+    if (trace_on) trace_event(TRACE_END, "leak", NULL, -1);
+
+    res->loss = to_units(total);
+    res->max_loss = to_units(max.loss);
+    res->max_from = max.from;
+    res->max_to = max.to;
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * fixedpoint.h
+ *
+ * Fixed-point leak engine.
+ * Volumes are propagated as unsigned 64-bit numbers with FIXED_SHIFT
+ * fractional bits. A leak percentage is taken in thousandths of a percent
+ * (the 3 decimals of the data file), then turned into a 32-bit binary
+ * fraction, so a section loss is one multiply and one shift. Fan-outs below
+ * FIXED_RECIPROCALS are divided by multiplying with a precomputed reciprocal.
+ *
+ * Every step rounds to the nearest, in the same way whatever the thread
+ * running it, and totals are integer sums: the threaded and serial runs
+ * return the same bits. Results stay within about 1e-7 (relative) of the
+ * floating-point engine (see the "fixed" engines of check.h).
+ */
+
+#ifndef FIXEDPOINT_H
+#define FIXEDPOINT_H
+
+#include <stdint.h>
+#include "leaks.h"
+
+/**
+ * Fractional bits of a volume
+ */
+#define FIXED_SHIFT 20
+
+/**
+ * Largest starting volume (internal units): volumes must stay below 2^64
+ * divided by FIXED_RECIPROCALS for the reciprocal divisions to be exact
+ */
+#define FIXED_MAX_VOLUME (1L << 37)
+
+/**
+ * Fan-outs divided through the reciprocal table (larger ones use a division)
+ */
+#define FIXED_RECIPROCALS 64
+
+/**
+ * Identifier of the engine in the result cache (differs from LEAK_ENGINE_VERSION)
+ * Must be increased whenever a change alters the computed values
+ */
+#define FIXED_ENGINE_ID 0x10001u
+
+/**
+ * Calculates the leaks downstream of a facility in fixed point
+ * The starting volume is the facility's actual volume, or its capacity;
+ * above FIXED_MAX_VOLUME the floating-point engine is used instead
+ *
+ * @param root         Root of the station tree
+ * @param facility_id  Facility identifier
+ * @param threaded     1 to split the first branches across threads (same result)
+ * @param res          Result initialized by leak_result_init, receives the total and
+ *                     the critical section, and the worst sections if res->worst is set
+ * @return             0 on success, -1 if the facility does not exist
+ */
+int leak_query_fixed(Station* root, const char* facility_id, int threaded, LeakResult* res);
+
+#endif /* FIXEDPOINT_H */
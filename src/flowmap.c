@@ -0,0 +1,321 @@
+/*
+ * flowmap.c
+ *
+ * Network-wide flow map in one topological sweep (see flowmap.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "flowmap.h"
+#include "avl.h"
+#include "pool.h"
+
+/**
+ * Water of one facility waiting at a station
+ */
+typedef struct FlowShare {
+    Station* facility;         // Facility the water comes from
+    double volume;             // Volume arrived so far
+    int tier;                  // Tier of the sections leaving the station
+    struct FlowShare* next;    // Water of another facility at the same station
+} FlowShare;
+
+/**
+ * Graph numbered for the sweep
+ */
+typedef struct {
+    long* slots;          // Hash table from station address to index (-1 = empty)
+    long mask;            // Hash table size - 1
+    long* child_start;    // Sections of node i: child_start[i]..child_start[i+1]-1
+    long* child;          // Index of the target of each section
+    AdjNode** edge;       // Section itself
+} FlowGraph;
+
+// Names of the tiers in the output table
+static const char* const TIER_NAMES[FLOW_TIERS] = {
+    "facility-storage", "storage-junction", "junction-service", "service-customer", "deeper"
+};
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Hash slot of a station address
+ */
+static long slot_of(const Station* s, long mask) {
+    uint64_t h = (uint64_t)(uintptr_t)s;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (long)(h & (uint64_t)mask);
+}
+
+/**
+ * Finds the index of a station, -1 if absent
+ */
+static long slot_find(const FlowGraph* g, Station* const* nodes, const Station* s) {
+    long h = slot_of(s, g->mask);
+    while (g->slots[h] >= 0) {
+        if (nodes[g->slots[h]] == s) return g->slots[h];
+        h = (h + 1) & g->mask;
+    }
+    return -1;
+}
+
+/**
+ * Stores the stations of a subtree in identifier order
+ */
+static void collect_nodes(Station* node, Station** nodes, long* count) {
+    if (!node) return;
+    collect_nodes(node->left, nodes, count);
+    nodes[(*count)++] = node;
+    collect_nodes(node->right, nodes, count);
+}
+
+/**
+ * Tells whether a section carries water of the facility
+ */
+static int section_valid(const AdjNode* e, const Station* facility) {
+    return e->factory == NULL || e->factory == facility;
+}
+
+/**
+ * Leak fraction of a section (rates of 0.001% or less count as no leak)
+ */
+static double section_fraction(const AdjNode* e) {
+    return (e->leak_perc > 0.001) ? e->leak_perc / 100.0 : 0.0;
+}
+
+/**
+ * Numbers the sections of every station
+ *
+ * @return  0 on success, -1 on allocation failure
+ */
+static int build_graph(FlowGraph* g, Station* const* nodes, long count) {
+    long size = 1024;
+    while (size < count * 2) size *= 2;
+    g->mask = size - 1;
+    g->slots = malloc(size * sizeof(long));
+    g->child_start = malloc((count + 1) * sizeof(long));
+    g->child = NULL;
+    g->edge = NULL;
+    if (!g->slots || !g->child_start) return -1;
+    memset(g->slots, 0xff, size * sizeof(long));
+
+    long sections = 0;
+    for (long i = 0; i < count; i++) {
+        long h = slot_of(nodes[i], g->mask);
+        while (g->slots[h] >= 0) h = (h + 1) & g->mask;
+        g->slots[h] = i;
+        g->child_start[i] = sections;
+        sections += nodes[i]->nb_children;
+    }
+    g->child_start[count] = sections;
+
+    g->child = malloc((sections > 0 ? sections : 1) * sizeof(long));
+    g->edge = malloc((sections > 0 ? sections : 1) * sizeof(AdjNode*));
+    if (!g->child || !g->edge) return -1;
+    for (long i = 0; i < count; i++) {
+        long k = g->child_start[i];
+        for (AdjNode* e = nodes[i]->children; e; e = e->next, k++) {
+            g->edge[k] = e;
+            g->child[k] = slot_find(g, nodes, e->target);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Orders the stations parents first (Kahn's algorithm)
+ * Stations on a cycle, and those below them, are left out
+ *
+ * @return  Number of ordered stations, -1 on allocation failure
+ */
+static long topological_order(const FlowGraph* g, long count, long* order) {
+    long* pending = calloc(count > 0 ? count : 1, sizeof(long));
+    if (!pending) return -1;
+
+    for (long k = 0; k < g->child_start[count]; k++) {
+        if (g->child[k] >= 0) pending[g->child[k]]++;
+    }
+    long n = 0;
+    for (long i = 0; i < count; i++) {
+        if (pending[i] == 0) order[n++] = i;
+    }
+    for (long head = 0; head < n; head++) {
+        long i = order[head];
+        for (long k = g->child_start[i]; k < g->child_start[i + 1]; k++) {
+            long c = g->child[k];
+            if (c >= 0 && --pending[c] == 0) order[n++] = c;
+        }
+    }
+    free(pending);
+    return n;
+}
+
+/**
+ * Adds water of a facility to a station
+ */
+static void add_share(FlowShare** heads, Pool* pool, long i, Station* facility,
+                      double volume, int tier) {
+    for (FlowShare* s = heads[i]; s; s = s->next) {
+        if (s->facility == facility) {
+            s->volume += volume;
+            return;
+        }
+    }
+    FlowShare* s = pool_alloc(pool, sizeof(FlowShare));
+    s->facility = facility;
+    s->volume = volume;
+    s->tier = tier;
+    s->next = heads[i];
+    heads[i] = s;
+}
+
+/**
+ * Adds a section flow to the totals of a tier
+ */
+static void add_tier(Flow* tier, double in, double lost) {
+    tier->inflow += in;
+    tier->outflow += in - lost;
+    tier->loss += lost;
+}
+
+/**
+ * Pushes the water waiting at every station through its valid sections
+ */
+static void sweep(FlowMap* map, const FlowGraph* g, const long* order, long ordered,
+                  FlowShare** heads, Pool* pool) {
+    for (long j = 0; j < ordered; j++) {
+        long i = order[j];
+        long first = g->child_start[i];
+        long last = g->child_start[i + 1];
+
+        for (FlowShare* s = heads[i]; s; s = s->next) {
+            int k = 0;
+            for (long e = first; e < last; e++) {
+                if (section_valid(g->edge[e], s->facility)) k++;
+            }
+            if (k == 0) continue;  // End of the network for this water
+
+            double in = s->volume / k;
+            int tier = (s->tier < TIER_OTHER) ? s->tier : TIER_OTHER;
+            for (long e = first; e < last; e++) {
+                if (!section_valid(g->edge[e], s->facility)) continue;
+                double lost = in * section_fraction(g->edge[e]);
+                map->flows[i].outflow += in - lost;
+                map->flows[i].loss += lost;
+                add_tier(&map->tiers[tier], in, lost);
+
+                long c = g->child[e];
+                if (c < 0) continue;
+                map->flows[c].inflow += in - lost;
+                add_share(heads, pool, c, s->facility, in - lost, s->tier + 1);
+            }
+        }
+    }
+}
+
+/**
+ * Writes one row of the table
+ */
+static void write_flow(OutBuffer* out, const char* prefix, const char* name, const Flow* f) {
+    char tmp[128];
+    out_puts(out, prefix);
+    out_puts(out, name);
+    snprintf(tmp, sizeof(tmp), ";%.6f;%.6f;%.6f\n",
+             f->inflow / 1000.0, f->outflow / 1000.0, f->loss / 1000.0);
+    out_puts(out, tmp);
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Computes the flows of every station in one sweep
+ *
+ * @param map   Receives the flow map (release with flowmap_free)
+ * @param root  Root of a station tree loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL)
+ * @return      0 on success, -1 on allocation failure
+ */
+int flowmap_build(FlowMap* map, Station* root) {
+    memset(map, 0, sizeof(*map));
+    long count = count_stations(root);
+    map->nodes = malloc((count > 0 ? count : 1) * sizeof(Station*));
+    map->flows = calloc(count > 0 ? count : 1, sizeof(Flow));
+    if (!map->nodes || !map->flows) {
+        flowmap_free(map);
+        return -1;
+    }
+    collect_nodes(root, map->nodes, &map->count);
+
+    FlowGraph g;
+    long* order = malloc((count > 0 ? count : 1) * sizeof(long));
+    FlowShare** heads = calloc(count > 0 ? count : 1, sizeof(FlowShare*));
+    Pool pool = POOL_INIT;
+    long ordered = -1;
+    if (build_graph(&g, map->nodes, count) == 0 && order && heads) {
+        ordered = topological_order(&g, count, order);
+    }
+
+    if (ordered >= 0) {
+        map->skipped = count - ordered;
+
+        // Every facility starts with its actual volume, or its capacity
+        for (long i = 0; i < count; i++) {
+            Station* s = map->nodes[i];
+            if (s->capacity <= 0 && s->real_qty <= 0) continue;
+            double volume = (s->real_qty > 0) ? (double)s->real_qty : (double)s->capacity;
+            map->flows[i].inflow += volume;
+            add_share(heads, &pool, i, s, volume, TIER_STORAGE);
+            map->facilities++;
+        }
+        sweep(map, &g, order, ordered, heads, &pool);
+    }
+
+    pool_release(&pool);
+    free(heads);
+    free(order);
+    free(g.slots);
+    free(g.child_start);
+    free(g.child);
+    free(g.edge);
+    if (ordered < 0) {
+        flowmap_free(map);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes a flow map as one table of "name;inflow;outflow;loss" rows (M.m3):
+ * every station with a flow in identifier order, then one
+ * "tier <name>" row per tier
+ *
+ * @param map  Flow map
+ * @param out  Output buffer
+ */
+void flowmap_write(const FlowMap* map, OutBuffer* out) {
+    for (long i = 0; i < map->count; i++) {
+        const Flow* f = &map->flows[i];
+        if (f->inflow > 0.0 || f->outflow > 0.0) write_flow(out, "", map->nodes[i]->name, f);
+    }
+    for (int t = 0; t < FLOW_TIERS; t++) write_flow(out, "tier ", TIER_NAMES[t], &map->tiers[t]);
+}
+
+/**
+ * Releases a flow map
+ *
+ * @param map  Flow map
+ */
+void flowmap_free(FlowMap* map) {
+    free(map->nodes);
+    free(map->flows);
+    map->nodes = NULL;
+    map->flows = NULL;
+    map->count = 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * flowmap.h
+ *
+ * Network-wide flow map: the starting volume of every facility (actual
+ * volume, or capacity if none) is pushed through the whole graph in one
+ * sweep over the stations in topological order, instead of one leak
+ * calculation per facility.
+ *
+ * The leak model is the one of solve_leaks: at each station, the water of
+ * a facility is split equally over the sections valid for it (no facility
+ * or that facility) and each section loses its leak rate. Water of several
+ * facilities crossing a station is split separately for each of them.
+ * Like the what-if engine, the 0.001 volume cut-off is not applied.
+ *
+ * Losses are also summed by tier, from the number of sections between the
+ * facility and the section: facility -> storage, storage -> junction,
+ * junction -> service, service -> customer, and deeper sections.
+ */
+
+#ifndef FLOWMAP_H
+#define FLOWMAP_H
+
+#include "structs.h"
+#include "output.h"
+
+/**
+ * Tiers of sections
+ */
+#define TIER_STORAGE 0    // Facility -> storage
+#define TIER_JUNCTION 1   // Storage -> junction
+#define TIER_SERVICE 2    // Junction -> service
+#define TIER_CUSTOMER 3   // Service -> customer
+#define TIER_OTHER 4      // Deeper sections
+#define FLOW_TIERS 5
+
+/**
+ * Flows of a station or a tier (internal units)
+ */
+typedef struct {
+    double inflow;    // Volume arriving (starting volume for a facility)
+    double outflow;   // Volume delivered downstream, after the leaks
+    double loss;      // Volume lost on the outgoing sections
+} Flow;
+
+/**
+ * Flow map of a network
+ */
+typedef struct {
+    long count;                 // Stations
+    Station** nodes;            // Stations in identifier order
+    Flow* flows;                // Flows of each station
+    Flow tiers[FLOW_TIERS];     // Flows of the sections of each tier
+    long facilities;            // Facilities whose volume was pushed
+    long skipped;               // Stations left out because they sit on a cycle
+} FlowMap;
+
+/**
+ * Computes the flows of every station in one sweep
+ *
+ * @param map   Receives the flow map (release with flowmap_free)
+ * @param root  Root of a station tree loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL)
+ * @return      0 on success, -1 on allocation failure
+ */
+int flowmap_build(FlowMap* map, Station* root);
+
+/**
+ * Writes a flow map as one table of "name;inflow;outflow;loss" rows (M.m3):
+ * every station with a flow in identifier order, then one
+ * "tier <name>" row per tier
+ *
+ * @param map  Flow map
+ * @param out  Output buffer
+ */
+void flowmap_write(const FlowMap* map, OutBuffer* out);
+
+/**
+ * Releases a flow map
+ *
+ * @param map  Flow map
+ */
+void flowmap_free(FlowMap* map);
+
+#endif /* FLOWMAP_H */
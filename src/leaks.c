@@ -0,0 +1,599 @@
+/*
+ * leaks.c
+ *
+ * Calculation of water losses downstream from a facility and
+ * detection of the section with the highest leakage.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "leaks.h"
+#include "avl.h"
+#include "multiThreaded.h"
+#include "memstats.h"
+#include "trace.h"
+
+/**
+ * Volume an approximate calculation may still skip
+ */
+typedef struct {
+    double budget;   // Largest total volume of the skipped subtrees
+    double skipped;  // Volume entering the subtrees skipped so far
+} LeakBudget;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Thread task wrapper for leak calculation of a specific branch
+ * @param arg Pointer to LeakTaskData structure
+ */
+static void leak_branch_task_wrapper(void* arg) {
+    LeakTaskData* data = (LeakTaskData*)arg;
+    if (trace_on) trace_event(TRACE_BEGIN, "branch", data->node->name, data->nodes);
+
+    // Execute leak calculation for this branch
+    *(data->leak_result) = solve_leaks(
+        data->node,
+        data->input_vol,
+        data->facility,
+        data->max_leak_val,
+        data->max_from,
+        data->max_to,
+        data->worst
+    );
+    if (trace_on) trace_event(TRACE_END, "branch", NULL, -1);
+}
+
+/**
+ * Number of stations solve_leaks visits from a station (same cut-offs)
+ */
+static long count_leak_nodes(Station* node, double input_vol, Station* u) {
+    if (!node || input_vol <= 0.001) return 0;
+    if (node->nb_children == 0) return 1;
+
+    int valid_count = 0;
+    for (AdjNode* curr = node->children; curr; curr = curr->next) {
+        if (curr->factory == NULL || curr->factory == u) valid_count++;
+    }
+    if (valid_count == 0) return 1;
+
+    long count = 1;
+    double vol_per_pipe = input_vol / valid_count;
+    for (AdjNode* curr = node->children; curr; curr = curr->next) {
+        if (curr->factory != NULL && curr->factory != u) continue;
+        double pipe_loss = 0.0;
+        if (curr->leak_perc > 0.001) pipe_loss = vol_per_pipe * (curr->leak_perc / 100.0);
+        double vol_arrived = vol_per_pipe - pipe_loss;
+        if (vol_arrived > 0.001) count += count_leak_nodes(curr->target, vol_arrived, u);
+    }
+    return count;
+}
+
+/**
+ * Single-threaded leak calculation filling a LeakResult
+ */
+static double solve_leaks_serial(Station* node, double volume, Station* facility, LeakResult* res) {
+    res->loss = solve_leaks(node, volume, facility, &res->max_loss, &res->max_from, &res->max_to,
+                            res->worst);
+    return res->loss;
+}
+
+/**
+ * Resets the values of a result, keeping its heap of worst sections
+ */
+static void leak_result_reset(LeakResult* res) {
+    res->loss = 0.0;
+    res->max_loss = 0.0;
+    res->max_from = NULL;
+    res->max_to = NULL;
+    res->bound = 0.0;
+}
+
+/**
+ * solve_leaks skipping the subtrees whose volume still fits in the budget
+ * (stations without sections are not worth skipping: they lose nothing)
+ */
+static double solve_leaks_approx(Station* node, double input_vol, Station* u,
+                                 LeakResult* res, LeakBudget* b) {
+    if (!node || input_vol <= 0.001) return 0.0;
+    if (node->nb_children == 0) return 0.0;
+
+    int valid_count = 0;
+    for (AdjNode* curr = node->children; curr; curr = curr->next) {
+        if (curr->factory == NULL || curr->factory == u) valid_count++;
+    }
+    if (valid_count == 0) return 0.0;
+
+    double total_loss = 0.0;
+    double vol_per_pipe = input_vol / valid_count;
+    for (AdjNode* curr = node->children; curr; curr = curr->next) {
+        if (curr->factory != NULL && curr->factory != u) continue;
+
+        double pipe_loss = 0.0;
+        if (curr->leak_perc > 0.001) pipe_loss = vol_per_pipe * (curr->leak_perc / 100.0);
+        if (pipe_loss > res->max_loss) {
+            res->max_loss = pipe_loss;
+            res->max_from = node->name;
+            res->max_to = curr->target->name;
+        }
+        if (res->worst && pipe_loss > 0.0) {
+            section_heap_push(res->worst, pipe_loss, node->name, curr->target->name);
+        }
+        total_loss += pipe_loss;
+
+        double vol_arrived = vol_per_pipe - pipe_loss;
+        if (vol_arrived <= 0.001) continue;
+        if (curr->target->nb_children > 0 && b->skipped + vol_arrived <= b->budget) {
+            b->skipped += vol_arrived;
+            continue;
+        }
+        total_loss += solve_leaks_approx(curr->target, vol_arrived, u, res, b);
+    }
+    return total_loss;
+}
+
+/**
+ * Tells whether section a is worse than section b
+ * Equal losses are ordered by identifiers to keep the selection deterministic
+ */
+static int section_worse(const LeakSection* a, const LeakSection* b) {
+    if (a->loss != b->loss) return a->loss > b->loss;
+    int cmp = strcmp(a->from, b->from);
+    if (cmp != 0) return cmp < 0;
+    return strcmp(a->to, b->to) < 0;
+}
+
+/**
+ * Restores the min-heap property downwards from index i
+ */
+static void section_sift_down(SectionHeap* h, int i) {
+    for (;;) {
+        int least = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < h->size && section_worse(&h->items[least], &h->items[l])) least = l;
+        if (r < h->size && section_worse(&h->items[least], &h->items[r])) least = r;
+        if (least == i) return;
+        LeakSection tmp = h->items[i];
+        h->items[i] = h->items[least];
+        h->items[least] = tmp;
+        i = least;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Resets a leak result
+ *
+ * @param res  Result to reset
+ */
+void leak_result_init(LeakResult* res) {
+    leak_result_reset(res);
+    res->worst = NULL;
+}
+
+/**
+ * Creates an empty heap of worst sections
+ *
+ * @param h  Heap to initialize
+ * @param k  Number of sections to keep
+ * @return   0 on success, -1 on allocation failure
+ */
+int section_heap_init(SectionHeap* h, int k) {
+    h->size = 0;
+    h->capacity = (k > 0) ? k : 0;
+    h->items = NULL;
+    if (h->capacity == 0) return 0;
+    h->items = malloc((size_t)h->capacity * sizeof(LeakSection));
+    return h->items ? 0 : -1;
+}
+
+/**
+ * Offers a section to the heap (kept if it is among the K worst so far)
+ *
+ * @param h     Heap
+ * @param loss  Volume lost on the section
+ * @param from  Upstream station
+ * @param to    Downstream station
+ */
+void section_heap_push(SectionHeap* h, double loss, char* from, char* to) {
+    LeakSection s = { loss, from, to };
+
+    if (h->size == h->capacity) {
+        // Full: replace the least bad kept section if the new one is worse
+        if (h->size == 0 || !section_worse(&s, &h->items[0])) return;
+        h->items[0] = s;
+        section_sift_down(h, 0);
+        return;
+    }
+
+    int i = h->size++;
+    while (i > 0 && section_worse(&h->items[(i - 1) / 2], &s)) {
+        h->items[i] = h->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->items[i] = s;
+}
+
+/**
+ * Offers every section of a heap to another one
+ *
+ * @param dst  Destination heap
+ * @param src  Heap to merge (unchanged)
+ */
+void section_heap_merge(SectionHeap* dst, const SectionHeap* src) {
+    for (int i = 0; i < src->size; i++) {
+        section_heap_push(dst, src->items[i].loss, src->items[i].from, src->items[i].to);
+    }
+}
+
+/**
+ * Sorts the kept sections from the worst to the least bad
+ * The heap must not receive sections afterwards
+ *
+ * @param h  Heap
+ */
+void section_heap_sort(SectionHeap* h) {
+    // Heap sort: the least bad section is moved to the end at each step
+    int n = h->size;
+    while (h->size > 1) {
+        LeakSection tmp = h->items[0];
+        h->items[0] = h->items[--h->size];
+        h->items[h->size] = tmp;
+        section_sift_down(h, 0);
+    }
+    h->size = n;
+}
+
+/**
+ * Releases a heap of worst sections
+ *
+ * @param h  Heap
+ */
+void section_heap_free(SectionHeap* h) {
+    free(h->items);
+    h->items = NULL;
+    h->size = 0;
+    h->capacity = 0;
+}
+
+/**
+ * Recursively calculates water losses in the network
+ * 
+ * @param node         Current station
+ * @param input_vol    Incoming water volume
+ * @param u            Facility for which leaks are calculated
+ * @param max_leak_val Pointer to track maximum leak value
+ * @param max_from     Pointer to track upstream station of critical section
+ * @param max_to       Pointer to track downstream station of critical section
+ * @param worst        Heap receiving every section with a loss (NULL if not tracked)
+ * @return             Total downstream leak volume
+ */
+double solve_leaks(Station* node, double input_vol, Station* u,
+                   double* max_leak_val, char** max_from, char** max_to,
+                   SectionHeap* worst) {
+    // Early termination conditions
+    if (!node || input_vol <= 0.001) return 0.0;
+    if (node->nb_children == 0) return 0.0;
+
+    // Count valid outgoing connections for this facility
+    int valid_count = 0;
+    AdjNode* curr = node->children;
+    
+    while (curr) {
+        if (curr->factory == NULL || curr->factory == u) {
+            valid_count++;
+        }
+        curr = curr->next;
+    }
+    
+    if (valid_count == 0) return 0.0;
+
+    // Distribute volume and calculate losses
+    double total_loss = 0.0;
+    double vol_per_pipe = input_vol / valid_count;
+    curr = node->children;
+
+    // Process each connection
+    while (curr) {
+        // Only process/recurse if the pipe belongs to the requested facility (or is shared)
+        if (curr->factory == NULL || curr->factory == u) {
+            // Calculate losses on this section
+            double pipe_loss = 0.0;
+            if (curr->leak_perc > 0.001) {
+                pipe_loss = vol_per_pipe * (curr->leak_perc / 100.0);
+            }
+
+            // Track section with maximum leak
+            if (pipe_loss > *max_leak_val) {
+                *max_leak_val = pipe_loss;
+                *max_from = node->name;       // Upstream ID
+                *max_to = curr->target->name; // Downstream ID
+            }
+            if (worst && pipe_loss > 0.0) {
+                section_heap_push(worst, pipe_loss, node->name, curr->target->name);
+            }
+
+            double vol_arrived = vol_per_pipe - pipe_loss;
+            
+            if (vol_arrived > 0.001) {
+                // Add local and recursive losses
+                total_loss += pipe_loss + solve_leaks(curr->target, vol_arrived, u,
+                                                    max_leak_val, max_from, max_to, worst);
+            } else {
+                // Just add the pipe loss without recursion
+                total_loss += pipe_loss;
+            }
+        }
+        curr = curr->next;
+    }
+    return total_loss;
+}
+
+/**
+ * Calculates leaks for a facility using multithreading for branches
+ * 
+ * @param node     Starting station
+ * @param volume   Input volume
+ * @param facility Target facility
+ * @param res      Receives the total and the critical section, and the worst
+ *                 sections if res->worst is set (one heap per branch task, merged)
+ * @return         Total leak volume
+ */
+double calculate_leaks_mt(Station* node, double volume, Station* facility, LeakResult* res) {
+    leak_result_reset(res);
+    if (!node || volume <= 0.001) return 0.0;
+
+    // Count valid outgoing connections
+    int count = 0;
+    AdjNode* curr = node->children;
+    
+    // Pre-allocate arrays
+    AdjNode** valid_connections = NULL;
+    double* pipe_losses = NULL;
+    double* volumes_arrived = NULL;
+    
+    // First pass: count valid connections
+    while (curr) {
+        if (curr->factory == NULL || curr->factory == facility) {
+            count++;
+        }
+        curr = curr->next;
+    }
+    
+    if (count == 0) return 0.0;
+    
+    // Use direct calculation for small number of branches
+    if (count <= 2) {
+        return solve_leaks_serial(node, volume, facility, res);
+    }
+
+    // Allocate arrays for connection data
+    valid_connections = (AdjNode**)malloc(count * sizeof(AdjNode*));
+    pipe_losses = (double*)malloc(count * sizeof(double));
+    volumes_arrived = (double*)malloc(count * sizeof(double));
+    
+    if (!valid_connections || !pipe_losses || !volumes_arrived) {
+        fprintf(stderr, "Memory allocation failed for connection arrays\n");
+        free(valid_connections);
+        free(pipe_losses);
+        free(volumes_arrived);
+        
+        // Fallback to direct calculation
+        return solve_leaks_serial(node, volume, facility, res);
+    }
+    
+    // Second pass: collect valid connections and pre-calculate losses
+    curr = node->children;
+    int idx = 0;
+    double vol_per_pipe = volume / count;
+    
+    while (curr && idx < count) {
+        if (curr->factory == NULL || curr->factory == facility) {
+            valid_connections[idx] = curr;
+            
+            // Pre-calculate pipe loss
+            if (curr->leak_perc > 0.001) {
+                pipe_losses[idx] = vol_per_pipe * (curr->leak_perc / 100.0);
+            } else {
+                pipe_losses[idx] = 0.0;
+            }
+            
+            // Pre-calculate volume that arrives
+            volumes_arrived[idx] = vol_per_pipe - pipe_losses[idx];
+            idx++;
+        }
+        curr = curr->next;
+    }
+    
+    // Setup thread system for parallel processing
+    Threads* thread_system = setupThreads();
+    LeakTaskData** tasks = mem_calloc(MEM_LEAK_TASKS, count, sizeof(LeakTaskData*));
+    if (!thread_system || !tasks) {
+        if (thread_system) cleanupThreads(thread_system);
+        mem_free(MEM_LEAK_TASKS, tasks, count * sizeof(LeakTaskData*));
+        free(valid_connections);
+        free(pipe_losses);
+        free(volumes_arrived);
+        return solve_leaks_serial(node, volume, facility, res);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (res->worst && pipe_losses[i] > 0.0) {
+            section_heap_push(res->worst, pipe_losses[i], node->name,
+                              valid_connections[i]->target->name);
+        }
+
+        // Skip branches with negligible volume
+        if (volumes_arrived[i] <= 0.001) continue;
+
+        // Create task for downstream calculation
+        double* branch_result = mem_malloc(MEM_LEAK_TASKS, sizeof(double));
+        double* max_leak_val = mem_malloc(MEM_LEAK_TASKS, sizeof(double));
+        char** max_from = mem_malloc(MEM_LEAK_TASKS, sizeof(char*));
+        char** max_to = mem_malloc(MEM_LEAK_TASKS, sizeof(char*));
+
+        *branch_result = 0.0;
+        *max_leak_val = 0.0;
+        *max_from = NULL;
+        *max_to = NULL;
+
+        // Create task data
+        LeakTaskData* task_data = mem_malloc(MEM_LEAK_TASKS, sizeof(LeakTaskData));
+        task_data->node = valid_connections[i]->target;
+        task_data->input_vol = volumes_arrived[i];
+        task_data->facility = facility;
+        task_data->leak_result = branch_result;
+        task_data->max_leak_val = max_leak_val;
+        task_data->max_from = max_from;
+        task_data->max_to = max_to;
+        task_data->worst = NULL;
+        task_data->nodes = -1;
+        if (trace_on) {
+            // Counted before the workers start, so the count does not widen their spans
+            task_data->nodes = count_leak_nodes(task_data->node, task_data->input_vol, facility);
+            trace_event(TRACE_INSTANT, "enqueue", task_data->node->name, task_data->nodes);
+        }
+        if (res->worst) {
+            // Each branch fills its own heap, merged once the threads are done
+            task_data->worst = mem_malloc(MEM_LEAK_TASKS, sizeof(SectionHeap));
+            if (!task_data->worst ||
+                section_heap_init(task_data->worst, res->worst->capacity) != 0) {
+                fprintf(stderr, "Memory allocation failed for section heap\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // Results are read back by branch index, whatever the completion order
+        tasks[i] = task_data;
+
+        // Schedule task
+        addTaskInThreads(thread_system, leak_branch_task_wrapper, task_data);
+    }
+
+    // Execute all tasks in parallel
+    thread_start = clock();
+    if (trace_on) trace_event(TRACE_BEGIN, "run", node->name, -1);
+    int th_err = handleThreads(thread_system);
+    if (trace_on) trace_event(TRACE_END, "run", NULL, -1);
+    if (th_err != 0) {
+        fprintf(stderr, "Warning: %d thread operations failed\n", th_err);
+    }
+    thread_stop = clock();
+
+    // Sum up results in branch order, exactly like solve_leaks: each section,
+    // then its subtree, so the total and the critical section match the serial run
+    double total_loss = 0.0;
+    double global_max_leak = 0.0;
+    char* global_max_from = NULL;
+    char* global_max_to = NULL;
+
+    for (int i = 0; i < count; i++) {
+        if (pipe_losses[i] > global_max_leak) {
+            global_max_leak = pipe_losses[i];
+            global_max_from = node->name;
+            global_max_to = valid_connections[i]->target->name;
+        }
+
+        LeakTaskData* data = tasks[i];
+        if (!data) {
+            total_loss += pipe_losses[i];
+            continue;
+        }
+
+        total_loss += pipe_losses[i] + *(data->leak_result);
+        if (*(data->max_leak_val) > global_max_leak) {
+            global_max_leak = *(data->max_leak_val);
+            global_max_from = *(data->max_from);
+            global_max_to = *(data->max_to);
+        }
+
+        mem_free(MEM_LEAK_TASKS, data->leak_result, sizeof(double));
+        mem_free(MEM_LEAK_TASKS, data->max_leak_val, sizeof(double));
+        mem_free(MEM_LEAK_TASKS, data->max_from, sizeof(char*));
+        mem_free(MEM_LEAK_TASKS, data->max_to, sizeof(char*));
+        if (data->worst) {
+            section_heap_merge(res->worst, data->worst);
+            section_heap_free(data->worst);
+            mem_free(MEM_LEAK_TASKS, data->worst, sizeof(SectionHeap));
+        }
+        mem_free(MEM_LEAK_TASKS, data, sizeof(LeakTaskData));
+    }
+
+    mem_free(MEM_LEAK_TASKS, tasks, count * sizeof(LeakTaskData*));
+    free(valid_connections);
+    free(pipe_losses);
+    free(volumes_arrived);
+    cleanupThreads(thread_system);
+
+    res->max_loss = global_max_leak;
+    res->max_from = global_max_from;
+    res->max_to = global_max_to;
+    res->loss = total_loss;
+    return res->loss;
+}
+
+/**
+ * Calculates the leaks downstream of a facility
+ * The starting volume is the facility's actual volume, or its capacity
+ *
+ * @param root         Root of the station tree
+ * @param facility_id  Facility identifier
+ * @param threaded     1 to split the first branches across threads
+ * @param res          Result initialized by leak_result_init, receives the total and
+ *                     the critical section, and the worst sections if res->worst is set
+ * @return             0 on success, -1 if the facility does not exist
+ */
+int leak_query(Station* root, const char* facility_id, int threaded, LeakResult* res) {
+    leak_result_reset(res);
+
+    Station* start = find_station(root, (char*)facility_id);
+    if (!start) return -1;
+
+    // Calculate leaks from actual volume or capacity if needed
+    double starting_volume = (start->real_qty > 0) ? (double)start->real_qty : (double)start->capacity;
+    if (starting_volume <= 0) return 0;
+
+    if (trace_on) trace_event(TRACE_BEGIN, "leak", start->name, -1);
+    if (threaded) {
+        calculate_leaks_mt(start, starting_volume, start, res);
+    } else {
+        solve_leaks_serial(start, starting_volume, start, res);
+    }
+    if (trace_on) trace_event(TRACE_END, "leak", NULL, -1);
+    return 0;
+}
+
+/**
+ * Approximate leak calculation with a guaranteed error bound
+ *
+ * @param root         Root of the station tree
+ * @param facility_id  Facility identifier
+ * @param tolerance    Largest error allowed (internal units)
+ * @param res          Result initialized by leak_result_init
+ * @return             0 on success, -1 if the facility does not exist
+ */
+int leak_query_approx(Station* root, const char* facility_id, double tolerance, LeakResult* res) {
+    leak_result_reset(res);
+
+    Station* start = find_station(root, (char*)facility_id);
+    if (!start) return -1;
+
+    double starting_volume = (start->real_qty > 0) ? (double)start->real_qty : (double)start->capacity;
+    if (starting_volume <= 0) return 0;
+
+    // A skipped subtree loses between nothing and its volume: counting half of
+    // it leaves an error of at most half, so twice the tolerance can be skipped
+    LeakBudget b = { 2.0 * (tolerance > 0.0 ? tolerance : 0.0), 0.0 };
+    double exact = solve_leaks_approx(start, starting_volume, start, res, &b);
+    res->bound = b.skipped / 2.0;
+    res->loss = exact + res->bound;
+    return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * leaks.h
+ *
+ * Calculation of water losses downstream from a facility.
+ */
+
+#ifndef LEAKS_H
+#define LEAKS_H
+
+#include "structs.h"
+
+/**
+ * Version of the leak engine, part of the result cache key
+ * Must be increased whenever a change alters the computed values
+ */
+#define LEAK_ENGINE_VERSION 2u
+
+/**
+ * Number of worst sections reported when no count is given
+ */
+#define DEFAULT_WORST_SECTIONS 100
+
+/**
+ * Section of the network and the volume lost on it
+ */
+typedef struct {
+    double loss;      // Volume lost on the section (internal units)
+    char* from;       // Upstream station
+    char* to;         // Downstream station
+} LeakSection;
+
+/**
+ * Bounded min-heap keeping the K sections with the largest losses
+ * The root is the smallest kept loss, so most pushes stop at one comparison
+ */
+typedef struct SectionHeap {
+    LeakSection* items;
+    int size;
+    int capacity;
+} SectionHeap;
+
+/**
+ * Outcome of a leak calculation
+ */
+typedef struct {
+    double loss;         // Total leak volume (internal units)
+    double max_loss;     // Loss on the critical section
+    char* max_from;      // Upstream station of the critical section (NULL if none)
+    char* max_to;        // Downstream station of the critical section (NULL if none)
+    SectionHeap* worst;  // Receives the worst sections (NULL if not tracked)
+    double bound;        // Largest possible error of an approximate result (0 when exact)
+} LeakResult;
+
+/**
+ * Resets a leak result (worst sections are not tracked)
+ *
+ * @param res  Result to reset
+ */
+void leak_result_init(LeakResult* res);
+
+/**
+ * Creates an empty heap of worst sections
+ *
+ * @param h  Heap to initialize
+ * @param k  Number of sections to keep
+ * @return   0 on success, -1 on allocation failure
+ */
+int section_heap_init(SectionHeap* h, int k);
+
+/**
+ * Offers a section to the heap (kept if it is among the K worst so far)
+ * Equal losses are ordered by station identifiers, so the kept set does not
+ * depend on the traversal order
+ *
+ * @param h     Heap
+ * @param loss  Volume lost on the section
+ * @param from  Upstream station
+ * @param to    Downstream station
+ */
+void section_heap_push(SectionHeap* h, double loss, char* from, char* to);
+
+/**
+ * Offers every section of a heap to another one
+ *
+ * @param dst  Destination heap
+ * @param src  Heap to merge (unchanged)
+ */
+void section_heap_merge(SectionHeap* dst, const SectionHeap* src);
+
+/**
+ * Sorts the kept sections from the worst to the least bad
+ * The heap must not receive sections afterwards
+ *
+ * @param h  Heap
+ */
+void section_heap_sort(SectionHeap* h);
+
+/**
+ * Releases a heap of worst sections
+ *
+ * @param h  Heap
+ */
+void section_heap_free(SectionHeap* h);
+
+/**
+ * Recursively calculates water losses in the network
+ *
+ * @param node         Current station
+ * @param input_vol    Incoming water volume
+ * @param u            Facility for which leaks are calculated
+ * @param max_leak_val Pointer to track maximum leak value
+ * @param max_from     Pointer to track upstream station of critical section
+ * @param max_to       Pointer to track downstream station of critical section
+ * @param worst        Heap receiving every section with a loss (NULL if not tracked)
+ * @return             Total downstream leak volume
+ */
+double solve_leaks(Station* node, double input_vol, Station* u,
+                   double* max_leak_val, char** max_from, char** max_to,
+                   SectionHeap* worst);
+
+/**
+ * Calculates leaks for a facility using multithreading for branches
+ * Branch results are combined in branch order, the order of solve_leaks, so
+ * the result does not depend on thread scheduling and equals the serial one
+ *
+ * @param node     Starting station
+ * @param volume   Input volume
+ * @param facility Target facility
+ * @param res      Receives the total and the critical section, and the worst
+ *                 sections if res->worst is set (one heap per branch task, merged)
+ * @return         Total leak volume
+ */
+double calculate_leaks_mt(Station* node, double volume, Station* facility, LeakResult* res);
+
+/**
+ * Calculates the leaks downstream of a facility
+ * The starting volume is the facility's actual volume, or its capacity
+ *
+ * @param root         Root of the station tree
+ * @param facility_id  Facility identifier
+ * @param threaded     1 to split the first branches across threads
+ * @param res          Result initialized by leak_result_init, receives the total and
+ *                     the critical section, and the worst sections if res->worst is set
+ * @return             0 on success, -1 if the facility does not exist
+ */
+int leak_query(Station* root, const char* facility_id, int threaded, LeakResult* res);
+
+/**
+ * Approximate leak calculation with a guaranteed error bound
+ * A subtree can lose at most the volume entering it, so subtrees are skipped
+ * (depth first, while the budget lasts) as long as half the volume skipped
+ * stays within the tolerance. The loss is the exact part plus half the
+ * volume skipped, and res->bound half the volume skipped: the value of
+ * leak_query is within res->bound of it. The critical and worst sections
+ * only cover the sections actually visited.
+ *
+ * @param root         Root of the station tree
+ * @param facility_id  Facility identifier
+ * @param tolerance    Largest error allowed (internal units)
+ * @param res          Result initialized by leak_result_init
+ * @return             0 on success, -1 if the facility does not exist
+ */
+int leak_query_approx(Station* root, const char* facility_id, double tolerance, LeakResult* res);
+
+#endif /* LEAKS_H */
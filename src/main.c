@@ -11,537 +11,646 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+#include <stdint.h>
 #include <time.h>
 #include "avl.h"
 #include "multiThreaded.h"
+#include "network.h"
+#include "leaks.h"
+#include "rank.h"
+#include "output.h"
+#include "server.h"
+#include "cache.h"
+#include "state.h"
+#include "whatif.h"
+#include "spill.h"
+#include "shard.h"
+#include "check.h"
+#include "reader.h"
+#include "columnar.h"
+#include "upstream.h"
+#include "flowmap.h"
+#include "chart.h"
+#include "memstats.h"
+#include "trace.h"
+#include "rowindex.h"
+#include "fixedpoint.h"
 #include "structs.h"
 
 /**
- * Removes whitespace at the beginning and end of string
- * @param str String to trim
- * @return Pointer to trimmed string
+ * Displays the critical section of a leak calculation on stderr
+ *
+ * @param max_loss  Loss on the section (nothing is displayed if not positive)
+ * @param from      Upstream station
+ * @param to        Downstream station
  */
-static char* trim_whitespace(char* str) {
-    if (!str) return NULL;
-    // Move to first non-whitespace character
-    while (*str && (*str == ' ' || *str == '\t')) {
-        str++;
-    }
-    if (*str == '\0') return str;
-    // Remove trailing whitespace
-    char* end = str + strlen(str) - 1;
-    while (end > str && (*end == ' ' || *end == '\t')) {
-        *end = '\0';
-        end--;
-    }
-    return str;
+static void print_critical_section(double max_loss, const char* from, const char* to) {
+    if (max_loss <= 0.0) return;
+    fprintf(stderr, "\n=== BONUS INFO ===\n");
+    fprintf(stderr, "Critical section (Worst absolute leak):\n");
+    fprintf(stderr, "Upstream: %s\n", from);
+    fprintf(stderr, "Downstream: %s\n", to);
+    fprintf(stderr, "Loss: %.6f M.m3\n", max_loss / 1000.0);
+    fprintf(stderr, "=================\n");
 }
 
 /**
- * Recursively calculates water losses in the network
- * 
- * @param node         Current station
- * @param input_vol    Incoming water volume
- * @param u            Facility for which leaks are calculated
- * @param max_leak_val Pointer to track maximum leak value
- * @param max_from     Pointer to track upstream station of critical section
- * @param max_to       Pointer to track downstream station of critical section
- * @return             Total downstream leak volume
+ * Writes the worst sections of a leak calculation, one per line:
+ * upstream;downstream;loss (M.m3);share of the total loss (%)
+ *
+ * @param path   Destination file
+ * @param worst  Sections sorted from the worst
+ * @param total  Total loss of the calculation
+ * @return       0 on success, -1 on failure
  */
-static double solve_leaks(Station* node, double input_vol, Station* u,
-                         double* max_leak_val, char** max_from, char** max_to) {
-    // Early termination conditions
-    if (!node || input_vol <= 0.001) return 0.0;
-    if (node->nb_children == 0) return 0.0;
-
-    // Count valid outgoing connections for this facility
-    int valid_count = 0;
-    AdjNode* curr = node->children;
-    
-    while (curr) {
-        if (curr->factory == NULL || curr->factory == u) {
-            valid_count++;
-        }
-        curr = curr->next;
+static int write_sections(const char* path, const SectionHeap* worst, double total) {
+    FILE* file = fopen(path, "w");
+    if (!file) return -1;
+    for (int i = 0; i < worst->size; i++) {
+        const LeakSection* s = &worst->items[i];
+        fprintf(file, "%s;%s;%.6f;%.6f\n", s->from, s->to, s->loss / 1000.0,
+                (total > 0.0) ? 100.0 * s->loss / total : 0.0);
     }
-    
-    if (valid_count == 0) return 0.0;
-
-    // Distribute volume and calculate losses
-    double total_loss = 0.0;
-    double vol_per_pipe = input_vol / valid_count;
-    curr = node->children;
-
-    // Process each connection
-    while (curr) {
-        // Only process/recurse if the pipe belongs to the requested facility (or is shared)
-        if (curr->factory == NULL || curr->factory == u) {
-            // Calculate losses on this section
-            double pipe_loss = 0.0;
-            if (curr->leak_perc > 0.001) {
-                pipe_loss = vol_per_pipe * (curr->leak_perc / 100.0);
-            }
-
-            // Track section with maximum leak
-            if (pipe_loss > *max_leak_val) {
-                *max_leak_val = pipe_loss;
-                *max_from = node->name;       // Upstream ID
-                *max_to = curr->target->name; // Downstream ID
-            }
-
-            double vol_arrived = vol_per_pipe - pipe_loss;
-            
-            if (vol_arrived > 0.001) {
-                // Add local and recursive losses
-                total_loss += pipe_loss + solve_leaks(curr->target, vol_arrived, u,
-                                                    max_leak_val, max_from, max_to);
-            } else {
-                // Just add the pipe loss without recursion
-                total_loss += pipe_loss;
-            }
-        }
-        curr = curr->next;
-    }
-    return total_loss;
-}
-
-/**
- * Thread task wrapper for leak calculation of a specific branch
- * @param arg Pointer to LeakTaskData structure
- */
-static void leak_branch_task_wrapper(void* arg) {
-    LeakTaskData* data = (LeakTaskData*)arg;
-
-    // Execute leak calculation for this branch
-    *(data->leak_result) = solve_leaks(
-        data->node,
-        data->input_vol,
-        data->facility,
-        data->max_leak_val,
-        data->max_from,
-        data->max_to
-    );
+    int failed = ferror(file);
+    if (fclose(file) != 0) failed = 1;
+    return failed ? -1 : 0;
 }
 
 /**
- * Calculates leaks for a facility using multithreading for branches
- * 
- * @param node     Starting station
- * @param volume   Input volume
- * @param facility Target facility
- * @return         Total leak volume
+ * Evaluates the leak rate changes of a scenario file, one per line:
+ * upstream;downstream;new leak %
+ * Each scenario is applied alone and reverted before the next one. For every
+ * facility using the section (or fed by it, for a source section), writes on
+ * stdout:
+ * upstream;downstream;leak;facility;current loss;loss with the change
+ * Lines writing nothing are counted as ignored
+ *
+ * @param net   Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL) | LOAD_REVERSE
+ * @param path  Scenario file
+ * @return      0 on success, 2 if the file cannot be opened
  */
-static double calculate_leaks_mt(Station* node, double volume, Station* facility) {
-    if (!node || volume <= 0.001) return 0.0;
-
-    // Count valid outgoing connections
-    int count = 0;
-    AdjNode* curr = node->children;
-    
-    // Pre-allocate arrays
-    AdjNode** valid_connections = NULL;
-    double* pipe_losses = NULL;
-    double* volumes_arrived = NULL;
-    
-    // First pass: count valid connections
-    while (curr) {
-        if (curr->factory == NULL || curr->factory == facility) {
-            count++;
-        }
-        curr = curr->next;
-    }
-    
-    if (count == 0) return 0.0;
-    
-    // Use direct calculation for small number of branches
-    if (count <= 2) {
-        double max_leak_val = 0.0;
-        char* max_from = NULL;
-        char* max_to = NULL;
-        return solve_leaks(node, volume, facility, &max_leak_val, &max_from, &max_to);
-    }
+static int run_scenarios(Network* net, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return 2;
 
-    // Allocate arrays for connection data
-    valid_connections = (AdjNode**)malloc(count * sizeof(AdjNode*));
-    pipe_losses = (double*)malloc(count * sizeof(double));
-    volumes_arrived = (double*)malloc(count * sizeof(double));
-    
-    if (!valid_connections || !pipe_losses || !volumes_arrived) {
-        fprintf(stderr, "Memory allocation failed for connection arrays\n");
-        free(valid_connections);
-        free(pipe_losses);
-        free(volumes_arrived);
-        
-        // Fallback to direct calculation
-        double max_leak_val = 0.0;
-        char* max_from = NULL;
-        char* max_to = NULL;
-        return solve_leaks(node, volume, facility, &max_leak_val, &max_from, &max_to);
-    }
-    
-    // Second pass: collect valid connections and pre-calculate losses
-    curr = node->children;
-    int idx = 0;
-    double vol_per_pipe = volume / count;
-    
-    while (curr && idx < count) {
-        if (curr->factory == NULL || curr->factory == facility) {
-            valid_connections[idx] = curr;
-            
-            // Pre-calculate pipe loss
-            if (curr->leak_perc > 0.001) {
-                pipe_losses[idx] = vol_per_pipe * (curr->leak_perc / 100.0);
-            } else {
-                pipe_losses[idx] = 0.0;
-            }
-            
-            // Pre-calculate volume that arrives
-            volumes_arrived[idx] = vol_per_pipe - pipe_losses[idx];
-            idx++;
-        }
-        curr = curr->next;
-    }
-    
-    // Setup thread system for parallel processing
-    Threads* thread_system = setupThreads();
-    if (!thread_system) {
-        double max_leak_val = 0.0;
-        char* max_from = NULL;
-        char* max_to = NULL;
-        return solve_leaks(node, volume, facility, &max_leak_val, &max_from, &max_to);
-    }
+    WhatIf w;
+    whatif_init(&w, net->root, net->reverse);
 
-    // Create a NodeGroup to store results
-    NodeGroup results;
-    if (initNodeGroup(&results) != 0) {
-        cleanupThreads(thread_system);
-        double max_leak_val = 0.0;
-        char* max_from = NULL;
-        char* max_to = NULL;
-        return solve_leaks(node, volume, facility, &max_leak_val, &max_from, &max_to);
-    }
+    AdjNode** edges = NULL;
+    double* old_leaks = NULL;
+    double* before = NULL;
+    long edge_cap = 0;
+    long before_cap = 0;
+    long evaluated = 0;
+    long ignored = 0;
+    clock_t start = clock();
 
-    // Prepare tasks for each branch
-    double total_pipe_loss = 0.0;
-    double global_max_leak = 0.0;
-    char* global_max_from = NULL;
-    char* global_max_to = NULL;
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        char* cols[5];
+        if (split_columns(line, cols) != 0) continue;
 
-    for (int i = 0; i < count; i++) {
-        // Skip branches with negligible volume
-        if (volumes_arrived[i] <= 0.001) {
-            total_pipe_loss += pipe_losses[i];
+        Station* from = cols[0] ? find_station(net->root, cols[0]) : NULL;
+        Station* to = cols[1] ? find_station(net->root, cols[1]) : NULL;
+        if (!from || !to || !cols[2]) {
+            ignored++;
+            continue;
+        }
+        double leak = atof(cols[2]);
+
+        // Sections between the two stations, and the models they affect
+        long n = 0;
+        for (AdjNode* e = from->children; e; e = e->next) {
+            if (e->target != to) continue;
+            if (n >= edge_cap) {
+                edge_cap = edge_cap ? edge_cap * 2 : 4;
+                edges = realloc(edges, edge_cap * sizeof(AdjNode*));
+                old_leaks = realloc(old_leaks, edge_cap * sizeof(double));
+                if (!edges || !old_leaks) exit(EXIT_FAILURE);
+            }
+            edges[n++] = e;
+            if (e->factory && !whatif_model(&w, e->factory)) exit(EXIT_FAILURE);
+        }
+        if (n == 0) {
+            ignored++;
             continue;
         }
 
-        // Track maximum pipe loss
-        if (pipe_losses[i] > global_max_leak) {
-            global_max_leak = pipe_losses[i];
-            global_max_from = node->name;
-            global_max_to = valid_connections[i]->target->name;
+        if (w.count > before_cap) {
+            before_cap = w.count;
+            before = realloc(before, before_cap * sizeof(double));
+            if (!before) exit(EXIT_FAILURE);
         }
+        for (long m = 0; m < w.count; m++) before[m] = whatif_loss(w.models[m]);
 
-        total_pipe_loss += pipe_losses[i];
-
-        // Create task for downstream calculation
-        double* branch_result = malloc(sizeof(double));
-        double* max_leak_val = malloc(sizeof(double));
-        char** max_from = malloc(sizeof(char*));
-        char** max_to = malloc(sizeof(char*));
-
-        *branch_result = 0.0;
-        *max_leak_val = 0.0;
-        *max_from = NULL;
-        *max_to = NULL;
-
-        // Create task data
-        LeakTaskData* task_data = malloc(sizeof(LeakTaskData));
-        task_data->node = valid_connections[i]->target;
-        task_data->input_vol = volumes_arrived[i];
-        task_data->facility = facility;
-        task_data->leak_result = branch_result;
-        task_data->max_leak_val = max_leak_val;
-        task_data->max_from = max_from;
-        task_data->max_to = max_to;
-
-        // Add result to results list
-        addContent(&results, task_data);
-
-        // Schedule task
-        addTaskInThreads(thread_system, leak_branch_task_wrapper, task_data);
-    }
+        for (long k = 0; k < n; k++) {
+            old_leaks[k] = edges[k]->leak_perc;
+            whatif_set_leak(&w, from, edges[k], leak);
+        }
 
-    // Free pre-allocated arrays
-    free(valid_connections);
-    free(pipe_losses);
-    free(volumes_arrived);
+        long written = 0;
+        for (long m = 0; m < w.count; m++) {
+            FacilityModel* model = w.models[m];
+            int used = 0;
+            for (long k = 0; k < n; k++) {
+                // A source section changes the volume entering its facility
+                if (edges[k]->volume > 0 && edges[k]->target == model->facility) used = 1;
+                else if ((!edges[k]->factory || edges[k]->factory == model->facility)
+                         && whatif_contains(model, from)) used = 1;
+            }
+            if (!used) continue;
+            printf("%s;%s;%.6f;%s;%.6f;%.6f\n", from->name, to->name, leak,
+                   model->facility->name, before[m] / 1000.0, whatif_loss(model) / 1000.0);
+            written++;
+        }
 
-    // Execute all tasks in parallel
-    thread_start = clock();
-    int th_err = handleThreads(thread_system);
-    if (th_err != 0) {
-        fprintf(stderr, "Warning: %d thread operations failed\n", th_err);
+        // Back to the original network for the next scenario
+        for (long k = n - 1; k >= 0; k--) whatif_set_leak(&w, from, edges[k], old_leaks[k]);
+        if (written > 0) evaluated++;
+        else ignored++;
     }
-    thread_stop = clock();
 
-    // Sum up results
-    double downstream_leaks = 0.0;
+    double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    fprintf(stderr, "%ld scenario(s) evaluated in %.3f seconds (%ld ignored)\n",
+            evaluated, elapsed, ignored);
 
-    Node* current = results.head;
-    while (current) {
-        LeakTaskData* data = (LeakTaskData*)current->content;
-        if (data) {
-            downstream_leaks += *(data->leak_result);
+    free(edges);
+    free(old_leaks);
+    free(before);
+    whatif_free(&w);
+    fclose(file);
+    return 0;
+}
 
-            if (*(data->max_leak_val) > global_max_leak) {
-                global_max_leak = *(data->max_leak_val);
-                global_max_from = *(data->max_from);
-                global_max_to = *(data->max_to);
-            }
+/**
+ * Writes the facilities and sources feeding a station (see upstream.h)
+ *
+ * @param net  Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL) | LOAD_REVERSE
+ * @param id   Queried station
+ * @return     0 on success, 3 if the answer cannot be computed or written
+ */
+static int run_upstream(Network* net, char* id) {
+    Station* target = find_station(net->root, id);
+    if (!target) {
+        printf("-1\n");
+        return 0;
+    }
 
-            free(data->leak_result);
-            free(data->max_leak_val);
-            free(data->max_from);
-            free(data->max_to);
-            free(data);
-        }
-        current = current->next;
+    clock_t start = clock();
+    UpstreamResult res;
+    if (upstream_query(net->reverse, target, &res) != 0) return 3;
+    double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    fprintf(stderr, "%ld upstream station(s) examined in %.3f seconds\n", res.ancestors, elapsed);
+
+    OutBuffer out;
+    int status = 0;
+    if (out_open_stream(&out, stdout) != 0) {
+        status = 3;
+    } else {
+        upstream_write(&res, target, &out);
+        if (out_close(&out) != 0) status = 3;
     }
+    upstream_result_free(&res);
+    return status;
+}
 
-    // NodeGroup cleanup is handled by cleanupNodeGroup
-    cleanupNodeGroup(&results);
-    cleanupThreads(thread_system);
-
-    // Display critical section info
-    if (global_max_leak > 0.0) {
-        fprintf(stderr, "\n=== BONUS INFO ===\n");
-        fprintf(stderr, "Critical section (Worst absolute leak):\n");
-        fprintf(stderr, "Upstream: %s\n", global_max_from);
-        fprintf(stderr, "Downstream: %s\n", global_max_to);
-        fprintf(stderr, "Loss: %.6f M.m3\n", global_max_leak / 1000.0);
-        fprintf(stderr, "=================\n");
+/**
+ * Writes the flow map of the whole network (see flowmap.h)
+ *
+ * @param net  Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL)
+ * @return     0 on success, 3 if the map cannot be computed or written
+ */
+static int run_flowmap(Network* net) {
+    clock_t start = clock();
+    FlowMap map;
+    if (flowmap_build(&map, net->root) != 0) return 3;
+    double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    fprintf(stderr, "Flows of %ld facilities through %ld stations in %.3f seconds", map.facilities,
+            map.count, elapsed);
+    if (map.skipped > 0) fprintf(stderr, " (%ld stations on or below a cycle left out)", map.skipped);
+    fprintf(stderr, "\n");
+
+    OutBuffer out;
+    int status = 0;
+    if (out_open_stream(&out, stdout) != 0) {
+        status = 3;
+    } else {
+        flowmap_write(&map, &out);
+        if (out_close(&out) != 0) status = 3;
     }
+    flowmap_free(&map);
+    return status;
+}
 
-    return total_pipe_loss + downstream_leaks;
+/**
+ * Writes the memory accounting (see mem_write)
+ *
+ * @param path  Destination file, "-" for stderr
+ * @return      0 on success, -1 on failure
+ */
+static int write_mem_stats(const char* path) {
+    int to_stderr = (strcmp(path, "-") == 0);
+    FILE* file = to_stderr ? stderr : fopen(path, "w");
+    if (!file) return -1;
+
+    OutBuffer out;
+    int status = -1;
+    if (out_open_stream(&out, file) == 0) {
+        mem_write(&out);
+        status = out_close(&out);
+    }
+    if (!to_stderr && fclose(file) != 0) status = -1;
+    return status;
 }
 
 /**
  * Program entry point
  *
  * Arguments:
- * - argv[1]: path to data file (.dat or .csv)
+ * - argv[1]: path to data file (.dat or .csv), "-" for the standard input;
+ *   gzip files and streams are accepted when built with ZLIB=1
  * - argv[2]: execution mode
  *   * "max", "src", "real", "all": histogram generation
+ *   * "serve": keep the network loaded and answer requests (see server.h)
+ *   * "update": apply delta files and write the resulting binary state
+ *     (appended to the journal of a state updated in place, see state.h)
+ *   * "whatif": evaluate leak rate changes listed in a scenario file
+ *   * "check": compare every engine with the serial one (see check.h)
+ *   * "upstream": facilities and sources feeding a station (--station <id>)
+ *   * "flowmap": inflow, outflow and loss of every station and loss by tier,
+ *     for all facilities in one sweep
+ *   * "columnar": write the parsed rows as a columnar file (see columnar.h),
+ *     which the histogram modes then read directly
+ *   * "index": write the byte ranges of each facility's rows to a sidecar
+ *     index (see rowindex.h), which leak calculations then read with pread
  *   * other: facility ID for specific leak calculation
+ * - Histogram options:
+ *   * --sort <name|max|src|real>: row order (default: name, max in "all" mode)
+ *   * --top <K>, --bottom <K>: only write the K largest / smallest rows
+ *   * --csv <path>: also write the full ordered table to a file
+ *   * --chart <prefix>: also draw the selected blocks as <prefix>_small and
+ *     <prefix>_big charts (--chart-format <svg|png>, default svg)
+ *   * --mem-limit <MB>: bound the in-memory table; beyond it partial sums are
+ *     written to sorted temporary runs and merged at the end (K/M/G suffixes accepted)
+ *   * --threads <N>: parse and aggregate with N threads (default: online processors)
+ * - Leak options:
+ *   * --graph <filtered|full>: load only the rows naming the facility (default),
+ *     or the whole network
+ *   * --index <path>: row index of the data file (default: <data file>.idx,
+ *     used when it exists and is up to date; also the file the "index" mode writes)
+ *   * --engine <double|fixed>: floating-point arithmetic (default), or 64-bit
+ *     fixed point, reproducible to the bit (see fixedpoint.h)
+ *   * --approx <T>: approximate calculation within T M.m3 of the exact one,
+ *     written as "loss;error bound" (the cache is not used)
+ *   * --cache <path>: reuse and store results in a persistent cache
+ *   * --sections <path>: write the worst sections (--top <K>, default 100);
+ *     the cache is not read when this option is given
+ * - Update options:
+ *   * --delta <path>: delta file in the data file format (repeatable, applied in order)
+ *   * --out <path>: state file to write (columnar file in "columnar" mode)
+ * - What-if options:
+ *   * --scenarios <path>: one "upstream;downstream;leak%" change per line
+ * - Check options:
+ *   * --generate <N>: also check N random networks (--seed <S>, default 1)
+ *   * --tolerance <T>: relative tolerance for every engine (default: each engine's own)
+ * - The data file may also be a state file written by the "update" mode
+ * - Server options:
+ *   * --socket <path>: listen on a Unix socket instead of stdin/stdout
+ * - Any mode working on a loaded network:
+ *   * --ingest <serial|pipeline>: how text rows are loaded; "pipeline" splits,
+ *     resolves and links them on three threads (see pipeline.h); plain
+ *     histograms are then loaded this way instead of by --threads shards
+ *   * --mem-stats <path>: write the memory used by each kind of structure and
+ *     the resident size once the work is done ("-" for stderr, see memstats.h)
+ *   * --trace <path>: record when the leak branch tasks are queued, started and
+ *     finished on each thread, written as a Chrome trace-event file (see trace.h)
  */
 int main(int argc, char** argv) {
     // Argument validation
-    if (argc != 3) return 1;
-
-    // Open data file
-    FILE* file = fopen(argv[1], "r");
-    if (!file) return 2;
-
-    // Reading optimization
-    const size_t BUF_SIZE = 32 * 1024 * 1024; // 32 MB buffer
-    char* big_buffer = malloc(BUF_SIZE);
-    if (big_buffer) setvbuf(file, big_buffer, _IOFBF, BUF_SIZE);
+    if (argc < 3) return 1;
+
+    RankOptions rank = { -1, 0, 0, NULL, NULL, CHART_SVG };
+    const char* socket_path = NULL;
+    const char* cache_path = NULL;
+    const char* sections_path = NULL;
+    const char* out_path = NULL;
+    const char* scenario_path = NULL;
+    const char* mem_stats_path = NULL;
+    const char* trace_path = NULL;
+    const char* index_path = NULL;
+    char* station_id = NULL;
+    size_t mem_limit = 0;
+    int pipelined = 0;
+    int full_graph = 0;
+    int fixed_engine = 0;
+    double approx = 0.0;
+    int threads = shard_default_threads();
+    int delta_count = 0;
+    CheckOptions check = { argv[1], 0, 1, -1.0 };
+    for (int i = 3; i < argc; i++) {
+        if (i + 1 >= argc) return 1;
+        if (strcmp(argv[i], "--sort") == 0) {
+            rank.sort_metric = parse_metric(argv[++i]);
+            if (rank.sort_metric < 0) return 1;
+        } else if (strcmp(argv[i], "--top") == 0) {
+            rank.top = atol(argv[++i]);
+            if (rank.top < 0) return 1;
+        } else if (strcmp(argv[i], "--bottom") == 0) {
+            rank.bottom = atol(argv[++i]);
+            if (rank.bottom < 0) return 1;
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            rank.csv_path = argv[++i];
+        } else if (strcmp(argv[i], "--chart") == 0) {
+            rank.chart = argv[++i];
+        } else if (strcmp(argv[i], "--chart-format") == 0) {
+            rank.chart_format = chart_parse_format(argv[++i]);
+            if (rank.chart_format < 0) return 1;
+        } else if (strcmp(argv[i], "--mem-limit") == 0) {
+            mem_limit = spill_parse_limit(argv[++i]);
+            if (mem_limit == 0) return 1;
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            threads = atoi(argv[++i]);
+            if (threads < 1) return 1;
+        } else if (strcmp(argv[i], "--generate") == 0) {
+            check.generate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            check.seed = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--tolerance") == 0) {
+            check.tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--socket") == 0) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            cache_path = argv[++i];
+        } else if (strcmp(argv[i], "--approx") == 0) {
+            approx = atof(argv[++i]) * 1000.0;
+            if (approx <= 0.0) return 1;
+        } else if (strcmp(argv[i], "--sections") == 0) {
+            sections_path = argv[++i];
+        } else if (strcmp(argv[i], "--delta") == 0) {
+            i++; // Applied in order once the base is loaded
+            delta_count++;
+        } else if (strcmp(argv[i], "--out") == 0) {
+            out_path = argv[++i];
+        } else if (strcmp(argv[i], "--scenarios") == 0) {
+            scenario_path = argv[++i];
+        } else if (strcmp(argv[i], "--station") == 0) {
+            station_id = argv[++i];
+        } else if (strcmp(argv[i], "--graph") == 0) {
+            i++;
+            if (strcmp(argv[i], "full") == 0) full_graph = 1;
+            else if (strcmp(argv[i], "filtered") != 0) return 1;
+        } else if (strcmp(argv[i], "--engine") == 0) {
+            i++;
+            if (strcmp(argv[i], "fixed") == 0) fixed_engine = 1;
+            else if (strcmp(argv[i], "double") != 0) return 1;
+        } else if (strcmp(argv[i], "--ingest") == 0) {
+            i++;
+            if (strcmp(argv[i], "pipeline") == 0) pipelined = 1;
+            else if (strcmp(argv[i], "serial") != 0) return 1;
+        } else if (strcmp(argv[i], "--mem-stats") == 0) {
+            mem_stats_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--index") == 0) {
+            index_path = argv[++i];
+        } else {
+            return 1;
+        }
+    }
 
     // Determine execution mode
     char* arg_mode = argv[2];
+    if (strcmp(arg_mode, "check") == 0) return run_check(&check);
+    if (strcmp(arg_mode, "columnar") == 0) return out_path ? columnar_export(argv[1], out_path) : 1;
+
+    // Row index next to the data file unless another path is given
+    char default_index[4096];
+    if (!index_path && rowindex_default_path(argv[1], default_index, sizeof(default_index)) == 0) {
+        index_path = default_index;
+    }
+    if (strcmp(arg_mode, "index") == 0) return index_path ? rowindex_build(argv[1], index_path) : 1;
+
     int mode_histo = 0; // 1=max, 2=src, 3=real, 4=all
+    int mode_serve = 0;
+    int mode_update = 0;
+    int mode_whatif = 0;
+    int mode_upstream = 0;
+    int mode_flowmap = 0;
     int mode_leaks = 0;
 
-    if (strcmp(arg_mode, "max") == 0) mode_histo = 1;
-    else if (strcmp(arg_mode, "src") == 0) mode_histo = 2;
-    else if (strcmp(arg_mode, "real") == 0) mode_histo = 3;
-    else if (strcmp(arg_mode, "all") == 0) mode_histo = 4;
+    if (strcmp(arg_mode, "max") == 0) mode_histo = HISTO_MAX;
+    else if (strcmp(arg_mode, "src") == 0) mode_histo = HISTO_SRC;
+    else if (strcmp(arg_mode, "real") == 0) mode_histo = HISTO_REAL;
+    else if (strcmp(arg_mode, "all") == 0) mode_histo = HISTO_ALL;
+    else if (strcmp(arg_mode, "serve") == 0) mode_serve = 1;
+    else if (strcmp(arg_mode, "update") == 0) mode_update = 1;
+    else if (strcmp(arg_mode, "whatif") == 0) mode_whatif = 1;
+    else if (strcmp(arg_mode, "upstream") == 0) mode_upstream = 1;
+    else if (strcmp(arg_mode, "flowmap") == 0) mode_flowmap = 1;
     else mode_leaks = 1; // Any other argument is considered a facility ID
 
-    // Initialization
-    Station* root = NULL;
-    char line[1024];
-    long line_count = 0;
-
-    // Progress display interval
-#ifndef PROGRESS_INTERVAL
-#define PROGRESS_INTERVAL 100000L
-#endif
-    long station_count = 0;
-    long capacity_count = 0;
-    long last_report_time = time(NULL);
-
-    // Read and process file
-    while (fgets(line, sizeof(line), file)) {
-        line_count++;
-
-        // Periodic progress display
-        time_t current_time = time(NULL);
-        if (line_count % PROGRESS_INTERVAL == 0 || current_time > last_report_time) {
-            fprintf(stderr, "Lines processed: %ld...\r", line_count);
-            fflush(stderr);
-            last_report_time = current_time;
-        }
-
-        // Clean line
-        line[strcspn(line, "\r\n")] = '\0';
-        if (strlen(line) < 2) continue;
-
-        // Split by semicolons (up to 5 columns)
-        char* cols[5] = {NULL};
-        char* p = line;
-        int c = 0;
-        cols[c++] = p;
-        
-        while (*p && c < 5) {
-            if (*p == ';') {
-                *p = '\0';
-                cols[c++] = p + 1;
-            }
-            p++;
-        }
-
-        // Clean fields
-        for (int i = 0; i < c; i++) {
-            if (cols[i]) {
-                cols[i] = trim_whitespace(cols[i]);
-                if (cols[i][0] == '-' && cols[i][1] == '\0') {
-                    cols[i] = NULL;
-                } else if (cols[i][0] == '\0') {
-                    cols[i] = NULL;
-                }
-            }
-        }
-
-        // Process according to mode
-        if (mode_leaks) {
-            // Leak calculation mode: build complete graph
-
-            // Create stations if needed
-            Station* pa = NULL;
-            Station* ch = NULL;
-
-            if (cols[1]) {
-                pa = find_station(root, cols[1]);
-                if (!pa) {
-                    root = insert_station(root, cols[1], 0, 0, 0);
-                    pa = find_station(root, cols[1]);
-                    station_count++;
-                }
-            }
+    if (trace_path) trace_start();
 
-            if (cols[2]) {
-                ch = find_station(root, cols[2]);
-                if (!ch) {
-                    root = insert_station(root, cols[2], 0, 0, 0);
-                    ch = find_station(root, cols[2]);
-                    station_count++;
-                }
-            }
+    // Load the network
+    LoadSpec spec = { 0, mode_histo, NULL, NULL, NULL };
+    Spill spill;
+    spill_init(&spill, mem_limit);
+    if (mode_leaks) {
+        // Leak calculation mode: only the facility's own rows, unless the whole graph is asked for
+        spec.flags = full_graph ? LOAD_GRAPH : LOAD_GRAPH | LOAD_FILTER;
+        spec.facility = arg_mode;
+        if (!full_graph) spec.index = index_path;
+    } else if (mode_serve || mode_update || mode_whatif || mode_flowmap) {
+        // Server, update, what-if and flow map modes: graph and every aggregate
+        spec.flags = LOAD_GRAPH | LOAD_HISTO;
+        spec.histo_mode = HISTO_ALL;
+        // Modes answering many queries first lay the graph out in traversal order
+        if (mode_serve) spec.flags |= LOAD_REVERSE | LOAD_RELAYOUT;
+        if (mode_whatif) spec.flags |= LOAD_REVERSE | LOAD_RELAYOUT;
+    } else if (mode_upstream) {
+        // Upstream mode: graph, aggregates and the sections arriving at each station
+        spec.flags = LOAD_GRAPH | LOAD_HISTO | LOAD_REVERSE;
+        spec.histo_mode = HISTO_ALL;
+    } else {
+        // Histogram mode: aggregate according to mode
+        spec.flags = LOAD_HISTO;
+        if (mem_limit > 0) spec.spill = &spill;
+    }
 
-            // Create connections between stations
-            if (pa && ch) {
-                double leak = (cols[4] ? atof(cols[4]) : 0.0);  // Leak %
-
-                // Determine facility associated with section
-                Station* factory = NULL;
-                if (cols[0]) {
-                    // Explicitly mentioned facility
-                    factory = find_station(root, cols[0]);
-                    if (!factory) {
-                        root = insert_station(root, cols[0], 0, 0, 0);
-                        factory = find_station(root, cols[0]);
-                        station_count++;
-                    }
-                } else {
-                    // Implicit facility based on section type
-                    if (cols[3]) {
-                        factory = ch;  // Source→facility: facility is downstream
-                    } else {
-                        factory = pa;  // Facility→storage: facility is upstream
-                    }
-                }
+    if (pipelined) spec.flags |= LOAD_PIPELINE;
 
-                // Add connection
-                add_connection(pa, ch, leak, factory);
+    if (mode_update && !out_path) return 1;
+    if (mode_whatif && !scenario_path) return 1;
+    if (mode_upstream && !station_id) return 1;
+    if (!rank_selection_valid(&rank)) {
+        fprintf(stderr, "Error: --top and --bottom cannot be combined with --sort name\n");
+        return 1;
+    }
 
-                // Update actual volume for source→facility sections
-                if (cols[3] && !cols[0]) {
-                    double vol = atof(cols[3]);
-                    double real_vol = vol * (1.0 - leak / 100.0);
+    // Piped input cannot be hashed without reading it twice
+    if (cache_path && strcmp(argv[1], READER_STDIN) == 0) {
+        fprintf(stderr, "Warning: the cache is not used with the standard input\n");
+        cache_path = NULL;
+    }
 
-                    if (mode_leaks && ch && strcmp(ch->name, arg_mode) == 0) {
-                        ch->real_qty += (long)real_vol;
-                    }
-                }
+    // The approximate calculation has its own arithmetic
+    if (fixed_engine && approx > 0.0) return 1;
+
+    // Approximate results are not worth keeping
+    if (cache_path && approx > 0.0) cache_path = NULL;
+    uint32_t engine_id = fixed_engine ? FIXED_ENGINE_ID : LEAK_ENGINE_VERSION;
+
+    // Leak results already computed on the same input come from the cache
+    uint64_t file_hash = 0;
+    if (mode_leaks && cache_path) {
+        CachedLeak hit;
+        if (cache_file_hash(cache_path, argv[1], &file_hash) != 0) return 2;
+        if (!sections_path && cache_lookup(cache_path, file_hash, engine_id, arg_mode, &hit)) {
+            fprintf(stderr, "Result served from cache\n");
+            if (!hit.found) {
+                printf("-1\n");
+            } else {
+                print_critical_section(hit.max_loss, hit.max_from, hit.max_to);
+                printf("%.6f\n", hit.loss / 1000.0);
             }
+            return 0;
+        }
+    }
 
-            // Update facility capacities
-            if (cols[1] && !cols[2] && cols[3]) {
-                Station* s = find_station(root, cols[1]);
-                if (s) {
-                    s->capacity += atol(cols[3]);
-                    capacity_count++;
-                }
-            }
+    // A state updated in place gets the delta rows appended to its journal,
+    // without loading it (see state.h); a full journal is compacted below
+    if (mode_update && state_can_append(argv[1], out_path)) {
+        const char** deltas = malloc((delta_count > 0 ? delta_count : 1) * sizeof(char*));
+        if (!deltas) return 3;
+        int n = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--delta") == 0) deltas[n++] = argv[++i];
+        }
+        long rows = 0;
+        int status = state_append_deltas(out_path, deltas, n, &rows);
+        free(deltas);
+        if (status == 2) fprintf(stderr, "Error: unable to read the delta files\n");
+        else if (status != 0) fprintf(stderr, "Error: unable to write the state %s\n", out_path);
+        else fprintf(stderr, "%d delta file(s): %ld rows appended to the journal\n", n, rows);
+        return status;
+    }
 
-        } else {
-            // Histogram mode: aggregate according to mode
+    Network net;
+    network_init(&net);
+    // Plain histograms are sums: each thread aggregates a part of the file
+    int loaded = (spec.flags == LOAD_HISTO && !spec.spill && threads > 1)
+                     ? network_load_sharded(&net, argv[1], mode_histo, threads)
+                     : network_load(&net, argv[1], &spec);
+    if (loaded != 0) {
+        spill_free(&spill);
+        return 2;
+    }
 
-            if ((mode_histo == 1 || mode_histo == 4) && cols[1] && !cols[2] && cols[3]) {
-                // "max" mode or "all" mode: maximum facility capacities
-                root = insert_station(root, cols[1], atol(cols[3]), 0, 0);
-            }
+    int status = 0;
 
-            if ((mode_histo == 2 || mode_histo == 4) && cols[2] && cols[3]) {
-                // "src" mode or "all" mode: captured volumes
-                long vol = atol(cols[3]);
-                root = insert_station(root, cols[2], 0, vol, 0);
+    // Produce results according to mode
+    if (mode_serve) {
+        status = run_server(&net, socket_path);
+    } else if (mode_whatif) {
+        status = run_scenarios(&net, scenario_path);
+    } else if (mode_upstream) {
+        status = run_upstream(&net, station_id);
+    } else if (mode_flowmap) {
+        status = run_flowmap(&net);
+    } else if (mode_update) {
+        // Apply the deltas in command line order
+        DeltaStats delta = { 0, 0, 0 };
+        for (int i = 3; i < argc && status == 0; i++) {
+            if (strcmp(argv[i], "--delta") != 0) continue;
+            if (network_apply_delta(&net, argv[++i], &delta) != 0) {
+                fprintf(stderr, "Error: unable to read the delta file %s\n", argv[i]);
+                status = 2;
             }
+        }
 
-            if ((mode_histo == 3 || mode_histo == 4) && cols[2] && cols[3]) {
-                // "real" mode or "all" mode: actual volumes
-                long vol = atol(cols[3]);
-                long real = vol;
-
-                if (cols[4]) {
-                    // Apply leak %
-                    double p_leak = atof(cols[4]);
-                    real = (long)(vol * (1.0 - (p_leak / 100.0)));
-                }
-
-                root = insert_station(root, cols[2], 0, 0, real);
+        if (status == 0) {
+            fprintf(stderr, "%d delta file(s): %ld rows, %ld added, %ld replaced\n",
+                    delta_count, delta.rows, delta.added, delta.updated);
+            if (state_write(&net, out_path) != 0) {
+                fprintf(stderr, "Error: unable to write the state %s\n", out_path);
+                status = 3;
             }
         }
-    }
-
-    fprintf(stderr, "Lines processed: %ld\n", line_count);
-    fclose(file);
-
-    // Produce results according to mode
-    if (mode_leaks) {
+    } else if (mode_leaks) {
         // Calculate leaks for a specific facility
-        Station* start = find_station(root, arg_mode);
+        Station* start = find_station(net.root, arg_mode);
+        LeakResult res;
+        leak_result_init(&res);
+
+        // Worst sections are collected during the same traversal
+        SectionHeap worst;
+        if (sections_path) {
+            if (section_heap_init(&worst, rank.top > 0 ? (int)rank.top : DEFAULT_WORST_SECTIONS) != 0) {
+                network_free(&net);
+                return 3;
+            }
+            res.worst = &worst;
+        }
 
         if (!start) {
             // Facility not found
             printf("-1\n");
         } else {
-            // Calculate leaks from actual volume or capacity if needed
-            double starting_volume = (start->real_qty > 0) ? (double)start->real_qty : (double)start->capacity;
-            double leaks = 0.0;
 
-            if (starting_volume > 0) {
+            if (approx > 0.0) {
+                // Approximate calculation, within the error bound written after the loss
+                clock_t begin = clock();
+                leak_query_approx(net.root, arg_mode, approx, &res);
+                fprintf(stderr, "Approximate calculation completed in %.3f seconds\n",
+                        (double)(clock() - begin) / CLOCKS_PER_SEC);
+                print_critical_section(res.max_loss, res.max_from, res.max_to);
+            } else if (start->real_qty > 0 || start->capacity > 0) {
                 fprintf(stderr, "Starting multithreaded leak calculation for %s...\n", start->name);
                 // Use multithreaded calculation for better performance
-                leaks = calculate_leaks_mt(start, starting_volume, start);
+                if (fixed_engine) leak_query_fixed(net.root, arg_mode, 1, &res);
+                else leak_query(net.root, arg_mode, 1, &res);
+
+                // Display critical section info
+                print_critical_section(res.max_loss, res.max_from, res.max_to);
+
                 double time_spent = (double)(thread_stop - thread_start) / CLOCKS_PER_SEC;
                 fprintf(stderr, "Calculation completed in %.2f seconds\n", time_spent);
             }
 
-            // Display result in millions of m³
-            printf("%.6f\n", leaks / 1000.0);
+            // Display result in millions of m³ ("loss;error bound" when approximate)
+            if (approx > 0.0) printf("%.6f;%.6f\n", res.loss / 1000.0, res.bound / 1000.0);
+            else printf("%.6f\n", res.loss / 1000.0);
+
+            if (sections_path) {
+                section_heap_sort(&worst);
+                if (write_sections(sections_path, &worst, res.loss) != 0) {
+                    fprintf(stderr, "Error: unable to write the sections %s\n", sections_path);
+                    status = 3;
+                }
+            }
+        }
+        if (sections_path) section_heap_free(&worst);
+
+        if (cache_path) {
+            // Remember the result for the next runs on the same input
+            CachedLeak entry;
+            entry.found = (start != NULL);
+            entry.loss = 0.0;
+            entry.max_loss = 0.0;
+            entry.max_from[0] = '\0';
+            entry.max_to[0] = '\0';
+            if (start) {
+                entry.loss = res.loss;
+                if (res.max_loss > 0.0 && strlen(res.max_from) < CACHE_NAME_LEN &&
+                    strlen(res.max_to) < CACHE_NAME_LEN) {
+                    entry.max_loss = res.max_loss;
+                    strcpy(entry.max_from, res.max_from);
+                    strcpy(entry.max_to, res.max_to);
+                }
+            }
+            if (cache_store(cache_path, file_hash, engine_id, arg_mode, &entry) != 0) {
+                fprintf(stderr, "Warning: unable to update the cache %s\n", cache_path);
+            }
         }
     } else {
         // Generate histogram
@@ -551,12 +660,34 @@ int main(int argc, char** argv) {
         else if (mode_histo == 3) strcpy(mode_str, "real");
         else if (mode_histo == 4) strcpy(mode_str, "all");
 
-        write_csv(root, stdout, mode_str);
+        rank_apply_defaults(&rank, mode_histo);
+
+        // Tables that outgrew the memory limit are merged from their runs
+        OutBuffer out;
+        if (out_open_stream(&out, stdout) != 0 ||
+            (spill.count > 0 ? spill_write_histogram(&spill, net.root, &out, mode_str, &rank)
+                             : write_histogram(net.root, &out, mode_str, &rank)) != 0 ||
+            out_close(&out) != 0) {
+            fprintf(stderr, "Error: unable to write the histogram\n");
+            status = 3;
+        }
+    }
+
+    // Timeline, while the station names it refers to are still loaded
+    if (trace_path && trace_write(trace_path) != 0) {
+        fprintf(stderr, "Error: unable to write the trace %s\n", trace_path);
+        if (status == 0) status = 3;
+    }
+
+    // Memory report, while the network is still loaded
+    if (mem_stats_path && write_mem_stats(mem_stats_path) != 0) {
+        fprintf(stderr, "Error: unable to write the memory report %s\n", mem_stats_path);
+        if (status == 0) status = 3;
     }
 
     // Free memory
-    free_tree(root);
-    if (big_buffer) free(big_buffer);
+    network_free(&net);
+    spill_free(&spill);
 
-    return 0;
-}
\ No newline at end of file
+    return status;
+}
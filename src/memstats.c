@@ -0,0 +1,165 @@
+/*
+ * memstats.c
+ *
+ * Memory accounting by category (see memstats.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memstats.h"
+
+// Live and peak bytes of each category
+static long live_bytes[MEM_CATEGORIES];
+static long peak_bytes[MEM_CATEGORIES];
+
+// Names of the categories in the report
+static const char* const CATEGORY_NAMES[MEM_CATEGORIES] = {
+    "stations", "names", "connections", "input", "threads", "leak-tasks"
+};
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Raises the peak of a category to at least value
+ */
+static void raise_peak(int category, long value) {
+    long peak = __atomic_load_n(&peak_bytes[category], __ATOMIC_RELAXED);
+    while (value > peak &&
+           !__atomic_compare_exchange_n(&peak_bytes[category], &peak, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Reads a "Name:   <n> kB" field of /proc/self/status, in bytes (-1 if absent)
+ */
+static long status_field(const char* text, const char* name) {
+    const char* p = strstr(text, name);
+    if (!p) return -1;
+    return strtol(p + strlen(name), NULL, 10) * 1024;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Counts bytes allocated (positive) or released (negative) in a category
+ *
+ * @param category  MEM_* category
+ * @param bytes     Change of the live bytes
+ */
+void mem_track(int category, long bytes) {
+    long live = __atomic_add_fetch(&live_bytes[category], bytes, __ATOMIC_RELAXED);
+    if (bytes > 0) raise_peak(category, live);
+}
+
+/**
+ * Releases every byte still counted in a category (pool released at once)
+ *
+ * @param category  MEM_* category
+ */
+void mem_clear(int category) {
+    __atomic_store_n(&live_bytes[category], 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * malloc counted in a category
+ *
+ * @param category  MEM_* category
+ * @param size      Number of bytes
+ * @return          Allocated memory, NULL on failure (nothing counted)
+ */
+void* mem_malloc(int category, size_t size) {
+    void* p = malloc(size);
+    if (p) mem_track(category, (long)size);
+    return p;
+}
+
+/**
+ * calloc counted in a category
+ *
+ * @param category  MEM_* category
+ * @param count     Number of elements
+ * @param size      Size of an element
+ * @return          Zeroed memory (release with mem_free and count * size), NULL on failure
+ */
+void* mem_calloc(int category, size_t count, size_t size) {
+    void* p = calloc(count, size);
+    if (p) mem_track(category, (long)(count * size));
+    return p;
+}
+
+/**
+ * free of memory obtained from mem_malloc or mem_calloc
+ *
+ * @param category  Category given to mem_malloc
+ * @param p         Memory to release (NULL is ignored)
+ * @param size      Size given to mem_malloc
+ */
+void mem_free(int category, void* p, size_t size) {
+    if (!p) return;
+    free(p);
+    mem_track(category, -(long)size);
+}
+
+/**
+ * Live bytes of a category
+ *
+ * @param category  MEM_* category
+ * @return          Bytes currently allocated
+ */
+long mem_live(int category) {
+    return __atomic_load_n(&live_bytes[category], __ATOMIC_RELAXED);
+}
+
+/**
+ * Peak bytes of a category
+ *
+ * @param category  MEM_* category
+ * @return          Largest number of bytes allocated at once
+ */
+long mem_peak(int category) {
+    return __atomic_load_n(&peak_bytes[category], __ATOMIC_RELAXED);
+}
+
+/**
+ * Resident set size of the process, from /proc/self/status
+ *
+ * @param peak  Receives the peak resident size (VmHWM) in bytes
+ * @return      Current resident size (VmRSS) in bytes, -1 if unavailable
+ */
+long mem_rss(long* peak) {
+    *peak = -1;
+    FILE* file = fopen("/proc/self/status", "r");
+    if (!file) return -1;
+
+    char text[4096];
+    size_t n = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    text[n] = '\0';
+
+    *peak = status_field(text, "VmHWM:");
+    return status_field(text, "VmRSS:");
+}
+
+/**
+ * Writes the accounting as "mem-<category>;live;peak" rows (bytes), then
+ * "rss;current;peak" (-1 where /proc is not available)
+ *
+ * @param out  Output buffer
+ */
+void mem_write(OutBuffer* out) {
+    char tmp[128];
+    for (int c = 0; c < MEM_CATEGORIES; c++) {
+        snprintf(tmp, sizeof(tmp), "mem-%s;%ld;%ld\n", CATEGORY_NAMES[c], mem_live(c), mem_peak(c));
+        out_puts(out, tmp);
+    }
+    long peak;
+    long rss = mem_rss(&peak);
+    snprintf(tmp, sizeof(tmp), "rss;%ld;%ld\n", rss, peak);
+    out_puts(out, tmp);
+}
@@ -0,0 +1,105 @@
+/*
+ * memstats.h
+ *
+ * Memory accounting: live and peak bytes of each kind of structure, and the
+ * resident set size of the process, to size the machines running the jobs.
+ *
+ * Pooled objects (stations, identifiers, connections) are counted at their
+ * size when created and released with their pools. The other categories are
+ * allocated through mem_malloc / mem_free. Counters are updated atomically:
+ * worker threads allocate and release tasks too.
+ */
+
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <stddef.h>
+#include "output.h"
+
+/**
+ * Accounted categories
+ */
+#define MEM_STATIONS 0      // Station nodes of the tree
+#define MEM_NAMES 1         // Station identifiers
+#define MEM_CONNECTIONS 2   // Sections (adjacency lists)
+#define MEM_INPUT 3         // Input buffers (reader blocks, state buffer)
+#define MEM_THREADS 4       // Thread systems, task queues and tasks
+#define MEM_LEAK_TASKS 5    // Branch tasks of the parallel leak calculation
+#define MEM_CATEGORIES 6
+
+/**
+ * Counts bytes allocated (positive) or released (negative) in a category
+ *
+ * @param category  MEM_* category
+ * @param bytes     Change of the live bytes
+ */
+void mem_track(int category, long bytes);
+
+/**
+ * Releases every byte still counted in a category (pool released at once)
+ *
+ * @param category  MEM_* category
+ */
+void mem_clear(int category);
+
+/**
+ * malloc counted in a category
+ *
+ * @param category  MEM_* category
+ * @param size      Number of bytes
+ * @return          Allocated memory, NULL on failure (nothing counted)
+ */
+void* mem_malloc(int category, size_t size);
+
+/**
+ * calloc counted in a category
+ *
+ * @param category  MEM_* category
+ * @param count     Number of elements
+ * @param size      Size of an element
+ * @return          Zeroed memory (release with mem_free and count * size), NULL on failure
+ */
+void* mem_calloc(int category, size_t count, size_t size);
+
+/**
+ * free of memory obtained from mem_malloc or mem_calloc
+ *
+ * @param category  Category given to mem_malloc
+ * @param p         Memory to release (NULL is ignored)
+ * @param size      Size given to mem_malloc
+ */
+void mem_free(int category, void* p, size_t size);
+
+/**
+ * Live bytes of a category
+ *
+ * @param category  MEM_* category
+ * @return          Bytes currently allocated
+ */
+long mem_live(int category);
+
+/**
+ * Peak bytes of a category
+ *
+ * @param category  MEM_* category
+ * @return          Largest number of bytes allocated at once
+ */
+long mem_peak(int category);
+
+/**
+ * Resident set size of the process, from /proc/self/status
+ *
+ * @param peak  Receives the peak resident size (VmHWM) in bytes
+ * @return      Current resident size (VmRSS) in bytes, -1 if unavailable
+ */
+long mem_rss(long* peak);
+
+/**
+ * Writes the accounting as "mem-<category>;live;peak" rows (bytes), then
+ * "rss;current;peak" (-1 where /proc is not available)
+ *
+ * @param out  Output buffer
+ */
+void mem_write(OutBuffer* out);
+
+#endif /* MEMSTATS_H */
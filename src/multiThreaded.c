@@ -1,5 +1,7 @@
 #include "multiThreaded.h"
 #include <stdlib.h>
+#include "memstats.h"
+#include "trace.h"
 
 // Global timing variables for performance measurement
 clock_t thread_start, thread_stop;
@@ -15,6 +17,7 @@ pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
 void* doallTasks(void* arg) {
     NodeGroup* schedule = (NodeGroup*)arg;
     if (!schedule) return NULL;
+    if (trace_on) trace_event(TRACE_BEGIN, "worker", NULL, -1);
 
     // Safely detach all tasks under mutex protection
     pthread_mutex_lock(&schedule->mutex);
@@ -32,11 +35,12 @@ void* doallTasks(void* arg) {
             tsk->task(tsk->data);
         }
 
-        free(tsk);      // Allocated in addTaskInThreads
-        free(current);  // Free the node from the queue
+        mem_free(MEM_THREADS, tsk, sizeof(Task));       // Allocated in addTaskInThreads
+        mem_free(MEM_THREADS, current, sizeof(Node));   // Free the node from the queue
         current = next;
     }
 
+    if (trace_on) trace_event(TRACE_END, "worker", NULL, -1);
     return NULL;
 }
 
@@ -59,7 +63,7 @@ int initNodeGroup(NodeGroup* ng) {
  * @return Pointer to the new Threads system, or NULL on failure
  */
 Threads* setupThreads(void) {
-    Threads* newThreads = malloc(sizeof(Threads));
+    Threads* newThreads = mem_malloc(MEM_THREADS, sizeof(Threads));
     if (!newThreads) return NULL;
     newThreads->doall = doallTasks;
     newThreads->error_count = 0;
@@ -68,7 +72,7 @@ Threads* setupThreads(void) {
         newThreads->occupency[i] = 0;
         if (initNodeGroup(&newThreads->scheduledTasks[i]) != 0) {
             for (int j = 0; j < i; j++) cleanupNodeGroup(&newThreads->scheduledTasks[j]);
-            free(newThreads);
+            mem_free(MEM_THREADS, newThreads, sizeof(Threads));
             return NULL;
         }
     }
@@ -85,7 +89,7 @@ Threads* setupThreads(void) {
 int addTaskToGroup(NodeGroup* g, Task* task) {
     if (!g || !task) return -1;
 
-    Node* n = malloc(sizeof(Node));
+    Node* n = mem_malloc(MEM_THREADS, sizeof(Node));
     if (!n) return -1;
 
     n->content = task;
@@ -122,7 +126,7 @@ int addTaskInThreads(Threads* t, void (*task)(void* param), void* data) {
         }
     }
 
-    Task* ntsk = malloc(sizeof(Task));
+    Task* ntsk = mem_malloc(MEM_THREADS, sizeof(Task));
     if (!ntsk) {
         pthread_mutex_unlock(&global_mutex);
         return -1;
@@ -132,7 +136,7 @@ int addTaskInThreads(Threads* t, void (*task)(void* param), void* data) {
     ntsk->data = data;
 
     if (addTaskToGroup(&t->scheduledTasks[slot], ntsk) != 0) {
-        free(ntsk);
+        mem_free(MEM_THREADS, ntsk, sizeof(Task));
         pthread_mutex_unlock(&global_mutex);
         return -1;
     }
@@ -181,7 +185,7 @@ int handleThreads(Threads* t) {
 int addContent(NodeGroup* ng, void* content) {
     if (!ng) return -1;
 
-    Node* n = malloc(sizeof(Node));
+    Node* n = mem_malloc(MEM_THREADS, sizeof(Node));
     if (!n) return -1;
 
     n->content = content;
@@ -212,7 +216,7 @@ void cleanupNodeGroup(NodeGroup* ng) {
     // Free the nodes (but not their content - caller handles that)
     while (current) {
         Node* next = current->next;
-        free(current);
+        mem_free(MEM_THREADS, current, sizeof(Node));
         current = next;
     }
 
@@ -229,5 +233,94 @@ void cleanupThreads(Threads* t) {
     for (int i = 0; i < maxthreads; i++) {
         cleanupNodeGroup(&t->scheduledTasks[i]);
     }
-    free(t);
-}
\ No newline at end of file
+    mem_free(MEM_THREADS, t, sizeof(Threads));
+}
+
+/**
+ * Initialize an empty bounded queue
+ *
+ * @param q Queue to initialize
+ * @param capacity Maximum number of queued items
+ * @return 0 on success, -1 on failure
+ */
+int initBoundedQueue(BoundedQueue* q, int capacity) {
+    if (!q || capacity < 1) return -1;
+    q->items = mem_malloc(MEM_THREADS, capacity * sizeof(void*));
+    if (!q->items) return -1;
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+/**
+ * Append an item, waiting while the queue is full
+ *
+ * @param q Queue
+ * @param item Item to add (not NULL)
+ * @return 0 on success, -1 if the queue is closed
+ */
+int pushBoundedQueue(BoundedQueue* q, void* item) {
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == q->capacity && !q->closed) pthread_cond_wait(&q->not_full, &q->mutex);
+    if (q->closed) {
+        pthread_mutex_unlock(&q->mutex);
+        return -1;
+    }
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
+/**
+ * Remove the oldest item, waiting while the queue is empty
+ *
+ * @param q Queue
+ * @return Oldest item, NULL once the queue is closed and empty
+ */
+void* popBoundedQueue(BoundedQueue* q) {
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == 0 && !q->closed) pthread_cond_wait(&q->not_empty, &q->mutex);
+    void* item = NULL;
+    if (q->count > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return item;
+}
+
+/**
+ * Close a queue: waiting consumers get NULL once the remaining items are taken
+ *
+ * @param q Queue
+ */
+void closeBoundedQueue(BoundedQueue* q) {
+    pthread_mutex_lock(&q->mutex);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+/**
+ * Clean up a bounded queue (its items are not freed)
+ *
+ * @param q Queue
+ */
+void cleanupBoundedQueue(BoundedQueue* q) {
+    if (!q || !q->items) return;
+    mem_free(MEM_THREADS, q->items, q->capacity * sizeof(void*));
+    q->items = NULL;
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
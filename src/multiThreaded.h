@@ -34,6 +34,21 @@ typedef struct {
     pthread_mutex_t mutex;
 } NodeGroup;
 
+/**
+ * Bounded FIFO queue handing items from one thread to another
+ * Producers wait while it is full, consumers while it is empty
+ */
+typedef struct {
+    void** items;            // Ring buffer
+    int capacity;            // Maximum number of items
+    int head;                // Index of the oldest item
+    int count;               // Items queued
+    int closed;              // Set once no more items will be pushed
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} BoundedQueue;
+
 /**
  * Task structure for thread execution
  */
@@ -117,4 +132,39 @@ void cleanupThreads(Threads* t);
  */
 int addContent(NodeGroup* ng, void* content);
 
+/**
+ * Initialize an empty bounded queue
+ * @param q Queue to initialize
+ * @param capacity Maximum number of queued items
+ * @return 0 on success, -1 on failure
+ */
+int initBoundedQueue(BoundedQueue* q, int capacity);
+
+/**
+ * Append an item, waiting while the queue is full
+ * @param q Queue
+ * @param item Item to add (not NULL)
+ * @return 0 on success, -1 if the queue is closed
+ */
+int pushBoundedQueue(BoundedQueue* q, void* item);
+
+/**
+ * Remove the oldest item, waiting while the queue is empty
+ * @param q Queue
+ * @return Oldest item, NULL once the queue is closed and empty
+ */
+void* popBoundedQueue(BoundedQueue* q);
+
+/**
+ * Close a queue: waiting consumers get NULL once the remaining items are taken
+ * @param q Queue
+ */
+void closeBoundedQueue(BoundedQueue* q);
+
+/**
+ * Clean up a bounded queue (its items are not freed)
+ * @param q Queue
+ */
+void cleanupBoundedQueue(BoundedQueue* q);
+
 #endif /* MULTITHREADED_H */
\ No newline at end of file
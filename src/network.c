@@ -0,0 +1,540 @@
+/*
+ * network.c
+ *
+ * Loading of the hydraulic network from the 5-column data file:
+ * facility;upstream;downstream;volume;leak%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "network.h"
+#include "avl.h"
+#include "state.h"
+#include "spill.h"
+#include "reader.h"
+#include "columnar.h"
+#include "upstream.h"
+#include "memstats.h"
+#include "pipeline.h"
+#include "rowindex.h"
+
+// Progress display interval
+#ifndef PROGRESS_INTERVAL
+#define PROGRESS_INTERVAL 100000L
+#endif
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Removes whitespace at the beginning and end of string
+ * @param str String to trim
+ * @return Pointer to trimmed string
+ */
+static char* trim_whitespace(char* str) {
+    if (!str) return NULL;
+    // Move to first non-whitespace character
+    while (*str && (*str == ' ' || *str == '\t')) {
+        str++;
+    }
+    if (*str == '\0') return str;
+    // Remove trailing whitespace
+    char* end = str + strlen(str) - 1;
+    while (end > str && (*end == ' ' || *end == '\t')) {
+        *end = '\0';
+        end--;
+    }
+    return str;
+}
+
+/**
+ * Finds a station or creates it with null volumes
+ *
+ * @param counted  Whether a created station counts as a graph station
+ */
+static Station* get_or_create(Network* net, char* name, int counted) {
+    Station* s = find_station(net->root, name);
+    if (!s) {
+        net->root = insert_station(net->root, name, 0, 0, 0);
+        s = find_station(net->root, name);
+        if (counted) net->station_count++;
+    }
+    return s;
+}
+
+/**
+ * Adds a section, recording it in the reverse index when it is new
+ */
+static AdjNode* connect(Network* net, Station* pa, Station* ch, double leak, Station* factory) {
+    int before = pa->nb_children;
+    AdjNode* edge = add_connection(pa, ch, leak, factory);
+    if (net->reverse && pa->nb_children != before && reverse_add(net->reverse, pa, edge) != 0) {
+        fprintf(stderr, "Error: reverse index allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return edge;
+}
+
+/**
+ * Graph part of a resolved row: connection and tracked facility volumes
+ * Stations are only reached through the resolved pointers, never through the tree
+ */
+static void link_graph_row(Network* net, char* cols[5], const LoadSpec* spec, const RowStations* rs) {
+    Station* pa = rs->upstream;
+    Station* ch = rs->downstream;
+
+    // Volumes come from the histogram aggregates when both are built
+    int track_volumes = !(spec->flags & LOAD_HISTO);
+
+    // Create connections between stations
+    if (pa && ch) {
+        double leak = (cols[4] ? atof(cols[4]) : 0.0);  // Leak %
+
+        // Determine facility associated with section
+        Station* factory = NULL;
+        if (cols[0]) {
+            // Explicitly mentioned facility
+            factory = rs->factory;
+        } else {
+            // Implicit facility based on section type
+            if (cols[3]) {
+                factory = ch;  // Source→facility: facility is downstream
+            } else {
+                factory = pa;  // Facility→storage: facility is upstream
+            }
+        }
+
+        // Add connection (source sections remember their volume for later updates)
+        AdjNode* edge = connect(net, pa, ch, leak, factory);
+        net->connection_count++;
+        if (cols[3] && edge->volume == 0) edge->volume = atol(cols[3]);
+
+        // Update actual volume for source→facility sections
+        if (track_volumes && cols[3] && !cols[0]) {
+            double vol = atof(cols[3]);
+            double real_vol = vol * (1.0 - leak / 100.0);
+
+            if (spec->facility && strcmp(ch->name, spec->facility) == 0) {
+                ch->real_qty += (long)real_vol;
+            }
+        }
+    }
+
+    // Update facility capacities
+    if (track_volumes && cols[1] && !cols[2] && cols[3] && pa) {
+        pa->capacity += atol(cols[3]);
+        net->capacity_count++;
+    }
+}
+
+/**
+ * Volume left after the leak of a section, rounded like the histogram aggregates
+ */
+static long real_volume(long vol, double leak) {
+    return (long)(vol * (1.0 - (leak / 100.0)));
+}
+
+/**
+ * Loads a binary state file through a large stdio buffer
+ */
+static int load_state(Network* net, const char* path, const LoadSpec* spec) {
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+
+    // Reading optimization
+    const size_t BUF_SIZE = 32 * 1024 * 1024; // 32 MB buffer
+    char* big_buffer = mem_malloc(MEM_INPUT, BUF_SIZE);
+    if (big_buffer) setvbuf(file, big_buffer, _IOFBF, BUF_SIZE);
+
+    int status = state_read(net, file, spec);
+    fclose(file);
+    mem_free(MEM_INPUT, big_buffer, BUF_SIZE);
+    return status;
+}
+
+/**
+ * Reads the rows of a data file, state file or columnar file
+ */
+static int load_rows(Network* net, const char* path, const LoadSpec* spec) {
+    // Binary state written by the "update" mode (not read from pipes)
+    if (strcmp(path, READER_STDIN) != 0) {
+        FILE* file = fopen(path, "r");
+        if (!file) return -1;
+        int is_state = state_detect(file);
+        int is_columnar = !is_state && columnar_detect(file);
+        fclose(file);
+        if (is_state) return load_state(net, path, spec);
+        if (is_columnar) {
+            // Columnar files are read without parsing, for histograms only
+            if (spec->flags != LOAD_HISTO) {
+                fprintf(stderr, "Error: columnar files only serve the histogram modes\n");
+                return -1;
+            }
+            return columnar_load_histogram(net, path, spec->histo_mode);
+        }
+    }
+
+    // A facility listed in its index is read without scanning the file
+    if ((spec->flags & LOAD_FILTER) && spec->facility && spec->index && strcmp(path, READER_STDIN) != 0) {
+        int indexed = rowindex_load(net, path, spec->index, spec);
+        if (indexed <= 0) return indexed;
+    }
+
+    // Text input: blocks are read on a separate thread while lines are parsed
+    LineReader* reader = reader_open(path);
+    if (!reader) return -1;
+
+    char line[1024];
+    long last_report_time = time(NULL);
+    int status = 0;
+
+    // Pipelined ingest: rows are resolved and linked on two more threads
+    Pipeline* pipe = NULL;
+    if ((spec->flags & LOAD_PIPELINE) && !spec->spill) {
+        pipe = pipeline_start(net, spec);
+        if (!pipe) fprintf(stderr, "Warning: pipelined ingest unavailable, rows are loaded serially\n");
+    }
+
+    // Read and process file
+    while (reader_gets(reader, line, sizeof(line))) {
+        net->line_count++;
+
+        // Periodic progress display
+        time_t current_time = time(NULL);
+        if (net->line_count % PROGRESS_INTERVAL == 0 || current_time > last_report_time) {
+            fprintf(stderr, "Lines processed: %ld...\r", net->line_count);
+            fflush(stderr);
+            last_report_time = current_time;
+        }
+
+        // Lines without the facility name cannot name it in a column
+        if ((spec->flags & LOAD_FILTER) && spec->facility && !strstr(line, spec->facility)) continue;
+
+        if (pipe) {
+            pipeline_push_line(pipe, line);
+            continue;
+        }
+
+        char* cols[5];
+        if (split_columns(line, cols) != 0 || !network_row_wanted(cols, spec)) continue;
+        network_add_row(net, cols, spec);
+
+        // Histogram over budget: write it as a sorted run and start a new one
+        if (spec->spill && tree_memory() > spec->spill->limit) {
+            if (spill_tree(spec->spill, net->root) != 0) {
+                status = -1;
+                break;
+            }
+            release_station_pools();
+            net->root = NULL;
+        }
+    }
+
+    if (pipe) pipeline_finish(pipe);
+    fprintf(stderr, "Lines processed: %ld\n", net->line_count);
+    if (reader_close(reader) != 0) status = -1;
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Splits a line in place into its 5 columns
+ *
+ * @param line  Line to split (modified)
+ * @param cols  Array receiving the 5 columns
+ * @return      0 if the line holds data, -1 if it must be skipped
+ */
+int split_columns(char* line, char* cols[5]) {
+    // Clean line
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strlen(line) < 2) return -1;
+
+    // Split by semicolons (up to 5 columns)
+    for (int i = 0; i < 5; i++) cols[i] = NULL;
+    char* p = line;
+    int c = 0;
+    cols[c++] = p;
+
+    while (*p && c < 5) {
+        if (*p == ';') {
+            *p = '\0';
+            cols[c++] = p + 1;
+        }
+        p++;
+    }
+
+    // Clean fields
+    for (int i = 0; i < c; i++) {
+        if (cols[i]) {
+            cols[i] = trim_whitespace(cols[i]);
+            if (cols[i][0] == '-' && cols[i][1] == '\0') {
+                cols[i] = NULL;
+            } else if (cols[i][0] == '\0') {
+                cols[i] = NULL;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Computes the histogram contribution of a split row
+ * A row adds to at most one station: capacity rows to the facility,
+ * volume rows to their downstream station
+ *
+ * @param cols  The 5 columns of the row
+ * @param mode  HISTO_* aggregates
+ * @param v     Receives the station and the amounts to add
+ * @return      1 if the row contributes, 0 otherwise
+ */
+int histo_row_value(char* cols[5], int mode, HistoValue* v) {
+    v->capacity = 0;
+    v->consumption = 0;
+    v->real_qty = 0;
+
+    if (cols[1] && !cols[2] && cols[3]) {
+        // "max" mode or "all" mode: maximum facility capacities
+        if (mode != HISTO_MAX && mode != HISTO_ALL) return 0;
+        v->name = cols[1];
+        v->capacity = atol(cols[3]);
+        return 1;
+    }
+
+    if (!cols[2] || !cols[3] || mode == HISTO_MAX) return 0;
+    long vol = atol(cols[3]);
+    v->name = cols[2];
+
+    if (mode == HISTO_SRC || mode == HISTO_ALL) {
+        // "src" mode or "all" mode: captured volumes
+        v->consumption = vol;
+    }
+
+    if (mode == HISTO_REAL || mode == HISTO_ALL) {
+        // "real" mode or "all" mode: actual volumes
+        long real = vol;
+        if (cols[4]) {
+            // Apply leak %
+            double p_leak = atof(cols[4]);
+            real = (long)(vol * (1.0 - (p_leak / 100.0)));
+        }
+        v->real_qty = real;
+    }
+    return 1;
+}
+
+/**
+ * Initializes an empty network
+ *
+ * @param net  Network to initialize
+ */
+void network_init(Network* net) {
+    net->root = NULL;
+    net->line_count = 0;
+    net->station_count = 0;
+    net->connection_count = 0;
+    net->capacity_count = 0;
+    net->reverse = NULL;
+}
+
+/**
+ * Tells whether a split row is loaded (LOAD_FILTER)
+ * Every section of a facility names it: in column 0, or in column 1 or 2 for
+ * the facility -> storage and source -> facility sections; so are its
+ * capacity rows. The rows naming the facility in one of the first three
+ * columns therefore hold its whole network, and nothing else is needed
+ * for its leak calculation
+ *
+ * @param cols  The 5 columns of the row
+ * @param spec  What to build
+ * @return      1 if the row is loaded, 0 if it is skipped
+ */
+int network_row_wanted(char* cols[5], const LoadSpec* spec) {
+    if (!(spec->flags & LOAD_FILTER) || !spec->facility) return 1;
+    for (int i = 0; i < 3; i++) {
+        if (cols[i] && strcmp(cols[i], spec->facility) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Finds or creates the stations a split row refers to (first half of
+ * network_add_row): only the tree is read and modified
+ *
+ * @param net   Network
+ * @param cols  The 5 columns of the row
+ * @param spec  What to build
+ * @param rs    Receives the stations
+ */
+void network_resolve_row(Network* net, char* cols[5], const LoadSpec* spec, RowStations* rs) {
+    rs->upstream = NULL;
+    rs->downstream = NULL;
+    rs->factory = NULL;
+    rs->histo = NULL;
+
+    if (spec->flags & LOAD_GRAPH) {
+        if (cols[1]) rs->upstream = get_or_create(net, cols[1], 1);
+        if (cols[2]) rs->downstream = get_or_create(net, cols[2], 1);
+        if (rs->upstream && rs->downstream && cols[0]) rs->factory = get_or_create(net, cols[0], 1);
+    }
+    if ((spec->flags & LOAD_HISTO) && histo_row_value(cols, spec->histo_mode, &rs->value)) {
+        rs->histo = get_or_create(net, rs->value.name, 0);
+    }
+}
+
+/**
+ * Applies a resolved row (second half of network_add_row): sections and
+ * volumes of the resolved stations, without reading the tree
+ *
+ * @param net   Network
+ * @param cols  The 5 columns of the row
+ * @param spec  What to build
+ * @param rs    Stations found by network_resolve_row
+ */
+void network_link_row(Network* net, char* cols[5], const LoadSpec* spec, const RowStations* rs) {
+    if (spec->flags & LOAD_GRAPH) link_graph_row(net, cols, spec, rs);
+    if (rs->histo) {
+        rs->histo->capacity += rs->value.capacity;
+        rs->histo->consumption += rs->value.consumption;
+        rs->histo->real_qty += rs->value.real_qty;
+    }
+}
+
+/**
+ * Applies one split row to the network
+ *
+ * @param net   Network
+ * @param cols  The 5 columns of the row
+ * @param spec  What to build
+ */
+void network_add_row(Network* net, char* cols[5], const LoadSpec* spec) {
+    RowStations rs;
+    network_resolve_row(net, cols, spec, &rs);
+    network_link_row(net, cols, spec, &rs);
+}
+
+/**
+ * Reads a whole data file into the network
+ * Binary state files (see state.h) and, for histograms, columnar files
+ * (see columnar.h) are recognized and loaded directly; text
+ * input is read through a LineReader (standard input, gzip with ZLIB=1).
+ * With LOAD_RELAYOUT, the graph is then laid out in traversal order (see
+ * relayout_tree); the reverse index is built last
+ *
+ * @param net   Network
+ * @param path  Path of the data file or state file, "-" for the standard input
+ * @param spec  What to build
+ * @return      0 on success, -1 if the file cannot be opened or read
+ */
+int network_load(Network* net, const char* path, const LoadSpec* spec) {
+    int status = load_rows(net, path, spec);
+    if (status != 0) return status;
+    if ((spec->flags & LOAD_GRAPH) && (spec->flags & LOAD_RELAYOUT)) net->root = relayout_tree(net->root);
+
+    // Sections added later (deltas) are recorded one by one
+    if ((spec->flags & LOAD_REVERSE) && !net->reverse) {
+        net->reverse = reverse_new();
+        if (!net->reverse || reverse_build(net->reverse, net->root) != 0) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Releases the memory of a network
+ * Stations come from process-wide pools: the trees of every other network
+ * are released too (see release_station_pools)
+ *
+ * @param net  Network to free
+ */
+void network_free(Network* net) {
+    release_station_pools();
+    net->root = NULL;
+    reverse_free(net->reverse);
+    net->reverse = NULL;
+}
+
+/**
+ * Applies one delta row to a network holding the graph and every aggregate
+ *
+ * @param net    Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL)
+ * @param cols   The 5 columns of the row
+ * @param stats  Counters updated with the effect of the row
+ */
+void network_apply_row(Network* net, char* cols[5], DeltaStats* stats) {
+    stats->rows++;
+
+    // Capacity row: the new value replaces the previous one
+    if (cols[1] && !cols[2]) {
+        if (cols[3]) {
+            Station* s = get_or_create(net, cols[1], 1);
+            s->capacity = atol(cols[3]);
+            stats->updated++;
+        }
+        return;
+    }
+    if (!cols[2]) return;
+
+    Station* ch = get_or_create(net, cols[2], 1);
+    long vol = cols[3] ? atol(cols[3]) : 0;
+    double leak = cols[4] ? atof(cols[4]) : 0.0;
+
+    if (!cols[1]) {
+        // No upstream station: aggregates only
+        ch->consumption += vol;
+        ch->real_qty += real_volume(vol, leak);
+        stats->added++;
+        return;
+    }
+
+    Station* pa = get_or_create(net, cols[1], 1);
+    Station* factory;
+    if (cols[0]) factory = get_or_create(net, cols[0], 1);
+    else factory = cols[3] ? ch : pa;
+
+    // A section already in the network is a changed row
+    AdjNode* edge = pa->children;
+    while (edge && !(edge->target == ch && edge->factory == factory)) edge = edge->next;
+
+    if (edge) {
+        // Withdraw the contribution of the previous version of the row
+        ch->consumption -= edge->volume;
+        ch->real_qty -= real_volume(edge->volume, edge->leak_perc);
+        edge->leak_perc = leak;
+        stats->updated++;
+    } else {
+        edge = connect(net, pa, ch, leak, factory);
+        net->connection_count++;
+        stats->added++;
+    }
+
+    edge->volume = vol;
+    ch->consumption += vol;
+    ch->real_qty += real_volume(vol, leak);
+}
+
+/**
+ * Applies a whole delta file to a network
+ *
+ * @param net    Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL)
+ * @param path   Delta file, in the 5-column format of the data file
+ * @param stats  Counters updated with the effect of the rows
+ * @return       0 on success, -1 if the file cannot be opened
+ */
+int network_apply_delta(Network* net, const char* path, DeltaStats* stats) {
+    LineReader* reader = reader_open(path);
+    if (!reader) return -1;
+
+    char line[1024];
+    while (reader_gets(reader, line, sizeof(line))) {
+        char* cols[5];
+        if (split_columns(line, cols) != 0) continue;
+        network_apply_row(net, cols, stats);
+    }
+
+    return reader_close(reader);
+}
@@ -0,0 +1,208 @@
+/*
+ * network.h
+ *
+ * Loading of the hydraulic network from the 5-column data file.
+ * Rows are aggregated per station (histograms) and/or turned into
+ * graph connections (leak calculations).
+ */
+
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include <stdio.h>
+#include "structs.h"
+
+/**
+ * What a load must build
+ */
+#define LOAD_HISTO 1   // Per-station aggregates (capacity, consumption, real_qty)
+#define LOAD_GRAPH 2   // Stations and connections of the flow graph
+#define LOAD_REVERSE 4 // Reverse adjacency index of the graph (see upstream.h)
+#define LOAD_RELAYOUT 8 // Graph laid out in traversal order, for repeated queries (see relayout_tree)
+#define LOAD_PIPELINE 16 // Text rows split, resolved and linked on separate threads (see pipeline.h)
+#define LOAD_FILTER 32   // With LOAD_GRAPH only: keep the text rows naming spec->facility
+
+/**
+ * Histogram aggregates (same codes as the histogram modes)
+ */
+#define HISTO_MAX  1
+#define HISTO_SRC  2
+#define HISTO_REAL 3
+#define HISTO_ALL  4
+
+/**
+ * Description of a load
+ */
+typedef struct {
+    int flags;             // LOAD_* bits
+    int histo_mode;        // HISTO_* aggregates built with LOAD_HISTO
+    const char* facility;  // Facility whose volumes are tracked with LOAD_GRAPH only
+    struct Spill* spill;   // Receives the histogram when it outgrows its budget (NULL = unbounded)
+    const char* index;     // Row index read instead of the text with LOAD_FILTER (NULL = none, see rowindex.h)
+} LoadSpec;
+
+/**
+ * Amounts a row adds to the histogram aggregates of one station
+ */
+typedef struct {
+    char* name;         // Station receiving the amounts
+    long capacity;      // Capacity to add
+    long consumption;   // Captured volume to add
+    long real_qty;      // Actual volume to add
+} HistoValue;
+
+/**
+ * Stations a row refers to, found before the row is applied
+ */
+typedef struct {
+    Station* upstream;    // Column 1 of a graph row (NULL if none)
+    Station* downstream;  // Column 2 of a graph row (NULL if none)
+    Station* factory;     // Explicit facility of a section (NULL if none)
+    Station* histo;       // Station receiving histogram amounts (NULL if none)
+    HistoValue value;     // Amounts added to histo
+} RowStations;
+
+/**
+ * Loaded network and its statistics
+ */
+typedef struct {
+    Station* root;          // AVL tree of stations
+    long line_count;        // Lines read
+    long station_count;     // Stations created by graph rows
+    long connection_count;  // Graph rows with both ends
+    long capacity_count;    // Capacity rows applied to the graph
+    struct ReverseIndex* reverse;  // Arriving sections, built with LOAD_REVERSE (NULL otherwise)
+} Network;
+
+/**
+ * Effect of delta rows applied to a network
+ */
+typedef struct {
+    long rows;     // Rows applied
+    long added;    // New sections or volumes
+    long updated;  // Sections and capacities replaced
+} DeltaStats;
+
+/**
+ * Splits a line in place into its 5 columns
+ * Missing fields and "-" are returned as NULL
+ *
+ * @param line  Line to split (modified)
+ * @param cols  Array receiving the 5 columns
+ * @return      0 if the line holds data, -1 if it must be skipped
+ */
+int split_columns(char* line, char* cols[5]);
+
+/**
+ * Computes the histogram contribution of a split row
+ * A row adds to at most one station: capacity rows to the facility,
+ * volume rows to their downstream station
+ *
+ * @param cols  The 5 columns of the row
+ * @param mode  HISTO_* aggregates
+ * @param v     Receives the station and the amounts to add
+ * @return      1 if the row contributes, 0 otherwise
+ */
+int histo_row_value(char* cols[5], int mode, HistoValue* v);
+
+/**
+ * Initializes an empty network
+ *
+ * @param net  Network to initialize
+ */
+void network_init(Network* net);
+
+/**
+ * Tells whether a split row is loaded (LOAD_FILTER)
+ * Every section of a facility names it: in column 0, or in column 1 or 2 for
+ * the facility -> storage and source -> facility sections; so are its
+ * capacity rows. The rows naming the facility in one of the first three
+ * columns therefore hold its whole network, and nothing else is needed
+ * for its leak calculation
+ *
+ * @param cols  The 5 columns of the row
+ * @param spec  What to build
+ * @return      1 if the row is loaded, 0 if it is skipped
+ */
+int network_row_wanted(char* cols[5], const LoadSpec* spec);
+
+/**
+ * Finds or creates the stations a split row refers to (first half of
+ * network_add_row): only the tree is read and modified
+ *
+ * @param net   Network
+ * @param cols  The 5 columns of the row
+ * @param spec  What to build
+ * @param rs    Receives the stations
+ */
+void network_resolve_row(Network* net, char* cols[5], const LoadSpec* spec, RowStations* rs);
+
+/**
+ * Applies a resolved row (second half of network_add_row): sections and
+ * volumes of the resolved stations, without reading the tree
+ * The two halves may run on different threads, in the same row order
+ *
+ * @param net   Network
+ * @param cols  The 5 columns of the row
+ * @param spec  What to build
+ * @param rs    Stations found by network_resolve_row
+ */
+void network_link_row(Network* net, char* cols[5], const LoadSpec* spec, const RowStations* rs);
+
+/**
+ * Applies one split row to the network
+ *
+ * @param net   Network
+ * @param cols  The 5 columns of the row
+ * @param spec  What to build
+ */
+void network_add_row(Network* net, char* cols[5], const LoadSpec* spec);
+
+/**
+ * Reads a whole data file into the network
+ * Binary state files (see state.h) and, for histograms, columnar files
+ * (see columnar.h) are recognized and loaded directly; text
+ * input is read through a LineReader (standard input, gzip with ZLIB=1).
+ * With LOAD_FILTER and spec->index, the facility's rows are read through
+ * the index when it lists them (see rowindex.h).
+ * With LOAD_RELAYOUT, the graph is then laid out in traversal order (see
+ * relayout_tree); the reverse index is built last
+ *
+ * @param net   Network
+ * @param path  Path of the data file or state file, "-" for the standard input
+ * @param spec  What to build
+ * @return      0 on success, -1 if the file cannot be opened or read
+ */
+int network_load(Network* net, const char* path, const LoadSpec* spec);
+
+/**
+ * Releases the memory of a network
+ * Stations come from process-wide pools: the trees of every other network
+ * are released too (see release_station_pools)
+ *
+ * @param net  Network to free
+ */
+void network_free(Network* net);
+
+/**
+ * Applies one delta row to a network holding the graph and every aggregate
+ * A row whose section already exists replaces it (leak and volume), a capacity
+ * row replaces the capacity of its station, any other row is added
+ *
+ * @param net    Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL)
+ * @param cols   The 5 columns of the row
+ * @param stats  Counters updated with the effect of the row
+ */
+void network_apply_row(Network* net, char* cols[5], DeltaStats* stats);
+
+/**
+ * Applies a whole delta file to a network
+ *
+ * @param net    Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL)
+ * @param path   Delta file, in the 5-column format of the data file ("-" for stdin)
+ * @param stats  Counters updated with the effect of the rows
+ * @return       0 on success, -1 if the file cannot be opened or read
+ */
+int network_apply_delta(Network* net, const char* path, DeltaStats* stats);
+
+#endif /* NETWORK_H */
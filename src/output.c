@@ -0,0 +1,407 @@
+/*
+ * output.c
+ *
+ * Buffered CSV output for histogram tables.
+ * Values are printed with a fixed-precision formatter instead of fprintf,
+ * and the buffer is handed to write(2) in large blocks.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "output.h"
+
+/**
+ * Largest magnitude (in thousandths) for which value/1000.0 printed with
+ * "%.6f" is exactly the three decimals followed by "000": below 2^32 units
+ * the double rounding error stays under half of the sixth decimal.
+ */
+#define FAST_FORMAT_LIMIT 4294967296000L
+
+/**
+ * Maximum depth of the traversal stack (AVL height stays far below it)
+ */
+#define TRAVERSAL_DEPTH 128
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Grows a memory buffer so that n more bytes fit
+ */
+static void out_grow(OutBuffer* out, size_t n) {
+    size_t cap = out->cap * 2;
+    if (cap < out->len + n) cap = out->len + n;
+    char* data = realloc(out->data, cap);
+    if (!data) {
+        // Keep the current content and drop the new bytes
+        out->error = 1;
+        return;
+    }
+    out->data = data;
+    out->cap = cap;
+}
+
+/**
+ * Makes room for n more bytes in the buffer
+ */
+static inline void out_reserve(OutBuffer* out, size_t n) {
+    if (out->len + n <= out->cap) return;
+    if (out->fd < 0) {
+        out_grow(out, n);
+    } else {
+        out_flush(out);
+    }
+}
+
+/**
+ * Appends a single character
+ */
+static inline void out_char(OutBuffer* out, char c) {
+    out_reserve(out, 1);
+    if (out->len < out->cap) out->data[out->len++] = c;
+}
+
+/**
+ * Appends a "name;" prefix
+ */
+static inline void out_name(OutBuffer* out, const char* name) {
+    out_write(out, name, strlen(name));
+    out_char(out, ';');
+}
+
+/**
+ * Row writer of the "max" mode
+ */
+static void write_row_max(OutBuffer* out, const Station* s) {
+    if (s->capacity <= 0) return;
+    out_name(out, s->name);
+    out_thousandths(out, s->capacity);
+    out_char(out, '\n');
+}
+
+/**
+ * Row writer of the "src" mode
+ */
+static void write_row_src(OutBuffer* out, const Station* s) {
+    if (s->consumption <= 0) return;
+    out_name(out, s->name);
+    out_thousandths(out, s->consumption);
+    out_char(out, '\n');
+}
+
+/**
+ * Row writer of the "real" mode
+ */
+static void write_row_real(OutBuffer* out, const Station* s) {
+    if (s->real_qty <= 0) return;
+    out_name(out, s->name);
+    out_thousandths(out, s->real_qty);
+    out_char(out, '\n');
+}
+
+/**
+ * Row writer of the "all" mode (facilities only)
+ */
+static void write_row_all(OutBuffer* out, const Station* s) {
+    if (s->capacity <= 0) return;
+    out_name(out, s->name);
+    out_thousandths(out, s->capacity);
+    out_char(out, ';');
+    out_thousandths(out, s->consumption);
+    out_char(out, ';');
+    out_thousandths(out, s->real_qty);
+    out_char(out, '\n');
+}
+
+/**
+ * Row filter of the "max" and "all" modes (facilities only)
+ */
+static int visible_max(const Station* s) {
+    return s->capacity > 0;
+}
+
+/**
+ * Row filter of the "src" mode
+ */
+static int visible_src(const Station* s) {
+    return s->consumption > 0;
+}
+
+/**
+ * Row filter of the "real" mode
+ */
+static int visible_real(const Station* s) {
+    return s->real_qty > 0;
+}
+
+/**
+ * Visitor of out_tree_rows: writes every station through the mode's writer
+ */
+typedef struct {
+    OutBuffer* out;
+    RowWriter writer;
+} WriteVisit;
+
+static void write_visited(Station* s, void* ctx) {
+    WriteVisit* v = (WriteVisit*)ctx;
+    v->writer(v->out, s);
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Writes a whole block to a file descriptor, retrying partial writes
+ *
+ * @param fd    Destination file descriptor
+ * @param data  Bytes to write
+ * @param len   Number of bytes
+ * @return      0 on success, -1 on failure
+ */
+int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Attaches a buffer to a file descriptor
+ *
+ * @param out  Buffer to initialize
+ * @param fd   Destination file descriptor
+ * @param cap  Buffer capacity in bytes
+ * @return     0 on success, -1 on allocation failure
+ */
+int out_open(OutBuffer* out, int fd, size_t cap) {
+    if (!out || cap < 64) return -1;
+    out->data = malloc(cap);
+    if (!out->data) return -1;
+    out->fd = fd;
+    out->len = 0;
+    out->cap = cap;
+    out->error = 0;
+    return 0;
+}
+
+/**
+ * Attaches a buffer to a stdio stream
+ *
+ * @param out     Buffer to initialize
+ * @param stream  Destination stream
+ * @return        0 on success, -1 on failure
+ */
+int out_open_stream(OutBuffer* out, FILE* stream) {
+    if (!stream) return -1;
+    fflush(stream);
+    return out_open(out, fileno(stream), OUT_BUFFER_SIZE);
+}
+
+/**
+ * Creates a growable in-memory buffer
+ *
+ * @param out  Buffer to initialize
+ * @param cap  Initial capacity in bytes
+ * @return     0 on success, -1 on allocation failure
+ */
+int out_open_memory(OutBuffer* out, size_t cap) {
+    return out_open(out, -1, cap);
+}
+
+/**
+ * Writes the buffered bytes to the file descriptor
+ *
+ * @param out  Buffer to flush
+ */
+void out_flush(OutBuffer* out) {
+    // Memory buffers keep their content
+    if (out->len == 0 || out->fd < 0) return;
+    if (write_all(out->fd, out->data, out->len) != 0) out->error = 1;
+    out->len = 0;
+}
+
+/**
+ * Flushes and releases a buffer
+ *
+ * @param out  Buffer to close
+ * @return     0 if every write succeeded, -1 otherwise
+ */
+int out_close(OutBuffer* out) {
+    out_flush(out);
+    free(out->data);
+    out->data = NULL;
+    out->cap = 0;
+    return out->error ? -1 : 0;
+}
+
+/**
+ * Appends raw bytes
+ *
+ * @param out  Buffer
+ * @param s    Bytes to append
+ * @param n    Number of bytes
+ */
+void out_write(OutBuffer* out, const char* s, size_t n) {
+    if (out->len + n > out->cap && out->fd < 0) {
+        out_grow(out, n);
+        if (out->len + n > out->cap) return;
+    } else if (out->len + n > out->cap) {
+        out_flush(out);
+        // Blocks larger than the buffer go straight to the descriptor
+        if (n > out->cap) {
+            if (write_all(out->fd, s, n) != 0) out->error = 1;
+            return;
+        }
+    }
+    memcpy(out->data + out->len, s, n);
+    out->len += n;
+}
+
+/**
+ * Appends a NUL-terminated string
+ */
+void out_puts(OutBuffer* out, const char* s) {
+    out_write(out, s, strlen(s));
+}
+
+/**
+ * Appends value/1000.0 formatted like printf("%.6f")
+ *
+ * @param out    Buffer
+ * @param value  Value in thousandths (internal units)
+ */
+void out_thousandths(OutBuffer* out, long value) {
+    char tmp[48];
+
+    if (value >= FAST_FORMAT_LIMIT || value <= -FAST_FORMAT_LIMIT) {
+        // Out of the exact range: let printf round the double
+        int n = snprintf(tmp, sizeof(tmp), "%.6f", value / 1000.0);
+        out_write(out, tmp, (size_t)n);
+        return;
+    }
+
+    // Build the digits backwards: "III.FFF000"
+    char* end = tmp + sizeof(tmp);
+    char* p = end;
+    unsigned long v = (value < 0) ? (unsigned long)(-value) : (unsigned long)value;
+    unsigned long frac = v % 1000;
+    unsigned long ip = v / 1000;
+
+    *--p = '0';
+    *--p = '0';
+    *--p = '0';
+    *--p = (char)('0' + frac % 10);
+    *--p = (char)('0' + (frac / 10) % 10);
+    *--p = (char)('0' + frac / 100);
+    *--p = '.';
+    do {
+        *--p = (char)('0' + ip % 10);
+        ip /= 10;
+    } while (ip > 0);
+    if (value < 0) *--p = '-';
+
+    out_write(out, p, (size_t)(end - p));
+}
+
+/**
+ * Resolves the row format of a mode
+ *
+ * @param mode  Data type ("max", "src", "real" or "all")
+ * @return      Row writer, NULL if the mode is unknown
+ */
+RowWriter row_writer_for_mode(const char* mode) {
+    if (!mode) return NULL;
+    if (strcmp(mode, "max") == 0) return write_row_max;
+    if (strcmp(mode, "src") == 0) return write_row_src;
+    if (strcmp(mode, "real") == 0) return write_row_real;
+    if (strcmp(mode, "all") == 0) return write_row_all;
+    return NULL;
+}
+
+/**
+ * Resolves the row filter of a mode: the stations its writer outputs
+ *
+ * @param mode  Data type ("max", "src", "real" or "all")
+ * @return      Row filter, NULL if the mode is unknown
+ */
+RowFilter row_filter_for_mode(const char* mode) {
+    if (!mode) return NULL;
+    if (strcmp(mode, "max") == 0) return visible_max;
+    if (strcmp(mode, "src") == 0) return visible_src;
+    if (strcmp(mode, "real") == 0) return visible_real;
+    if (strcmp(mode, "all") == 0) return visible_max;
+    return NULL;
+}
+
+/**
+ * Visits the stations of a tree in identifier order
+ * Uses an explicit stack instead of recursion
+ *
+ * @param root     Root of the tree
+ * @param visible  Row filter (NULL to visit every station)
+ * @param visit    Called on each station kept by the filter
+ * @param ctx      Passed to visit
+ */
+void tree_visit_rows(Station* root, RowFilter visible, RowVisitor visit, void* ctx) {
+    Station* stack[TRAVERSAL_DEPTH];
+    int top = 0;
+    Station* curr = root;
+
+    while (curr || top > 0) {
+        // Go down the left branch
+        while (curr) {
+            stack[top++] = curr;
+            curr = curr->left;
+        }
+        curr = stack[--top];
+        if (!visible || visible(curr)) visit(curr, ctx);
+        curr = curr->right;
+    }
+}
+
+/**
+ * Writes the rows of a tree in identifier order (see tree_visit_rows)
+ *
+ * @param out     Buffer
+ * @param root    Root of the tree
+ * @param writer  Row writer of the mode
+ */
+void out_tree_rows(OutBuffer* out, Station* root, RowWriter writer) {
+    WriteVisit v = { out, writer };
+    tree_visit_rows(root, NULL, write_visited, &v);
+}
+
+/**
+ * Writes station data to a CSV file according to the specified mode
+ *
+ * @param node    Root of the tree
+ * @param output  Output file
+ * @param mode    Data type ("max", "src", "real", or "all")
+ */
+void write_csv(Station* node, FILE* output, char* mode) {
+    RowWriter writer = row_writer_for_mode(mode);
+    if (!writer) return;
+
+    OutBuffer out;
+    if (out_open_stream(&out, output) != 0) {
+        fprintf(stderr, "Error: unable to allocate the output buffer\n");
+        return;
+    }
+    out_tree_rows(&out, node, writer);
+    if (out_close(&out) != 0) {
+        fprintf(stderr, "Error: write failed\n");
+    }
+}
@@ -0,0 +1,167 @@
+/*
+ * output.h
+ *
+ * Buffered CSV output for histogram tables.
+ * Rows are formatted into a large memory buffer flushed with write(2),
+ * and the per-mode row format is resolved once before the traversal.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "structs.h"
+
+/**
+ * Default size of the output buffer
+ */
+#define OUT_BUFFER_SIZE (4 * 1024 * 1024)
+
+/**
+ * Output buffer attached to a file descriptor
+ */
+typedef struct {
+    int fd;        // Destination file descriptor (-1 for a memory buffer)
+    char* data;    // Buffered bytes
+    size_t len;    // Number of buffered bytes
+    size_t cap;    // Buffer capacity
+    int error;     // Non-zero once a write failed
+} OutBuffer;
+
+/**
+ * Writes the CSV line of a station (nothing if it is not part of the mode)
+ */
+typedef void (*RowWriter)(OutBuffer* out, const Station* s);
+
+/**
+ * Tells whether a station is part of the output of a mode
+ */
+typedef int (*RowFilter)(const Station* s);
+
+/**
+ * Called on each station of a traversal
+ */
+typedef void (*RowVisitor)(Station* s, void* ctx);
+
+/**
+ * Writes a whole block to a file descriptor, retrying partial writes
+ *
+ * @param fd    Destination file descriptor
+ * @param data  Bytes to write
+ * @param len   Number of bytes
+ * @return      0 on success, -1 on failure
+ */
+int write_all(int fd, const char* data, size_t len);
+
+/**
+ * Attaches a buffer to a file descriptor
+ *
+ * @param out  Buffer to initialize
+ * @param fd   Destination file descriptor
+ * @param cap  Buffer capacity in bytes
+ * @return     0 on success, -1 on allocation failure
+ */
+int out_open(OutBuffer* out, int fd, size_t cap);
+
+/**
+ * Attaches a buffer to a stdio stream (pending stdio output is flushed first)
+ *
+ * @param out     Buffer to initialize
+ * @param stream  Destination stream
+ * @return        0 on success, -1 on failure
+ */
+int out_open_stream(OutBuffer* out, FILE* stream);
+
+/**
+ * Creates a growable in-memory buffer (fd = -1, never flushed)
+ *
+ * @param out  Buffer to initialize
+ * @param cap  Initial capacity in bytes
+ * @return     0 on success, -1 on allocation failure
+ */
+int out_open_memory(OutBuffer* out, size_t cap);
+
+/**
+ * Writes the buffered bytes to the file descriptor
+ *
+ * @param out  Buffer to flush
+ */
+void out_flush(OutBuffer* out);
+
+/**
+ * Flushes and releases a buffer (the descriptor stays open)
+ *
+ * @param out  Buffer to close
+ * @return     0 if every write succeeded, -1 otherwise
+ */
+int out_close(OutBuffer* out);
+
+/**
+ * Appends raw bytes
+ *
+ * @param out  Buffer
+ * @param s    Bytes to append
+ * @param n    Number of bytes
+ */
+void out_write(OutBuffer* out, const char* s, size_t n);
+
+/**
+ * Appends a NUL-terminated string
+ */
+void out_puts(OutBuffer* out, const char* s);
+
+/**
+ * Appends value/1000.0 formatted like printf("%.6f")
+ *
+ * @param out    Buffer
+ * @param value  Value in thousandths (internal units)
+ */
+void out_thousandths(OutBuffer* out, long value);
+
+/**
+ * Resolves the row format of a mode
+ *
+ * @param mode  Data type ("max", "src", "real" or "all")
+ * @return      Row writer, NULL if the mode is unknown
+ */
+RowWriter row_writer_for_mode(const char* mode);
+
+/**
+ * Resolves the row filter of a mode: the stations its writer outputs
+ * In "all" mode only stations with a positive capacity are written
+ *
+ * @param mode  Data type ("max", "src", "real" or "all")
+ * @return      Row filter, NULL if the mode is unknown
+ */
+RowFilter row_filter_for_mode(const char* mode);
+
+/**
+ * Visits the stations of a tree in identifier order (iterative in-order traversal)
+ *
+ * @param root     Root of the tree
+ * @param visible  Row filter (NULL to visit every station)
+ * @param visit    Called on each station kept by the filter
+ * @param ctx      Passed to visit
+ */
+void tree_visit_rows(Station* root, RowFilter visible, RowVisitor visit, void* ctx);
+
+/**
+ * Writes the rows of a tree in identifier order (see tree_visit_rows)
+ *
+ * @param out     Buffer
+ * @param root    Root of the tree
+ * @param writer  Row writer of the mode
+ */
+void out_tree_rows(OutBuffer* out, Station* root, RowWriter writer);
+
+/**
+ * Generates a CSV file from the tree data
+ *
+ * @param node    Root of the tree
+ * @param output  Output file
+ * @param mode    Data type ("max", "src", "real" or "all")
+ */
+void write_csv(Station* node, FILE* output, char* mode);
+
+#endif /* OUTPUT_H */
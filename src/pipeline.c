@@ -0,0 +1,180 @@
+/*
+ * pipeline.c
+ *
+ * Pipelined ingest of text rows (see pipeline.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pipeline.h"
+#include "multiThreaded.h"
+#include "memstats.h"
+
+/**
+ * Row of a batch
+ */
+typedef struct {
+    char* cols[5];     // Columns, split in the text of the batch
+    RowStations at;    // Stations of the row, set by the resolution stage
+} PipelineRow;
+
+/**
+ * Rows travelling together from stage to stage
+ */
+typedef struct {
+    long count;          // Rows
+    size_t used;         // Bytes of text used
+    char* text;          // Copies of the lines
+    PipelineRow* rows;   // Split rows
+} Batch;
+
+/**
+ * Stages and the queues between them
+ */
+struct Pipeline {
+    Network* net;
+    const LoadSpec* spec;
+    Batch batches[PIPELINE_BATCHES];
+    Batch* current;              // Batch being filled by the reading thread
+    BoundedQueue empty;          // Batches given back by the link stage
+    BoundedQueue split;          // Batches waiting for the resolution stage
+    BoundedQueue resolved;       // Batches waiting for the link stage
+    pthread_t resolver;
+    pthread_t linker;
+};
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Thread function: finds the stations of every row (sole user of the tree)
+ */
+static void* resolve_batches(void* arg) {
+    Pipeline* p = (Pipeline*)arg;
+    Batch* b;
+    while ((b = popBoundedQueue(&p->split)) != NULL) {
+        for (long i = 0; i < b->count; i++) {
+            network_resolve_row(p->net, b->rows[i].cols, p->spec, &b->rows[i].at);
+        }
+        pushBoundedQueue(&p->resolved, b);
+    }
+    closeBoundedQueue(&p->resolved);
+    return NULL;
+}
+
+/**
+ * Thread function: adds the sections and volumes of every row
+ */
+static void* link_batches(void* arg) {
+    Pipeline* p = (Pipeline*)arg;
+    Batch* b;
+    while ((b = popBoundedQueue(&p->resolved)) != NULL) {
+        for (long i = 0; i < b->count; i++) {
+            network_link_row(p->net, b->rows[i].cols, p->spec, &b->rows[i].at);
+        }
+        b->count = 0;
+        b->used = 0;
+        pushBoundedQueue(&p->empty, b);
+    }
+    return NULL;
+}
+
+/**
+ * Releases the batches and queues of a pipeline whose threads are stopped
+ */
+static void release(Pipeline* p) {
+    for (int i = 0; i < PIPELINE_BATCHES; i++) {
+        mem_free(MEM_INPUT, p->batches[i].text, PIPELINE_BATCH_BYTES);
+        mem_free(MEM_INPUT, p->batches[i].rows, PIPELINE_BATCH_ROWS * sizeof(PipelineRow));
+    }
+    cleanupBoundedQueue(&p->empty);
+    cleanupBoundedQueue(&p->split);
+    cleanupBoundedQueue(&p->resolved);
+    free(p);
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Starts the resolution and link threads
+ *
+ * @param net   Network being loaded (not used by the caller until pipeline_finish)
+ * @param spec  What to build (no spill)
+ * @return      Pipeline, NULL if the stages cannot be started (nothing is loaded)
+ */
+Pipeline* pipeline_start(Network* net, const LoadSpec* spec) {
+    Pipeline* p = calloc(1, sizeof(Pipeline));
+    if (!p) return NULL;
+    p->net = net;
+    p->spec = spec;
+
+    // Every queue can hold every batch: only the empty queue ever waits
+    int ok = initBoundedQueue(&p->empty, PIPELINE_BATCHES) == 0 &&
+             initBoundedQueue(&p->split, PIPELINE_BATCHES) == 0 &&
+             initBoundedQueue(&p->resolved, PIPELINE_BATCHES) == 0;
+    for (int i = 0; ok && i < PIPELINE_BATCHES; i++) {
+        Batch* b = &p->batches[i];
+        b->text = mem_malloc(MEM_INPUT, PIPELINE_BATCH_BYTES);
+        b->rows = mem_malloc(MEM_INPUT, PIPELINE_BATCH_ROWS * sizeof(PipelineRow));
+        ok = b->text && b->rows && pushBoundedQueue(&p->empty, b) == 0;
+    }
+    if (!ok) {
+        release(p);
+        return NULL;
+    }
+
+    if (pthread_create(&p->resolver, NULL, resolve_batches, p) != 0) {
+        release(p);
+        return NULL;
+    }
+    if (pthread_create(&p->linker, NULL, link_batches, p) != 0) {
+        // Nothing was pushed: the resolution thread stops at once
+        closeBoundedQueue(&p->split);
+        pthread_join(p->resolver, NULL);
+        release(p);
+        return NULL;
+    }
+    return p;
+}
+
+/**
+ * Splits a line into the current batch, handed to the next stage when full
+ *
+ * @param p     Pipeline
+ * @param line  Line read from the input
+ */
+void pipeline_push_line(Pipeline* p, const char* line) {
+    size_t len = strlen(line) + 1;
+    Batch* b = p->current;
+    if (b && (b->count == PIPELINE_BATCH_ROWS || b->used + len > PIPELINE_BATCH_BYTES)) {
+        pushBoundedQueue(&p->split, b);
+        b = NULL;
+    }
+    if (!b) b = popBoundedQueue(&p->empty);
+    p->current = b;
+
+    char* copy = b->text + b->used;
+    memcpy(copy, line, len);
+    char** cols = b->rows[b->count].cols;
+    if (split_columns(copy, cols) != 0 || !network_row_wanted(cols, p->spec)) return;
+    b->used += len;
+    b->count++;
+}
+
+/**
+ * Flushes the last batch, waits for the stages and releases the pipeline
+ *
+ * @param p  Pipeline
+ */
+void pipeline_finish(Pipeline* p) {
+    if (p->current && p->current->count > 0) pushBoundedQueue(&p->split, p->current);
+    closeBoundedQueue(&p->split);
+    pthread_join(p->resolver, NULL);
+    pthread_join(p->linker, NULL);
+    release(p);
+}
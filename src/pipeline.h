@@ -0,0 +1,67 @@
+/*
+ * pipeline.h
+ *
+ * Pipelined ingest of text rows, in three stages on separate threads:
+ * - the reading thread splits the lines into batches of columns,
+ * - a resolution thread owns the station tree and finds or creates the
+ *   stations of each row (network_resolve_row),
+ * - a link thread adds the sections and volumes (network_link_row).
+ *
+ * Batches go from stage to stage through bounded queues and come back
+ * empty to the reading thread, so at most PIPELINE_BATCHES are in flight.
+ * The tree is only touched by the resolution thread and the station values
+ * and sections only by the link thread, so neither needs a lock. Rows
+ * keep their file order in both stages: the network is the one a serial
+ * load builds.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "network.h"
+
+/**
+ * Batches circulating between the stages
+ */
+#define PIPELINE_BATCHES 8
+
+/**
+ * Largest number of rows of a batch
+ */
+#define PIPELINE_BATCH_ROWS 2048
+
+/**
+ * Text held by a batch (lines are at most 1023 bytes)
+ */
+#define PIPELINE_BATCH_BYTES (128 * 1024)
+
+/**
+ * Running pipeline (opaque)
+ */
+typedef struct Pipeline Pipeline;
+
+/**
+ * Starts the resolution and link threads
+ *
+ * @param net   Network being loaded (not used by the caller until pipeline_finish)
+ * @param spec  What to build (no spill)
+ * @return      Pipeline, NULL if the stages cannot be started (nothing is loaded)
+ */
+Pipeline* pipeline_start(Network* net, const LoadSpec* spec);
+
+/**
+ * Splits a line into the current batch, handed to the next stage when full
+ *
+ * @param p     Pipeline
+ * @param line  Line read from the input
+ */
+void pipeline_push_line(Pipeline* p, const char* line);
+
+/**
+ * Flushes the last batch, waits for the stages and releases the pipeline
+ *
+ * @param p  Pipeline
+ */
+void pipeline_finish(Pipeline* p);
+
+#endif /* PIPELINE_H */
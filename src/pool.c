@@ -0,0 +1,96 @@
+/*
+ * pool.c
+ *
+ * Slab allocation for the many small, long-lived objects of a network.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "pool.h"
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Starts a new chunk able to hold at least size bytes
+ */
+static PoolChunk* add_chunk(Pool* pool, size_t size) {
+    size_t usable = (size > POOL_CHUNK_SIZE) ? size : POOL_CHUNK_SIZE;
+    size_t total = sizeof(PoolChunk) + POOL_CHUNK_ALIGN + usable;
+    PoolChunk* chunk = malloc(total);
+    if (!chunk) {
+        fprintf(stderr, "Error: unable to allocate a memory pool chunk\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Objects start on the first aligned address after the header
+    uintptr_t start = (uintptr_t)(chunk + 1);
+    start = (start + POOL_CHUNK_ALIGN - 1) & ~(uintptr_t)(POOL_CHUNK_ALIGN - 1);
+    chunk->data = (char*)start;
+    chunk->next = pool->head;
+    chunk->used = 0;
+    chunk->size = usable;
+    pool->head = chunk;
+    pool->allocated += total;
+    return chunk;
+}
+
+/**
+ * Hands out the next size bytes of the current chunk
+ */
+static void* bump(Pool* pool, size_t size) {
+    PoolChunk* chunk = pool->head;
+    if (!chunk || chunk->size - chunk->used < size) chunk = add_chunk(pool, size);
+    void* p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Returns uninitialized memory from a pool (exits if memory is exhausted)
+ *
+ * @param pool  Pool
+ * @param size  Number of bytes (rounded up to a multiple of 8)
+ * @return      Memory aligned on 8 bytes
+ */
+void* pool_alloc(Pool* pool, size_t size) {
+    return bump(pool, (size + 7) & ~(size_t)7);
+}
+
+/**
+ * Copies a string into a pool
+ * Strings are not padded: keep them in a pool of their own
+ *
+ * @param pool  Pool
+ * @param s     String to copy
+ * @return      Pooled copy
+ */
+char* pool_strdup(Pool* pool, const char* s) {
+    size_t len = strlen(s) + 1;
+    char* copy = bump(pool, len);
+    memcpy(copy, s, len);
+    return copy;
+}
+
+/**
+ * Releases every object of a pool (the pool can be reused afterwards)
+ *
+ * @param pool  Pool
+ */
+void pool_release(Pool* pool) {
+    PoolChunk* chunk = pool->head;
+    while (chunk) {
+        PoolChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    pool->head = NULL;
+    pool->allocated = 0;
+}
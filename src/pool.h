@@ -0,0 +1,83 @@
+/*
+ * pool.h
+ *
+ * Slab allocation for the many small, long-lived objects of a network.
+ * Objects are carved out of large chunks: no per-object allocation header,
+ * and objects created one after the other stay contiguous in memory.
+ * A pool is released as a whole.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/**
+ * Size of the chunks requested from malloc
+ */
+#define POOL_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * Alignment of the first object of a chunk
+ * Objects whose size is a multiple of it never straddle two cache lines
+ */
+#define POOL_CHUNK_ALIGN 64
+
+/**
+ * Chunk of pooled memory
+ */
+typedef struct PoolChunk {
+    struct PoolChunk* next;  // Previously filled chunk
+    size_t used;             // Bytes handed out
+    size_t size;             // Usable bytes
+    char* data;              // Objects, aligned on a cache line
+} PoolChunk;
+
+/**
+ * Pool of objects released together
+ */
+typedef struct {
+    PoolChunk* head;         // Chunk being filled
+    size_t allocated;        // Bytes requested from malloc
+} Pool;
+
+/**
+ * Static initializer of an empty pool
+ */
+#define POOL_INIT { NULL, 0 }
+
+/**
+ * Returns uninitialized memory from a pool (exits if memory is exhausted)
+ *
+ * @param pool  Pool
+ * @param size  Number of bytes (rounded up to a multiple of 8)
+ * @return      Memory aligned on 8 bytes
+ */
+void* pool_alloc(Pool* pool, size_t size);
+
+/**
+ * Copies a string into a pool
+ * Strings are not padded: keep them in a pool of their own
+ *
+ * @param pool  Pool
+ * @param s     String to copy
+ * @return      Pooled copy
+ */
+char* pool_strdup(Pool* pool, const char* s);
+
+/**
+ * Releases every object of a pool (the pool can be reused afterwards)
+ *
+ * @param pool  Pool
+ */
+void pool_release(Pool* pool);
+
+/**
+ * Defines a typed allocator prefix##_new(pool) for a node type
+ */
+#define POOL_DEFINE_TYPE(prefix, type)                  \
+    static inline type* prefix##_new(Pool* pool) {      \
+        return (type*)pool_alloc(pool, sizeof(type));   \
+    }
+
+#endif /* POOL_H */
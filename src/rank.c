@@ -0,0 +1,409 @@
+/*
+ * rank.c
+ *
+ * Ranking of histogram rows.
+ * Full orderings use a stable LSD radix sort on the integer values, while
+ * top-K / bottom-K selections keep bounded heaps filled in one tree traversal.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rank.h"
+#include "avl.h"
+#include "output.h"
+#include "chart.h"
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Radix sort element: biased key and its station
+ */
+typedef struct {
+    unsigned long long key;
+    Station* station;
+} RankItem;
+
+/**
+ * Bounded binary heap of stations
+ * keep_largest = 1: min-heap keeping the K largest rows (root = smallest kept)
+ * keep_largest = 0: max-heap keeping the K smallest rows (root = largest kept)
+ */
+typedef struct {
+    Station** items;
+    long size;
+    long capacity;
+    int keep_largest;
+    int metric;
+} RankHeap;
+
+/**
+ * Orders two stations by metric value, then by identifier
+ */
+static int compare_rank(const Station* a, const Station* b, int metric) {
+    long va = station_metric(a, metric);
+    long vb = station_metric(b, metric);
+    if (va != vb) return (va < vb) ? -1 : 1;
+    return strcmp(a->name, b->name);
+}
+
+/**
+ * Tells whether item a must stay above item b in the heap
+ */
+static int heap_above(const RankHeap* h, const Station* a, const Station* b) {
+    int cmp = compare_rank(a, b, h->metric);
+    return h->keep_largest ? (cmp < 0) : (cmp > 0);
+}
+
+/**
+ * Restores the heap property downwards from index i
+ */
+static void heap_sift_down(RankHeap* h, long i) {
+    for (;;) {
+        long l = 2 * i + 1;
+        long r = l + 1;
+        long top = i;
+        if (l < h->size && heap_above(h, h->items[l], h->items[top])) top = l;
+        if (r < h->size && heap_above(h, h->items[r], h->items[top])) top = r;
+        if (top == i) return;
+        Station* tmp = h->items[i];
+        h->items[i] = h->items[top];
+        h->items[top] = tmp;
+        i = top;
+    }
+}
+
+/**
+ * Offers a station to a bounded heap
+ */
+static void heap_offer(RankHeap* h, Station* s) {
+    if (h->capacity <= 0) return;
+
+    if (h->size < h->capacity) {
+        // Sift up the new element
+        long i = h->size++;
+        h->items[i] = s;
+        while (i > 0) {
+            long parent = (i - 1) / 2;
+            if (!heap_above(h, h->items[i], h->items[parent])) break;
+            Station* tmp = h->items[i];
+            h->items[i] = h->items[parent];
+            h->items[parent] = tmp;
+            i = parent;
+        }
+        return;
+    }
+
+    // Full heap: replace the root if the new station ranks better
+    if (heap_above(h, h->items[0], s)) {
+        h->items[0] = s;
+        heap_sift_down(h, 0);
+    }
+}
+
+/**
+ * Sorts the content of a heap in ascending order (heap sort in place)
+ */
+static void heap_sort_ascending(RankHeap* h) {
+    long n = h->size;
+
+    // Repeatedly move the root to the end of the array
+    while (h->size > 1) {
+        Station* tmp = h->items[0];
+        h->items[0] = h->items[h->size - 1];
+        h->items[h->size - 1] = tmp;
+        h->size--;
+        heap_sift_down(h, 0);
+    }
+    h->size = n;
+
+    // A min-heap yields descending order: reverse it
+    if (h->keep_largest) {
+        for (long i = 0, j = n - 1; i < j; i++, j--) {
+            Station* tmp = h->items[i];
+            h->items[i] = h->items[j];
+            h->items[j] = tmp;
+        }
+    }
+}
+
+/**
+ * Visitor feeding a station to both heaps (ctx: the two heaps)
+ */
+static void select_row(Station* s, void* ctx) {
+    RankHeap* heaps = (RankHeap*)ctx;
+    heap_offer(&heaps[0], s);
+    heap_offer(&heaps[1], s);
+}
+
+/**
+ * Rows collected by a traversal
+ */
+typedef struct {
+    Station** rows;
+    long count;
+} RowList;
+
+/**
+ * Visitor appending a station to a RowList
+ */
+static void collect_row(Station* s, void* ctx) {
+    RowList* list = (RowList*)ctx;
+    list->rows[list->count++] = s;
+}
+
+/**
+ * Writes an array of stations
+ */
+static void write_rows(Station** rows, long n, OutBuffer* out, RowWriter writer) {
+    for (long i = 0; i < n; i++) {
+        writer(out, rows[i]);
+    }
+}
+
+/**
+ * Writes the selected blocks (bottom first, then top) and their charts
+ *
+ * @return 0 on success, -1 if a chart cannot be written
+ */
+static int write_selection(Station** bottom, long nb_bottom, Station** top, long nb_top,
+                           const char* mode, const RankOptions* opts, OutBuffer* out,
+                           RowWriter writer) {
+    if (opts->bottom > 0) write_rows(bottom, nb_bottom, out, writer);
+    // Two blank lines separate gnuplot datasets
+    if (opts->bottom > 0 && opts->top > 0) out_write(out, "\n\n", 2);
+    if (opts->top > 0) write_rows(top, nb_top, out, writer);
+
+    if (!opts->chart) return 0;
+    return chart_write_selection(opts->chart, opts->chart_format, mode, bottom,
+                                 opts->bottom > 0 ? nb_bottom : 0, top, opts->top > 0 ? nb_top : 0);
+}
+
+/**
+ * Writes the fully ordered table (to the CSV file and/or the output)
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int write_ordered(Station* root, const char* mode, const RankOptions* opts,
+                         OutBuffer* out, RowWriter writer, RowFilter visible) {
+    long total = count_stations(root);
+    Station** rows = malloc((total > 0 ? total : 1) * sizeof(Station*));
+    if (!rows) return -1;
+
+    RowList list = { rows, 0 };
+    tree_visit_rows(root, visible, collect_row, &list);
+    long count = list.count;
+    if (radix_sort_stations(rows, count, opts->sort_metric) != 0) {
+        free(rows);
+        return -1;
+    }
+
+    if (opts->csv_path) {
+        FILE* csv = fopen(opts->csv_path, "w");
+        OutBuffer csv_out;
+        if (!csv || out_open_stream(&csv_out, csv) != 0) {
+            fprintf(stderr, "Error: unable to open %s\n", opts->csv_path);
+            if (csv) fclose(csv);
+            free(rows);
+            return -1;
+        }
+        write_rows(rows, count, &csv_out, writer);
+        int err = out_close(&csv_out);
+        fclose(csv);
+        if (err != 0) {
+            free(rows);
+            return -1;
+        }
+    }
+
+    if (opts->top > 0 || opts->bottom > 0) {
+        // Slices of the ordered table
+        long nb_bottom = (opts->bottom < count) ? opts->bottom : count;
+        long nb_top = (opts->top < count) ? opts->top : count;
+        int status = write_selection(rows, nb_bottom, rows + (count - nb_top), nb_top, mode, opts,
+                                     out, writer);
+        free(rows);
+        return status;
+    }
+    if (!opts->csv_path) write_rows(rows, count, out, writer);
+
+    free(rows);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Converts a metric name to its METRIC_* code
+ *
+ * @param name  Metric name ("name", "max", "src", "real")
+ * @return      METRIC_* code, -1 if unknown
+ */
+int parse_metric(const char* name) {
+    if (!name) return -1;
+    if (strcmp(name, "name") == 0) return METRIC_NAME;
+    if (strcmp(name, "max") == 0) return METRIC_MAX;
+    if (strcmp(name, "src") == 0) return METRIC_SRC;
+    if (strcmp(name, "real") == 0) return METRIC_REAL;
+    return -1;
+}
+
+/**
+ * Completes ranking options with the defaults of a histogram mode
+ * The combined table is ordered on capacity, the others by identifier;
+ * selections rank on the histogram's own value when no order is given.
+ * An explicit order is kept (see rank_selection_valid).
+ *
+ * @param opts        Ranking options (sort_metric < 0 when not set)
+ * @param histo_mode  Histogram mode (1=max, 2=src, 3=real, 4=all)
+ */
+void rank_apply_defaults(RankOptions* opts, int histo_mode) {
+    if (opts->sort_metric >= 0) return;
+
+    if (opts->top > 0 || opts->bottom > 0) {
+        opts->sort_metric = (histo_mode == 4) ? METRIC_MAX : histo_mode;
+    } else {
+        opts->sort_metric = (histo_mode == 4) ? METRIC_MAX : METRIC_NAME;
+    }
+}
+
+/**
+ * Tells whether a top/bottom selection can be made in the given order
+ * Rows are selected on a value: the identifier order cannot select any
+ *
+ * @param opts  Ranking options
+ * @return      1 if valid, 0 if --sort name is combined with --top or --bottom
+ */
+int rank_selection_valid(const RankOptions* opts) {
+    return !(opts->sort_metric == METRIC_NAME && (opts->top > 0 || opts->bottom > 0));
+}
+
+/**
+ * Returns the value of a station for a metric
+ *
+ * @param s       Station
+ * @param metric  METRIC_* code
+ * @return        Metric value in internal units
+ */
+long station_metric(const Station* s, int metric) {
+    switch (metric) {
+        case METRIC_MAX:  return s->capacity;
+        case METRIC_SRC:  return s->consumption;
+        case METRIC_REAL: return s->real_qty;
+        default:          return 0;
+    }
+}
+
+/**
+ * Stable ascending LSD radix sort of stations on a metric
+ * Byte passes where every key shares the same digit are skipped,
+ * so small values only cost a few passes.
+ *
+ * @param rows    Array of stations
+ * @param n       Number of stations
+ * @param metric  METRIC_* code
+ * @return        0 on success, -1 on allocation failure
+ */
+int radix_sort_stations(Station** rows, long n, int metric) {
+    if (n < 2 || metric == METRIC_NAME) return 0;
+
+    RankItem* items = malloc(n * sizeof(RankItem));
+    RankItem* tmp = malloc(n * sizeof(RankItem));
+    if (!items || !tmp) {
+        free(items);
+        free(tmp);
+        return -1;
+    }
+
+    // Bias the sign bit so that unsigned order matches signed order
+    for (long i = 0; i < n; i++) {
+        items[i].key = (unsigned long long)station_metric(rows[i], metric) ^ (1ULL << 63);
+        items[i].station = rows[i];
+    }
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        long counts[256] = {0};
+        for (long i = 0; i < n; i++) {
+            counts[(items[i].key >> shift) & 0xFF]++;
+        }
+
+        // Skip passes that would not move anything
+        if (counts[(items[0].key >> shift) & 0xFF] == n) continue;
+
+        long pos = 0;
+        for (int d = 0; d < 256; d++) {
+            long c = counts[d];
+            counts[d] = pos;
+            pos += c;
+        }
+        for (long i = 0; i < n; i++) {
+            tmp[counts[(items[i].key >> shift) & 0xFF]++] = items[i];
+        }
+
+        RankItem* swap = items;
+        items = tmp;
+        tmp = swap;
+    }
+
+    for (long i = 0; i < n; i++) {
+        rows[i] = items[i].station;
+    }
+    free(items);
+    free(tmp);
+    return 0;
+}
+
+/**
+ * Writes the histogram of a tree according to ranking options
+ *
+ * @param root    Root of the tree
+ * @param out     Output buffer
+ * @param mode    Data type ("max", "src", "real" or "all")
+ * @param opts    Ranking options
+ * @return        0 on success, -1 on failure
+ */
+int write_histogram(Station* root, OutBuffer* out, const char* mode, const RankOptions* opts) {
+    int selecting = (opts->top > 0 || opts->bottom > 0);
+    RowWriter writer = row_writer_for_mode(mode);
+    RowFilter visible = row_filter_for_mode(mode);
+    if (!writer || !visible) return -1;
+
+    if (!selecting && !opts->csv_path && opts->sort_metric == METRIC_NAME) {
+        // Plain identifier order: stream the tree directly
+        out_tree_rows(out, root, writer);
+        return 0;
+    }
+
+    if (!selecting || opts->csv_path) {
+        return write_ordered(root, mode, opts, out, writer, visible);
+    }
+
+    // Selection only: bounded heaps, no full sort
+    // A count below 1 selects nothing
+    RankHeap heaps[2] = {
+        { NULL, 0, opts->top > 0 ? opts->top : 0, 1, opts->sort_metric },
+        { NULL, 0, opts->bottom > 0 ? opts->bottom : 0, 0, opts->sort_metric }
+    };
+    RankHeap* top = &heaps[0];
+    RankHeap* bottom = &heaps[1];
+    top->items = malloc((opts->top > 0 ? opts->top : 1) * sizeof(Station*));
+    bottom->items = malloc((opts->bottom > 0 ? opts->bottom : 1) * sizeof(Station*));
+
+    int status = 0;
+    if (top->items && bottom->items) {
+        tree_visit_rows(root, visible, select_row, heaps);
+        heap_sort_ascending(top);
+        heap_sort_ascending(bottom);
+        status = write_selection(bottom->items, bottom->size, top->items, top->size, mode, opts, out,
+                                 writer);
+    } else {
+        status = -1;
+    }
+    free(top->items);
+    free(bottom->items);
+    return status;
+}
@@ -0,0 +1,98 @@
+/*
+ * rank.h
+ *
+ * Ranking of histogram rows: full ordering on a metric and
+ * top-K / bottom-K selection without sorting the whole table.
+ */
+
+#ifndef RANK_H
+#define RANK_H
+
+#include "structs.h"
+#include "output.h"
+
+/**
+ * Metrics available for ordering histogram rows
+ */
+#define METRIC_NAME 0   // Identifier order (AVL in-order)
+#define METRIC_MAX  1   // Capacity
+#define METRIC_SRC  2   // Captured volume
+#define METRIC_REAL 3   // Actual volume
+
+/**
+ * Ranking options of a histogram run
+ */
+typedef struct {
+    int sort_metric;       // METRIC_* used to order rows
+    long top;              // Number of largest rows to select (0 = none)
+    long bottom;           // Number of smallest rows to select (0 = none)
+    const char* csv_path;  // Optional file receiving the full ordered table
+    const char* chart;     // Optional path prefix of the charts of the selection (see chart.h)
+    int chart_format;      // CHART_* format of the charts
+} RankOptions;
+
+/**
+ * Converts a metric name ("name", "max", "src", "real") to its METRIC_* code
+ *
+ * @param name  Metric name
+ * @return      METRIC_* code, -1 if unknown
+ */
+int parse_metric(const char* name);
+
+/**
+ * Completes ranking options with the defaults of a histogram mode
+ * The combined table is ordered on capacity, the others by identifier;
+ * selections rank on the histogram's own value when no order is given.
+ * An explicit order is kept (see rank_selection_valid).
+ *
+ * @param opts        Ranking options (sort_metric < 0 when not set)
+ * @param histo_mode  Histogram mode (1=max, 2=src, 3=real, 4=all)
+ */
+void rank_apply_defaults(RankOptions* opts, int histo_mode);
+
+/**
+ * Tells whether a top/bottom selection can be made in the given order
+ *
+ * @param opts  Ranking options
+ * @return      1 if valid, 0 if --sort name is combined with --top or --bottom
+ */
+int rank_selection_valid(const RankOptions* opts);
+
+/**
+ * Returns the value of a station for a metric
+ *
+ * @param s       Station
+ * @param metric  METRIC_* code (METRIC_NAME yields 0)
+ * @return        Metric value in internal units
+ */
+long station_metric(const Station* s, int metric);
+
+/**
+ * Stable ascending radix sort of stations on a metric
+ * Stations with equal values keep their relative order
+ *
+ * @param rows    Array of stations
+ * @param n       Number of stations
+ * @param metric  METRIC_* code
+ * @return        0 on success, -1 on allocation failure (rows untouched)
+ */
+int radix_sort_stations(Station** rows, long n, int metric);
+
+/**
+ * Writes the histogram of a tree according to ranking options
+ *
+ * Without selection the whole table is written in the requested order.
+ * With top/bottom selection, the smallest rows are written first, then the
+ * largest ones after two blank lines (gnuplot "index 0" and "index 1"),
+ * both in ascending order. When opts->chart is set, both blocks are also
+ * drawn as charts.
+ *
+ * @param root    Root of the tree
+ * @param out     Output buffer
+ * @param mode    Data type ("max", "src", "real" or "all")
+ * @param opts    Ranking options
+ * @return        0 on success, -1 on failure
+ */
+int write_histogram(Station* root, OutBuffer* out, const char* mode, const RankOptions* opts);
+
+#endif /* RANK_H */
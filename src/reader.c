@@ -0,0 +1,269 @@
+/*
+ * reader.c
+ *
+ * Threaded line reader for data files, pipes and compressed streams
+ * (see reader.h).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "reader.h"
+#include "memstats.h"
+
+/**
+ * Ring of buffers shared by the reading thread and the parser
+ */
+struct LineReader {
+    int fd;                           // Input descriptor (owned)
+#ifdef HAVE_ZLIB
+    gzFile gz;                        // Decompressing stream on fd
+#endif
+    char* blocks[READER_BLOCKS];      // Buffers of the ring
+    size_t lengths[READER_BLOCKS];    // Bytes held by each filled buffer
+    int head;                         // Next buffer filled by the thread
+    int tail;                         // Next buffer handed to the parser
+    int filled;                       // Buffers waiting for the parser
+    int eof;                          // No buffer will be filled anymore
+    int error;                        // Non-zero after a read error
+    int stop;                         // Set by the parser to stop the thread
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;             // A buffer was filled
+    pthread_cond_t released;          // A buffer was given back
+
+    // Parser side
+    char* current;                    // Buffer being parsed
+    size_t pos;                       // Next byte of the buffer
+    size_t len;                       // Bytes in the buffer
+    int holding;                      // 1 while the parser owns the tail buffer
+};
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Fills a buffer from the input (short only at the end of the input)
+ *
+ * @return  Bytes read, -1 on error
+ */
+static long read_block(LineReader* r, char* buf, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+#ifdef HAVE_ZLIB
+        int n = gzread(r->gz, buf + total, (unsigned)(size - total));
+#else
+        ssize_t n = read(r->fd, buf + total, size - total);
+        if (n < 0 && errno == EINTR) continue;
+#endif
+        if (n < 0) return -1;
+        if (n == 0) break;
+        total += (size_t)n;
+    }
+    return (long)total;
+}
+
+/**
+ * Thread function: fills the free buffers of the ring in order
+ */
+static void* read_blocks(void* arg) {
+    LineReader* r = (LineReader*)arg;
+#ifndef HAVE_ZLIB
+    int first = 1;
+#endif
+
+    for (;;) {
+        pthread_mutex_lock(&r->mutex);
+        while (r->filled == READER_BLOCKS && !r->stop) {
+            pthread_cond_wait(&r->released, &r->mutex);
+        }
+        int stop = r->stop;
+        int slot = r->head;
+        pthread_mutex_unlock(&r->mutex);
+        if (stop) break;
+
+        long n = read_block(r, r->blocks[slot], READER_BLOCK_SIZE);
+#ifndef HAVE_ZLIB
+        if (first && n >= 2 && (unsigned char)r->blocks[slot][0] == 0x1f &&
+            (unsigned char)r->blocks[slot][1] == 0x8b) {
+            fprintf(stderr, "Error: compressed input needs a build with ZLIB=1\n");
+            n = -1;
+        }
+        first = 0;
+#endif
+
+        pthread_mutex_lock(&r->mutex);
+        if (n < 0) r->error = 1;
+        if (n > 0) {
+            r->lengths[slot] = (size_t)n;
+            r->head = (r->head + 1) % READER_BLOCKS;
+            r->filled++;
+        } else {
+            r->eof = 1;
+        }
+        pthread_cond_signal(&r->ready);
+        pthread_mutex_unlock(&r->mutex);
+        if (n <= 0) break;
+    }
+    return NULL;
+}
+
+/**
+ * Gives the parsed buffer back and waits for the next one
+ *
+ * @return  1 if a buffer is available, 0 at the end of the input
+ */
+static int next_block(LineReader* r) {
+    pthread_mutex_lock(&r->mutex);
+    if (r->holding) {
+        r->tail = (r->tail + 1) % READER_BLOCKS;
+        r->filled--;
+        r->holding = 0;
+        pthread_cond_signal(&r->released);
+    }
+    while (r->filled == 0 && !r->eof) {
+        pthread_cond_wait(&r->ready, &r->mutex);
+    }
+    int available = (r->filled > 0);
+    if (available) {
+        r->current = r->blocks[r->tail];
+        r->len = r->lengths[r->tail];
+        r->pos = 0;
+        r->holding = 1;
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return available;
+}
+
+/**
+ * Releases the resources of a reader whose thread is not running
+ */
+static void release(LineReader* r) {
+#ifdef HAVE_ZLIB
+    if (r->gz) gzclose(r->gz);
+    else if (r->fd >= 0) close(r->fd);
+#else
+    if (r->fd >= 0) close(r->fd);
+#endif
+    for (int i = 0; i < READER_BLOCKS; i++) mem_free(MEM_INPUT, r->blocks[i], READER_BLOCK_SIZE);
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->ready);
+    pthread_cond_destroy(&r->released);
+    free(r);
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Tells whether a stream starts with the gzip signature (the stream is rewound)
+ *
+ * @param file  Seekable stream
+ * @return      1 for a gzip stream, 0 otherwise
+ */
+int reader_detect_gzip(FILE* file) {
+    unsigned char magic[2];
+    size_t n = fread(magic, 1, sizeof(magic), file);
+    rewind(file);
+    return n == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+/**
+ * Opens a file, or the standard input for "-", and starts the reading thread
+ *
+ * @param path  Path of the input or READER_STDIN
+ * @return      Reader, NULL if the input cannot be opened
+ */
+LineReader* reader_open(const char* path) {
+    LineReader* r = calloc(1, sizeof(LineReader));
+    if (!r) return NULL;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->ready, NULL);
+    pthread_cond_init(&r->released, NULL);
+
+    // The standard input is duplicated so that closing the reader leaves it open
+    r->fd = (strcmp(path, READER_STDIN) == 0) ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+    int ok = (r->fd >= 0);
+#ifdef HAVE_ZLIB
+    if (ok) {
+        // Plain input is passed through unchanged
+        r->gz = gzdopen(r->fd, "rb");
+        ok = (r->gz != NULL);
+        if (ok) gzbuffer(r->gz, 256 * 1024);
+    }
+#endif
+    for (int i = 0; ok && i < READER_BLOCKS; i++) {
+        r->blocks[i] = mem_malloc(MEM_INPUT, READER_BLOCK_SIZE);
+        if (!r->blocks[i]) ok = 0;
+    }
+    if (ok && pthread_create(&r->thread, NULL, read_blocks, r) != 0) ok = 0;
+
+    if (!ok) {
+        release(r);
+        return NULL;
+    }
+    return r;
+}
+
+/**
+ * Reads the next line like fgets: up to size - 1 bytes, newline included
+ *
+ * @param r     Reader
+ * @param line  Destination buffer
+ * @param size  Size of the buffer
+ * @return      line, NULL at the end of the input or on error
+ */
+char* reader_gets(LineReader* r, char* line, size_t size) {
+    size_t n = 0;
+    while (n + 1 < size) {
+        if (r->pos == r->len) {
+            if (!next_block(r)) break;
+            continue;
+        }
+
+        size_t avail = r->len - r->pos;
+        if (avail > size - 1 - n) avail = size - 1 - n;
+        char* start = r->current + r->pos;
+        char* nl = memchr(start, '\n', avail);
+        size_t take = nl ? (size_t)(nl - start) + 1 : avail;
+        memcpy(line + n, start, take);
+        n += take;
+        r->pos += take;
+        if (nl) break;
+    }
+
+    if (n == 0) return NULL;
+    line[n] = '\0';
+    return line;
+}
+
+/**
+ * Stops the reading thread and closes the input
+ *
+ * @param r  Reader
+ * @return   0 if no read error occurred, -1 otherwise
+ */
+int reader_close(LineReader* r) {
+    if (!r) return -1;
+
+    pthread_mutex_lock(&r->mutex);
+    r->stop = 1;
+    pthread_cond_signal(&r->released);
+    pthread_mutex_unlock(&r->mutex);
+    pthread_join(r->thread, NULL);
+
+    int status = r->error ? -1 : 0;
+    release(r);
+    return status;
+}
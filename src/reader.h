@@ -0,0 +1,71 @@
+/*
+ * reader.h
+ *
+ * Threaded line reader for data files, pipes and compressed streams.
+ * A dedicated thread reads large blocks into a ring of buffers while the
+ * caller parses the previous ones, so reading and parsing overlap. The
+ * input may be "-" (standard input). Built with ZLIB=1, gzip streams are
+ * decompressed on the reading thread; plain input is passed through.
+ */
+
+#ifndef READER_H
+#define READER_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/**
+ * Number of buffers in the ring
+ */
+#define READER_BLOCKS 4
+
+/**
+ * Size of each buffer
+ */
+#define READER_BLOCK_SIZE (4 * 1024 * 1024)
+
+/**
+ * Path designating the standard input
+ */
+#define READER_STDIN "-"
+
+/**
+ * Line reader (opaque)
+ */
+typedef struct LineReader LineReader;
+
+/**
+ * Tells whether a stream starts with the gzip signature (the stream is rewound)
+ *
+ * @param file  Seekable stream
+ * @return      1 for a gzip stream, 0 otherwise
+ */
+int reader_detect_gzip(FILE* file);
+
+/**
+ * Opens a file, or the standard input for "-", and starts the reading thread
+ *
+ * @param path  Path of the input or READER_STDIN
+ * @return      Reader, NULL if the input cannot be opened
+ */
+LineReader* reader_open(const char* path);
+
+/**
+ * Reads the next line like fgets: up to size - 1 bytes, newline included
+ *
+ * @param r     Reader
+ * @param line  Destination buffer
+ * @param size  Size of the buffer
+ * @return      line, NULL at the end of the input or on error
+ */
+char* reader_gets(LineReader* r, char* line, size_t size);
+
+/**
+ * Stops the reading thread and closes the input
+ *
+ * @param r  Reader
+ * @return   0 if no read error occurred, -1 otherwise
+ */
+int reader_close(LineReader* r);
+
+#endif /* READER_H */
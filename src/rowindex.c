@@ -0,0 +1,593 @@
+/*
+ * rowindex.c
+ *
+ * Sidecar index of the rows of each facility (see rowindex.h).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rowindex.h"
+#include "columnar.h"
+#include "state.h"
+#include "reader.h"
+#include "pool.h"
+#include "memstats.h"
+
+// Size of the buffer the ranges are read into
+#define ROWINDEX_READ_SIZE (1024 * 1024)
+
+/**
+ * Identity of a data file
+ */
+typedef struct {
+    uint64_t size;         // Size in bytes
+    int64_t mtime_sec;     // Modification time
+    int64_t mtime_nsec;
+    uint64_t head_hash;    // FNV-1a hash of the first ROWINDEX_HEAD_BYTES
+} RowIndexFingerprint;
+
+/**
+ * File header
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    RowIndexFingerprint data;     // Data file the index was built from
+    uint64_t facilities;          // Number of facilities
+    uint64_t ranges;              // Number of ranges
+    uint64_t name_bytes;          // Size of the names block
+    uint64_t facilities_offset;
+    uint64_t ranges_offset;
+    uint64_t names_offset;
+} RowIndexHeader;
+
+/**
+ * Facility names found by the first pass
+ */
+typedef struct {
+    Pool pool;             // Identifier copies
+    char** names;          // Identifier of each facility
+    long count;            // Facilities
+    long capacity;         // Allocated entries of names
+    long* slots;           // Hash table of facility numbers (-1 = empty)
+    long mask;             // Hash table size - 1
+} FacilitySet;
+
+/**
+ * Line of a facility found by the second pass
+ */
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t facility;
+} RowEntry;
+
+// Names compared by the facility sort
+static char** sort_names;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * 64-bit FNV-1a hash of a byte range
+ */
+static uint64_t hash_bytes(const char* s, size_t n, uint64_t h) {
+    for (size_t i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Reads the fingerprint of an open data file
+ */
+static int fingerprint(int fd, RowIndexFingerprint* fp) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    memset(fp, 0, sizeof(*fp));
+    fp->size = (uint64_t)st.st_size;
+    fp->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    fp->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+
+    char head[ROWINDEX_HEAD_BYTES];
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    if (n < 0) return -1;
+    fp->head_hash = hash_bytes(head, (size_t)n, 14695981039346656037ULL);
+    return 0;
+}
+
+/**
+ * Fingerprint of a data file given by its path
+ */
+static int fingerprint_path(const char* path, RowIndexFingerprint* fp) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    int status = fingerprint(fd, fp);
+    close(fd);
+    return status;
+}
+
+/**
+ * Rebuilds the hash table of a facility set with twice the slots
+ */
+static int set_grow(FacilitySet* set) {
+    long size = set->slots ? (set->mask + 1) * 2 : 4096;
+    long* slots = malloc(size * sizeof(long));
+    if (!slots) return -1;
+    for (long i = 0; i < size; i++) slots[i] = -1;
+    for (long id = 0; id < set->count; id++) {
+        const char* name = set->names[id];
+        long i = (long)(hash_bytes(name, strlen(name), 14695981039346656037ULL) & (uint64_t)(size - 1));
+        while (slots[i] >= 0) i = (i + 1) & (size - 1);
+        slots[i] = id;
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->mask = size - 1;
+    return 0;
+}
+
+/**
+ * Number of a facility, -1 if it is not in the set
+ */
+static long set_find(const FacilitySet* set, const char* name) {
+    if (!name || !set->slots) return -1;
+    long i = (long)(hash_bytes(name, strlen(name), 14695981039346656037ULL) & (uint64_t)set->mask);
+    while (set->slots[i] >= 0) {
+        if (strcmp(set->names[set->slots[i]], name) == 0) return set->slots[i];
+        i = (i + 1) & set->mask;
+    }
+    return -1;
+}
+
+/**
+ * Adds a facility to the set if it is not there yet
+ *
+ * @return  0 on success, -1 on allocation failure
+ */
+static int set_add(FacilitySet* set, const char* name) {
+    if (set_find(set, name) >= 0) return 0;
+    if ((set->count + 1) * 2 > (set->slots ? set->mask + 1 : 0) && set_grow(set) != 0) return -1;
+    if (set->count == set->capacity) {
+        long capacity = set->capacity ? set->capacity * 2 : 1024;
+        char** names = realloc(set->names, capacity * sizeof(char*));
+        if (!names) return -1;
+        set->names = names;
+        set->capacity = capacity;
+    }
+
+    long i = (long)(hash_bytes(name, strlen(name), 14695981039346656037ULL) & (uint64_t)set->mask);
+    while (set->slots[i] >= 0) i = (i + 1) & set->mask;
+    set->names[set->count] = pool_strdup(&set->pool, name);
+    set->slots[i] = set->count++;
+    return 0;
+}
+
+/**
+ * Releases a facility set
+ */
+static void set_free(FacilitySet* set) {
+    pool_release(&set->pool);
+    free(set->names);
+    free(set->slots);
+}
+
+/**
+ * Facility a split row belongs to, by row type (NULL if none)
+ */
+static const char* row_facility(char* cols[5]) {
+    switch (columnar_row_type(cols)) {
+        case ROW_SOURCE: return cols[2];
+        case ROW_CAPACITY:
+        case ROW_STORAGE: return cols[1];
+        case ROW_DISTRIBUTION: return cols[0];
+        default: return NULL;
+    }
+}
+
+/**
+ * Tells whether a file can be indexed: a plain text file, not a pipe, a
+ * gzip stream, a state file or a columnar file
+ */
+static int indexable(const char* path) {
+    if (strcmp(path, READER_STDIN) == 0) return 0;
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    int ok = !reader_detect_gzip(file) && !state_detect(file) && !columnar_detect(file);
+    fclose(file);
+    return ok;
+}
+
+/**
+ * First pass: finds the facilities of a data file
+ */
+static int collect_facilities(const char* data_path, FacilitySet* set) {
+    LineReader* reader = reader_open(data_path);
+    if (!reader) return 2;
+
+    char line[1024];
+    int status = 0;
+    while (status == 0 && reader_gets(reader, line, sizeof(line))) {
+        char* cols[5];
+        if (split_columns(line, cols) != 0) continue;
+        const char* facility = row_facility(cols);
+        if (facility && set_add(set, facility) != 0) status = 3;
+    }
+    if (reader_close(reader) != 0 && status == 0) status = 2;
+    return status;
+}
+
+/**
+ * Second pass: lists the lines naming a facility in one of the first three
+ * columns, in file order (a line naming two facilities is listed for both)
+ */
+static int collect_rows(const char* data_path, const FacilitySet* set,
+                        RowEntry** entries, long* count) {
+    LineReader* reader = reader_open(data_path);
+    if (!reader) return 2;
+
+    char line[1024];
+    uint64_t offset = 0;
+    long capacity = 0;
+    int status = 0;
+    while (status == 0 && reader_gets(reader, line, sizeof(line))) {
+        // Offsets follow the pieces reader_gets returns, like the loader reads them back
+        size_t length = strlen(line);
+        uint64_t start = offset;
+        offset += length;
+
+        char* cols[5];
+        if (split_columns(line, cols) != 0) continue;
+        long seen[3];
+        for (int c = 0; c < 3; c++) {
+            seen[c] = set_find(set, cols[c]);
+            if (seen[c] < 0 || (c > 0 && seen[c] == seen[0]) || (c > 1 && seen[c] == seen[1])) continue;
+
+            if (*count == capacity) {
+                capacity = capacity ? capacity * 2 : 65536;
+                RowEntry* grown = realloc(*entries, capacity * sizeof(RowEntry));
+                if (!grown) {
+                    status = 3;
+                    break;
+                }
+                *entries = grown;
+            }
+            RowEntry* e = &(*entries)[(*count)++];
+            e->offset = start;
+            e->length = (uint32_t)length;
+            e->facility = (uint32_t)seen[c];
+        }
+    }
+    if (reader_close(reader) != 0 && status == 0) status = 2;
+    return status;
+}
+
+/**
+ * qsort comparator of facility numbers by name
+ */
+static int compare_facilities(const void* a, const void* b) {
+    return strcmp(sort_names[*(const long*)a], sort_names[*(const long*)b]);
+}
+
+/**
+ * Groups the lines by facility (file order kept) and merges close ones
+ *
+ * @param set      Facilities
+ * @param entries  Lines in file order
+ * @param count    Number of lines
+ * @param first    Receives the first range of each facility (count + 1 entries)
+ * @param ranges   Receives the ranges
+ * @return         Number of ranges, -1 on allocation failure
+ */
+static long build_ranges(const FacilitySet* set, const RowEntry* entries, long count,
+                         uint64_t* first, RowIndexRange** ranges) {
+    // Counting sort by facility: stable, so each facility keeps file order
+    long* start = calloc(set->count + 1, sizeof(long));
+    RowEntry* sorted = malloc((count > 0 ? count : 1) * sizeof(RowEntry));
+    *ranges = malloc((count > 0 ? count : 1) * sizeof(RowIndexRange));
+    if (!start || !sorted || !*ranges) {
+        free(start);
+        free(sorted);
+        free(*ranges);
+        *ranges = NULL;
+        return -1;
+    }
+    for (long i = 0; i < count; i++) start[entries[i].facility + 1]++;
+    for (long f = 0; f < set->count; f++) start[f + 1] += start[f];
+    for (long i = 0; i < count; i++) sorted[start[entries[i].facility]++] = entries[i];
+
+    // start[f] is now the end of facility f
+    long n = 0;
+    long i = 0;
+    for (long f = 0; f < set->count; f++) {
+        first[f] = (uint64_t)n;
+        long group_start = n;
+        for (; i < start[f]; i++) {
+            RowIndexRange* last = (n > group_start) ? &(*ranges)[n - 1] : NULL;
+            if (last && sorted[i].offset <= last->offset + last->length + ROWINDEX_GAP) {
+                last->length = sorted[i].offset + sorted[i].length - last->offset;
+            } else {
+                (*ranges)[n].offset = sorted[i].offset;
+                (*ranges)[n].length = sorted[i].length;
+                n++;
+            }
+        }
+    }
+    first[set->count] = (uint64_t)n;
+
+    free(start);
+    free(sorted);
+    return n;
+}
+
+/**
+ * Writes the index file
+ */
+static int write_index(FILE* f, const RowIndexFingerprint* fp, const FacilitySet* set,
+                       const uint64_t* first, const RowIndexRange* ranges, long range_count) {
+    long* order = malloc((set->count > 0 ? set->count : 1) * sizeof(long));
+    if (!order) return -1;
+    for (long id = 0; id < set->count; id++) order[id] = id;
+    sort_names = set->names;
+    qsort(order, set->count, sizeof(long), compare_facilities);
+
+    RowIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ROWINDEX_MAGIC, sizeof(h.magic));
+    h.version = ROWINDEX_VERSION;
+    h.data = *fp;
+    h.facilities = (uint64_t)set->count;
+    h.ranges = (uint64_t)range_count;
+    h.facilities_offset = sizeof(RowIndexHeader);
+    h.ranges_offset = h.facilities_offset + h.facilities * sizeof(RowIndexFacility);
+    h.names_offset = h.ranges_offset + h.ranges * sizeof(RowIndexRange);
+    for (long id = 0; id < set->count; id++) h.name_bytes += strlen(set->names[id]) + 1;
+
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    // Facilities in name order, their names stored in the same order
+    uint64_t name_offset = 0;
+    for (long k = 0; ok && k < set->count; k++) {
+        long id = order[k];
+        RowIndexFacility e = { name_offset, first[id], first[id + 1] - first[id] };
+        ok = fwrite(&e, sizeof(e), 1, f) == 1;
+        name_offset += strlen(set->names[id]) + 1;
+    }
+    if (ok && range_count > 0) ok = fwrite(ranges, sizeof(RowIndexRange), range_count, f) == (size_t)range_count;
+    for (long k = 0; ok && k < set->count; k++) {
+        const char* name = set->names[order[k]];
+        ok = fwrite(name, 1, strlen(name) + 1, f) == strlen(name) + 1;
+    }
+
+    free(order);
+    return ok ? 0 : -1;
+}
+
+/**
+ * Applies one line read back from the data file
+ */
+static void load_line(Network* net, const char* text, size_t length, const LoadSpec* spec) {
+    char line[1024];
+    memcpy(line, text, length);
+    line[length] = '\0';
+    net->line_count++;
+
+    char* cols[5];
+    if (split_columns(line, cols) != 0 || !network_row_wanted(cols, spec)) return;
+    network_add_row(net, cols, spec);
+}
+
+/**
+ * Applies the lines of a range of the data file, cut like reader_gets cuts
+ * them (at each newline, or after 1023 bytes)
+ */
+static int load_range(Network* net, int fd, const RowIndexRange* range, char* buf, const LoadSpec* spec) {
+    uint64_t pos = range->offset;
+    uint64_t end = range->offset + range->length;
+    size_t have = 0;
+    while (pos < end) {
+        size_t want = ROWINDEX_READ_SIZE - have;
+        if (want > end - pos) want = (size_t)(end - pos);
+        ssize_t n = pread(fd, buf + have, want, (off_t)pos);
+        if (n <= 0) return -1;
+        pos += (uint64_t)n;
+        have += (size_t)n;
+
+        // Complete lines; the rest waits for the next read
+        char* p = buf;
+        char* stop = buf + have;
+        for (;;) {
+            size_t left = (size_t)(stop - p);
+            size_t piece = left < 1023 ? left : 1023;
+            char* nl = memchr(p, '\n', piece);
+            if (nl) piece = (size_t)(nl - p) + 1;
+            else if (piece < 1023) break;
+            load_line(net, p, piece, spec);
+            p += piece;
+        }
+        have = (size_t)(stop - p);
+        memmove(buf, p, have);
+    }
+    if (have > 0) load_line(net, buf, have, spec);   // Last line of the file, without newline
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Writes the default index path of a data file (data path + ROWINDEX_SUFFIX)
+ *
+ * @param data_path  Data file
+ * @param buf        Destination buffer
+ * @param size       Size of the buffer
+ * @return           0 on success, -1 if the path does not fit
+ */
+int rowindex_default_path(const char* data_path, char* buf, size_t size) {
+    int n = snprintf(buf, size, "%s%s", data_path, ROWINDEX_SUFFIX);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+/**
+ * Scans an uncompressed text data file and writes its index
+ * The index is replaced atomically
+ *
+ * @param data_path  Data file (not the standard input, a gzip, state or columnar file)
+ * @param path       Index file
+ * @return           0 on success, 2 if the data cannot be read, 3 if the index cannot be written
+ */
+int rowindex_build(const char* data_path, const char* path) {
+    if (!indexable(data_path)) {
+        fprintf(stderr, "Error: only an uncompressed text data file can be indexed\n");
+        return 2;
+    }
+
+    // Fingerprint taken first: a file modified during the scan is seen as out of date
+    RowIndexFingerprint fp;
+    if (fingerprint_path(data_path, &fp) != 0) return 2;
+
+    FacilitySet set = { POOL_INIT, NULL, 0, 0, NULL, 0 };
+    RowEntry* entries = NULL;
+    long count = 0;
+    int status = collect_facilities(data_path, &set);
+    if (status == 0) status = collect_rows(data_path, &set, &entries, &count);
+
+    uint64_t* first = NULL;
+    RowIndexRange* ranges = NULL;
+    long range_count = 0;
+    if (status == 0) {
+        first = malloc((set.count + 1) * sizeof(uint64_t));
+        range_count = first ? build_ranges(&set, entries, count, first, &ranges) : -1;
+        if (range_count < 0) status = 3;
+    }
+    free(entries);
+
+    if (status == 0) {
+        // Written next to the destination, then renamed over it
+        size_t len = strlen(path);
+        char* tmp_path = malloc(len + 5);
+        FILE* f = NULL;
+        if (tmp_path) {
+            memcpy(tmp_path, path, len);
+            memcpy(tmp_path + len, ".tmp", 5);
+            f = fopen(tmp_path, "wb");
+        }
+        if (!f) {
+            status = 3;
+        } else {
+            if (write_index(f, &fp, &set, first, ranges, range_count) != 0) status = 3;
+            if (fclose(f) != 0) status = 3;
+            if (status == 0 && rename(tmp_path, path) != 0) status = 3;
+            if (status != 0) remove(tmp_path);
+        }
+        free(tmp_path);
+    }
+
+    if (status == 0) {
+        fprintf(stderr, "Index written: %ld facilities, %ld rows in %ld ranges\n",
+                set.count, count, range_count);
+    }
+    free(first);
+    free(ranges);
+    set_free(&set);
+    return status;
+}
+
+/**
+ * Loads the rows of spec->facility listed in the index into an empty network
+ *
+ * @param net         Empty network
+ * @param data_path   Data file
+ * @param index_path  Index file
+ * @param spec        What to build (LOAD_GRAPH | LOAD_FILTER, facility set)
+ * @return            0 if loaded, 1 if the index is missing, out of date or does
+ *                    not list the facility (nothing is loaded), -1 on read error
+ */
+int rowindex_load(Network* net, const char* data_path, const char* index_path, const LoadSpec* spec) {
+    int index_fd = open(index_path, O_RDONLY);
+    if (index_fd < 0) return 1;
+    struct stat st;
+    if (fstat(index_fd, &st) != 0 || (size_t)st.st_size < sizeof(RowIndexHeader)) {
+        close(index_fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, index_fd, 0);
+    close(index_fd);
+    if (map == MAP_FAILED) return 1;
+
+    // Header, then the bounds of every block
+    const char* base = map;
+    const RowIndexHeader* h = map;
+    int valid = memcmp(h->magic, ROWINDEX_MAGIC, sizeof(h->magic)) == 0 &&
+                h->version == ROWINDEX_VERSION &&
+                h->facilities_offset + h->facilities * sizeof(RowIndexFacility) <= size &&
+                h->ranges_offset + h->ranges * sizeof(RowIndexRange) <= size &&
+                h->names_offset + h->name_bytes <= size &&
+                h->name_bytes > 0 && base[h->names_offset + h->name_bytes - 1] == '\0';
+    if (!valid) {
+        fprintf(stderr, "Warning: %s is not a valid index, the data file is scanned\n", index_path);
+        munmap(map, size);
+        return 1;
+    }
+
+    int data_fd = open(data_path, O_RDONLY);
+    RowIndexFingerprint fp;
+    if (data_fd < 0 || fingerprint(data_fd, &fp) != 0 ||
+        memcmp(&fp, &h->data, sizeof(fp)) != 0) {
+        fprintf(stderr, "Warning: %s is out of date, the data file is scanned\n", index_path);
+        if (data_fd >= 0) close(data_fd);
+        munmap(map, size);
+        return 1;
+    }
+
+    // Binary search of the facility among the sorted names
+    const RowIndexFacility* facilities = (const RowIndexFacility*)(base + h->facilities_offset);
+    const RowIndexRange* ranges = (const RowIndexRange*)(base + h->ranges_offset);
+    const char* names = base + h->names_offset;
+    const RowIndexFacility* found = NULL;
+    uint64_t lo = 0;
+    uint64_t hi = h->facilities;
+    while (lo < hi && !found) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (facilities[mid].name >= h->name_bytes) break;
+        int cmp = strcmp(spec->facility, names + facilities[mid].name);
+        if (cmp == 0) found = &facilities[mid];
+        else if (cmp < 0) hi = mid;
+        else lo = mid + 1;
+    }
+
+    int status = 1;
+    if (found && found->first + found->count <= h->ranges) {
+        char* buf = mem_malloc(MEM_INPUT, ROWINDEX_READ_SIZE);
+        status = buf ? 0 : -1;
+        for (uint64_t r = 0; status == 0 && r < found->count; r++) {
+            const RowIndexRange* range = &ranges[found->first + r];
+            if (range->offset + range->length > fp.size ||
+                load_range(net, data_fd, range, buf, spec) != 0) {
+                status = -1;
+            }
+        }
+        mem_free(MEM_INPUT, buf, ROWINDEX_READ_SIZE);
+        if (status == 0) {
+            fprintf(stderr, "Rows read through the index: %ld lines in %lu ranges\n",
+                    net->line_count, (unsigned long)found->count);
+        }
+    }
+
+    close(data_fd);
+    munmap(map, size);
+    return status;
+}
@@ -0,0 +1,103 @@
+/*
+ * rowindex.h
+ *
+ * Sidecar index of the rows of each facility in a text data file.
+ * For every facility (column 0 of a distribution row, column 1 of a
+ * capacity or storage row, column 2 of a source row), the index lists the
+ * byte ranges of the lines naming it in one of the first three columns:
+ * the rows a LOAD_FILTER load keeps (see network_row_wanted). A leak query
+ * then reads those ranges with pread instead of scanning the whole file,
+ * and no copy of the data is kept.
+ *
+ * Ranges closer than ROWINDEX_GAP are merged: the lines in between are read
+ * and skipped by the usual row filter. The index records the size,
+ * modification time and a hash of the first block of the data file, and is
+ * ignored once they no longer match.
+ *
+ * Layout (native byte order):
+ *   header      magic, version, fingerprint, counts and offsets
+ *   facilities  one RowIndexFacility per facility, in strcmp order of names
+ *   ranges      RowIndexRange of each facility, in file order
+ *   names       NUL-terminated identifiers
+ */
+
+#ifndef ROWINDEX_H
+#define ROWINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "network.h"
+
+/**
+ * File signature and format version
+ */
+#define ROWINDEX_MAGIC "CWWINDEX"
+#define ROWINDEX_VERSION 1u
+
+/**
+ * Suffix of the default index path, next to the data file
+ */
+#define ROWINDEX_SUFFIX ".idx"
+
+/**
+ * Largest gap between two ranges of a facility merged into one read
+ */
+#define ROWINDEX_GAP 4096
+
+/**
+ * Bytes of the beginning of the data file hashed in the fingerprint
+ */
+#define ROWINDEX_HEAD_BYTES 4096
+
+/**
+ * Rows of a facility
+ */
+typedef struct {
+    uint64_t name;     // Offset of the identifier in the names block
+    uint64_t first;    // Index of the first range
+    uint64_t count;    // Number of ranges
+} RowIndexFacility;
+
+/**
+ * Lines of the data file, newline of the last one included
+ */
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} RowIndexRange;
+
+/**
+ * Writes the default index path of a data file (data path + ROWINDEX_SUFFIX)
+ *
+ * @param data_path  Data file
+ * @param buf        Destination buffer
+ * @param size       Size of the buffer
+ * @return           0 on success, -1 if the path does not fit
+ */
+int rowindex_default_path(const char* data_path, char* buf, size_t size);
+
+/**
+ * Scans an uncompressed text data file and writes its index
+ * The index is replaced atomically
+ *
+ * @param data_path  Data file (not the standard input, a gzip, state or columnar file)
+ * @param path       Index file
+ * @return           0 on success, 2 if the data cannot be read, 3 if the index cannot be written
+ */
+int rowindex_build(const char* data_path, const char* path);
+
+/**
+ * Loads the rows of spec->facility listed in the index into an empty network
+ * Rows go through network_row_wanted and network_add_row in file order, so
+ * the network is the one a LOAD_FILTER scan builds
+ *
+ * @param net         Empty network
+ * @param data_path   Data file
+ * @param index_path  Index file
+ * @param spec        What to build (LOAD_GRAPH | LOAD_FILTER, facility set)
+ * @return            0 if loaded, 1 if the index is missing, out of date or does
+ *                    not list the facility (nothing is loaded), -1 on read error
+ */
+int rowindex_load(Network* net, const char* data_path, const char* index_path, const LoadSpec* spec);
+
+#endif /* ROWINDEX_H */
@@ -0,0 +1,693 @@
+/*
+ * server.c
+ *
+ * Resident query server.
+ * A poll() loop gathers the complete request lines of every connection,
+ * each batch is dispatched to the worker threads, and the answers are
+ * queued in request order. Sockets are non-blocking: the queued bytes are
+ * written whenever a connection accepts them, so a client that does not
+ * read its answers only holds up itself.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "avl.h"
+#include "leaks.h"
+#include "upstream.h"
+#include "rank.h"
+#include "output.h"
+#include "multiThreaded.h"
+#include "memstats.h"
+
+/**
+ * Size of a read from a connection
+ */
+#define READ_CHUNK 65536
+
+/**
+ * Unsent answer bytes above which a connection is no longer read
+ */
+#define MAX_PENDING_REPLY (4 * 1024 * 1024)
+
+/**
+ * Actions decided by the dispatcher before running a request
+ */
+#define ACTION_ANSWER   0
+#define ACTION_QUIT     1
+#define ACTION_SHUTDOWN 2
+#define ACTION_REJECT   3   // Answer already written (line too long)
+
+/**
+ * Connection (the stdin/stdout pair counts as one)
+ */
+typedef struct {
+    int in_fd;        // Descriptor requests are read from
+    int out_fd;       // Descriptor answers are written to
+    char* in;         // Pending bytes (incomplete line)
+    size_t in_len;
+    size_t in_cap;
+    OutBuffer out;    // Queued answers
+    size_t out_sent;  // Bytes of out already written
+    int discarding;   // Skipping the rest of an oversized line
+    int eof;          // No more input
+    int quit;         // No more requests (quit, shutdown): closed once out is written
+    int closed;       // No more output (write error)
+} Client;
+
+/**
+ * Shared state of the server
+ */
+typedef struct {
+    Network* net;
+    long station_total;  // Stations in the tree
+    long served;         // Requests answered
+    long connections;    // Connections accepted
+} ServerState;
+
+/**
+ * Request line and its answer
+ */
+typedef struct {
+    ServerState* state;
+    Client* client;
+    char* line;
+    int action;
+    OutBuffer reply;
+} Request;
+
+// Set by SIGINT/SIGTERM
+static volatile sig_atomic_t stop_requested = 0;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Signal handler requesting a clean stop
+ */
+static void on_stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+/**
+ * Counts the lines of a buffer
+ */
+static long count_lines(const OutBuffer* body) {
+    long n = 0;
+    for (size_t i = 0; i < body->len; i++) {
+        if (body->data[i] == '\n') n++;
+    }
+    return n;
+}
+
+/**
+ * Writes "OK <n>" followed by the body, or "ERR <message>"
+ */
+static void finish_reply(OutBuffer* reply, OutBuffer* body, const char* error) {
+    char header[64];
+
+    if (error) {
+        out_puts(reply, "ERR ");
+        out_puts(reply, error);
+        out_puts(reply, "\n");
+        return;
+    }
+    snprintf(header, sizeof(header), "OK %ld\n", count_lines(body));
+    out_puts(reply, header);
+    out_write(reply, body->data, body->len);
+}
+
+/**
+ * Answers "histo <mode> [options]"
+ *
+ * @return NULL on success, error message otherwise
+ */
+static const char* answer_histo(ServerState* st, char* args, OutBuffer* body) {
+    char* words[8];
+    int n = 0;
+
+    // Split arguments on spaces
+    char* p = args;
+    while (*p && n < 8) {
+        while (*p == ' ') *p++ = '\0';
+        if (!*p) break;
+        words[n++] = p;
+        while (*p && *p != ' ') p++;
+    }
+    if (n == 0) return "missing histogram mode";
+
+    int mode = parse_metric(words[0]);
+    if (strcmp(words[0], "all") == 0) mode = 4;
+    else if (mode <= 0) return "unknown histogram mode";
+
+    RankOptions opts = { -1, 0, 0, NULL, NULL, 0 };
+    for (int i = 1; i < n; i++) {
+        if (i + 1 >= n) return "missing option value";
+        if (strcmp(words[i], "--sort") == 0) {
+            opts.sort_metric = parse_metric(words[++i]);
+            if (opts.sort_metric < 0) return "unknown metric";
+        } else if (strcmp(words[i], "--top") == 0) {
+            opts.top = atol(words[++i]);
+            if (opts.top < 0) return "bad count";
+        } else if (strcmp(words[i], "--bottom") == 0) {
+            opts.bottom = atol(words[++i]);
+            if (opts.bottom < 0) return "bad count";
+        } else {
+            return "unknown option";
+        }
+    }
+    if (!rank_selection_valid(&opts)) return "name order cannot select rows";
+    rank_apply_defaults(&opts, mode);
+
+    if (write_histogram(st->net->root, body, words[0], &opts) != 0) return "histogram failed";
+    return NULL;
+}
+
+/**
+ * Answers "leak <facility>"
+ */
+static void answer_leak(ServerState* st, const char* facility, OutBuffer* body) {
+    char tmp[64];
+    LeakResult res;
+    leak_result_init(&res);
+
+    if (leak_query(st->net->root, facility, 0, &res) != 0) {
+        out_puts(body, "-1\n");
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%.6f\n", res.loss / 1000.0);
+    out_puts(body, tmp);
+
+    // Critical section: upstream;downstream;loss
+    if (res.max_loss > 0.0) {
+        out_puts(body, res.max_from);
+        out_puts(body, ";");
+        out_puts(body, res.max_to);
+        snprintf(tmp, sizeof(tmp), ";%.6f\n", res.max_loss / 1000.0);
+        out_puts(body, tmp);
+    }
+}
+
+/**
+ * Answers "approx <tolerance> <facility>": "loss;error bound", then the
+ * critical section of the visited part
+ */
+static const char* answer_approx(ServerState* st, char* args, OutBuffer* body) {
+    char* facility = strchr(args, ' ');
+    if (!facility) return "missing facility";
+    *facility++ = '\0';
+    while (*facility == ' ') facility++;
+    double tolerance = atof(args) * 1000.0;
+    if (tolerance <= 0.0) return "bad tolerance";
+    if (!*facility) return "missing facility";
+
+    char tmp[96];
+    LeakResult res;
+    leak_result_init(&res);
+    if (leak_query_approx(st->net->root, facility, tolerance, &res) != 0) {
+        out_puts(body, "-1\n");
+        return NULL;
+    }
+    snprintf(tmp, sizeof(tmp), "%.6f;%.6f\n", res.loss / 1000.0, res.bound / 1000.0);
+    out_puts(body, tmp);
+    if (res.max_loss > 0.0) {
+        out_puts(body, res.max_from);
+        out_puts(body, ";");
+        out_puts(body, res.max_to);
+        snprintf(tmp, sizeof(tmp), ";%.6f\n", res.max_loss / 1000.0);
+        out_puts(body, tmp);
+    }
+    return NULL;
+}
+
+/**
+ * Answers "upstream <station>"
+ */
+static const char* answer_upstream(ServerState* st, char* id, OutBuffer* body) {
+    Station* target = find_station(st->net->root, id);
+    if (!target) {
+        out_puts(body, "-1\n");
+        return NULL;
+    }
+
+    UpstreamResult res;
+    if (upstream_query(st->net->reverse, target, &res) != 0) return "out of memory";
+    upstream_write(&res, target, body);
+    upstream_result_free(&res);
+    return NULL;
+}
+
+/**
+ * Answers "stats"
+ */
+static void answer_stats(ServerState* st, OutBuffer* body) {
+    char tmp[128];
+    snprintf(tmp, sizeof(tmp), "lines;%ld\nstations;%ld\nconnections;%ld\nrequests;%ld\n",
+             st->net->line_count, st->station_total, st->net->connection_count, st->served);
+    out_puts(body, tmp);
+    mem_write(body);
+}
+
+/**
+ * Worker task: answers one request line
+ * @param arg Pointer to Request
+ */
+static void request_task(void* arg) {
+    Request* req = (Request*)arg;
+    OutBuffer body;
+    const char* error = NULL;
+
+    if (out_open_memory(&body, 4096) != 0) {
+        finish_reply(&req->reply, NULL, "out of memory");
+        return;
+    }
+
+    // First word is the command, the rest its argument
+    char* line = req->line;
+    char* rest = strchr(line, ' ');
+    if (rest) {
+        *rest++ = '\0';
+        while (*rest == ' ') rest++;
+    } else {
+        rest = line + strlen(line);
+    }
+
+    if (strcmp(line, "histo") == 0) {
+        error = answer_histo(req->state, rest, &body);
+    } else if (strcmp(line, "leak") == 0) {
+        if (*rest) answer_leak(req->state, rest, &body);
+        else error = "missing facility";
+    } else if (strcmp(line, "approx") == 0) {
+        error = answer_approx(req->state, rest, &body);
+    } else if (strcmp(line, "upstream") == 0) {
+        if (*rest) error = answer_upstream(req->state, rest, &body);
+        else error = "missing station";
+    } else if (strcmp(line, "stats") == 0) {
+        answer_stats(req->state, &body);
+    } else {
+        error = "unknown command";
+    }
+
+    finish_reply(&req->reply, &body, error);
+    out_close(&body);
+}
+
+/**
+ * Reads the available bytes of a connection
+ */
+static void read_client(Client* c) {
+    if (c->in_cap - c->in_len < READ_CHUNK) {
+        size_t cap = c->in_cap ? c->in_cap * 2 : 2 * READ_CHUNK;
+        char* in = realloc(c->in, cap);
+        if (!in) {
+            c->eof = 1;
+            return;
+        }
+        c->in = in;
+        c->in_cap = cap;
+    }
+
+    ssize_t n = read(c->in_fd, c->in + c->in_len, READ_CHUNK);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n <= 0) {
+        c->eof = 1;
+        return;
+    }
+    c->in_len += (size_t)n;
+}
+
+/**
+ * Appends a request to the list
+ *
+ * @return New request (line and reply not set), NULL on allocation failure
+ */
+static Request* new_request(ServerState* st, Client* c, Request** reqs, long* count, long* cap) {
+    if (*count == *cap) {
+        long ncap = *cap ? *cap * 2 : 16;
+        Request* nreqs = realloc(*reqs, ncap * sizeof(Request));
+        if (!nreqs) return NULL;
+        *reqs = nreqs;
+        *cap = ncap;
+    }
+    Request* r = &(*reqs)[*count];
+    r->state = st;
+    r->client = c;
+    r->line = NULL;
+    r->action = ACTION_ANSWER;
+    return r;
+}
+
+/**
+ * Adds the "ERR line too long" answer of an oversized line to the request list
+ *
+ * @return 0 on success, -1 on allocation failure
+ */
+static int reject_line(ServerState* st, Client* c, Request** reqs, long* count, long* cap) {
+    Request* r = new_request(st, c, reqs, count, cap);
+    if (!r || out_open_memory(&r->reply, 64) != 0) return -1;
+    r->action = ACTION_REJECT;
+    finish_reply(&r->reply, NULL, "line too long");
+    (*count)++;
+    return 0;
+}
+
+/**
+ * Moves the complete lines of a connection to the request list
+ * A line longer than SERVER_MAX_LINE is answered "ERR line too long" and
+ * skipped up to its newline
+ *
+ * @return 0 on success, -1 on allocation failure
+ */
+static int take_lines(ServerState* st, Client* c, Request** reqs, long* count, long* cap) {
+    size_t start = 0;
+
+    for (size_t i = 0; i < c->in_len; i++) {
+        if (c->in[i] != '\n') continue;
+        if (c->discarding) {
+            // End of the oversized line, already answered
+            c->discarding = 0;
+            start = i + 1;
+            continue;
+        }
+
+        // Trim the line ("\r\n" endings, surrounding spaces)
+        size_t end = i;
+        while (end > start && (c->in[end - 1] == '\r' || c->in[end - 1] == ' ')) end--;
+        size_t begin = start;
+        while (begin < end && c->in[begin] == ' ') begin++;
+        start = i + 1;
+        if (begin == end) continue;
+
+        if (end - begin > SERVER_MAX_LINE) {
+            if (reject_line(st, c, reqs, count, cap) != 0) return -1;
+            continue;
+        }
+
+        Request* r = new_request(st, c, reqs, count, cap);
+        if (!r) return -1;
+        r->line = malloc(end - begin + 1);
+        if (!r->line || out_open_memory(&r->reply, 256) != 0) {
+            free(r->line);
+            return -1;
+        }
+        memcpy(r->line, c->in + begin, end - begin);
+        r->line[end - begin] = '\0';
+        if (strcmp(r->line, "quit") == 0) r->action = ACTION_QUIT;
+        else if (strcmp(r->line, "shutdown") == 0) r->action = ACTION_SHUTDOWN;
+        (*count)++;
+    }
+
+    // Keep the incomplete tail, unless it is part of an oversized line
+    if (c->discarding) start = c->in_len;
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+    if (c->in_len > SERVER_MAX_LINE) {
+        if (reject_line(st, c, reqs, count, cap) != 0) return -1;
+        c->discarding = 1;
+        c->in_len = 0;
+    }
+    return 0;
+}
+
+/**
+ * Queues an answer on its connection
+ */
+static void queue_reply(Client* c, const OutBuffer* reply) {
+    // Drop the bytes already written before growing the queue
+    if (c->out_sent > 0) {
+        memmove(c->out.data, c->out.data + c->out_sent, c->out.len - c->out_sent);
+        c->out.len -= c->out_sent;
+        c->out_sent = 0;
+    }
+    out_write(&c->out, reply->data, reply->len);
+    if (c->out.error) c->closed = 1;
+}
+
+/**
+ * Writes as much of the queued answers as the connection accepts
+ */
+static void flush_client(Client* c) {
+    while (!c->closed && c->out_sent < c->out.len) {
+        ssize_t n = write(c->out_fd, c->out.data + c->out_sent, c->out.len - c->out_sent);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) c->closed = 1;
+            return;
+        }
+        c->out_sent += (size_t)n;
+    }
+    if (c->out_sent == c->out.len) {
+        c->out.len = 0;
+        c->out_sent = 0;
+    }
+}
+
+/**
+ * Unsent answer bytes of a connection
+ */
+static size_t pending_reply(const Client* c) {
+    return c->out.len - c->out_sent;
+}
+
+/**
+ * Runs a batch of requests on the worker threads
+ */
+static void run_batch(Request* reqs, long count) {
+    long pending = 0;
+    for (long i = 0; i < count; i++) {
+        if (reqs[i].action == ACTION_ANSWER) pending++;
+    }
+    if (pending == 0) return;
+
+    // A lone request is not worth starting threads
+    Threads* pool = (pending > 1) ? setupThreads() : NULL;
+    if (!pool) {
+        for (long i = 0; i < count; i++) {
+            if (reqs[i].action == ACTION_ANSWER) request_task(&reqs[i]);
+        }
+        return;
+    }
+
+    for (long i = 0; i < count; i++) {
+        if (reqs[i].action != ACTION_ANSWER) continue;
+        if (addTaskInThreads(pool, request_task, &reqs[i]) != 0) {
+            request_task(&reqs[i]);
+        }
+    }
+    int th_err = handleThreads(pool);
+    if (th_err != 0) {
+        fprintf(stderr, "Warning: %d thread operations failed\n", th_err);
+    }
+    cleanupThreads(pool);
+}
+
+/**
+ * Opens a listening Unix socket
+ *
+ * @return Socket descriptor, -1 on failure
+ */
+static int open_socket(const char* path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Adds a connection to the client list
+ *
+ * @return 0 on success, -1 on allocation failure
+ */
+static int add_client(Client** clients, long* count, long* cap, int in_fd, int out_fd) {
+    if (*count == *cap) {
+        long ncap = *cap ? *cap * 2 : 8;
+        Client* nc = realloc(*clients, ncap * sizeof(Client));
+        if (!nc) return -1;
+        *clients = nc;
+        *cap = ncap;
+    }
+    Client* c = &(*clients)[*count];
+    memset(c, 0, sizeof(Client));
+    if (out_open_memory(&c->out, 4096) != 0) return -1;
+    c->in_fd = in_fd;
+    c->out_fd = out_fd;
+    (*count)++;
+    return 0;
+}
+
+/**
+ * Releases a connection
+ */
+static void free_client(Client* c) {
+    if (c->in_fd != STDIN_FILENO) close(c->in_fd);
+    free(c->in);
+    out_close(&c->out);
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Answers requests until shutdown, end of input or SIGINT/SIGTERM
+ *
+ * @param net          Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL)
+ * @param socket_path  Unix socket to listen on, NULL for stdin/stdout
+ * @return             0 on normal termination, 4 if the socket cannot be opened
+ */
+int run_server(Network* net, const char* socket_path) {
+    ServerState st = { net, count_stations(net->root), 0, 0 };
+    Client* clients = NULL;
+    long nb_clients = 0, cap_clients = 0;
+    int listen_fd = -1;
+
+    // Closed peers must not kill the server; signals stop it cleanly
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (socket_path) {
+        listen_fd = open_socket(socket_path);
+        if (listen_fd < 0) {
+            fprintf(stderr, "Error: unable to listen on %s\n", socket_path);
+            return 4;
+        }
+        fprintf(stderr, "Listening on %s (%ld stations)\n", socket_path, st.station_total);
+    } else {
+        if (add_client(&clients, &nb_clients, &cap_clients, STDIN_FILENO, STDOUT_FILENO) != 0) return 4;
+        fflush(stdout);
+        fprintf(stderr, "Ready (%ld stations)\n", st.station_total);
+    }
+
+    Request* reqs = NULL;
+    long cap_reqs = 0;
+    int running = 1;
+
+    while (running && !stop_requested) {
+        // Poll the listening socket, then each connection's input and output
+        // (read while its unsent answers stay small, written while any remain)
+        long nfds = 2 * nb_clients + 1;
+        struct pollfd* fds = malloc(nfds * sizeof(struct pollfd));
+        if (!fds) break;
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        for (long i = 0; i < nb_clients; i++) {
+            Client* c = &clients[i];
+            int reading = !c->eof && !c->quit && pending_reply(c) < MAX_PENDING_REPLY;
+            fds[2 * i + 1].fd = reading ? c->in_fd : -1;
+            fds[2 * i + 1].events = POLLIN;
+            fds[2 * i + 1].revents = 0;
+            fds[2 * i + 2].fd = (pending_reply(c) > 0) ? c->out_fd : -1;
+            fds[2 * i + 2].events = POLLOUT;
+            fds[2 * i + 2].revents = 0;
+        }
+
+        int ready = poll(fds, (nfds_t)nfds, -1);
+        if (ready < 0) {
+            free(fds);
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // Read from the connections that have data, write to the ready ones
+        long known_clients = nb_clients;
+        for (long i = 0; i < known_clients; i++) {
+            if (fds[2 * i + 1].revents & (POLLIN | POLLHUP | POLLERR)) read_client(&clients[i]);
+            if (fds[2 * i + 2].revents & (POLLOUT | POLLHUP | POLLERR)) flush_client(&clients[i]);
+        }
+
+        // Accept new connections
+        if (listen_fd >= 0 && (fds[0].revents & POLLIN)) {
+            int cfd = accept(listen_fd, NULL, NULL);
+            if (cfd >= 0) {
+                if (fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK) != 0 ||
+                    add_client(&clients, &nb_clients, &cap_clients, cfd, cfd) != 0) {
+                    close(cfd);
+                } else {
+                    st.connections++;
+                }
+            }
+        }
+        free(fds);
+
+        // Gather complete request lines (not from connections behind on their answers)
+        long nb_reqs = 0;
+        for (long i = 0; i < nb_clients; i++) {
+            Client* c = &clients[i];
+            if (c->closed || c->quit || pending_reply(c) >= MAX_PENDING_REPLY) continue;
+            if (take_lines(&st, c, &reqs, &nb_reqs, &cap_reqs) != 0) c->closed = 1;
+        }
+
+        // Answer the batch, then queue the answers in request order
+        run_batch(reqs, nb_reqs);
+        for (long i = 0; i < nb_reqs; i++) {
+            Request* r = &reqs[i];
+            if (r->action == ACTION_SHUTDOWN) running = 0;
+            Client* c = r->client;
+            if (r->action == ACTION_QUIT || r->action == ACTION_SHUTDOWN) c->quit = 1;
+            else if (!c->closed && !c->quit && r->reply.len > 0) queue_reply(c, &r->reply);
+            if (r->action == ACTION_ANSWER || r->action == ACTION_REJECT) st.served++;
+            out_close(&r->reply);
+            free(r->line);
+        }
+        for (long i = 0; i < nb_clients; i++) flush_client(&clients[i]);
+
+        // Drop finished connections, once their answers are written
+        long kept = 0;
+        for (long i = 0; i < nb_clients; i++) {
+            Client* c = &clients[i];
+            if (c->closed || ((c->eof || c->quit) && pending_reply(c) == 0)) {
+                free_client(c);
+                continue;
+            }
+            clients[kept++] = *c;
+        }
+        nb_clients = kept;
+
+        // stdin mode ends with its input
+        if (!socket_path && nb_clients == 0) running = 0;
+    }
+
+    // Cleanup (answers not accepted by now are lost)
+    for (long i = 0; i < nb_clients; i++) {
+        flush_client(&clients[i]);
+        free_client(&clients[i]);
+    }
+    free(clients);
+    free(reqs);
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(socket_path);
+    }
+    fprintf(stderr, "Server stopped after %ld requests\n", st.served);
+    return 0;
+}
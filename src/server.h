@@ -0,0 +1,40 @@
+/*
+ * server.h
+ *
+ * Resident query server: the network is loaded once and requests are
+ * answered from memory, over a Unix domain socket or stdin/stdout.
+ *
+ * Requests are single lines:
+ *   histo <max|src|real|all> [--sort <m>] [--top <K>] [--bottom <K>]
+ *   leak <facility id>
+ *   approx <tolerance M.m3> <facility id>  (loss within the tolerance, see leak_query_approx)
+ *   upstream <station id>  (facilities and sources feeding it, see upstream.h)
+ *   stats  (counters, then memory by category and resident size, see memstats.h)
+ *   quit        (closes the connection)
+ *   shutdown    (stops the server)
+ *
+ * Each answer starts with "OK <n>" followed by n lines, or "ERR <message>".
+ * A line longer than SERVER_MAX_LINE is answered "ERR line too long" and
+ * skipped up to its newline.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "network.h"
+
+/**
+ * Maximum length of a request line
+ */
+#define SERVER_MAX_LINE 4096
+
+/**
+ * Answers requests until shutdown, end of input or SIGINT/SIGTERM
+ *
+ * @param net          Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL) | LOAD_REVERSE
+ * @param socket_path  Unix socket to listen on, NULL for stdin/stdout
+ * @return             0 on normal termination, 4 if the socket cannot be opened
+ */
+int run_server(Network* net, const char* socket_path);
+
+#endif /* SERVER_H */
@@ -0,0 +1,434 @@
+/*
+ * shard.c
+ *
+ * Parallel loading of the histogram aggregates (see shard.h).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "shard.h"
+#include "avl.h"
+#include "pool.h"
+#include "state.h"
+#include "reader.h"
+#include "columnar.h"
+#include "memstats.h"
+
+// Smallest byte range worth a thread of its own
+#define SHARD_MIN_RANGE (64 * 1024)
+
+// stdio buffer of each worker
+#define SHARD_READ_BUFFER (4 * 1024 * 1024)
+
+// Initial number of slots of a shard table
+#define SHARD_TABLE_SLOTS 1024
+
+/**
+ * Aggregates of one station in a shard
+ */
+typedef struct {
+    char* name;          // Identifier (in the worker's name pool)
+    uint64_t hash;       // Hash of the identifier
+    long capacity;
+    long consumption;
+    long real_qty;
+} ShardEntry;
+
+/**
+ * Open-addressing hash table of the stations of one shard
+ */
+typedef struct {
+    ShardEntry** slots;  // Entries (NULL = empty)
+    long mask;           // Number of slots - 1
+    long count;          // Number of entries
+} ShardTable;
+
+/**
+ * Parsing worker: one byte range of the file, one table per shard
+ */
+typedef struct {
+    const char* path;    // Data file
+    int histo_mode;      // HISTO_* aggregates
+    off_t start;         // First byte of the range (start of a line)
+    off_t end;           // End of the range (start of a line or end of file)
+    int shards;          // Number of shards
+    ShardTable* tables;  // One table per shard
+    Pool entries;        // Entries of the tables
+    Pool names;          // Identifiers of the entries
+    long lines;          // Lines read
+    int error;           // Non-zero if the range could not be read
+} ShardWorker;
+
+/**
+ * Merging task: one shard of every worker
+ */
+typedef struct {
+    ShardWorker* workers;  // Workers (the first one receives the merge)
+    int count;             // Number of workers
+    int shard;             // Shard merged by this task
+    ShardEntry** sorted;   // Entries of the shard in identifier order
+    long size;             // Number of entries
+    int error;             // Non-zero on allocation failure
+} ShardMerge;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * 64-bit FNV-1a hash of an identifier
+ */
+static uint64_t hash_name(const char* s) {
+    uint64_t h = 14695981039346656037ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Shard of an identifier (high bits, the low ones select the slot)
+ */
+static int shard_of(uint64_t hash, int shards) {
+    return (int)((hash >> 40) % (uint64_t)shards);
+}
+
+/**
+ * Allocates an empty table
+ */
+static int table_init(ShardTable* t) {
+    t->slots = calloc(SHARD_TABLE_SLOTS, sizeof(ShardEntry*));
+    t->mask = SHARD_TABLE_SLOTS - 1;
+    t->count = 0;
+    return t->slots ? 0 : -1;
+}
+
+/**
+ * Returns the slot holding an identifier, or the empty slot where it belongs
+ */
+static ShardEntry** table_slot(ShardTable* t, const char* name, uint64_t hash) {
+    long i = (long)(hash & (uint64_t)t->mask);
+    while (t->slots[i]) {
+        if (t->slots[i]->hash == hash && strcmp(t->slots[i]->name, name) == 0) break;
+        i = (i + 1) & t->mask;
+    }
+    return &t->slots[i];
+}
+
+/**
+ * Doubles the table once it is half full
+ *
+ * @return  0 on success, -1 on allocation failure
+ */
+static int table_reserve(ShardTable* t) {
+    if ((t->count + 1) * 2 <= t->mask + 1) return 0;
+
+    long size = (t->mask + 1) * 2;
+    ShardEntry** old = t->slots;
+    long old_size = t->mask + 1;
+    t->slots = calloc(size, sizeof(ShardEntry*));
+    if (!t->slots) {
+        t->slots = old;
+        return -1;
+    }
+    t->mask = size - 1;
+    for (long i = 0; i < old_size; i++) {
+        if (old[i]) *table_slot(t, old[i]->name, old[i]->hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * Returns the first line start at or after an offset
+ */
+static off_t line_start(FILE* f, off_t offset) {
+    if (offset == 0) return 0;
+    if (fseeko(f, offset - 1, SEEK_SET) != 0) return -1;
+    int c;
+    while ((c = fgetc(f)) != EOF && c != '\n') {}
+    return ftello(f);
+}
+
+/**
+ * Thread function: parses a byte range into the worker's shard tables
+ */
+static void* load_range(void* arg) {
+    ShardWorker* w = (ShardWorker*)arg;
+    FILE* file = fopen(w->path, "r");
+    if (!file || fseeko(file, w->start, SEEK_SET) != 0) {
+        if (file) fclose(file);
+        w->error = 1;
+        return NULL;
+    }
+    char* buffer = mem_malloc(MEM_INPUT, SHARD_READ_BUFFER);
+    if (buffer) setvbuf(file, buffer, _IOFBF, SHARD_READ_BUFFER);
+
+    char line[1024];
+    off_t pos = w->start;
+    while (pos < w->end && fgets(line, sizeof(line), file)) {
+        pos += (off_t)strlen(line);
+        w->lines++;
+
+        char* cols[5];
+        HistoValue v;
+        if (split_columns(line, cols) != 0) continue;
+        if (!histo_row_value(cols, w->histo_mode, &v)) continue;
+
+        uint64_t hash = hash_name(v.name);
+        ShardTable* t = &w->tables[shard_of(hash, w->shards)];
+        if (table_reserve(t) != 0) {
+            w->error = 1;
+            break;
+        }
+        ShardEntry** slot = table_slot(t, v.name, hash);
+        if (!*slot) {
+            ShardEntry* e = pool_alloc(&w->entries, sizeof(ShardEntry));
+            e->name = pool_strdup(&w->names, v.name);
+            e->hash = hash;
+            e->capacity = 0;
+            e->consumption = 0;
+            e->real_qty = 0;
+            *slot = e;
+            t->count++;
+        }
+        (*slot)->capacity += v.capacity;
+        (*slot)->consumption += v.consumption;
+        (*slot)->real_qty += v.real_qty;
+    }
+
+    if (ferror(file)) w->error = 1;
+    fclose(file);
+    mem_free(MEM_INPUT, buffer, SHARD_READ_BUFFER);
+    return NULL;
+}
+
+/**
+ * Orders entries by identifier
+ */
+static int compare_entries(const void* a, const void* b) {
+    return strcmp((*(ShardEntry* const*)a)->name, (*(ShardEntry* const*)b)->name);
+}
+
+/**
+ * Thread function: merges one shard of every worker into the first worker's
+ * table, then sorts it
+ */
+static void* merge_shard(void* arg) {
+    ShardMerge* m = (ShardMerge*)arg;
+    ShardTable* dst = &m->workers[0].tables[m->shard];
+
+    for (int w = 1; w < m->count && !m->error; w++) {
+        ShardTable* src = &m->workers[w].tables[m->shard];
+        for (long i = 0; i <= src->mask; i++) {
+            ShardEntry* e = src->slots[i];
+            if (!e) continue;
+            if (table_reserve(dst) != 0) {
+                m->error = 1;
+                break;
+            }
+            ShardEntry** slot = table_slot(dst, e->name, e->hash);
+            if (*slot) {
+                (*slot)->capacity += e->capacity;
+                (*slot)->consumption += e->consumption;
+                (*slot)->real_qty += e->real_qty;
+            } else {
+                // Entries stay in the pools of their worker until the end
+                *slot = e;
+                dst->count++;
+            }
+        }
+    }
+    if (m->error) return NULL;
+
+    m->sorted = malloc((dst->count > 0 ? dst->count : 1) * sizeof(ShardEntry*));
+    if (!m->sorted) {
+        m->error = 1;
+        return NULL;
+    }
+    for (long i = 0; i <= dst->mask; i++) {
+        if (dst->slots[i]) m->sorted[m->size++] = dst->slots[i];
+    }
+    qsort(m->sorted, m->size, sizeof(ShardEntry*), compare_entries);
+    return NULL;
+}
+
+/**
+ * Runs a thread function on every task, in the calling thread if a thread
+ * cannot be created
+ */
+static void run_tasks(void* (*fn)(void*), void* tasks, size_t task_size, int count) {
+    pthread_t threads[SHARD_MAX_THREADS];
+    int started[SHARD_MAX_THREADS];
+    for (int i = 0; i < count; i++) {
+        void* task = (char*)tasks + i * task_size;
+        started[i] = (pthread_create(&threads[i], NULL, fn, task) == 0);
+        if (!started[i]) fn(task);
+    }
+    for (int i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * Combines the sorted shards into the station tree
+ *
+ * @return  0 on success, -1 on allocation failure
+ */
+static int build_tree(Network* net, ShardMerge* merges, int shards) {
+    long total = 0;
+    for (int s = 0; s < shards; s++) total += merges[s].size;
+    if (total == 0) return 0;
+
+    char** names = malloc(total * sizeof(char*));
+    ShardEntry** order = malloc(total * sizeof(ShardEntry*));
+    Station** nodes = malloc(total * sizeof(Station*));
+    long pos[SHARD_MAX_THREADS] = { 0 };
+    if (!names || !order || !nodes) {
+        free(names);
+        free(order);
+        free(nodes);
+        return -1;
+    }
+
+    // K-way merge: identifiers are distinct across shards
+    for (long n = 0; n < total; n++) {
+        int best = -1;
+        for (int s = 0; s < shards; s++) {
+            if (pos[s] == merges[s].size) continue;
+            if (best < 0 || strcmp(merges[s].sorted[pos[s]]->name,
+                                   merges[best].sorted[pos[best]]->name) < 0) {
+                best = s;
+            }
+        }
+        order[n] = merges[best].sorted[pos[best]++];
+        names[n] = order[n]->name;
+    }
+
+    net->root = build_sorted_tree(names, total, nodes);
+    for (long n = 0; n < total; n++) {
+        nodes[n]->capacity = order[n]->capacity;
+        nodes[n]->consumption = order[n]->consumption;
+        nodes[n]->real_qty = order[n]->real_qty;
+    }
+
+    free(names);
+    free(order);
+    free(nodes);
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Number of threads to use when none is requested (online processors)
+ *
+ * @return  Thread count, at least 1
+ */
+int shard_default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return (n > SHARD_MAX_THREADS) ? SHARD_MAX_THREADS : (int)n;
+}
+
+/**
+ * Reads the histogram aggregates of a data file with several threads
+ * Builds the same tree as network_load with LOAD_HISTO
+ *
+ * @param net         Network (empty)
+ * @param path        Path of the data file (not a state file)
+ * @param histo_mode  HISTO_* aggregates
+ * @param threads     Number of threads (clamped to 1..SHARD_MAX_THREADS)
+ * @return            0 on success, -1 if the file cannot be read
+ */
+int network_load_sharded(Network* net, const char* path, int histo_mode, int threads) {
+    LoadSpec fallback = { LOAD_HISTO, histo_mode, NULL, NULL, NULL };
+    if (strcmp(path, READER_STDIN) == 0) return network_load(net, path, &fallback);
+
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+
+    // State, columnar, compressed and non-regular inputs go through network_load
+    struct stat st;
+    if (state_detect(file) || columnar_detect(file) || reader_detect_gzip(file) ||
+        fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)) {
+        fclose(file);
+        return network_load(net, path, &fallback);
+    }
+
+    // Small files do not need every thread
+    if (threads > SHARD_MAX_THREADS) threads = SHARD_MAX_THREADS;
+    if (threads > st.st_size / SHARD_MIN_RANGE + 1) threads = (int)(st.st_size / SHARD_MIN_RANGE + 1);
+    if (threads < 1) threads = 1;
+
+    ShardWorker* workers = calloc(threads, sizeof(ShardWorker));
+    ShardMerge* merges = calloc(threads, sizeof(ShardMerge));
+    int status = (workers && merges) ? 0 : -1;
+
+    // Byte ranges cut on line boundaries, one shard per thread
+    off_t previous = 0;
+    for (int i = 0; i < threads && status == 0; i++) {
+        ShardWorker* w = &workers[i];
+        w->path = path;
+        w->histo_mode = histo_mode;
+        w->start = previous;
+        w->end = (i == threads - 1) ? st.st_size
+                                    : line_start(file, (off_t)(st.st_size / threads * (i + 1)));
+        if (w->end < w->start) w->end = w->start;
+        previous = w->end;
+        w->shards = threads;
+        w->entries = (Pool)POOL_INIT;
+        w->names = (Pool)POOL_INIT;
+        w->tables = calloc(threads, sizeof(ShardTable));
+        if (!w->tables) status = -1;
+        for (int s = 0; s < threads && status == 0; s++) {
+            if (table_init(&w->tables[s]) != 0) status = -1;
+        }
+    }
+    fclose(file);
+
+    if (status == 0) {
+        run_tasks(load_range, workers, sizeof(ShardWorker), threads);
+        for (int i = 0; i < threads; i++) {
+            net->line_count += workers[i].lines;
+            if (workers[i].error) status = -1;
+        }
+        fprintf(stderr, "Lines processed: %ld (%d threads)\n", net->line_count, threads);
+    }
+
+    if (status == 0) {
+        for (int s = 0; s < threads; s++) {
+            merges[s].workers = workers;
+            merges[s].count = threads;
+            merges[s].shard = s;
+        }
+        run_tasks(merge_shard, merges, sizeof(ShardMerge), threads);
+        for (int s = 0; s < threads; s++) {
+            if (merges[s].error) status = -1;
+        }
+    }
+
+    if (status == 0) status = build_tree(net, merges, threads);
+
+    for (int i = 0; merges && i < threads; i++) free(merges[i].sorted);
+    for (int i = 0; workers && i < threads; i++) {
+        for (int s = 0; workers[i].tables && s < threads; s++) free(workers[i].tables[s].slots);
+        free(workers[i].tables);
+        pool_release(&workers[i].entries);
+        pool_release(&workers[i].names);
+    }
+    free(workers);
+    free(merges);
+    return status;
+}
@@ -0,0 +1,43 @@
+/*
+ * shard.h
+ *
+ * Parallel loading of the histogram aggregates.
+ * The data file is cut into one byte range per thread (on line boundaries).
+ * Each worker parses its range and sums the rows into hash tables, one per
+ * shard, a shard being the set of identifiers with the same hash partition.
+ * Shard s of every worker is then merged by thread s alone, so no locks are
+ * needed, and the merged shards are sorted and combined into the station tree.
+ * Sums are integers, so the result does not depend on the number of threads.
+ */
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "network.h"
+
+/**
+ * Most threads used by a sharded load
+ */
+#define SHARD_MAX_THREADS 64
+
+/**
+ * Number of threads to use when none is requested (online processors)
+ *
+ * @return  Thread count, at least 1
+ */
+int shard_default_threads(void);
+
+/**
+ * Reads the histogram aggregates of a data file with several threads
+ * Builds the same tree as network_load with LOAD_HISTO
+ *
+ * @param net         Network (empty)
+ * @param path        Path of the data file (state, columnar and compressed files
+ *                    and pipes fall back to network_load)
+ * @param histo_mode  HISTO_* aggregates
+ * @param threads     Number of threads (clamped to 1..SHARD_MAX_THREADS)
+ * @return            0 on success, -1 if the file cannot be read
+ */
+int network_load_sharded(Network* net, const char* path, int histo_mode, int threads);
+
+#endif /* SHARD_H */
@@ -0,0 +1,610 @@
+/*
+ * spill.c
+ *
+ * External-memory histogram aggregation (see spill.h).
+ * Run records: uint32 identifier length, identifier bytes, then capacity,
+ * consumption and real_qty as int64, in the native byte order.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "spill.h"
+#include "avl.h"
+#include "chart.h"
+#include "pool.h"
+
+// Longest identifier of a record (data lines are read in 1024-byte buffers)
+#define SPILL_NAME_MAX 1024
+
+// stdio buffer of each run
+#define SPILL_IO_BUFFER (256 * 1024)
+
+/**
+ * Record read back from a run
+ */
+typedef struct {
+    Station st;                   // Values (st.name points to name)
+    char name[SPILL_NAME_MAX];    // Identifier
+} SpillRow;
+
+/**
+ * K-way merge of sorted runs
+ * Rows with the same identifier are summed into one
+ */
+typedef struct {
+    FILE** runs;        // Inputs
+    SpillRow* heads;    // Current record of each input
+    int* heap;          // Min-heap of input indices
+    int size;           // Inputs not exhausted
+    int metric;         // Order of the runs (METRIC_NAME: identifier only)
+    int error;          // Non-zero after a read error
+} Merge;
+
+/**
+ * Rows kept for a top-K or bottom-K block
+ */
+typedef struct {
+    Station* rows;      // Copies (identifiers allocated)
+    long capacity;      // K
+    long count;         // Rows kept
+    long first;         // Oldest row of the ring (top block)
+} RowBlock;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Creates an anonymous temporary run (deleted when closed)
+ */
+static FILE* new_run(void) {
+    FILE* f = tmpfile();
+    if (!f) {
+        fprintf(stderr, "Error: unable to create a temporary file\n");
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, SPILL_IO_BUFFER);
+    return f;
+}
+
+/**
+ * Appends a run to an array of runs
+ *
+ * @return  0 on success, -1 on allocation failure
+ */
+static int add_run(FILE*** runs, int* count, int* capacity, FILE* run) {
+    if (*count == *capacity) {
+        int cap = *capacity ? *capacity * 2 : 16;
+        FILE** grown = realloc(*runs, cap * sizeof(FILE*));
+        if (!grown) return -1;
+        *runs = grown;
+        *capacity = cap;
+    }
+    (*runs)[(*count)++] = run;
+    return 0;
+}
+
+/**
+ * Writes one record
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int write_record(FILE* f, const Station* s) {
+    uint32_t len = (uint32_t)strlen(s->name);
+    int64_t v[3] = { s->capacity, s->consumption, s->real_qty };
+    if (len >= SPILL_NAME_MAX) return -1;
+    if (fwrite(&len, sizeof(len), 1, f) != 1) return -1;
+    if (fwrite(s->name, 1, len, f) != len) return -1;
+    if (fwrite(v, sizeof(v), 1, f) != 1) return -1;
+    return 0;
+}
+
+/**
+ * Reads one record
+ *
+ * @return  1 if a record was read, 0 at the end of the run, -1 on error
+ */
+static int read_record(FILE* f, SpillRow* r) {
+    uint32_t len;
+    int64_t v[3];
+    if (fread(&len, sizeof(len), 1, f) != 1) return feof(f) ? 0 : -1;
+    if (len >= SPILL_NAME_MAX || fread(r->name, 1, len, f) != len) return -1;
+    if (fread(v, sizeof(v), 1, f) != 1) return -1;
+    r->name[len] = '\0';
+    r->st.name = r->name;
+    r->st.capacity = (long)v[0];
+    r->st.consumption = (long)v[1];
+    r->st.real_qty = (long)v[2];
+    return 1;
+}
+
+/**
+ * Writes the stations of a tree in identifier order
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int write_tree(FILE* f, Station* node) {
+    if (!node) return 0;
+    if (write_tree(f, node->left) != 0) return -1;
+    if (write_record(f, node) != 0) return -1;
+    return write_tree(f, node->right);
+}
+
+/**
+ * Orders two rows by metric value, then by identifier
+ */
+static int compare_rows(const Station* a, const Station* b, int metric) {
+    if (metric != METRIC_NAME) {
+        long va = station_metric(a, metric);
+        long vb = station_metric(b, metric);
+        if (va != vb) return (va < vb) ? -1 : 1;
+    }
+    return strcmp(a->name, b->name);
+}
+
+/**
+ * Restores the merge heap downwards from position i
+ */
+static void merge_sift_down(Merge* m, int i) {
+    for (;;) {
+        int least = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < m->size && compare_rows(&m->heads[m->heap[l]].st,
+                                        &m->heads[m->heap[least]].st, m->metric) < 0) {
+            least = l;
+        }
+        if (r < m->size && compare_rows(&m->heads[m->heap[r]].st,
+                                        &m->heads[m->heap[least]].st, m->metric) < 0) {
+            least = r;
+        }
+        if (least == i) return;
+        int tmp = m->heap[i];
+        m->heap[i] = m->heap[least];
+        m->heap[least] = tmp;
+        i = least;
+    }
+}
+
+/**
+ * Reads the next record of the input at the top of the heap
+ */
+static void merge_advance(Merge* m) {
+    int input = m->heap[0];
+    int r = read_record(m->runs[input], &m->heads[input]);
+    if (r < 0) m->error = 1;
+    if (r <= 0) m->heap[0] = m->heap[--m->size];
+    if (m->size > 0) merge_sift_down(m, 0);
+}
+
+/**
+ * Starts merging runs (each run is read from its beginning)
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int merge_open(Merge* m, FILE** runs, int count, int metric) {
+    m->runs = runs;
+    m->heads = malloc((count > 0 ? count : 1) * sizeof(SpillRow));
+    m->heap = malloc((count > 0 ? count : 1) * sizeof(int));
+    m->size = 0;
+    m->metric = metric;
+    m->error = 0;
+    if (!m->heads || !m->heap) return -1;
+
+    for (int i = 0; i < count; i++) {
+        rewind(runs[i]);
+        int r = read_record(runs[i], &m->heads[i]);
+        if (r < 0) m->error = 1;
+        if (r > 0) m->heap[m->size++] = i;
+    }
+    for (int i = m->size / 2 - 1; i >= 0; i--) merge_sift_down(m, i);
+    return m->error ? -1 : 0;
+}
+
+/**
+ * Returns the next merged row, identical identifiers summed
+ *
+ * @return  1 if a row was produced, 0 at the end, -1 on error
+ */
+static int merge_next(Merge* m, SpillRow* out) {
+    if (m->error) return -1;
+    if (m->size == 0) return 0;
+
+    const SpillRow* top = &m->heads[m->heap[0]];
+    memcpy(out->name, top->name, strlen(top->name) + 1);
+    out->st.name = out->name;
+    out->st.capacity = top->st.capacity;
+    out->st.consumption = top->st.consumption;
+    out->st.real_qty = top->st.real_qty;
+    merge_advance(m);
+
+    while (m->size > 0 && strcmp(m->heads[m->heap[0]].name, out->name) == 0) {
+        top = &m->heads[m->heap[0]];
+        out->st.capacity += top->st.capacity;
+        out->st.consumption += top->st.consumption;
+        out->st.real_qty += top->st.real_qty;
+        merge_advance(m);
+    }
+    return m->error ? -1 : 1;
+}
+
+/**
+ * Releases a merge (the runs stay open)
+ */
+static void merge_close(Merge* m) {
+    free(m->heads);
+    free(m->heap);
+}
+
+/**
+ * Merges runs in passes until at most SPILL_MAX_FANIN remain
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int reduce_runs(FILE*** runs, int* count, int* capacity, int metric) {
+    while (*count > SPILL_MAX_FANIN) {
+        FILE** next = NULL;
+        int next_count = 0;
+        int next_cap = 0;
+
+        for (int start = 0; start < *count; start += SPILL_MAX_FANIN) {
+            int n = (*count - start < SPILL_MAX_FANIN) ? *count - start : SPILL_MAX_FANIN;
+            FILE* run = new_run();
+            Merge m;
+            int status = (run && merge_open(&m, *runs + start, n, metric) == 0) ? 0 : -1;
+
+            SpillRow* row = malloc(sizeof(SpillRow));
+            int r = 0;
+            while (status == 0 && row && (r = merge_next(&m, row)) > 0) {
+                if (write_record(run, &row->st) != 0) status = -1;
+            }
+            if (!row || r < 0) status = -1;
+            free(row);
+            merge_close(&m);
+
+            for (int i = start; i < start + n; i++) {
+                fclose((*runs)[i]);
+                (*runs)[i] = NULL;
+            }
+            if (status != 0 || add_run(&next, &next_count, &next_cap, run) != 0) {
+                if (run) fclose(run);
+                for (int i = 0; i < next_count; i++) fclose(next[i]);
+                for (int i = start + n; i < *count; i++) fclose((*runs)[i]);
+                free(next);
+                *count = 0;
+                return -1;
+            }
+        }
+
+        free(*runs);
+        *runs = next;
+        *count = next_count;
+        *capacity = next_cap;
+    }
+    return 0;
+}
+
+/**
+ * Copies a row into a block slot (the identifier is duplicated)
+ *
+ * @return  0 on success, -1 on allocation failure
+ */
+static int block_store(Station* slot, const Station* row) {
+    size_t len = strlen(row->name) + 1;
+    char* name = realloc(slot->name, len);
+    if (!name) return -1;
+    memcpy(name, row->name, len);
+    *slot = *row;
+    slot->name = name;
+    return 0;
+}
+
+/**
+ * Keeps the first K rows (bottom block)
+ */
+static int block_keep_first(RowBlock* b, const Station* row) {
+    if (b->count >= b->capacity) return 0;
+    return block_store(&b->rows[b->count++], row);
+}
+
+/**
+ * Keeps the last K rows in a ring (top block)
+ */
+static int block_keep_last(RowBlock* b, const Station* row) {
+    if (b->capacity == 0) return 0;
+    if (b->count < b->capacity) return block_store(&b->rows[b->count++], row);
+    int status = block_store(&b->rows[b->first], row);
+    b->first = (b->first + 1) % b->capacity;
+    return status;
+}
+
+/**
+ * Writes the rows of a block, oldest first
+ */
+static void block_write(const RowBlock* b, OutBuffer* out, RowWriter writer) {
+    for (long i = 0; i < b->count; i++) {
+        writer(out, &b->rows[(b->first + i) % b->count]);
+    }
+}
+
+/**
+ * Draws the charts of the bottom and top blocks (oldest rows first)
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int block_charts(const RowBlock* bottom, const RowBlock* top, const char* mode,
+                        const RankOptions* opts) {
+    Station** rows = malloc((bottom->count + top->count + 1) * sizeof(Station*));
+    if (!rows) return -1;
+    for (long i = 0; i < bottom->count; i++) {
+        rows[i] = &bottom->rows[(bottom->first + i) % bottom->count];
+    }
+    for (long i = 0; i < top->count; i++) {
+        rows[bottom->count + i] = &top->rows[(top->first + i) % top->count];
+    }
+    int status = chart_write_selection(opts->chart, opts->chart_format, mode, rows, bottom->count,
+                                       rows + bottom->count, top->count);
+    free(rows);
+    return status;
+}
+
+/**
+ * Initializes a block of K rows
+ */
+static int block_init(RowBlock* b, long k) {
+    b->capacity = (k > 0) ? k : 0;
+    b->count = 0;
+    b->first = 0;
+    b->rows = calloc(b->capacity > 0 ? b->capacity : 1, sizeof(Station));
+    return b->rows ? 0 : -1;
+}
+
+/**
+ * Releases a block
+ */
+static void block_free(RowBlock* b) {
+    for (long i = 0; i < b->count; i++) free(b->rows[i].name);
+    free(b->rows);
+}
+
+/**
+ * Writes the visible rows of the identifier-ordered runs as sorted runs on a metric
+ * Rows are buffered up to the memory budget, then radix sorted and written
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int sort_by_metric(Spill* s, RowFilter visible, int metric,
+                          FILE*** runs, int* count, int* capacity) {
+    Merge m;
+    if (merge_open(&m, s->runs, s->count, METRIC_NAME) != 0) {
+        merge_close(&m);
+        return -1;
+    }
+
+    Pool pool = POOL_INIT;
+    Station** rows = NULL;
+    long n = 0;
+    long cap = 0;
+    int status = 0;
+    int r;
+    SpillRow* row = malloc(sizeof(SpillRow));
+    if (!row) status = -1;
+
+    while (status == 0) {
+        r = merge_next(&m, row);
+        if (r < 0) status = -1;
+        if (r > 0 && !visible(&row->st)) continue;
+
+        // Buffer full or input exhausted: sort and write a run
+        if (n > 0 && (r <= 0 || pool.allocated > s->limit)) {
+            FILE* run = new_run();
+            if (!run || radix_sort_stations(rows, n, metric) != 0) status = -1;
+            for (long i = 0; status == 0 && i < n; i++) {
+                if (write_record(run, rows[i]) != 0) status = -1;
+            }
+            if (status == 0 && add_run(runs, count, capacity, run) != 0) status = -1;
+            if (status != 0 && run) fclose(run);
+            pool_release(&pool);
+            n = 0;
+        }
+        if (r <= 0) break;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 4096;
+            Station** grown = realloc(rows, cap * sizeof(Station*));
+            if (!grown) {
+                status = -1;
+                break;
+            }
+            rows = grown;
+        }
+        Station* copy = pool_alloc(&pool, sizeof(Station));
+        *copy = row->st;
+        copy->name = pool_strdup(&pool, row->name);
+        rows[n++] = copy;
+    }
+
+    pool_release(&pool);
+    free(rows);
+    free(row);
+    merge_close(&m);
+    return status;
+}
+
+/**
+ * Streams the final rows to the outputs
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int emit_rows(FILE** runs, int count, int metric, OutBuffer* out, const char* mode,
+                     const RankOptions* opts, RowWriter writer, RowFilter visible) {
+    int selecting = (opts->top > 0 || opts->bottom > 0);
+    RowBlock bottom, top;
+    Merge m;
+    FILE* csv = NULL;
+    OutBuffer csv_out;
+    int status = 0;
+
+    if (block_init(&bottom, opts->bottom) != 0) return -1;
+    if (block_init(&top, opts->top) != 0) {
+        block_free(&bottom);
+        return -1;
+    }
+
+    if (opts->csv_path) {
+        csv = fopen(opts->csv_path, "w");
+        if (!csv || out_open_stream(&csv_out, csv) != 0) {
+            fprintf(stderr, "Error: unable to open %s\n", opts->csv_path);
+            if (csv) fclose(csv);
+            csv = NULL;
+            status = -1;
+        }
+    }
+
+    SpillRow* row = malloc(sizeof(SpillRow));
+    if (!row || merge_open(&m, runs, count, metric) != 0) status = -1;
+
+    int r = 0;
+    while (status == 0 && (r = merge_next(&m, row)) > 0) {
+        if (!visible(&row->st)) continue;
+        if (csv) writer(&csv_out, &row->st);
+        if (selecting) {
+            if (block_keep_first(&bottom, &row->st) != 0 ||
+                block_keep_last(&top, &row->st) != 0) {
+                status = -1;
+            }
+        } else if (!csv) {
+            writer(out, &row->st);
+        }
+    }
+    if (r < 0) status = -1;
+    if (row) merge_close(&m);
+    free(row);
+
+    if (csv) {
+        if (out_close(&csv_out) != 0) status = -1;
+        fclose(csv);
+    }
+
+    if (status == 0 && selecting) {
+        // Same layout as the in-memory selection: bottom block, then top block
+        if (opts->bottom > 0) block_write(&bottom, out, writer);
+        if (opts->bottom > 0 && opts->top > 0) out_write(out, "\n\n", 2);
+        if (opts->top > 0) block_write(&top, out, writer);
+        if (opts->chart && block_charts(&bottom, &top, mode, opts) != 0) status = -1;
+    }
+
+    block_free(&bottom);
+    block_free(&top);
+    return status;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Parses a memory budget: a number of megabytes, or a number followed by K, M or G
+ *
+ * @param text  Budget text
+ * @return      Budget in bytes, 0 if the text is invalid
+ */
+size_t spill_parse_limit(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value <= 0) return 0;
+
+    double unit = 1024.0 * 1024.0;
+    if (*end == 'K' || *end == 'k') unit = 1024.0;
+    else if (*end == 'G' || *end == 'g') unit = 1024.0 * 1024.0 * 1024.0;
+    else if (*end != '\0' && *end != 'M' && *end != 'm') return 0;
+    if (*end != '\0' && end[1] != '\0') return 0;
+
+    return (size_t)(value * unit);
+}
+
+/**
+ * Initializes an empty set of runs
+ *
+ * @param s      Runs
+ * @param limit  Memory budget in bytes (raised to SPILL_MIN_LIMIT)
+ */
+void spill_init(Spill* s, size_t limit) {
+    s->limit = (limit < SPILL_MIN_LIMIT) ? SPILL_MIN_LIMIT : limit;
+    s->runs = NULL;
+    s->count = 0;
+    s->capacity = 0;
+    s->rows = 0;
+}
+
+/**
+ * Writes a tree as a new sorted run (the tree is left untouched)
+ *
+ * @param s     Runs
+ * @param root  Root of the tree
+ * @return      0 on success, -1 on failure
+ */
+int spill_tree(Spill* s, Station* root) {
+    FILE* run = new_run();
+    if (!run) return -1;
+    if (write_tree(run, root) != 0 || fflush(run) != 0 ||
+        add_run(&s->runs, &s->count, &s->capacity, run) != 0) {
+        fclose(run);
+        return -1;
+    }
+    s->rows += count_stations(root);
+    return 0;
+}
+
+/**
+ * Writes a histogram from the runs and the stations still in memory
+ * Produces exactly the output of write_histogram on the complete tree
+ *
+ * @param s     Runs
+ * @param root  Stations aggregated since the last run (may be NULL)
+ * @param out   Output buffer
+ * @param mode  Data type ("max", "src", "real" or "all")
+ * @param opts  Ranking options (defaults applied)
+ * @return      0 on success, -1 on failure
+ */
+int spill_write_histogram(Spill* s, Station* root, OutBuffer* out, const char* mode,
+                          const RankOptions* opts) {
+    RowWriter writer = row_writer_for_mode(mode);
+    RowFilter visible = row_filter_for_mode(mode);
+    if (!writer || !visible) return -1;
+
+    if (root && spill_tree(s, root) != 0) return -1;
+    fprintf(stderr, "Merging %d sorted run(s) of %ld partial rows\n", s->count, s->rows);
+    if (reduce_runs(&s->runs, &s->count, &s->capacity, METRIC_NAME) != 0) return -1;
+
+    if (opts->sort_metric == METRIC_NAME) {
+        return emit_rows(s->runs, s->count, METRIC_NAME, out, mode, opts, writer, visible);
+    }
+
+    // Second external sort on the metric
+    FILE** runs = NULL;
+    int count = 0;
+    int capacity = 0;
+    int status = sort_by_metric(s, visible, opts->sort_metric, &runs, &count, &capacity);
+    if (status == 0) status = reduce_runs(&runs, &count, &capacity, opts->sort_metric);
+    if (status == 0) status = emit_rows(runs, count, opts->sort_metric, out, mode, opts, writer, visible);
+
+    for (int i = 0; i < count; i++) fclose(runs[i]);
+    free(runs);
+    return status;
+}
+
+/**
+ * Closes and deletes every run
+ *
+ * @param s  Runs
+ */
+void spill_free(Spill* s) {
+    for (int i = 0; i < s->count; i++) {
+        if (s->runs[i]) fclose(s->runs[i]);
+    }
+    free(s->runs);
+    spill_init(s, s->limit);
+}
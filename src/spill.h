@@ -0,0 +1,88 @@
+/*
+ * spill.h
+ *
+ * External-memory histogram aggregation.
+ * When the station tree grows past a memory budget it is written as a
+ * sorted run of partial sums (identifier, capacity, consumption, real_qty)
+ * to an anonymous temporary file and released. At the end the runs are
+ * merged k-way, summing equal identifiers, and the rows are streamed to the
+ * output; metric orderings go through a second external sort.
+ */
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "structs.h"
+#include "output.h"
+#include "rank.h"
+
+/**
+ * Maximum number of runs merged at once (more runs are merged in passes)
+ */
+#define SPILL_MAX_FANIN 64
+
+/**
+ * Smallest memory budget (the tree pools grow by POOL_CHUNK_SIZE chunks)
+ */
+#define SPILL_MIN_LIMIT (4 * 1024 * 1024)
+
+/**
+ * Sorted runs of a histogram
+ */
+typedef struct Spill {
+    size_t limit;     // Memory budget of the in-memory tree, in bytes
+    FILE** runs;      // Runs sorted by identifier (anonymous temporary files)
+    int count;        // Number of runs
+    int capacity;     // Allocated run slots
+    long rows;        // Rows written to the runs
+} Spill;
+
+/**
+ * Parses a memory budget: a number of megabytes, or a number followed by K, M or G
+ *
+ * @param text  Budget text
+ * @return      Budget in bytes, 0 if the text is invalid
+ */
+size_t spill_parse_limit(const char* text);
+
+/**
+ * Initializes an empty set of runs
+ *
+ * @param s      Runs
+ * @param limit  Memory budget in bytes (raised to SPILL_MIN_LIMIT)
+ */
+void spill_init(Spill* s, size_t limit);
+
+/**
+ * Writes a tree as a new sorted run (the tree is left untouched)
+ *
+ * @param s     Runs
+ * @param root  Root of the tree
+ * @return      0 on success, -1 on failure
+ */
+int spill_tree(Spill* s, Station* root);
+
+/**
+ * Writes a histogram from the runs and the stations still in memory
+ * Produces exactly the output of write_histogram on the complete tree
+ *
+ * @param s     Runs
+ * @param root  Stations aggregated since the last run (may be NULL)
+ * @param out   Output buffer
+ * @param mode  Data type ("max", "src", "real" or "all")
+ * @param opts  Ranking options (defaults applied)
+ * @return      0 on success, -1 on failure
+ */
+int spill_write_histogram(Spill* s, Station* root, OutBuffer* out, const char* mode,
+                          const RankOptions* opts);
+
+/**
+ * Closes and deletes every run
+ *
+ * @param s  Runs
+ */
+void spill_free(Spill* s);
+
+#endif /* SPILL_H */
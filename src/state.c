@@ -0,0 +1,534 @@
+/*
+ * state.c
+ *
+ * Binary snapshot of a loaded network (see state.h for the layout).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "state.h"
+#include "avl.h"
+#include "reader.h"
+#include "output.h"
+
+/**
+ * Fixed-size file header
+ */
+typedef struct {
+    char magic[8];        // STATE_MAGIC without terminator
+    uint32_t version;     // STATE_VERSION
+    uint32_t reserved;    // Always 0
+    int64_t stations;     // Number of stations
+    int64_t sections;     // Number of sections
+    int64_t name_bytes;   // Size of the name block
+} StateHeader;
+
+/**
+ * Section record
+ */
+typedef struct {
+    int64_t parent;       // Index of the upstream station
+    int64_t target;       // Index of the downstream station
+    int64_t factory;      // Index of the facility, -1 if none
+    int64_t volume;       // Volume of a source section
+    double leak_perc;     // Leak percentage
+} StateSection;
+
+/**
+ * Header of a journal block (followed by the rows)
+ */
+typedef struct {
+    char magic[8];        // STATE_JOURNAL_MAGIC without terminator
+    uint64_t bytes;       // Size of the rows
+    uint64_t hash;        // FNV-1a hash of the rows
+} JournalBlock;
+
+// Size of the stdio buffer used to write a state
+#define STATE_BUFFER_SIZE (8 * 1024 * 1024)
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * 64-bit FNV-1a hash of the rows of a journal block
+ */
+static uint64_t hash_rows(const char* data, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/**
+ * Reads and checks the header of a state file
+ *
+ * @return  0 on success, -1 if the file is not a supported state
+ */
+static int read_header(FILE* file, StateHeader* h) {
+    if (fread(h, sizeof(*h), 1, file) != 1 ||
+        memcmp(h->magic, STATE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != STATE_VERSION || h->stations < 0 || h->sections < 0 || h->name_bytes < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Size of the snapshot part of a state (offset of its journal)
+ */
+static int64_t snapshot_size(const StateHeader* h) {
+    return (int64_t)sizeof(StateHeader) + h->name_bytes + h->stations * 3 * (int64_t)sizeof(int64_t) +
+           h->sections * (int64_t)sizeof(StateSection);
+}
+
+/**
+ * Size of a regular file, -1 if unknown
+ */
+static int64_t file_size(FILE* file) {
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+    return (int64_t)st.st_size;
+}
+
+/**
+ * Applies the rows of a journal block (lines ending with '\n')
+ */
+static void replay_rows(Network* net, char* data, size_t len, DeltaStats* stats) {
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\n') continue;
+        data[i] = '\0';
+        char* cols[5];
+        if (split_columns(data + start, cols) == 0) network_apply_row(net, cols, stats);
+        start = i + 1;
+    }
+}
+
+/**
+ * Replays the journal blocks from the current position to the end of the file
+ *
+ * @return  Number of blocks replayed, -1 on allocation failure
+ */
+static long replay_journal(Network* net, FILE* file, int64_t remaining, DeltaStats* stats) {
+    long blocks = 0;
+    while (remaining > 0) {
+        JournalBlock b;
+        if (remaining < (int64_t)sizeof(b) || fread(&b, sizeof(b), 1, file) != 1 ||
+            memcmp(b.magic, STATE_JOURNAL_MAGIC, sizeof(b.magic)) != 0 ||
+            b.bytes > (uint64_t)(remaining - (int64_t)sizeof(b))) {
+            fprintf(stderr, "Warning: incomplete journal block ignored\n");
+            break;
+        }
+        char* data = malloc(b.bytes > 0 ? (size_t)b.bytes : 1);
+        if (!data) return -1;
+        if ((b.bytes > 0 && fread(data, (size_t)b.bytes, 1, file) != 1) ||
+            hash_rows(data, (size_t)b.bytes) != b.hash) {
+            fprintf(stderr, "Warning: incomplete journal block ignored\n");
+            free(data);
+            break;
+        }
+        replay_rows(net, data, (size_t)b.bytes, stats);
+        free(data);
+        remaining -= (int64_t)sizeof(b) + (int64_t)b.bytes;
+        blocks++;
+    }
+    return blocks;
+}
+
+/**
+ * Stores the stations of a tree in identifier order
+ *
+ * @param node  Root of the tree
+ * @param out   Destination array
+ * @param pos   Next free index (updated)
+ */
+static void collect_stations(Station* node, Station** out, long* pos) {
+    if (!node) return;
+    collect_stations(node->left, out, pos);
+    out[(*pos)++] = node;
+    collect_stations(node->right, out, pos);
+}
+
+/**
+ * Finds the index of a station in the sorted station array
+ *
+ * @param sorted  Stations in identifier order
+ * @param count   Number of stations
+ * @param s       Station to find (NULL gives -1)
+ * @return        Index of the station, -1 if absent
+ */
+static int64_t station_index(Station** sorted, long count, const Station* s) {
+    if (!s) return -1;
+    long lo = 0;
+    long hi = count;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(s->name, sorted[mid]->name);
+        if (cmp == 0) return mid;
+        if (cmp < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return -1;
+}
+
+/**
+ * Writes the whole state to an open stream
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int write_body(FILE* f, Station** sorted, long count) {
+    StateHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STATE_MAGIC, sizeof(h.magic));
+    h.version = STATE_VERSION;
+    h.stations = count;
+    for (long i = 0; i < count; i++) {
+        h.name_bytes += (int64_t)strlen(sorted[i]->name) + 1;
+        h.sections += sorted[i]->nb_children;
+    }
+    if (fwrite(&h, sizeof(h), 1, f) != 1) return -1;
+
+    for (long i = 0; i < count; i++) {
+        const char* name = sorted[i]->name;
+        if (fwrite(name, strlen(name) + 1, 1, f) != 1) return -1;
+    }
+
+    for (long i = 0; i < count; i++) {
+        int64_t v[3] = { sorted[i]->capacity, sorted[i]->consumption, sorted[i]->real_qty };
+        if (fwrite(v, sizeof(v), 1, f) != 1) return -1;
+    }
+
+    for (long i = 0; i < count; i++) {
+        for (AdjNode* e = sorted[i]->children; e; e = e->next) {
+            StateSection rec;
+            rec.parent = i;
+            rec.target = station_index(sorted, count, e->target);
+            rec.factory = station_index(sorted, count, e->factory);
+            rec.volume = e->volume;
+            rec.leak_perc = e->leak_perc;
+            if (fwrite(&rec, sizeof(rec), 1, f) != 1) return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads the name block and checks that it holds count sorted identifiers
+ *
+ * @param file   State file
+ * @param h      Header of the file
+ * @param block  Receives the allocated name block
+ * @param names  Receives the allocated array of identifiers
+ * @return       0 on success, -1 on failure
+ */
+static int read_names(FILE* file, const StateHeader* h, char** block, char*** names) {
+    *block = NULL;
+    *names = NULL;
+    if (h->name_bytes < h->stations) return -1;
+
+    char* data = malloc(h->name_bytes > 0 ? (size_t)h->name_bytes : 1);
+    char** list = malloc((h->stations > 0 ? (size_t)h->stations : 1) * sizeof(char*));
+    if (!data || !list) {
+        free(data);
+        free(list);
+        return -1;
+    }
+
+    int ok = (h->name_bytes == 0 || fread(data, (size_t)h->name_bytes, 1, file) == 1);
+
+    int64_t pos = 0;
+    for (int64_t i = 0; ok && i < h->stations; i++) {
+        char* end = memchr(data + pos, '\0', (size_t)(h->name_bytes - pos));
+        if (!end) {
+            ok = 0;
+            break;
+        }
+        list[i] = data + pos;
+        pos = (end - data) + 1;
+        // The tree is built without comparisons: the order must be strict
+        if (i > 0 && strcmp(list[i - 1], list[i]) >= 0) ok = 0;
+    }
+    if (pos != h->name_bytes) ok = 0;
+
+    if (!ok) {
+        free(data);
+        free(list);
+        return -1;
+    }
+    *block = data;
+    *names = list;
+    return 0;
+}
+
+/**
+ * Reads the sections and rebuilds the adjacency lists in their original order
+ *
+ * @return  0 on success, -1 on failure
+ */
+static int read_sections(FILE* file, const StateHeader* h, Station** nodes) {
+    AdjNode* tail = NULL;
+    int64_t tail_parent = -1;
+
+    for (int64_t i = 0; i < h->sections; i++) {
+        StateSection rec;
+        if (fread(&rec, sizeof(rec), 1, file) != 1) return -1;
+        if (rec.parent < 0 || rec.parent >= h->stations ||
+            rec.target < 0 || rec.target >= h->stations ||
+            rec.factory < -1 || rec.factory >= h->stations) {
+            return -1;
+        }
+
+        AdjNode* e = new_connection();
+        e->target = nodes[rec.target];
+        e->leak_perc = rec.leak_perc;
+        e->factory = (rec.factory >= 0) ? nodes[rec.factory] : NULL;
+        e->volume = rec.volume;
+        e->next = NULL;
+
+        // Sections of a station are stored contiguously: append at the tail
+        Station* parent = nodes[rec.parent];
+        if (rec.parent == tail_parent && tail) {
+            tail->next = e;
+        } else if (!parent->children) {
+            parent->children = e;
+        } else {
+            return -1;
+        }
+        parent->nb_children++;
+        tail = e;
+        tail_parent = rec.parent;
+    }
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Tells whether an open file is a state file (the position is reset)
+ *
+ * @param file  File opened for reading
+ * @return      1 if the file starts with the state signature, 0 otherwise
+ */
+int state_detect(FILE* file) {
+    char magic[8];
+    size_t n = fread(magic, 1, sizeof(magic), file);
+    rewind(file);
+    return n == sizeof(magic) && memcmp(magic, STATE_MAGIC, sizeof(magic)) == 0;
+}
+
+/**
+ * Loads a state file into an empty network
+ * Sections are only read when the spec asks for the graph
+ *
+ * @param net   Empty network
+ * @param file  State file positioned at its beginning
+ * @param spec  What to build
+ * @return      0 on success, -1 if the file is truncated or inconsistent
+ */
+int state_read(Network* net, FILE* file, const LoadSpec* spec) {
+    StateHeader h;
+    if (read_header(file, &h) != 0) {
+        fprintf(stderr, "Error: unsupported or damaged state file\n");
+        return -1;
+    }
+    int64_t size = file_size(file);
+    int64_t journal = (size >= 0) ? size - snapshot_size(&h) : 0;
+    if (journal < 0) {
+        fprintf(stderr, "Error: damaged state file (truncated)\n");
+        return -1;
+    }
+
+    char* block;
+    char** names;
+    if (read_names(file, &h, &block, &names) != 0) {
+        fprintf(stderr, "Error: damaged state file (identifiers)\n");
+        return -1;
+    }
+
+    Station** nodes = malloc((h.stations > 0 ? (size_t)h.stations : 1) * sizeof(Station*));
+    if (!nodes) {
+        free(block);
+        free(names);
+        return -1;
+    }
+    net->root = build_sorted_tree(names, (long)h.stations, nodes);
+    net->station_count = (long)h.stations;
+    free(names);
+    free(block);
+
+    int status = 0;
+    for (int64_t i = 0; i < h.stations; i++) {
+        int64_t v[3];
+        if (fread(v, sizeof(v), 1, file) != 1) {
+            status = -1;
+            break;
+        }
+        nodes[i]->capacity = (long)v[0];
+        nodes[i]->consumption = (long)v[1];
+        nodes[i]->real_qty = (long)v[2];
+        if (v[0] > 0) net->capacity_count++;
+    }
+
+    // Delta rows replace sections: the journal needs the graph
+    if (status == 0 && ((spec->flags & LOAD_GRAPH) || journal > 0)) {
+        status = read_sections(file, &h, nodes);
+        if (status == 0) net->connection_count = (long)h.sections;
+    }
+    free(nodes);
+
+    if (status != 0) {
+        fprintf(stderr, "Error: damaged state file (truncated)\n");
+        return -1;
+    }
+    fprintf(stderr, "State loaded: %ld stations, %ld sections\n",
+            net->station_count, (long)h.sections);
+
+    if (journal > 0) {
+        DeltaStats stats = { 0, 0, 0 };
+        long blocks = replay_journal(net, file, journal, &stats);
+        if (blocks < 0) return -1;
+        fprintf(stderr, "Journal replayed: %ld block(s), %ld rows\n", blocks, stats.rows);
+    }
+    return 0;
+}
+
+/**
+ * Writes a network holding the graph and every aggregate to a state file
+ * The file is replaced atomically
+ *
+ * @param net   Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL)
+ * @param path  Destination file
+ * @return      0 on success, -1 on failure
+ */
+int state_write(const Network* net, const char* path) {
+    long count = count_stations(net->root);
+    Station** sorted = malloc((count > 0 ? (size_t)count : 1) * sizeof(Station*));
+    if (!sorted) return -1;
+    long pos = 0;
+    collect_stations(net->root, sorted, &pos);
+
+    // Written next to the destination, then renamed over it
+    size_t len = strlen(path);
+    char* tmp_path = malloc(len + 5);
+    if (!tmp_path) {
+        free(sorted);
+        return -1;
+    }
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".tmp", 5);
+
+    int status = -1;
+    FILE* f = fopen(tmp_path, "wb");
+    if (f) {
+        char* buffer = malloc(STATE_BUFFER_SIZE);
+        if (buffer) setvbuf(f, buffer, _IOFBF, STATE_BUFFER_SIZE);
+        status = write_body(f, sorted, count);
+        if (fclose(f) != 0) status = -1;
+        free(buffer);
+        if (status == 0 && rename(tmp_path, path) != 0) status = -1;
+        if (status != 0) remove(tmp_path);
+    }
+
+    free(tmp_path);
+    free(sorted);
+    return status;
+}
+
+/**
+ * Tells whether an update can be appended to the journal of a state
+ *
+ * @param path      Input of the update
+ * @param out_path  State the update writes
+ * @return          1 if both are the same state file and its journal still has room, 0 otherwise
+ */
+int state_can_append(const char* path, const char* out_path) {
+    struct stat in_st, out_st;
+    if (stat(path, &in_st) != 0 || stat(out_path, &out_st) != 0 ||
+        in_st.st_dev != out_st.st_dev || in_st.st_ino != out_st.st_ino) {
+        return 0;
+    }
+
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    StateHeader h;
+    int64_t size = file_size(file);
+    int ok = (read_header(file, &h) == 0 && size >= snapshot_size(&h) &&
+              (size - snapshot_size(&h)) * STATE_JOURNAL_RATIO < snapshot_size(&h));
+    fclose(file);
+    return ok;
+}
+
+/**
+ * Appends the rows of delta files to the journal of a state, as one block
+ * Nothing is appended if a delta cannot be read
+ *
+ * @param path    State file
+ * @param deltas  Delta files, in the data file format, in application order
+ * @param count   Number of delta files
+ * @param rows    Receives the number of lines appended
+ * @return        0 on success, 2 if a delta cannot be read, 3 if the state cannot be written
+ */
+int state_append_deltas(const char* path, const char* const* deltas, int count, long* rows) {
+    OutBuffer block;
+    if (out_open_memory(&block, 64 * 1024) != 0) return 3;
+
+    // Every line as the reader returns it, so the replay splits them alike
+    char line[1024];
+    *rows = 0;
+    for (int i = 0; i < count; i++) {
+        LineReader* reader = reader_open(deltas[i]);
+        if (!reader) {
+            out_close(&block);
+            return 2;
+        }
+        while (reader_gets(reader, line, sizeof(line))) {
+            size_t len = strlen(line);
+            out_write(&block, line, len);
+            if (len == 0 || line[len - 1] != '\n') out_write(&block, "\n", 1);
+            (*rows)++;
+        }
+        if (reader_close(reader) != 0) {
+            out_close(&block);
+            return 2;
+        }
+    }
+    if (block.error) {
+        out_close(&block);
+        return 3;
+    }
+
+    JournalBlock b;
+    memset(&b, 0, sizeof(b));
+    memcpy(b.magic, STATE_JOURNAL_MAGIC, sizeof(b.magic));
+    b.bytes = block.len;
+    b.hash = hash_rows(block.data, block.len);
+
+    // A failed append is cut off so the journal ends on a whole block
+    int status = 3;
+    int fd = open(path, O_WRONLY | O_APPEND);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+        if (write_all(fd, (const char*)&b, sizeof(b)) == 0 &&
+            write_all(fd, block.data, block.len) == 0 && fsync(fd) == 0) {
+            status = 0;
+        } else if (ftruncate(fd, st.st_size) != 0) {
+            fprintf(stderr, "Warning: unable to remove the incomplete journal block\n");
+        }
+    }
+    if (fd >= 0 && close(fd) != 0) status = 3;
+    out_close(&block);
+    return status;
+}
@@ -0,0 +1,93 @@
+/*
+ * state.h
+ *
+ * Binary snapshot of a loaded network (graph and every aggregate).
+ * A state is reloaded without parsing or rebalancing, so daily deltas
+ * can be applied to it instead of rebuilding from the full data file.
+ *
+ * A state updated in place is not rewritten: the delta rows are appended
+ * to its journal, so an update costs the size of the deltas. The journal
+ * is replayed at load. Once it reaches 1/STATE_JOURNAL_RATIO of the
+ * snapshot, the next update loads the state and writes a new snapshot
+ * without a journal (compaction).
+ *
+ * Layout (native byte order):
+ *   header    magic, version, station count, connection count, name bytes
+ *   names     NUL-terminated identifiers in strcmp order
+ *   stations  capacity, consumption, real_qty of each station
+ *   sections  parent, target, facility (-1 if none), volume, leak %
+ *             grouped by parent, in adjacency list order
+ *   journal   blocks of delta rows: signature, size, hash, then the rows
+ *             in the data file format, in update order
+ */
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdio.h>
+#include "network.h"
+
+/**
+ * File signature and format version
+ */
+#define STATE_MAGIC "CWWSTATE"
+#define STATE_VERSION 2u
+#define STATE_JOURNAL_MAGIC "CWWDELTA"
+
+/**
+ * The journal is appended to while it stays below 1/STATE_JOURNAL_RATIO of the snapshot
+ */
+#define STATE_JOURNAL_RATIO 4
+
+/**
+ * Tells whether an open file is a state file (the position is reset)
+ *
+ * @param file  File opened for reading
+ * @return      1 if the file starts with the state signature, 0 otherwise
+ */
+int state_detect(FILE* file);
+
+/**
+ * Loads a state file into an empty network, then replays its journal
+ * Sections are only read when the spec asks for the graph or a journal
+ * has to be replayed; an incomplete last journal block is ignored
+ *
+ * @param net   Empty network
+ * @param file  State file positioned at its beginning
+ * @param spec  What to build
+ * @return      0 on success, -1 if the file is truncated or inconsistent
+ */
+int state_read(Network* net, FILE* file, const LoadSpec* spec);
+
+/**
+ * Writes a network holding the graph and every aggregate to a state file
+ * The file is replaced atomically
+ *
+ * @param net   Network loaded with LOAD_GRAPH | LOAD_HISTO (HISTO_ALL)
+ * @param path  Destination file
+ * @return      0 on success, -1 on failure
+ */
+int state_write(const Network* net, const char* path);
+
+/**
+ * Tells whether an update can be appended to the journal of a state
+ *
+ * @param path      Input of the update
+ * @param out_path  State the update writes
+ * @return          1 if both are the same state file and its journal still has room, 0 otherwise
+ */
+int state_can_append(const char* path, const char* out_path);
+
+/**
+ * Appends the rows of delta files to the journal of a state, as one block
+ * Nothing is appended if a delta cannot be read
+ *
+ * @param path    State file
+ * @param deltas  Delta files, in the data file format, in application order
+ * @param count   Number of delta files
+ * @param rows    Receives the number of lines appended
+ * @return        0 on success, 2 if a delta cannot be read, 3 if the state cannot be written
+ */
+int state_append_deltas(const char* path, const char* const* deltas, int count, long* rows);
+
+#endif /* STATE_H */
@@ -16,28 +16,32 @@ typedef struct AdjNode {
     struct Station* target;   // Destination station
     double leak_perc;         // Leak percentage on this section
     struct Station* factory;  // Facility associated with this section
+    long volume;              // Volume captured on a source section (0 otherwise)
     struct AdjNode* next;     // Pointer to next node
 } AdjNode;
 
 /**
  * Hydraulic station (facility, source, storage, etc.)
  * Serves as both a node in the AVL tree and a vertex in the graph
+ * Fields are ordered so that a station fills exactly one 64-byte cache line,
+ * the ones read by tree searches first
  */
 typedef struct Station {
     char* name;           // Unique identifier
 
-    // Volume data (in internal units)
-    long capacity;        // Maximum processing capacity
-    long consumption;     // Volume captured upstream
-    long real_qty;        // Actual volume after losses
-
     // AVL tree fields
-    int height;           // Height of subtree
     struct Station* left; // Left subtree
     struct Station* right;// Right subtree
 
     // Flow graph fields
     AdjNode* children;    // List of outgoing connections
+
+    // Volume data (in internal units)
+    long capacity;        // Maximum processing capacity
+    long consumption;     // Volume captured upstream
+    long real_qty;        // Actual volume after losses
+
+    int height;           // Height of subtree
     int nb_children;      // Number of outgoing connections
 } Station;
 
@@ -53,6 +57,8 @@ typedef struct {
     double* max_leak_val;     // Pointer to track maximum leak
     char** max_from;          // Pointer to track upstream station of critical section
     char** max_to;            // Pointer to track downstream station of critical section
+    struct SectionHeap* worst;// Worst sections of the branch (NULL if not tracked)
+    long nodes;               // Stations visited by the branch (counted only when tracing)
 } LeakTaskData;
 
 #endif /* STRUCTS_H */
\ No newline at end of file
@@ -0,0 +1,242 @@
+/*
+ * trace.c
+ *
+ * Per-thread event buffers and trace-event JSON output (see trace.h).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+#include "output.h"
+
+/**
+ * Recorded event
+ */
+typedef struct {
+    long long ns;        // Time since trace_start
+    const char* name;
+    const char* root;    // NULL if none
+    long nodes;          // Negative if not known
+    char phase;
+} TraceEvent;
+
+/**
+ * Block of events of a thread
+ */
+typedef struct TraceBlock {
+    TraceEvent events[TRACE_BLOCK_EVENTS];
+    int count;
+    struct TraceBlock* next;
+} TraceBlock;
+
+/**
+ * Events of one thread, only written by that thread
+ */
+typedef struct TraceBuffer {
+    int tid;                    // Thread number in the trace (0 = main)
+    TraceBlock* first;
+    TraceBlock* last;
+    struct TraceBuffer* next;   // Next registered buffer
+} TraceBuffer;
+
+int trace_on = 0;
+
+static struct timespec epoch;             // Time of trace_start
+static TraceBuffer* buffers = NULL;       // Registered buffers, most recent first
+static int next_tid = 0;
+static long dropped = 0;                  // Events lost to allocation failures
+static __thread TraceBuffer* local = NULL;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Buffer of the calling thread, registered on its first event (NULL on failure)
+ */
+static TraceBuffer* local_buffer(void) {
+    if (local) return local;
+
+    TraceBuffer* b = calloc(1, sizeof(TraceBuffer));
+    if (!b) return NULL;
+    b->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+
+    // Lock-free push at the head of the list
+    b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&buffers, &b->next, b, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    local = b;
+    return b;
+}
+
+/**
+ * Writes a string as a JSON string literal
+ */
+static void put_json_string(OutBuffer* out, const char* s) {
+    char tmp[8];
+    out_write(out, "\"", 1);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            out_write(out, "\\", 1);
+            out_write(out, s, 1);
+        } else if (c < 0x20) {
+            snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+            out_puts(out, tmp);
+        } else {
+            out_write(out, s, 1);
+        }
+    }
+    out_write(out, "\"", 1);
+}
+
+/**
+ * Writes one event (timestamps in microseconds)
+ */
+static void put_event(OutBuffer* out, int tid, const TraceEvent* e) {
+    char tmp[128];
+    out_puts(out, "{\"name\":");
+    put_json_string(out, e->name);
+    snprintf(tmp, sizeof(tmp), ",\"ph\":\"%c\",\"ts\":%lld.%03lld,\"pid\":1,\"tid\":%d",
+             e->phase, e->ns / 1000, e->ns % 1000, tid);
+    out_puts(out, tmp);
+    if (e->phase == TRACE_INSTANT) out_puts(out, ",\"s\":\"t\"");
+
+    if (e->root || e->nodes >= 0) {
+        out_puts(out, ",\"args\":{");
+        if (e->root) {
+            out_puts(out, "\"root\":");
+            put_json_string(out, e->root);
+        }
+        if (e->nodes >= 0) {
+            snprintf(tmp, sizeof(tmp), "%s\"nodes\":%ld", e->root ? "," : "", e->nodes);
+            out_puts(out, tmp);
+        }
+        out_write(out, "}", 1);
+    }
+    out_write(out, "}", 1);
+}
+
+/**
+ * Releases every buffer
+ */
+static void release_buffers(void) {
+    TraceBuffer* b = buffers;
+    while (b) {
+        TraceBuffer* next = b->next;
+        TraceBlock* blk = b->first;
+        while (blk) {
+            TraceBlock* following = blk->next;
+            free(blk);
+            blk = following;
+        }
+        free(b);
+        b = next;
+    }
+    buffers = NULL;
+    local = NULL;
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Starts recording (the calling thread is shown as "main")
+ */
+void trace_start(void) {
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+    local_buffer();
+    trace_on = 1;
+}
+
+/**
+ * Records an event on the calling thread
+ *
+ * @param phase  TRACE_BEGIN, TRACE_END or TRACE_INSTANT
+ * @param name   Event name
+ * @param root   Station at the root of the work (NULL if none)
+ * @param nodes  Number of stations of the work (negative if not known)
+ */
+void trace_event(char phase, const char* name, const char* root, long nodes) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    TraceBuffer* b = local_buffer();
+    if (!b) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (!b->last || b->last->count == TRACE_BLOCK_EVENTS) {
+        TraceBlock* blk = malloc(sizeof(TraceBlock));
+        if (!blk) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        blk->count = 0;
+        blk->next = NULL;
+        if (b->last) b->last->next = blk;
+        else b->first = blk;
+        b->last = blk;
+    }
+
+    TraceEvent* e = &b->last->events[b->last->count++];
+    e->ns = (long long)(now.tv_sec - epoch.tv_sec) * 1000000000LL + (now.tv_nsec - epoch.tv_nsec);
+    e->name = name;
+    e->root = root;
+    e->nodes = nodes;
+    e->phase = phase;
+}
+
+/**
+ * Writes the recorded events as a trace-event JSON document, then stops
+ * recording and releases the buffers
+ *
+ * @param path  Destination file
+ * @return      0 on success, -1 on failure
+ */
+int trace_write(const char* path) {
+    trace_on = 0;
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        release_buffers();
+        return -1;
+    }
+
+    OutBuffer out;
+    int status = -1;
+    if (out_open_stream(&out, file) == 0) {
+        char tmp[128];
+        int first = 1;
+        out_puts(&out, "{\"traceEvents\":[\n");
+        for (TraceBuffer* b = buffers; b; b = b->next) {
+            // Row label of the thread
+            char label[32];
+            if (b->tid == 0) snprintf(label, sizeof(label), "main");
+            else snprintf(label, sizeof(label), "worker %d", b->tid);
+            snprintf(tmp, sizeof(tmp), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                     "\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", b->tid, label);
+            out_puts(&out, tmp);
+            first = 0;
+
+            for (TraceBlock* blk = b->first; blk; blk = blk->next) {
+                for (int i = 0; i < blk->count; i++) {
+                    out_puts(&out, ",\n");
+                    put_event(&out, b->tid, &blk->events[i]);
+                }
+            }
+        }
+        out_puts(&out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        status = out_close(&out);
+    }
+    if (fclose(file) != 0) status = -1;
+
+    if (dropped > 0) fprintf(stderr, "Warning: %ld trace events lost\n", dropped);
+    release_buffers();
+    return status;
+}
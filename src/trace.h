@@ -0,0 +1,59 @@
+/*
+ * trace.h
+ *
+ * Timeline of the scheduler and the leak engine, written in the Chrome
+ * trace-event format (JSON), which chrome://tracing and Perfetto display as
+ * one row per thread.
+ *
+ * Each thread appends its events to its own buffer, registered once in a
+ * lock-free list: recording takes no lock and threads do not share cache
+ * lines. When tracing is off, a recording point costs one test of trace_on.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * Event kinds (trace-event phases)
+ */
+#define TRACE_BEGIN 'B'     // Start of a span on the calling thread
+#define TRACE_END 'E'       // End of the last span started on the calling thread
+#define TRACE_INSTANT 'i'   // Point in time on the calling thread
+
+/**
+ * Events stored in each block of a thread buffer
+ */
+#define TRACE_BLOCK_EVENTS 4096
+
+/**
+ * Set while events are recorded: test it before calling trace_event
+ */
+extern int trace_on;
+
+/**
+ * Starts recording (the calling thread is shown as "main")
+ */
+void trace_start(void);
+
+/**
+ * Records an event on the calling thread
+ * The strings are not copied: they must live until trace_write
+ *
+ * @param phase  TRACE_BEGIN, TRACE_END or TRACE_INSTANT
+ * @param name   Event name
+ * @param root   Station at the root of the work (NULL if none)
+ * @param nodes  Number of stations of the work (negative if not known)
+ */
+void trace_event(char phase, const char* name, const char* root, long nodes);
+
+/**
+ * Writes the recorded events as a trace-event JSON document, then stops
+ * recording and releases the buffers
+ * Every traced thread must have finished
+ *
+ * @param path  Destination file
+ * @return      0 on success, -1 on failure
+ */
+int trace_write(const char* path);
+
+#endif /* TRACE_H */
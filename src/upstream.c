@@ -0,0 +1,465 @@
+/*
+ * upstream.c
+ *
+ * Reverse adjacency index and upstream attribution queries (see upstream.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "upstream.h"
+
+// Initial number of slots of the reverse index
+#define REVERSE_INITIAL_SLOTS 1024
+
+/**
+ * Stations of a query, numbered in discovery order
+ */
+typedef struct {
+    Station** nodes;   // Station of each number
+    long count;        // Stations
+    long capacity;     // Allocated entries of nodes
+    long* slots;       // Hash table of numbers (-1 = empty)
+    long mask;         // Hash table size - 1
+} LocalMap;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Hash slot of a station address
+ */
+static long slot_of(const Station* s, long mask) {
+    uint64_t h = (uint64_t)(uintptr_t)s;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (long)(h & (uint64_t)mask);
+}
+
+/**
+ * Slot of a station in the reverse index, or the empty slot where it belongs
+ */
+static long reverse_slot(const ReverseIndex* r, const Station* s) {
+    long h = slot_of(s, r->mask);
+    while (r->keys[h] && r->keys[h] != s) h = (h + 1) & r->mask;
+    return h;
+}
+
+/**
+ * Doubles the slots of the reverse index
+ */
+static int reverse_grow(ReverseIndex* r) {
+    long old_size = r->mask + 1;
+    Station** old_keys = r->keys;
+    ParentLink** old_heads = r->heads;
+
+    r->keys = calloc(old_size * 2, sizeof(Station*));
+    r->heads = calloc(old_size * 2, sizeof(ParentLink*));
+    if (!r->keys || !r->heads) {
+        free(r->keys);
+        free(r->heads);
+        r->keys = old_keys;
+        r->heads = old_heads;
+        return -1;
+    }
+    r->mask = old_size * 2 - 1;
+    for (long i = 0; i < old_size; i++) {
+        if (!old_keys[i]) continue;
+        long h = reverse_slot(r, old_keys[i]);
+        r->keys[h] = old_keys[i];
+        r->heads[h] = old_heads[i];
+    }
+    free(old_keys);
+    free(old_heads);
+    return 0;
+}
+
+/**
+ * Indexes the sections of a subtree
+ */
+static int build_node(ReverseIndex* r, Station* node) {
+    if (!node) return 0;
+    for (AdjNode* e = node->children; e; e = e->next) {
+        if (reverse_add(r, node, e) != 0) return -1;
+    }
+    if (build_node(r, node->left) != 0) return -1;
+    return build_node(r, node->right);
+}
+
+/**
+ * Number of a station in a query, -1 if it is not part of it
+ */
+static long local_find(const LocalMap* m, const Station* s) {
+    long h = slot_of(s, m->mask);
+    while (m->slots[h] >= 0) {
+        if (m->nodes[m->slots[h]] == s) return m->slots[h];
+        h = (h + 1) & m->mask;
+    }
+    return -1;
+}
+
+/**
+ * Numbers a station (not already part of the query)
+ *
+ * @return  0 on success, -1 on allocation failure
+ */
+static int local_add(LocalMap* m, Station* s) {
+    if (m->count == m->capacity) {
+        long cap = m->capacity * 2;
+        Station** nodes = realloc(m->nodes, cap * sizeof(Station*));
+        long* slots = malloc(cap * 2 * sizeof(long));
+        if (!nodes || !slots) {
+            if (nodes) m->nodes = nodes;
+            free(slots);
+            return -1;
+        }
+        m->nodes = nodes;
+        m->capacity = cap;
+        free(m->slots);
+        m->slots = slots;
+        m->mask = cap * 2 - 1;
+        memset(m->slots, 0xff, cap * 2 * sizeof(long));
+        for (long i = 0; i < m->count; i++) {
+            long h = slot_of(m->nodes[i], m->mask);
+            while (m->slots[h] >= 0) h = (h + 1) & m->mask;
+            m->slots[h] = i;
+        }
+    }
+    long h = slot_of(s, m->mask);
+    while (m->slots[h] >= 0) h = (h + 1) & m->mask;
+    m->slots[h] = m->count;
+    m->nodes[m->count++] = s;
+    return 0;
+}
+
+/**
+ * Appends a line to an answer
+ */
+static int add_line(UpstreamResult* res, Station* station, Station* facility,
+                    double volume, double loss) {
+    if (res->count == res->capacity) {
+        long cap = res->capacity ? res->capacity * 2 : 16;
+        UpstreamLine* lines = realloc(res->lines, cap * sizeof(UpstreamLine));
+        if (!lines) return -1;
+        res->lines = lines;
+        res->capacity = cap;
+    }
+    UpstreamLine* l = &res->lines[res->count++];
+    l->station = station;
+    l->facility = facility;
+    l->volume = volume;
+    l->loss = loss;
+    return 0;
+}
+
+/**
+ * Tells whether a section carries the water of a facility
+ */
+static int section_valid(const AdjNode* e, const Station* facility) {
+    return e->factory == NULL || e->factory == facility;
+}
+
+/**
+ * Leak fraction of a section, with the threshold of solve_leaks
+ */
+static double section_leak(const AdjNode* e) {
+    return (e->leak_perc > 0.001) ? e->leak_perc / 100.0 : 0.0;
+}
+
+/**
+ * Orders the stations of a query parents first (Kahn's algorithm)
+ * Stations on a cycle are left out
+ *
+ * @param m      Stations of the query
+ * @param r      Reverse index
+ * @param order  Receives the numbers in topological order
+ * @param pos    Receives the position of each number (-1 if left out)
+ * @return       Number of ordered stations, -1 on allocation failure
+ */
+static long topological_order(const LocalMap* m, const ReverseIndex* r, long* order, long* pos) {
+    long* pending = malloc((m->count > 0 ? m->count : 1) * sizeof(long));
+    if (!pending) return -1;
+
+    long n = 0;
+    for (long i = 0; i < m->count; i++) {
+        pending[i] = 0;
+        pos[i] = -1;
+        for (ParentLink* p = reverse_parents(r, m->nodes[i]); p; p = p->next) pending[i]++;
+        if (pending[i] == 0) order[n++] = i;
+    }
+    for (long head = 0; head < n; head++) {
+        pos[order[head]] = head;
+        for (AdjNode* e = m->nodes[order[head]]->children; e; e = e->next) {
+            long c = local_find(m, e->target);
+            if (c >= 0 && --pending[c] == 0) order[n++] = c;
+        }
+    }
+    free(pending);
+    return n;
+}
+
+/**
+ * Figures of one facility: fractions reaching the target, then the volumes
+ * flowing from the facility and the losses they suffer on the way
+ *
+ * @return  Volume from the facility reaching the target (loss in *loss)
+ */
+static double facility_supply(const LocalMap* m, const long* order, const long* pos, long ordered,
+                              long target, long facility, double* f, double* g, double* vol,
+                              double* loss) {
+    Station* u = m->nodes[facility];
+
+    for (long j = ordered - 1; j >= 0; j--) {
+        long n = order[j];
+        f[n] = 0.0;
+        g[n] = 0.0;
+        if (n == target) {
+            f[n] = 1.0;
+            g[n] = 1.0;
+            continue;
+        }
+        int k = 0;
+        double sum = 0.0;
+        double routed = 0.0;
+        for (AdjNode* e = m->nodes[n]->children; e; e = e->next) {
+            if (!section_valid(e, u)) continue;
+            k++;
+            long c = local_find(m, e->target);
+            if (c < 0 || pos[c] <= j) continue;
+            sum += (1.0 - section_leak(e)) * f[c];
+            routed += g[c];
+        }
+        if (k > 0) {
+            f[n] = sum / k;
+            g[n] = routed / k;
+        }
+    }
+
+    double volume = (u->real_qty > 0) ? (double)u->real_qty : (double)u->capacity;
+    *loss = 0.0;
+    if (f[facility] <= 0.0) return 0.0;
+
+    for (long j = 0; j < ordered; j++) vol[order[j]] = 0.0;
+    vol[facility] = volume;
+    for (long j = pos[facility]; j < ordered; j++) {
+        long n = order[j];
+        if (n == target || vol[n] <= 0.0) continue;
+        int k = 0;
+        for (AdjNode* e = m->nodes[n]->children; e; e = e->next) {
+            if (section_valid(e, u)) k++;
+        }
+        for (AdjNode* e = m->nodes[n]->children; e; e = e->next) {
+            if (!section_valid(e, u)) continue;
+            long c = local_find(m, e->target);
+            if (c < 0 || pos[c] <= j) continue;
+            double in = vol[n] / k;
+            double l = section_leak(e);
+            *loss += in * l * g[c];
+            vol[c] += in * (1.0 - l);
+        }
+    }
+    return volume * f[facility];
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Creates an empty reverse index
+ *
+ * @return  Index, NULL on allocation failure
+ */
+ReverseIndex* reverse_new(void) {
+    ReverseIndex* r = malloc(sizeof(ReverseIndex));
+    if (!r) return NULL;
+    r->links = (Pool)POOL_INIT;
+    r->keys = calloc(REVERSE_INITIAL_SLOTS, sizeof(Station*));
+    r->heads = calloc(REVERSE_INITIAL_SLOTS, sizeof(ParentLink*));
+    r->mask = REVERSE_INITIAL_SLOTS - 1;
+    r->count = 0;
+    if (!r->keys || !r->heads) {
+        reverse_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+/**
+ * Records a new section
+ *
+ * @param r     Index
+ * @param from  Upstream station
+ * @param edge  Section just added to from's adjacency list
+ * @return      0 on success, -1 on allocation failure
+ */
+int reverse_add(ReverseIndex* r, Station* from, AdjNode* edge) {
+    if ((r->count + 1) * 2 > r->mask + 1 && reverse_grow(r) != 0) return -1;
+
+    long h = reverse_slot(r, edge->target);
+    if (!r->keys[h]) {
+        r->keys[h] = edge->target;
+        r->count++;
+    }
+    ParentLink* link = pool_alloc(&r->links, sizeof(ParentLink));
+    link->from = from;
+    link->edge = edge;
+    link->next = r->heads[h];
+    r->heads[h] = link;
+    return 0;
+}
+
+/**
+ * Indexes every section of a loaded tree (sections added later go through reverse_add)
+ *
+ * @param r     Empty index
+ * @param root  Root of the station tree
+ * @return      0 on success, -1 on allocation failure
+ */
+int reverse_build(ReverseIndex* r, Station* root) {
+    return build_node(r, root);
+}
+
+/**
+ * Returns the sections arriving at a station
+ *
+ * @param r  Index
+ * @param s  Station
+ * @return   First arriving section, NULL if none
+ */
+ParentLink* reverse_parents(const ReverseIndex* r, const Station* s) {
+    long h = reverse_slot(r, s);
+    return r->keys[h] ? r->heads[h] : NULL;
+}
+
+/**
+ * Releases an index
+ *
+ * @param r  Index (may be NULL)
+ */
+void reverse_free(ReverseIndex* r) {
+    if (!r) return;
+    pool_release(&r->links);
+    free(r->keys);
+    free(r->heads);
+    free(r);
+}
+
+/**
+ * Finds the facilities and sources feeding a station and what reaches it
+ * Read-only on the graph and the index: queries may run concurrently
+ *
+ * @param r       Index
+ * @param target  Queried station
+ * @param res     Receives the answer (release with upstream_result_free)
+ * @return        0 on success, -1 on allocation failure
+ */
+int upstream_query(const ReverseIndex* r, Station* target, UpstreamResult* res) {
+    memset(res, 0, sizeof(*res));
+
+    LocalMap m;
+    m.capacity = 256;
+    m.count = 0;
+    m.mask = 511;
+    m.nodes = malloc(m.capacity * sizeof(Station*));
+    m.slots = malloc((m.mask + 1) * sizeof(long));
+    if (!m.nodes || !m.slots) {
+        free(m.nodes);
+        free(m.slots);
+        return -1;
+    }
+    memset(m.slots, 0xff, (m.mask + 1) * sizeof(long));
+
+    // Every station with a path to the target (breadth-first over the parents)
+    int status = local_add(&m, target);
+    for (long i = 0; status == 0 && i < m.count; i++) {
+        for (ParentLink* p = reverse_parents(r, m.nodes[i]); p; p = p->next) {
+            if (local_find(&m, p->from) < 0 && local_add(&m, p->from) != 0) {
+                status = -1;
+                break;
+            }
+        }
+    }
+
+    long* order = malloc(m.count * sizeof(long));
+    long* pos = malloc(m.count * sizeof(long));
+    double* f = malloc(m.count * sizeof(double));
+    double* g = malloc(m.count * sizeof(double));
+    double* vol = malloc(m.count * sizeof(double));
+    long ordered = -1;
+    if (status == 0 && order && pos && f && g && vol) ordered = topological_order(&m, r, order, pos);
+    if (ordered < 0) status = -1;
+    res->ancestors = m.count - 1;
+
+    for (long j = 0; status == 0 && j < ordered; j++) {
+        long u = order[j];
+        Station* facility = m.nodes[u];
+        if (facility->capacity <= 0 && facility->real_qty <= 0) continue;
+
+        double loss;
+        double volume = facility_supply(&m, order, pos, ordered, 0, u, f, g, vol, &loss);
+        if (volume <= 0.0) continue;
+        if (add_line(res, facility, facility, volume, loss) != 0) status = -1;
+        res->volume += volume;
+        res->loss += loss;
+
+        // Sources in proportion of the actual volume they bring to the facility
+        if (facility->real_qty <= 0) continue;
+        for (ParentLink* p = reverse_parents(r, facility); p && status == 0; p = p->next) {
+            if (p->edge->factory != facility || p->edge->volume <= 0) continue;
+            long real = (long)(p->edge->volume * (1.0 - (p->edge->leak_perc / 100.0)));
+            double share = (double)real / (double)facility->real_qty;
+            if (add_line(res, p->from, facility, volume * share, loss * share) != 0) status = -1;
+        }
+    }
+
+    free(order);
+    free(pos);
+    free(f);
+    free(g);
+    free(vol);
+    free(m.nodes);
+    free(m.slots);
+    if (status != 0) upstream_result_free(res);
+    return status;
+}
+
+/**
+ * Writes an answer, one "type;station;facility;volume;loss" line per
+ * facility or source, then "total;<station>;-;volume;loss"
+ *
+ * @param res     Answer
+ * @param target  Queried station
+ * @param out     Output buffer
+ */
+void upstream_write(const UpstreamResult* res, const Station* target, OutBuffer* out) {
+    char tmp[96];
+    for (long i = 0; i < res->count; i++) {
+        const UpstreamLine* l = &res->lines[i];
+        out_puts(out, (l->station == l->facility) ? "facility;" : "source;");
+        out_puts(out, l->station->name);
+        out_puts(out, ";");
+        out_puts(out, l->facility->name);
+        snprintf(tmp, sizeof(tmp), ";%.6f;%.6f\n", l->volume / 1000.0, l->loss / 1000.0);
+        out_puts(out, tmp);
+    }
+    out_puts(out, "total;");
+    out_puts(out, target->name);
+    snprintf(tmp, sizeof(tmp), ";-;%.6f;%.6f\n", res->volume / 1000.0, res->loss / 1000.0);
+    out_puts(out, tmp);
+}
+
+/**
+ * Releases an answer
+ *
+ * @param res  Answer
+ */
+void upstream_result_free(UpstreamResult* res) {
+    free(res->lines);
+    res->lines = NULL;
+    res->count = 0;
+    res->capacity = 0;
+}
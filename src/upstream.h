@@ -0,0 +1,143 @@
+/*
+ * upstream.h
+ *
+ * Reverse adjacency index and upstream attribution queries.
+ *
+ * The index maps each station to the sections arriving at it. It is filled
+ * while connections are created, so it stays in step with the graph when
+ * deltas are applied, and answers "what feeds this station" without
+ * scanning the network.
+ *
+ * An upstream query walks the parents of a station, then applies the leak
+ * model of solve_leaks to the sub-network found (equal split over the
+ * facility's valid sections). For each facility u feeding the station:
+ *   f(n)     fraction of the volume at n that reaches the station
+ *   g(n)     fraction of the volume at n routed towards the station (leaks aside)
+ *   volume   V(u) * f(u), the part of u's volume that reaches the station
+ *   loss     sum over sections e = (n -> c) of in(e) * leak(e) * g(c), the
+ *            leaks of the water routed to it (over every station downstream
+ *            of u, these shares add up to u's total loss)
+ * Sources get the share of their facility's figures given by their actual
+ * volume. Like the what-if engine, the 0.001 volume cut-off is ignored.
+ */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include "structs.h"
+#include "pool.h"
+#include "output.h"
+
+/**
+ * Section arriving at a station
+ */
+typedef struct ParentLink {
+    Station* from;             // Upstream station
+    AdjNode* edge;             // Section, in from's adjacency list
+    struct ParentLink* next;   // Next section arriving at the same station
+} ParentLink;
+
+/**
+ * Reverse adjacency index: station address -> arriving sections
+ */
+typedef struct ReverseIndex {
+    Pool links;                // ParentLink storage
+    Station** keys;            // Stations (NULL = empty slot)
+    ParentLink** heads;        // Arriving sections of each station
+    long mask;                 // Number of slots - 1
+    long count;                // Stations with at least one parent
+} ReverseIndex;
+
+/**
+ * Station feeding the queried one
+ */
+typedef struct {
+    Station* station;          // Facility or source
+    Station* facility;         // Facility it feeds (itself for a facility)
+    double volume;             // Volume reaching the queried station (internal units)
+    double loss;               // Volume lost upstream that would have reached it
+} UpstreamLine;
+
+/**
+ * Answer of an upstream query
+ */
+typedef struct {
+    UpstreamLine* lines;       // Facilities, each followed by its sources
+    long count;                // Number of lines
+    long capacity;             // Allocated lines
+    long ancestors;            // Stations upstream of the queried one
+    double volume;             // Total volume reaching the queried station
+    double loss;               // Total loss attributed to it
+} UpstreamResult;
+
+/**
+ * Creates an empty reverse index
+ *
+ * @return  Index, NULL on allocation failure
+ */
+ReverseIndex* reverse_new(void);
+
+/**
+ * Records a new section
+ *
+ * @param r     Index
+ * @param from  Upstream station
+ * @param edge  Section just added to from's adjacency list
+ * @return      0 on success, -1 on allocation failure
+ */
+int reverse_add(ReverseIndex* r, Station* from, AdjNode* edge);
+
+/**
+ * Indexes every section of a loaded tree (sections added later go through reverse_add)
+ *
+ * @param r     Empty index
+ * @param root  Root of the station tree
+ * @return      0 on success, -1 on allocation failure
+ */
+int reverse_build(ReverseIndex* r, Station* root);
+
+/**
+ * Returns the sections arriving at a station
+ *
+ * @param r  Index
+ * @param s  Station
+ * @return   First arriving section, NULL if none
+ */
+ParentLink* reverse_parents(const ReverseIndex* r, const Station* s);
+
+/**
+ * Releases an index
+ *
+ * @param r  Index (may be NULL)
+ */
+void reverse_free(ReverseIndex* r);
+
+/**
+ * Finds the facilities and sources feeding a station and what reaches it
+ * Read-only on the graph and the index: queries may run concurrently
+ *
+ * @param r       Index
+ * @param target  Queried station
+ * @param res     Receives the answer (release with upstream_result_free)
+ * @return        0 on success, -1 on allocation failure
+ */
+int upstream_query(const ReverseIndex* r, Station* target, UpstreamResult* res);
+
+/**
+ * Writes an answer, one "type;station;facility;volume;loss" line per
+ * facility or source, then "total;<station>;-;volume;loss"
+ *
+ * @param res     Answer
+ * @param target  Queried station
+ * @param out     Output buffer
+ */
+void upstream_write(const UpstreamResult* res, const Station* target, OutBuffer* out);
+
+/**
+ * Releases an answer
+ *
+ * @param res  Answer
+ */
+void upstream_result_free(UpstreamResult* res);
+
+#endif /* UPSTREAM_H */
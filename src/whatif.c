@@ -0,0 +1,472 @@
+/*
+ * whatif.c
+ *
+ * What-if evaluation of leak rate changes (see whatif.h for the model).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "whatif.h"
+#include "upstream.h"
+
+// Initial size of a station index table (power of 2)
+#define WHATIF_INITIAL_SLOTS 1024
+
+/**
+ * Depth-first traversal frame
+ */
+typedef struct {
+    long index;      // Discovery index of the station
+    AdjNode* next;   // Next section to explore
+} WalkFrame;
+
+// -----------------------------------------------------------------------------
+// Internal utility functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Tells whether a section carries water of the facility
+ */
+static int section_valid(const AdjNode* e, const Station* facility) {
+    return e->factory == NULL || e->factory == facility;
+}
+
+/**
+ * Volume arriving through a source section (same truncation as the loader)
+ */
+static long source_volume(long volume, double leak) {
+    return (long)(volume * (1.0 - (leak / 100.0)));
+}
+
+/**
+ * Starting volume of a facility: its actual volume, or its capacity
+ */
+static double start_volume(const Station* facility) {
+    return (facility->real_qty > 0) ? (double)facility->real_qty : (double)facility->capacity;
+}
+
+/**
+ * Leak fraction of a section (rates of 0.001% or less count as no leak)
+ */
+static double section_fraction(const AdjNode* e) {
+    return (e->leak_perc > 0.001) ? e->leak_perc / 100.0 : 0.0;
+}
+
+/**
+ * Hash slot of a station address
+ */
+static long slot_of(const Station* s, long mask) {
+    uint64_t h = (uint64_t)(uintptr_t)s;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (long)(h & (uint64_t)mask);
+}
+
+/**
+ * Finds the index of a station in a table keyed by addresses
+ *
+ * @param slots  Table of indices (-1 = empty)
+ * @param mask   Table size - 1
+ * @param nodes  Stations by index
+ * @param s      Station to find
+ * @return       Index of the station, -1 if absent
+ */
+static long slot_find(const long* slots, long mask, Station* const* nodes, const Station* s) {
+    long h = slot_of(s, mask);
+    while (slots[h] >= 0) {
+        if (nodes[slots[h]] == s) return slots[h];
+        h = (h + 1) & mask;
+    }
+    return -1;
+}
+
+/**
+ * Inserts an index in a table keyed by addresses (the key must be absent)
+ */
+static void slot_insert(long* slots, long mask, const Station* s, long index) {
+    long h = slot_of(s, mask);
+    while (slots[h] >= 0) h = (h + 1) & mask;
+    slots[h] = index;
+}
+
+/**
+ * Grows an array of elements of a given size to hold at least need elements
+ *
+ * @return  0 on success, -1 on allocation failure (the array is unchanged)
+ */
+static int grow_array(void** array, long* cap, long need, size_t elem) {
+    if (need <= *cap) return 0;
+    long new_cap = (*cap > 0) ? *cap : 256;
+    while (new_cap < need) new_cap *= 2;
+    void* p = realloc(*array, (size_t)new_cap * elem);
+    if (!p) return -1;
+    *array = p;
+    *cap = new_cap;
+    return 0;
+}
+
+/**
+ * Recomputes the loss fraction of one station from its sections
+ */
+static double compute_gain(const FacilityModel* m, long i) {
+    long first = m->child_start[i];
+    long last = m->child_start[i + 1];
+    if (last == first) return 0.0;
+
+    double sum = 0.0;
+    for (long k = first; k < last; k++) {
+        double l = section_fraction(m->edge[k]);
+        double below = (m->child[k] >= 0) ? m->gain[m->child[k]] : 0.0;
+        sum += l + (1.0 - l) * below;
+    }
+    return sum / (double)(last - first);
+}
+
+/**
+ * Releases a facility model
+ */
+static void free_model(FacilityModel* m) {
+    if (!m) return;
+    free(m->nodes);
+    free(m->gain);
+    free(m->child_start);
+    free(m->child);
+    free(m->edge);
+    free(m->slots);
+    free(m);
+}
+
+/**
+ * Visits the sub-network of a facility depth first
+ * Stations are indexed in discovery order in the model's table
+ *
+ * @param m      Model receiving the table and the stations (discovery order)
+ * @param post   Receives the discovery indices in post-order
+ * @return       Number of stations, -1 on allocation failure
+ */
+static long walk_facility(FacilityModel* m, long** post) {
+    long node_cap = 0, post_cap = 0, stack_cap = 0;
+    long count = 0, done = 0, depth = 0;
+    WalkFrame* stack = NULL;
+    *post = NULL;
+
+    long slot_count = WHATIF_INITIAL_SLOTS;
+    m->slots = malloc((size_t)slot_count * sizeof(long));
+    if (!m->slots) return -1;
+    memset(m->slots, 0xff, (size_t)slot_count * sizeof(long));
+    m->slot_mask = slot_count - 1;
+
+    if (grow_array((void**)&m->nodes, &node_cap, 1, sizeof(Station*)) != 0 ||
+        grow_array((void**)&stack, &stack_cap, 1, sizeof(WalkFrame)) != 0) {
+        free(stack);
+        return -1;
+    }
+    m->nodes[count] = m->facility;
+    slot_insert(m->slots, m->slot_mask, m->facility, count);
+    stack[depth].index = count++;
+    stack[depth++].next = m->facility->children;
+
+    while (depth > 0) {
+        WalkFrame* top = &stack[depth - 1];
+        AdjNode* e = top->next;
+        while (e && !section_valid(e, m->facility)) e = e->next;
+
+        if (!e) {
+            // Every section explored: the station is finished
+            if (grow_array((void**)post, &post_cap, done + 1, sizeof(long)) != 0) break;
+            (*post)[done++] = top->index;
+            depth--;
+            continue;
+        }
+        top->next = e->next;
+
+        if (slot_find(m->slots, m->slot_mask, m->nodes, e->target) >= 0) continue;
+
+        // Keep the table at most half full
+        if ((count + 1) * 2 > slot_count) {
+            long* bigger = malloc((size_t)slot_count * 2 * sizeof(long));
+            if (!bigger) break;
+            slot_count *= 2;
+            memset(bigger, 0xff, (size_t)slot_count * sizeof(long));
+            for (long i = 0; i < count; i++) slot_insert(bigger, slot_count - 1, m->nodes[i], i);
+            free(m->slots);
+            m->slots = bigger;
+            m->slot_mask = slot_count - 1;
+        }
+        if (grow_array((void**)&m->nodes, &node_cap, count + 1, sizeof(Station*)) != 0 ||
+            grow_array((void**)&stack, &stack_cap, depth + 1, sizeof(WalkFrame)) != 0) {
+            break;
+        }
+
+        m->nodes[count] = e->target;
+        slot_insert(m->slots, m->slot_mask, e->target, count);
+        stack[depth].index = count++;
+        stack[depth++].next = e->target->children;
+    }
+
+    free(stack);
+    if (depth > 0) return -1;
+    return count;
+}
+
+/**
+ * Builds the cached sub-network of a facility
+ *
+ * @param facility  Facility station
+ * @return          New model, NULL on allocation failure
+ */
+static FacilityModel* build_model(Station* facility) {
+    FacilityModel* m = calloc(1, sizeof(FacilityModel));
+    if (!m) return NULL;
+    m->facility = facility;
+    m->volume = start_volume(facility);
+
+    long* post;
+    long n = walk_facility(m, &post);
+    if (n < 0) {
+        free(post);
+        free_model(m);
+        return NULL;
+    }
+    m->count = n;
+
+    // Renumber the stations in post-order: targets come before their sources
+    Station** ordered = malloc((size_t)n * sizeof(Station*));
+    m->child_start = calloc((size_t)n + 1, sizeof(long));
+    m->gain = calloc((size_t)n, sizeof(double));
+    if (!ordered || !m->child_start || !m->gain) {
+        free(ordered);
+        free(post);
+        free_model(m);
+        return NULL;
+    }
+    for (long i = 0; i < n; i++) ordered[i] = m->nodes[post[i]];
+    free(post);
+    free(m->nodes);
+    m->nodes = ordered;
+    memset(m->slots, 0xff, (size_t)(m->slot_mask + 1) * sizeof(long));
+    for (long i = 0; i < n; i++) slot_insert(m->slots, m->slot_mask, m->nodes[i], i);
+
+    // Forward sections, grouped by station
+    long sections = 0;
+    for (long i = 0; i < n; i++) {
+        m->child_start[i] = sections;
+        for (AdjNode* e = m->nodes[i]->children; e; e = e->next) {
+            if (section_valid(e, facility)) sections++;
+        }
+    }
+    m->child_start[n] = sections;
+
+    m->child = malloc((size_t)(sections > 0 ? sections : 1) * sizeof(long));
+    m->edge = malloc((size_t)(sections > 0 ? sections : 1) * sizeof(AdjNode*));
+    if (!m->child || !m->edge) {
+        free_model(m);
+        return NULL;
+    }
+
+    long k = 0;
+    for (long i = 0; i < n; i++) {
+        for (AdjNode* e = m->nodes[i]->children; e; e = e->next) {
+            if (!section_valid(e, facility)) continue;
+            long j = slot_find(m->slots, m->slot_mask, m->nodes, e->target);
+            // A target finishing after its source closes a cycle: not followed
+            m->child[k] = (j < i) ? j : -1;
+            m->edge[k] = e;
+            k++;
+        }
+    }
+
+    // Loss fractions, targets first
+    for (long i = 0; i < n; i++) m->gain[i] = compute_gain(m, i);
+    return m;
+}
+
+/**
+ * Pushes an index on the min-heap of pending stations
+ */
+static void heap_push(long* heap, long* size, long value) {
+    long i = (*size)++;
+    while (i > 0 && heap[(i - 1) / 2] > value) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = value;
+}
+
+/**
+ * Pops the smallest index of the min-heap of pending stations
+ */
+static long heap_pop(long* heap, long* size) {
+    long top = heap[0];
+    long last = heap[--(*size)];
+    long i = 0;
+    for (;;) {
+        long c = 2 * i + 1;
+        if (c >= *size) break;
+        if (c + 1 < *size && heap[c + 1] < heap[c]) c++;
+        if (heap[c] >= last) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (*size > 0) heap[i] = last;
+    return top;
+}
+
+/**
+ * Recomputes the fractions of a station and of its affected ancestors
+ * Stations are processed in increasing post-order index, so each one is
+ * recomputed once, after all of its changed descendants. Parents come from
+ * the reverse index: those of the model's sections that are followed (a
+ * parent finishing before its child closes a cycle)
+ */
+static void propagate(WhatIf* w, FacilityModel* m, long start) {
+    long size = 0;
+    heap_push(w->heap, &size, start);
+    w->flags[start] = 1;
+
+    while (size > 0) {
+        long i = heap_pop(w->heap, &size);
+        w->flags[i] = 0;
+
+        double g = compute_gain(m, i);
+        if (g == m->gain[i]) continue;
+        m->gain[i] = g;
+
+        for (ParentLink* p = reverse_parents(w->reverse, m->nodes[i]); p; p = p->next) {
+            if (!section_valid(p->edge, m->facility)) continue;
+            long j = slot_find(m->slots, m->slot_mask, m->nodes, p->from);
+            if (j <= i) continue;
+            if (!w->flags[j]) {
+                w->flags[j] = 1;
+                heap_push(w->heap, &size, j);
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Public functions
+// -----------------------------------------------------------------------------
+
+/**
+ * Initializes an engine on a loaded graph
+ *
+ * @param w        Engine to initialize
+ * @param root     Root of the station tree
+ * @param reverse  Reverse index of the graph (network loaded with LOAD_REVERSE)
+ */
+void whatif_init(WhatIf* w, Station* root, const struct ReverseIndex* reverse) {
+    w->root = root;
+    w->reverse = reverse;
+    w->models = NULL;
+    w->count = 0;
+    w->capacity = 0;
+    w->flags = NULL;
+    w->heap = NULL;
+    w->work_size = 0;
+}
+
+/**
+ * Returns the model of a facility, building it on first use
+ *
+ * @param w         Engine
+ * @param facility  Facility station
+ * @return          Model, NULL on allocation failure
+ */
+FacilityModel* whatif_model(WhatIf* w, Station* facility) {
+    for (long i = 0; i < w->count; i++) {
+        if (w->models[i]->facility == facility) return w->models[i];
+    }
+
+    if (grow_array((void**)&w->models, &w->capacity, w->count + 1, sizeof(FacilityModel*)) != 0) {
+        return NULL;
+    }
+    FacilityModel* m = build_model(facility);
+    if (!m) return NULL;
+
+    // Work areas large enough for every model
+    if (m->count > w->work_size) {
+        char* flags = calloc((size_t)m->count, 1);
+        long* heap = malloc((size_t)m->count * sizeof(long));
+        if (!flags || !heap) {
+            free(flags);
+            free(heap);
+            free_model(m);
+            return NULL;
+        }
+        free(w->flags);
+        free(w->heap);
+        w->flags = flags;
+        w->heap = heap;
+        w->work_size = m->count;
+    }
+
+    w->models[w->count++] = m;
+    return m;
+}
+
+/**
+ * Current loss of a facility according to its model
+ *
+ * @param m  Facility model
+ * @return   Total leak volume (internal units)
+ */
+double whatif_loss(const FacilityModel* m) {
+    if (m->count == 0 || m->volume <= 0.001) return 0.0;
+    return m->volume * m->gain[m->count - 1];
+}
+
+/**
+ * Tells whether a station is part of a facility's sub-network
+ *
+ * @param m  Facility model
+ * @param s  Station
+ * @return   1 if the station is reachable from the facility, 0 otherwise
+ */
+int whatif_contains(const FacilityModel* m, const Station* s) {
+    return slot_find(m->slots, m->slot_mask, m->nodes, s) >= 0;
+}
+
+/**
+ * Changes the leak rate of a section and updates every built model using it
+ * Only the ancestors of the upstream station are recomputed; on a source
+ * section, the actual volume of the facility and its models are updated
+ *
+ * @param w     Engine
+ * @param from  Upstream station of the section
+ * @param edge  Section (one of from's connections)
+ * @param leak  New leak percentage
+ */
+void whatif_set_leak(WhatIf* w, Station* from, AdjNode* edge, double leak) {
+    if (edge->volume > 0) {
+        // Source section: the facility receives a different volume
+        Station* facility = edge->target;
+        facility->real_qty -= source_volume(edge->volume, edge->leak_perc);
+        facility->real_qty += source_volume(edge->volume, leak);
+    }
+    edge->leak_perc = leak;
+
+    for (long i = 0; i < w->count; i++) {
+        FacilityModel* m = w->models[i];
+        if (edge->volume > 0 && m->facility == edge->target) m->volume = start_volume(m->facility);
+        if (!section_valid(edge, m->facility)) continue;
+        long idx = slot_find(m->slots, m->slot_mask, m->nodes, from);
+        if (idx >= 0) propagate(w, m, idx);
+    }
+}
+
+/**
+ * Releases the models of an engine (the graph is left untouched)
+ *
+ * @param w  Engine
+ */
+void whatif_free(WhatIf* w) {
+    for (long i = 0; i < w->count; i++) free_model(w->models[i]);
+    free(w->models);
+    free(w->flags);
+    free(w->heap);
+    whatif_init(w, NULL, NULL);
+}
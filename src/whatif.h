@@ -0,0 +1,107 @@
+/*
+ * whatif.h
+ *
+ * What-if evaluation of leak rate changes on the in-memory graph.
+ *
+ * Losses are linear in the input volume, so the network downstream of a
+ * facility is summarized by one loss fraction per station:
+ *   g(node) = 1/k * sum over the k valid sections (l + (1 - l) * g(target))
+ * and the facility loss is volume * g(facility). Changing the leak rate of
+ * a section only changes g on the ancestors of its upstream station, which
+ * are found through the network's reverse index (see upstream.h) and
+ * recomputed children first.
+ *
+ * The fractions ignore the 0.001 volume cut-off of solve_leaks, so values
+ * can differ from the leak mode by the negligible volumes it prunes.
+ */
+
+#ifndef WHATIF_H
+#define WHATIF_H
+
+#include "structs.h"
+
+/**
+ * Cached sub-network of one facility
+ */
+typedef struct {
+    Station* facility;     // Facility at the root of the sub-network
+    double volume;         // Starting volume (actual volume or capacity)
+    long count;            // Stations reachable from the facility
+    Station** nodes;       // Stations in post-order (targets before sources)
+    double* gain;          // Loss fraction of each station
+    long* child_start;     // Valid sections of node i: child_start[i]..child_start[i+1]-1
+    long* child;           // Index of the target of each section (-1 for a back edge)
+    AdjNode** edge;        // Section itself (leak rate read live)
+    long* slots;           // Hash table from station address to index (-1 = empty)
+    long slot_mask;        // Hash table size - 1
+} FacilityModel;
+
+/**
+ * What-if engine: models built on demand for the facilities it is asked about
+ */
+typedef struct {
+    Station* root;            // Station tree
+    const struct ReverseIndex* reverse;  // Arriving sections of each station
+    FacilityModel** models;   // Built models
+    long count;               // Number of models
+    long capacity;            // Allocated model slots
+    char* flags;              // Work area of the updates
+    long* heap;               // Work area of the updates
+    long work_size;           // Size of the work areas
+} WhatIf;
+
+/**
+ * Initializes an engine on a loaded graph
+ *
+ * @param w        Engine to initialize
+ * @param root     Root of the station tree
+ * @param reverse  Reverse index of the graph (network loaded with LOAD_REVERSE)
+ */
+void whatif_init(WhatIf* w, Station* root, const struct ReverseIndex* reverse);
+
+/**
+ * Returns the model of a facility, building it on first use
+ *
+ * @param w         Engine
+ * @param facility  Facility station
+ * @return          Model, NULL on allocation failure
+ */
+FacilityModel* whatif_model(WhatIf* w, Station* facility);
+
+/**
+ * Current loss of a facility according to its model
+ *
+ * @param m  Facility model
+ * @return   Total leak volume (internal units)
+ */
+double whatif_loss(const FacilityModel* m);
+
+/**
+ * Tells whether a station is part of a facility's sub-network
+ *
+ * @param m  Facility model
+ * @param s  Station
+ * @return   1 if the station is reachable from the facility, 0 otherwise
+ */
+int whatif_contains(const FacilityModel* m, const Station* s);
+
+/**
+ * Changes the leak rate of a section and updates every built model using it
+ * Only the ancestors of the upstream station are recomputed; on a source
+ * section, the actual volume of the facility and its models are updated
+ *
+ * @param w     Engine
+ * @param from  Upstream station of the section
+ * @param edge  Section (one of from's connections)
+ * @param leak  New leak percentage
+ */
+void whatif_set_leak(WhatIf* w, Station* from, AdjNode* edge, double leak);
+
+/**
+ * Releases the models of an engine (the graph is left untouched)
+ *
+ * @param w  Engine
+ */
+void whatif_free(WhatIf* w);
+
+#endif /* WHATIF_H */